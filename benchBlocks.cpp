@@ -0,0 +1,220 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Giordano Cerriza
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  benchBlocks.cpp
+ *  @brief: Benchmark of the getter/distributor block protocol.
+ *
+ *  mpirun -np n benchBlocks mode blockBytes blocks ?analysisUs?
+ *
+ *  Rank 0 answers block requests with blocks of blockBytes until it has
+ *  sent blocks of them and then sends each worker an empty end block.
+ *  The workers "analyze" each block for analysisUs microseconds.  The
+ *  analysis sleeps rather than spins so that, on a machine with fewer
+ *  cores than ranks, the distributor can run meanwhile as it would on
+ *  its own core.  mode is:
+ *
+ *  -  original   - a blocking request, probe, allocate and receive per
+ *                  block; the block is asked for only once the last one
+ *                  has been analyzed (the old protocol).
+ *  -  prefetch   - two fixed buffers with the next block asked for with
+ *                  MPI_Isend/MPI_Irecv before the current one is
+ *                  analyzed (what CMPIDataGetter does).
+ *  -  persistent - the same with persistent requests on the buffers.
+ *
+ *  Rank 0 prints the time per block.
+ */
+#include <mpi.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+static const int TAG(3);
+
+/**
+ * analyze
+ *    Stand in for analyzing a block.
+ * @param us - microseconds it takes.
+ */
+static void
+analyze(int us)
+{
+    if (us > 0) {
+        struct timespec t;
+        t.tv_sec  = us / 1000000;
+        t.tv_nsec = (us % 1000000) * 1000;
+        nanosleep(&t, nullptr);
+    }
+}
+/**
+ * distribute
+ *    Rank 0: answer requests until the blocks and an end per worker are
+ *    sent.
+ */
+static void
+distribute(size_t blockBytes, int blocks, int workers)
+{
+    std::vector<char> block(blockBytes, 'x');
+    for (int i = 0; i < blocks + workers; i++) {
+        uint64_t   capacity;
+        MPI_Status status;
+        MPI_Recv(
+            &capacity, sizeof(capacity), MPI_CHAR, MPI_ANY_SOURCE, TAG,
+            MPI_COMM_WORLD, &status
+        );
+        MPI_Send(
+            block.data(), (i < blocks) ? blockBytes : 0, MPI_CHAR,
+            status.MPI_SOURCE, TAG, MPI_COMM_WORLD
+        );
+    }
+}
+/**
+ * original
+ *    Worker: ask, wait, analyze.
+ */
+static void
+original(int us)
+{
+    for (;;) {
+        uint64_t capacity(0);
+        MPI_Send(&capacity, sizeof(capacity), MPI_CHAR, 0, TAG, MPI_COMM_WORLD);
+        MPI_Status status;
+        int        nBytes;
+        MPI_Probe(0, TAG, MPI_COMM_WORLD, &status);
+        MPI_Get_count(&status, MPI_CHAR, &nBytes);
+        char* pBlock = new char[nBytes ? nBytes : 1];
+        MPI_Recv(pBlock, nBytes, MPI_CHAR, 0, TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        delete []pBlock;
+        if (!nBytes) break;
+        analyze(us);
+    }
+}
+/**
+ * prefetch
+ *    Worker: ask for the next block before analyzing this one.
+ * @param persistent - use persistent requests.
+ */
+static void
+prefetch(size_t blockBytes, int us, bool persistent)
+{
+    struct Buffer {
+        std::vector<char> s_data;
+        uint64_t          s_capacity;
+        MPI_Request       s_request;
+        MPI_Request       s_reply;
+    } buffers[2];
+    for (int i = 0; i < 2; i++) {
+        buffers[i].s_data.resize(blockBytes);
+        buffers[i].s_capacity = blockBytes;
+        if (persistent) {
+            MPI_Send_init(
+                &buffers[i].s_capacity, sizeof(uint64_t), MPI_CHAR, 0, TAG,
+                MPI_COMM_WORLD, &buffers[i].s_request
+            );
+            MPI_Recv_init(
+                buffers[i].s_data.data(), blockBytes, MPI_CHAR, 0, TAG,
+                MPI_COMM_WORLD, &buffers[i].s_reply
+            );
+        }
+    }
+    auto ask = [&](Buffer& b) {
+        if (persistent) {
+            MPI_Start(&b.s_reply);
+            MPI_Start(&b.s_request);
+        } else {
+            MPI_Irecv(
+                b.s_data.data(), blockBytes, MPI_CHAR, 0, TAG, MPI_COMM_WORLD,
+                &b.s_reply
+            );
+            MPI_Isend(
+                &b.s_capacity, sizeof(uint64_t), MPI_CHAR, 0, TAG,
+                MPI_COMM_WORLD, &b.s_request
+            );
+        }
+    };
+
+    // Only one request is outstanding at a time, as in the getter: the
+    // next is sent once the current block has arrived.
+
+    int current = 0;
+    ask(buffers[current]);
+    for (;;) {
+        MPI_Status status;
+        int        nBytes;
+        MPI_Wait(&buffers[current].s_reply, &status);
+        MPI_Wait(&buffers[current].s_request, MPI_STATUS_IGNORE);
+        MPI_Get_count(&status, MPI_CHAR, &nBytes);
+        if (!nBytes) break;
+        int next = 1 - current;
+        ask(buffers[next]);
+        analyze(us);
+        current = next;
+    }
+    if (persistent) {
+        for (int i = 0; i < 2; i++) {
+            MPI_Request_free(&buffers[i].s_request);
+            MPI_Request_free(&buffers[i].s_reply);
+        }
+    }
+}
+
+int
+main(int argc, char** argv)
+{
+    MPI_Init(&argc, &argv);
+    int rank, nRanks;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &nRanks);
+    if ((argc < 4) || (nRanks < 2)) {
+        if (rank == 0) {
+            fprintf(
+                stderr,
+                "Usage: mpirun -np n benchBlocks original|prefetch|persistent "
+                "blockBytes blocks ?analysisUs?\n"
+            );
+        }
+        MPI_Finalize();
+        return EXIT_FAILURE;
+    }
+    std::string mode       = argv[1];
+    size_t      blockBytes = strtoul(argv[2], nullptr, 0);
+    int         blocks     = atoi(argv[3]);
+    int         us         = (argc > 4) ? atoi(argv[4]) : 0;
+
+    MPI_Barrier(MPI_COMM_WORLD);
+    double start = MPI_Wtime();
+    if (rank == 0) {
+        distribute(blockBytes, blocks, nRanks - 1);
+    } else if (mode == "original") {
+        original(us);
+    } else {
+        prefetch(blockBytes, us, mode == "persistent");
+    }
+    MPI_Barrier(MPI_COMM_WORLD);
+    double elapsed = MPI_Wtime() - start;
+    if (rank == 0) {
+        printf(
+            "%-10s block %8zu analysis %6d us np %d: %8.2f us/block\n",
+            mode.c_str(), blockBytes, us, nRanks, elapsed / blocks * 1.0e6
+        );
+    }
+    MPI_Finalize();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,219 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Giordano Cerriza
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  benchCodec.cpp
+ *  @brief: Benchmark of mpi send -binary's wire format against strings.
+ *
+ *  benchCodec
+ *
+ *  The data are a dict of detectors, each a dict of an id, a gain, a
+ *  pedestal, a name and a 64 channel list, for 16, 128 and 1024
+ *  detectors.  Each repetition builds the data as a sender would, ships
+ *  it (as its string, or encoded by CMPITclCodec) and has the receiver
+ *  walk every channel and gain so that the receiving side's parsing is
+ *  counted.  The time to build the data is measured separately and
+ *  subtracted.  The sums the walks produce are checked against each
+ *  other, each size is round tripped through the codec and every
+ *  truncation of an encoding must be rejected.
+ */
+#include "mpiCodec.h"
+#include <tcl.h>
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+/**
+ * detectors
+ *    Build the data.
+ * @param n - number of detectors.
+ * @return Tcl_Obj* - the dict (reference count 0).
+ */
+static Tcl_Obj*
+detectors(int n)
+{
+    Tcl_Obj* pTop = Tcl_NewDictObj();
+    for (int d = 0; d < n; d++) {
+        Tcl_Obj* pDetector = Tcl_NewDictObj();
+        Tcl_DictObjPut(nullptr, pDetector, Tcl_NewStringObj("id", -1), Tcl_NewIntObj(d));
+        Tcl_DictObjPut(
+            nullptr, pDetector, Tcl_NewStringObj("gain", -1),
+            Tcl_NewDoubleObj(1.0 + d*0.0137)
+        );
+        Tcl_DictObjPut(
+            nullptr, pDetector, Tcl_NewStringObj("pedestal", -1),
+            Tcl_NewDoubleObj(102.25 + d*0.5)
+        );
+        Tcl_DictObjPut(
+            nullptr, pDetector, Tcl_NewStringObj("name", -1),
+            Tcl_ObjPrintf("crate%d.slot%d.ch%d", d/64, (d/16) % 4, d % 16)
+        );
+        Tcl_Obj* pChannels = Tcl_NewListObj(0, nullptr);
+        for (int c = 0; c < 64; c++) {
+            Tcl_ListObjAppendElement(
+                nullptr, pChannels, Tcl_NewIntObj((d*131 + c*17) % 4096)
+            );
+        }
+        Tcl_DictObjPut(nullptr, pDetector, Tcl_NewStringObj("channels", -1), pChannels);
+        Tcl_DictObjPut(nullptr, pTop, Tcl_ObjPrintf("det%d", d), pDetector);
+    }
+    return pTop;
+}
+/**
+ * walk
+ *    What the receiver does with the data: use every channel and gain,
+ *    which makes Tcl give them their internal representations.
+ * @param pTop - the data.
+ * @return long - sum of the channels and (truncated) gains.
+ */
+static long
+walk(Tcl_Obj* pTop)
+{
+    long           sum = 0;
+    Tcl_DictSearch search;
+    Tcl_Obj*       pKey;
+    Tcl_Obj*       pValue;
+    int            done;
+    Tcl_Obj*       pChannelsKey = Tcl_NewStringObj("channels", -1);
+    Tcl_Obj*       pGainKey     = Tcl_NewStringObj("gain", -1);
+    Tcl_IncrRefCount(pChannelsKey);
+    Tcl_IncrRefCount(pGainKey);
+    Tcl_DictObjFirst(nullptr, pTop, &search, &pKey, &pValue, &done);
+    for (; !done; Tcl_DictObjNext(&search, &pKey, &pValue, &done)) {
+        Tcl_Obj*  pChannels;
+        Tcl_Obj** ppChannels;
+        int       nChannels;
+        Tcl_DictObjGet(nullptr, pValue, pChannelsKey, &pChannels);
+        Tcl_ListObjGetElements(nullptr, pChannels, &nChannels, &ppChannels);
+        for (int i = 0; i < nChannels; i++) {
+            int channel;
+            Tcl_GetIntFromObj(nullptr, ppChannels[i], &channel);
+            sum += channel;
+        }
+        Tcl_Obj* pGain;
+        double   gain;
+        Tcl_DictObjGet(nullptr, pValue, pGainKey, &pGain);
+        Tcl_GetDoubleFromObj(nullptr, pGain, &gain);
+        sum += static_cast<long>(gain);
+    }
+    Tcl_DictObjDone(&search);
+    Tcl_DecrRefCount(pChannelsKey);
+    Tcl_DecrRefCount(pGainKey);
+    return sum;
+}
+
+int
+main(int, char** argv)
+{
+    using namespace std::chrono;
+    Tcl_FindExecutable(argv[0]);
+    bool ok = true;
+
+    int sizes[] = {16, 128, 1024};
+    for (int n : sizes) {
+        int      reps = 20000/n + 5;
+        Tcl_Obj* pData = detectors(n);
+        Tcl_IncrRefCount(pData);
+        long expected = walk(pData) * reps;
+
+        size_t stringBytes = 0;
+        long   stringSum   = 0;
+        auto   t0          = steady_clock::now();
+        for (int r = 0; r < reps; r++) {
+            Tcl_Obj* pSent = detectors(n);
+            Tcl_IncrRefCount(pSent);
+            int         length;
+            const char* pString = Tcl_GetStringFromObj(pSent, &length);
+            std::string wire(pString, length);
+            stringBytes = length + 1;
+            Tcl_Obj* pReceived = Tcl_NewStringObj(wire.c_str(), -1);
+            Tcl_IncrRefCount(pReceived);
+            stringSum += walk(pReceived);
+            Tcl_DecrRefCount(pReceived);
+            Tcl_DecrRefCount(pSent);
+        }
+        auto t1 = steady_clock::now();
+
+        size_t            binaryBytes = 0;
+        long              binarySum   = 0;
+        std::vector<char> wire;
+        for (int r = 0; r < reps; r++) {
+            Tcl_Obj* pSent = detectors(n);
+            Tcl_IncrRefCount(pSent);
+            wire.clear();
+            CMPITclCodec::encode(pSent, wire);
+            binaryBytes = wire.size();
+            Tcl_Obj* pReceived = CMPITclCodec::decode(wire.data(), wire.size());
+            Tcl_IncrRefCount(pReceived);
+            binarySum += walk(pReceived);
+            Tcl_DecrRefCount(pReceived);
+            Tcl_DecrRefCount(pSent);
+        }
+        auto t2 = steady_clock::now();
+
+        for (int r = 0; r < reps; r++) {
+            Tcl_Obj* pSent = detectors(n);
+            Tcl_IncrRefCount(pSent);
+            Tcl_DecrRefCount(pSent);
+        }
+        auto t3 = steady_clock::now();
+
+        double build  = duration<double, std::micro>(t3 - t2).count()/reps;
+        double string = duration<double, std::micro>(t1 - t0).count()/reps - build;
+        double binary = duration<double, std::micro>(t2 - t1).count()/reps - build;
+        bool   sums   = (stringSum == expected) && (binarySum == expected);
+        printf(
+            "%5d detectors: string %8zu B %9.1f us   binary %8zu B %9.1f us (%.1fx) %s\n",
+            n, stringBytes, string, binaryBytes, binary, string/binary,
+            sums ? "ok" : "MISMATCH"
+        );
+        ok = ok && sums;
+
+        wire.clear();
+        CMPITclCodec::encode(pData, wire);
+        Tcl_Obj* pBack = CMPITclCodec::decode(wire.data(), wire.size());
+        Tcl_IncrRefCount(pBack);
+        if (strcmp(Tcl_GetString(pBack), Tcl_GetString(pData))) {
+            printf("%5d detectors: round trip MISMATCH\n", n);
+            ok = false;
+        }
+        Tcl_DecrRefCount(pBack);
+        Tcl_DecrRefCount(pData);
+    }
+
+    Tcl_Obj* pSmall = detectors(4);
+    Tcl_IncrRefCount(pSmall);
+    std::vector<char> wire;
+    CMPITclCodec::encode(pSmall, wire);
+    size_t rejected = 0;
+    for (size_t length = 0; length < wire.size(); length++) {
+        try {
+            Tcl_Obj* pObj = CMPITclCodec::decode(wire.data(), length);
+            Tcl_IncrRefCount(pObj);
+            Tcl_DecrRefCount(pObj);
+        }
+        catch (std::string) {
+            rejected++;
+        }
+    }
+    Tcl_DecrRefCount(pSmall);
+    printf("truncations rejected %zu/%zu\n", rejected, wire.size());
+    ok = ok && (rejected == wire.size());
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,103 @@
+#
+#    This software is Copyright by the Board of Trustees of Michigan
+#    State University (c) Copyright 2017.
+#
+#    You may use this software under the terms of the GNU public license
+#    (GPL).  The terms of this license are described at:
+#
+#     http://www.gnu.org/licenses/gpl.txt
+#
+#     Authors:
+#             Ron Fox
+#             Giordano Cerriza
+#	     NSCL
+#	     Michigan State University
+#	     East Lansing, MI 48824-1321
+#
+
+##
+# @file:  checkChunks.tcl
+# @brief: Check that payloads round trip whole through chunking and compression.
+#
+#  mpirun -np 2 mpitcl checkChunks.tcl
+#
+#  Rank 0 sends payloads just under, at and over the chunk size, and a
+#  few chunks long, to rank 1, which sends them back.  That's done with
+#  compression off and on, for data that compress and data that don't,
+#  as text and with -binary.  Each must come back as it was sent.  Exits
+#  1 on a failure or if the echoes don't all arrive within 30 seconds.
+#
+
+set chunk 4096
+set sizes [list 100 [expr {$chunk - 1}] $chunk [expr {$chunk + 1}] \
+    [expr {3*$chunk + 5}] 100000]
+
+expr {srand(1)}
+set noise ""
+for {set i 0} {$i < 100000} {incr i} {
+    append noise [format %c [expr {33 + int(rand()*94)}]]
+}
+set contents [dict create \
+    repeated [string repeat {event 12 34 56 } [expr {100000/16 + 1}]] \
+    random   $noise]
+
+mpi evalall [list mpi configure -chunksize $chunk -compressthreshold 1024]
+mpi evalall {
+    proc echo {source data} {
+        lassign $data how id payload
+        mpi send {*}$how $source [list $how $id $payload]
+    }
+    mpi handle echo
+}
+proc received {source data} {
+    lassign $data how id payload
+    set ::back($id) $payload
+    if {[incr ::pending -1] == 0} {
+        set ::done 1
+    }
+}
+mpi handle received
+
+set ok 1
+foreach compress {off on} {
+    mpi evalall [list mpi configure -compress $compress]
+    array unset back
+    set sent    [dict create]
+    set pending 0
+    set done    0
+    set id      0
+    foreach how {{} -binary} {
+        dict for {kind content} $contents {
+            foreach size $sizes {
+                set payload [string range $content 0 [expr {$size - 1}]]
+                dict set sent [incr id] [list $how $kind $payload]
+                incr pending
+                mpi send {*}$how 1 [list $how $id $payload]
+            }
+        }
+    }
+    set timeout [after 30000 {set done 0; set ::timedOut 1}]
+    if {$pending} {vwait done}
+    after cancel $timeout
+    if {[info exists timedOut]} {
+        puts "-compress $compress: [expr {$id - $pending}] of $id echoes came back"
+        set ok 0
+        break
+    }
+    set bad 0
+    dict for {n what} $sent {
+        lassign $what how kind payload
+        if {$back($n) ne $payload} {
+            puts "-compress $compress: $kind [string length $payload] bytes $how came back as [string length $back($n)] bytes that differ"
+            incr bad
+        }
+    }
+    if {$bad} {
+        set ok 0
+    } else {
+        puts "-compress $compress: $id payloads ok"
+    }
+}
+
+mpi execute others exit
+exit [expr {$ok ? 0 : 1}]
@@ -0,0 +1,99 @@
+#
+#    This software is Copyright by the Board of Trustees of Michigan
+#    State University (c) Copyright 2017.
+#
+#    You may use this software under the terms of the GNU public license
+#    (GPL).  The terms of this license are described at:
+#
+#     http://www.gnu.org/licenses/gpl.txt
+#
+#     Authors:
+#             Ron Fox
+#             Giordano Cerriza
+#	     NSCL
+#	     Michigan State University
+#	     East Lansing, MI 48824-1321
+#
+
+##
+# @file:  checkCodec.tcl
+# @brief: Check that mpi send -binary round trips Tcl values.
+#
+#  mpirun -np 2 mpitcl checkCodec.tcl
+#
+#  Rank 0 sends values of each type the binary format has, nested
+#  containers, numbers not written the way Tcl writes them and a list
+#  bigger than a chunk to rank 1 with -binary, each in a list with its
+#  number; rank 1 sends each back the same way.  They must come back
+#  with the same string form and, for containers, the same size.  Exits
+#  1 on a failure or if the echoes don't all arrive within 30 seconds.
+#
+
+set chunk 4096
+
+proc value {script} {
+    return [uplevel #0 $script]
+}
+set values [list \
+    [value {expr {0x10 + 0}}] \
+    [value {set n 0x10; incr n 0; set n 0x10; expr {$n + 0}; set n}] \
+    [value {expr {-(2**40)}}] \
+    [value {expr {1.5}}] \
+    [value {set d 1.50; expr {$d + 0}; set d}] \
+    [value {list a {b c} [list 1 [expr {2.5}]] {}}] \
+    [value {dict create k1 [expr {3}] k2 [list x y] k3 0x1f}] \
+    [value {binary format c* {0 1 2 -1}}] \
+    {} \
+    "\u00e9t\u00e9 \u4e2d" \
+    [value {lrepeat 3000 a 17}] \
+]
+
+mpi evalall [list mpi configure -chunksize $chunk]
+mpi evalall {
+    proc echo {source data} {
+        mpi send -binary $source $data
+    }
+    mpi handle echo
+}
+proc received {source data} {
+    lassign $data i value
+    set ::back($i) $value
+    if {[array size ::back] == [llength $::values]} {
+        set ::done 1
+    }
+}
+mpi handle received
+
+array set back {}
+set done    0
+set timeout [after 30000 {set done 0; set ::timedOut 1}]
+set i       0
+foreach value $values {
+    mpi send -binary 1 [list [incr i] $value]
+}
+vwait done
+after cancel $timeout
+
+set ok 1
+if {[info exists timedOut]} {
+    puts "only [array size back] of [llength $values] values came back"
+    set ok 0
+} else {
+    set i 0
+    foreach sent $values {
+        set got $back([incr i])
+        if {$got ne $sent} {
+            puts "sent [string range $sent 0 40] got [string range $got 0 40]"
+            set ok 0
+        } elseif {[string is list $sent] && ([llength $got] != [llength $sent])} {
+            puts "sent [llength $sent] elements got [llength $got]"
+            set ok 0
+        }
+    }
+    if {$ok} {
+        puts "[llength $values] values ok"
+    }
+}
+
+mpi execute others exit
+exit [expr {$ok ? 0 : 1}]
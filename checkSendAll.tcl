@@ -0,0 +1,74 @@
+#
+#    This software is Copyright by the Board of Trustees of Michigan
+#    State University (c) Copyright 2017.
+#
+#    You may use this software under the terms of the GNU public license
+#    (GPL).  The terms of this license are described at:
+#
+#     http://www.gnu.org/licenses/gpl.txt
+#
+#     Authors:
+#             Ron Fox
+#             Giordano Cerriza
+#	     NSCL
+#	     Michigan State University
+#	     East Lansing, MI 48824-1321
+#
+
+##
+# @file:  checkSendAll.tcl
+# @brief: Check that mpi send all delivers payloads bigger than a chunk.
+#
+#  mpirun -np n mpitcl checkSendAll.tcl
+#
+#  Every rank, rank 0 included, must get the payload whole, as text and
+#  with -binary.  Each rank reports the length it got to rank 0.  Exits
+#  1 on a failure or if the reports don't all arrive within 30 seconds.
+#
+
+set chunk   4096
+set payload [string repeat 0123456789abcdef [expr {$chunk*5/16 + 7}]]
+
+mpi evalall [list mpi configure -chunksize $chunk]
+mpi evalall {
+    proc received {source data} {
+        if {[lindex $data 0] eq "got"} {
+            lappend ::reports [lrange $data 1 end]
+            if {[llength $::reports] == $::expected} {
+                set ::done 1
+            }
+        } else {
+            mpi send 0 [list got [mpi rank] [string length $data]]
+        }
+    }
+    mpi handle received
+}
+
+set ok 1
+foreach option {{} -binary} {
+    set reports  [list]
+    set expected [mpi size]
+    set done     0
+    set timeout  [after 30000 {set done 0; set ::timedOut 1}]
+    mpi send {*}$option all $payload
+    vwait done
+    after cancel $timeout
+    if {[info exists timedOut]} {
+        puts "mpi send $option all: only [llength $reports] of $expected ranks reported"
+        set ok 0
+        break
+    }
+    foreach report [lsort -integer -index 0 $reports] {
+        lassign $report rank length
+        if {$length != [string length $payload]} {
+            puts "mpi send $option all: rank $rank got $length of [string length $payload] bytes"
+            set ok 0
+        }
+    }
+    if {$ok} {
+        puts "mpi send $option all: [string length $payload] bytes to $expected ranks ok"
+    }
+}
+
+mpi execute others exit
+exit [expr {$ok ? 0 : 1}]
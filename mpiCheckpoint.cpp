@@ -0,0 +1,445 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Giordano Cerriza
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+/** @file:  mpiCheckpoint.cpp
+ *  @brief: Implement checkpoints and resuming from them.
+ */
+#include "mpiCheckpoint.h"
+
+#include <TCLInterpreter.h>
+#include <SpecTcl.h>
+#include <Spectrum.h>
+#include <tcl.h>
+
+#include <sys/time.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+#include <iostream>
+
+/**
+ * readExactly
+ *    @param pFile  - file to read.
+ *    @param pData  - where to put what's read.
+ *    @param nBytes - how much to read.
+ *    @throw std::string - couldn't read it all.
+ */
+static void
+readExactly(FILE* pFile, void* pData, size_t nBytes)
+{
+    if (fread(pData, 1, nBytes, pFile) != nBytes) {
+        throw std::string("Checkpoint file is truncated or unreadable");
+    }
+}
+/**
+ * writeExactly
+ *    @param pFile  - file to write.
+ *    @param pData  - what to write.
+ *    @param nBytes - how much.
+ *    @throw std::string - the write failed.
+ */
+static void
+writeExactly(FILE* pFile, const void* pData, size_t nBytes)
+{
+    if (fwrite(pData, 1, nBytes, pFile) != nBytes) {
+        throw std::string("Unable to write checkpoint: ") + strerror(errno);
+    }
+}
+/**
+ * now
+ *    @return double - seconds since 1970.
+ */
+static double
+now()
+{
+    struct timeval t;
+    gettimeofday(&t, nullptr);
+    return t.tv_sec + t.tv_usec*1.0e-6;
+}
+/**
+ * requireRank0
+ *    @throw std::string - we're not rank 0.
+ */
+static void
+requireRank0()
+{
+    int rank;
+    MPI_Comm comm = MPISpecTcl_comm();
+    if (comm == MPI_COMM_NULL) {
+        throw std::string("Checkpoints need mpispectcl setup first");
+    }
+    MPI_Comm_rank(comm, &rank);
+    if (rank != 0) {
+        throw std::string("Checkpoints are taken and resumed by rank 0");
+    }
+}
+
+CMPICheckpoints* CMPICheckpoints::m_pInstance(nullptr);
+
+/**
+ * getInstance
+ *    @return CMPICheckpoints* - the singleton.
+ */
+CMPICheckpoints*
+CMPICheckpoints::getInstance()
+{
+    if (!m_pInstance) {
+        m_pInstance = new CMPICheckpoints;
+    }
+    return m_pInstance;
+}
+/**
+ * constructor
+ *    We hear about every snapshot that lands but only write the ones we
+ *    asked for.
+ */
+CMPICheckpoints::CMPICheckpoints() :
+    m_pInterp(nullptr), m_period(0), m_timer(nullptr), m_due(0),
+    m_pending(false), m_snapshot(0), m_requested(0), m_checkpoints(0)
+{
+    rewind();
+    CMPISnapshots::getInstance()->addObserver(this);
+}
+
+/**
+ * start
+ *    Start checkpointing.  Any checkpointing in progress is stopped
+ *    first.
+ *
+ * @param interp   - interpreter SpecTcl's commands are in.
+ * @param filename - checkpoint file.
+ * @param period   - seconds between checkpoints.
+ * @throw std::string - not rank 0 or the file can't be made.
+ */
+void
+CMPICheckpoints::start(
+    CTCLInterpreter& interp, const std::string& filename, double period
+)
+{
+    requireRank0();
+    if (period <= 0) {
+        throw std::string("Checkpoint period must be positive");
+    }
+    std::string temporary = filename + ".tmp";
+    FILE* pFile = fopen(temporary.c_str(), "wb");
+    if (!pFile) {
+        throw std::string("Unable to create ") + temporary + ": " + strerror(errno);
+    }
+    fclose(pFile);
+    unlink(temporary.c_str());
+
+    stop();
+    m_filename    = filename;
+    m_pInterp     = &interp;
+    m_period      = period;
+    m_checkpoints = 0;
+    schedule();
+}
+/**
+ * stop
+ *    Stop checkpointing.  A snapshot in flight is not written.
+ */
+void
+CMPICheckpoints::stop()
+{
+    if (m_timer) {
+        Tcl_DeleteTimerHandler(m_timer);
+        m_timer = nullptr;
+    }
+    m_filename.clear();
+    m_pending = false;
+}
+/**
+ * rewind
+ *    A new distributor starts from the beginning of the data without
+ *    discarding any.
+ */
+void
+CMPICheckpoints::rewind()
+{
+    memset(&m_position, 0, sizeof(m_position));
+    m_resume  = m_position;
+    m_cut     = m_position;
+    m_written = m_position;
+    m_pending = false;
+}
+/**
+ * resume
+ *    Load a checkpoint: its counts go into rank 0's spectra and become
+ *    the baseline, and the data before its position will be discarded.
+ *    The spectra must already be defined as they were when it was taken.
+ *
+ * @param interp   - interpreter SpecTcl's commands are in.
+ * @param filename - the checkpoint file.
+ * @throw std::string - not rank 0, the file can't be read or a
+ *                      spectrum in it isn't defined the same way.
+ */
+void
+CMPICheckpoints::resume(CTCLInterpreter& interp, const std::string& filename)
+{
+    requireRank0();
+    FILE* pFile = fopen(filename.c_str(), "rb");
+    if (!pFile) {
+        throw std::string("Unable to open ") + filename + ": " + strerror(errno);
+    }
+
+    SpecTcl*                        pApi = SpecTcl::getInstance();
+    MPICheckpointHeader             header;
+    std::vector<CSpectrum*>         spectra;
+    std::vector<std::vector<char> > counts;
+    try {
+        readExactly(pFile, &header, sizeof(header));
+        if (header.s_magic != MPICHECKPOINT_MAGIC) {
+            throw filename + " is not a checkpoint file";
+        }
+        counts.resize(header.s_spectra);
+        for (uint32_t i = 0; i < header.s_spectra; i++) {
+            MPICheckpointSpectrum spectrum;
+            readExactly(pFile, &spectrum, sizeof(spectrum));
+            std::string name(spectrum.s_nameLength, ' ');
+            readExactly(pFile, &name[0], name.size());
+            counts[i].resize(spectrum.s_bytes);
+            readExactly(pFile, counts[i].data(), counts[i].size());
+
+            CSpectrum* pSpectrum = pApi->FindSpectrum(name);
+            if (!pSpectrum || (pSpectrum->StorageNeeded() != spectrum.s_bytes)
+                || (pSpectrum->StorageType() != static_cast<DataType_t>(spectrum.s_type))) {
+                throw std::string("Checkpointed spectrum ") + name
+                    + " is not defined as it was when the checkpoint was taken";
+            }
+            spectra.push_back(pSpectrum);
+        }
+    }
+    catch (...) {
+        fclose(pFile);
+        throw;
+    }
+    fclose(pFile);
+
+    CMPISpectrumBaseline* pBaseline = CMPISpectrumBaseline::getInstance();
+    pBaseline->clear();
+    for (size_t i = 0; i < spectra.size(); i++) {
+        memcpy(spectra[i]->getStorage(), counts[i].data(), counts[i].size());
+        pBaseline->set(
+            spectra[i]->getName(), spectra[i]->StorageType(), counts[i].data(),
+            counts[i].size()
+        );
+    }
+    rewind();
+    m_resume.s_runs   = header.s_runs;
+    m_resume.s_blocks = header.s_blocks;
+    m_resume.s_bytes  = header.s_bytes;
+    m_written         = m_resume;
+}
+
+/**
+ * block
+ *    The distributor has a block.
+ *
+ * @param nBytes - its size.
+ * @return bool  - false if it was analyzed before the checkpoint we're
+ *                 resuming and must be discarded.
+ */
+bool
+CMPICheckpoints::block(size_t nBytes)
+{
+    bool discard = before(m_position, m_resume);
+    m_position.s_blocks++;
+    m_position.s_bytes += nBytes;
+    if (discard && !before(m_position, m_resume)
+        && (m_position.s_bytes != m_resume.s_bytes)) {
+        std::cerr << "Resumed data don't match the checkpoint: "
+                  << m_position.s_bytes << " bytes were skipped where it had "
+                  << m_resume.s_bytes << std::endl;
+    }
+    return !discard;
+}
+/**
+ * end
+ *    The distributor has an end of data.
+ *
+ * @return bool - false if the run ended before the checkpoint we're
+ *                resuming and its end must be discarded.
+ */
+bool
+CMPICheckpoints::end()
+{
+    bool discard = m_position.s_runs < m_resume.s_runs;
+    if (!discard && before(m_position, m_resume)) {
+        std::cerr << "Resumed run ended before the checkpoint's position"
+                  << std::endl;
+    }
+    m_position.s_runs++;
+    m_position.s_blocks = 0;
+    m_position.s_bytes  = 0;
+    return !discard;
+}
+
+/**
+ * reduced
+ *    A snapshot has landed in rank 0's spectra; write a checkpoint if
+ *    it's the one we're waiting for.  Errors are reported; the next
+ *    checkpoint may do better.
+ */
+void
+CMPICheckpoints::reduced(CTCLInterpreter& interp)
+{
+    if (!m_pending || (CMPISnapshots::getInstance()->landed() != m_snapshot)) {
+        return;
+    }
+    m_pending = false;
+    try {
+        write();
+        m_written = m_cut;
+        m_checkpoints++;
+    }
+    catch (std::string msg) {
+        std::cerr << "Checkpoint failed: " << msg << std::endl;
+    }
+}
+/**
+ * write
+ *    Write the spectra and the position of the cut to the temporary
+ *    file, get it to disk and rename it to the checkpoint file.
+ */
+void
+CMPICheckpoints::write()
+{
+    SpecTcl*                 pApi = SpecTcl::getInstance();
+    std::vector<std::string> names;
+    std::vector<CSpectrum*>  spectra;
+    MPISpecTcl_spectrumNames(*m_pInterp, names);
+    for (size_t i = 0; i < names.size(); i++) {
+        CSpectrum* pSpectrum = pApi->FindSpectrum(names[i]);
+        if (pSpectrum) spectra.push_back(pSpectrum);
+    }
+
+    std::string temporary = m_filename + ".tmp";
+    FILE* pFile = fopen(temporary.c_str(), "wb");
+    if (!pFile) {
+        throw std::string("Unable to create ") + temporary + ": " + strerror(errno);
+    }
+    try {
+        MPICheckpointHeader header;
+        header.s_magic   = MPICHECKPOINT_MAGIC;
+        header.s_spectra = spectra.size();
+        header.s_runs    = m_cut.s_runs;
+        header.s_blocks  = m_cut.s_blocks;
+        header.s_bytes   = m_cut.s_bytes;
+        header.s_time    = now();
+        writeExactly(pFile, &header, sizeof(header));
+        for (size_t i = 0; i < spectra.size(); i++) {
+            std::string           name = spectra[i]->getName();
+            MPICheckpointSpectrum spectrum;
+            spectrum.s_nameLength = name.size();
+            spectrum.s_type       = spectra[i]->StorageType();
+            spectrum.s_bytes      = spectra[i]->StorageNeeded();
+            writeExactly(pFile, &spectrum, sizeof(spectrum));
+            writeExactly(pFile, name.data(), name.size());
+            writeExactly(pFile, spectra[i]->getStorage(), spectrum.s_bytes);
+        }
+        if (fflush(pFile) || fsync(fileno(pFile))) {
+            throw std::string("Unable to write checkpoint: ") + strerror(errno);
+        }
+    }
+    catch (...) {
+        fclose(pFile);
+        unlink(temporary.c_str());
+        throw;
+    }
+    fclose(pFile);
+    if (rename(temporary.c_str(), m_filename.c_str())) {
+        throw std::string("Unable to rename ") + temporary + ": " + strerror(errno);
+    }
+}
+/**
+ * schedule
+ *    Set the timer for the next checkpoint.
+ */
+void
+CMPICheckpoints::schedule()
+{
+    m_due   = now() + m_period;
+    m_timer = Tcl_CreateTimerHandler(
+        static_cast<int>(m_period*1000.0), timer, this
+    );
+}
+/**
+ * poll
+ *    The distributor is between blocks.  While it's busy with a run the
+ *    event loop doesn't run, so fire the timer ourselves if it's due.
+ */
+void
+CMPICheckpoints::poll()
+{
+    if (m_timer && (now() >= m_due)) {
+        Tcl_DeleteTimerHandler(m_timer);
+        timer(this);
+    }
+}
+/**
+ * timer
+ *    Time for a checkpoint.  If nothing was distributed since the last
+ *    or a snapshot is still being reduced, this one is skipped.  Our
+ *    snapshot is abandoned if it hasn't landed within three periods (a
+ *    minute at least): it isn't written if it does land and the next is
+ *    asked for right away.
+ * @param pData - the checkpoints.
+ */
+void
+CMPICheckpoints::timer(ClientData pData)
+{
+    CMPICheckpoints* pThis = static_cast<CMPICheckpoints*>(pData);
+    pThis->m_timer = nullptr;
+    if (pThis->m_filename.empty()) return;
+    CMPISnapshots* pSnapshots = CMPISnapshots::getInstance();
+    double         waited     = now() - pThis->m_requested;
+    if (pThis->m_pending && !pSnapshots->ready()
+        && (waited >= std::max(3.0*pThis->m_period, 60.0))) {
+        std::cerr << "Checkpoint snapshot " << pThis->m_snapshot
+                  << " didn't land in " << static_cast<int>(waited)
+                  << " seconds; abandoning it" << std::endl;
+        pSnapshots->abandon();
+        pThis->m_pending = false;
+    }
+    if (!pThis->m_pending && before(pThis->m_written, pThis->m_position)
+        && pSnapshots->ready()) {
+        try {
+            pThis->m_cut       = pThis->m_position;
+            pThis->m_snapshot  = pSnapshots->request(*pThis->m_pInterp);
+            pThis->m_pending   = true;
+            pThis->m_requested = now();
+        }
+        catch (std::string msg) {
+            std::cerr << "Checkpoint snapshot failed: " << msg << std::endl;
+        }
+    }
+    pThis->schedule();
+}
+/**
+ * before
+ *    @param a, b - positions.
+ *    @return bool - true if a is before b.
+ */
+bool
+CMPICheckpoints::before(const Position& a, const Position& b)
+{
+    if (a.s_runs != b.s_runs) return a.s_runs < b.s_runs;
+    return a.s_blocks < b.s_blocks;
+}
@@ -0,0 +1,123 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Giordano Cerriza
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+/** @file:  mpiCheckpoint.h
+ *  @brief: Checkpoints of the distribution position and summed spectra.
+ *
+ *  While checkpointing, rank 0 takes a snapshot (see CMPISnapshots)
+ *  every period.  When one lands rank 0's spectra hold the counts of
+ *  exactly the blocks distributed before its cut, so they're written
+ *  with that position to the checkpoint file:
+ *
+ *  -  An MPICheckpointHeader.
+ *  -  For each of its s_spectra spectra, an MPICheckpointSpectrum, the
+ *     name and s_bytes of counts.
+ *
+ *  Each checkpoint is written to the file name with .tmp appended and
+ *  renamed over the last one so a failure while writing leaves that
+ *  intact.  Resuming loads the counts as the spectrum baseline (see
+ *  CMPISpectrumBaseline) and the distributor discards the data up to
+ *  the position, so nothing is counted twice.  The position is in the
+ *  blocks given to the distributor: runs ended, blocks of the current
+ *  run and their bytes, the offset in the run's data.  The data must be
+ *  replayed with the same block boundaries (same source and buffer size).
+ *  Only rank 0's position is kept, so checkpoints can't be used when
+ *  workers pull from other readers too.
+ */
+#ifndef MPICHECKPOINT_H
+#define MPICHECKPOINT_H
+
+#include "mpiSpectra.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+struct MPICheckpointHeader {
+    uint32_t s_magic;                  // MPICHECKPOINT_MAGIC.
+    uint32_t s_spectra;                // Spectra that follow.
+    uint64_t s_runs;                   // Runs ended before the cut.
+    uint64_t s_blocks;                 // Blocks of the cut's run before it.
+    uint64_t s_bytes;                  // Their bytes.
+    double   s_time;                   // When it landed (seconds since 1970).
+};
+static const uint32_t MPICHECKPOINT_MAGIC(0x4349504d);   // "MPIC"
+
+struct MPICheckpointSpectrum {
+    uint32_t s_nameLength;             // Name follows.
+    uint32_t s_type;                   // DataType_t of the channels.
+    uint64_t s_bytes;                  // Storage size.
+};
+
+/**
+ * @class CMPICheckpoints
+ *    Rank 0 - takes checkpoints, resumes from them and keeps track of
+ *    the position the distributor is at.  The distributor asks about
+ *    every block and end of data; while resuming those before the
+ *    checkpoint's position are discarded.  Snapshots are only requested
+ *    when data have been distributed since the last checkpoint, and one
+ *    that doesn't land in time is abandoned.  The Tcl timer can't fire
+ *    while the distributor is busy, so it also polls between blocks.
+ */
+class CMPICheckpoints : public CMPIBackgroundReduction::Observer
+{
+public:
+    struct Position {
+        uint64_t s_runs;               // Runs ended.
+        uint64_t s_blocks;             // Blocks of the current run.
+        uint64_t s_bytes;              // Bytes of those blocks.
+    };
+private:
+    std::string       m_filename;
+    CTCLInterpreter*  m_pInterp;
+    double            m_period;        // Seconds.
+    Tcl_TimerToken    m_timer;
+    double            m_due;           // When it fires.
+    Position          m_position;      // Given to the distributor.
+    Position          m_resume;        // Discard data before this.
+    Position          m_cut;           // Of our snapshot in flight.
+    Position          m_written;       // Of the last checkpoint.
+    bool              m_pending;       // Our snapshot is in flight.
+    uint32_t          m_snapshot;      // Its number.
+    double            m_requested;     // When it was asked for.
+    uint64_t          m_checkpoints;
+
+    static CMPICheckpoints* m_pInstance;
+public:
+    static CMPICheckpoints* getInstance();
+
+    void start(CTCLInterpreter& interp, const std::string& filename, double period);
+    void stop();
+    bool recording() const { return !m_filename.empty(); }
+    std::string filename() const { return m_filename; }
+    uint64_t checkpoints() const { return m_checkpoints; }
+    void rewind();
+    void resume(CTCLInterpreter& interp, const std::string& filename);
+    bool resuming() const { return before(m_position, m_resume); }
+
+    bool block(size_t nBytes);
+    bool end();
+    void poll();
+
+    virtual void reduced(CTCLInterpreter& interp);
+private:
+    CMPICheckpoints();
+    void write();
+    void schedule();
+    static void timer(ClientData pData);
+    static bool before(const Position& a, const Position& b);
+};
+
+#endif
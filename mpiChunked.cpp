@@ -0,0 +1,244 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Giordano Cerriza
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  mpiChunked.cpp
+ *  @brief: Implement chunked transfer of large messages.
+ */
+#include "mpiChunked.h"
+#include "mpitcl.h"
+
+#include <limits.h>
+#include <string>
+
+static size_t   chunkSize(16*1024*1024);   // Default chunk size.
+static unsigned chunkWindow(4);            // Default chunks in flight.
+
+/**
+ * MPITcl_setChunkSize
+ *    Set the size of chunks for subsequent large sends.  This is also the
+ *    size above which a payload is chunked.
+ * @param nBytes - new chunk size.
+ * @throw std::string - size is zero or not representable in an MPI count.
+ */
+void
+MPITcl_setChunkSize(size_t nBytes)
+{
+    if ((nBytes == 0) || (nBytes > INT_MAX)) {
+        throw std::string("Chunk size must be in the range [1, INT_MAX]");
+    }
+    chunkSize = nBytes;
+}
+size_t
+MPITcl_getChunkSize()
+{
+    return chunkSize;
+}
+/**
+ * MPITcl_setChunkWindow
+ *    Set the number of chunks that can be in flight at once.
+ * @param nChunks - the new window.
+ */
+void
+MPITcl_setChunkWindow(unsigned nChunks)
+{
+    if (nChunks == 0) {
+        throw std::string("Chunk window must be at least 1");
+    }
+    chunkWindow = nChunks;
+}
+unsigned
+MPITcl_getChunkWindow()
+{
+    return chunkWindow;
+}
+
+/**
+ * MPITcl_sendLarge
+ *    Send a payload of any size.  Payloads that fit in a chunk are sent
+ *    as a single message with the requested tag.  Larger ones are
+ *    announced with an MPI_TAG_CHUNKED message and sent in chunks.
+ *
+ * @param pData  - The payload.
+ * @param nBytes - Its size.
+ * @param tag    - Tag the receiver will process the payload as.
+ * @param dest   - Receiving rank.
+ * @param comm   - Communicator.
+ */
+void
+MPITcl_sendLarge(
+    const void* pData, uint64_t nBytes, int tag, int dest, MPI_Comm comm
+)
+{
+    if (nBytes <= chunkSize) {
+        MPI_Send(pData, nBytes, MPI_CHAR, dest, tag, comm);
+    } else {
+        MPIChunkHeader header;
+        header.s_totalSize = nBytes;
+        header.s_chunkSize = chunkSize;
+        header.s_tag       = tag;
+        MPI_Send(&header, sizeof(header), MPI_CHAR, dest, MPI_TAG_CHUNKED, comm);
+        MPITcl_sendChunks(pData, header, dest, comm);
+    }
+}
+/**
+ * MPITcl_sendChunks
+ *    Send the chunks of a payload whose header has already gone out.
+ *    A window of nonblocking sends is kept in flight.  The data are
+ *    sent from the caller's buffer so no copies are made.
+ *
+ * @param pData  - The payload.
+ * @param header - Describes how it's chunked.
+ * @param dest   - Receiving rank.
+ * @param comm   - Communicator.
+ */
+void
+MPITcl_sendChunks(
+    const void* pData, const MPIChunkHeader& header, int dest, MPI_Comm comm
+)
+{
+    const char* p       = static_cast<const char*>(pData);
+    uint64_t    nChunks =
+        (header.s_totalSize + header.s_chunkSize - 1)/header.s_chunkSize;
+    std::vector<MPI_Request> requests(chunkWindow, MPI_REQUEST_NULL);
+
+    for (uint64_t i = 0; i < nChunks; i++) {
+        MPI_Request& slot   = requests[i % chunkWindow];
+        uint64_t     offset = i * header.s_chunkSize;
+        uint64_t     nBytes = header.s_totalSize - offset;
+        if (nBytes > header.s_chunkSize) nBytes = header.s_chunkSize;
+
+        MPI_Wait(&slot, MPI_STATUS_IGNORE);
+        MPI_Isend(
+            p + offset, nBytes, MPI_CHAR, dest, MPI_TAG_CHUNK, comm, &slot
+        );
+    }
+    MPI_Waitall(requests.size(), requests.data(), MPI_STATUSES_IGNORE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// CMPIChunkReceiver implementation.
+
+/**
+ * constructor
+ *   @param window - number of chunks to keep in flight.
+ */
+CMPIChunkReceiver::CMPIChunkReceiver(unsigned window) :
+    m_window(window ? window : 1)
+{}
+
+/**
+ * receiveInto
+ *    Receive all chunks of a payload directly into their final location.
+ *
+ * @param pDest  - Where the payload goes (header.s_totalSize bytes).
+ * @param header - Describes the chunking.
+ * @param source - Rank sending the chunks.
+ * @param comm   - Communicator they're coming in on.
+ */
+void
+CMPIChunkReceiver::receiveInto(
+    void* pDest, const MPIChunkHeader& header, int source, MPI_Comm comm
+)
+{
+    char* p = static_cast<char*>(pDest);
+    pipeline(
+        header, source, comm,
+        [p, &header](uint64_t chunk) { return p + chunk*header.s_chunkSize; },
+        Consumer()
+    );
+}
+/**
+ * receive
+ *    Receive the chunks of a payload through a ring of buffers passing
+ *    each chunk to a consumer as it arrives.  The consumer gets the offset
+ *    of the chunk in the payload, a pointer to the chunk and its size.
+ *    The chunk pointer is only valid during the call.
+ *
+ * @param consumer - Called for each chunk, in order.
+ * @param header   - Describes the chunking.
+ * @param source   - Rank sending the chunks.
+ * @param comm     - Communicator they're coming in on.
+ */
+void
+CMPIChunkReceiver::receive(
+    Consumer consumer, const MPIChunkHeader& header, int source, MPI_Comm comm
+)
+{
+    m_buffers.resize(m_window);
+    for (size_t i = 0; i < m_buffers.size(); i++) {
+        m_buffers[i].resize(header.s_chunkSize);
+    }
+    pipeline(
+        header, source, comm,
+        [this](uint64_t chunk) { return m_buffers[chunk % m_window].data(); },
+        consumer
+    );
+}
+/**
+ * pipeline
+ *    Common code for receiveInto/receive.  Receives for the next window
+ *    chunks are kept posted.  As each chunk completes it's given to the
+ *    consumer and its slot reused for the chunk window positions later.
+ *
+ * @param header   - Describes the chunking.
+ * @param source   - Rank sending the chunks.
+ * @param comm     - Communicator they're coming in on.
+ * @param slot     - Returns the buffer a chunk is received into.
+ * @param consumer - If not empty, called as each chunk is received.
+ * @throw std::string - the header is invalid.
+ */
+void
+CMPIChunkReceiver::pipeline(
+    const MPIChunkHeader& header, int source, MPI_Comm comm,
+    std::function<char*(uint64_t)> slot, Consumer consumer
+)
+{
+    if (header.s_chunkSize == 0) {
+        throw std::string("Chunked transfer with a zero chunk size");
+    }
+    uint64_t nChunks =
+        (header.s_totalSize + header.s_chunkSize - 1)/header.s_chunkSize;
+    std::vector<MPI_Request> requests(m_window, MPI_REQUEST_NULL);
+    uint64_t posted = 0;
+
+    for (uint64_t i = 0; i < nChunks; i++) {
+        while ((posted < nChunks) && (posted < i + m_window)) {
+            MPI_Irecv(
+                slot(posted), chunkBytes(header, posted), MPI_CHAR, source,
+                MPI_TAG_CHUNK, comm, &requests[posted % m_window]
+            );
+            posted++;
+        }
+        MPI_Wait(&requests[i % m_window], MPI_STATUS_IGNORE);
+        if (consumer) {
+            consumer(i*header.s_chunkSize, slot(i), chunkBytes(header, i));
+        }
+    }
+}
+/**
+ * chunkBytes
+ *    @param header - chunking description.
+ *    @param chunk  - chunk number.
+ *    @return size_t - number of bytes in that chunk.
+ */
+size_t
+CMPIChunkReceiver::chunkBytes(const MPIChunkHeader& header, uint64_t chunk)
+{
+    uint64_t offset = chunk * header.s_chunkSize;
+    uint64_t nBytes = header.s_totalSize - offset;
+    return (nBytes > header.s_chunkSize) ? header.s_chunkSize : nBytes;
+}
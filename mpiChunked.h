@@ -0,0 +1,94 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Giordano Cerriza
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  mpiChunked.h
+ *  @brief: Transfer of messages too big for a single MPI message.
+ *
+ *  MPI counts are ints so a single message can't exceed 2GB.  Large
+ *  payloads are therefore sent as:
+ *  -  An announcement carrying an MPIChunkHeader.  For the Tcl and binary
+ *     data paths this is a message with MPI_TAG_CHUNKED; the block
+ *     distributor embeds it in its own block header instead.
+ *  -  The payload split in chunks of at most s_chunkSize bytes, sent
+ *     in order with MPI_TAG_CHUNK from the same sender.
+ *
+ *  The receiver keeps a window of receives posted so that the transfer
+ *  of later chunks overlaps the handling of earlier ones.
+ */
+#ifndef MPICHUNKED_H
+#define MPICHUNKED_H
+
+#include <mpi.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <functional>
+#include <vector>
+
+struct MPIChunkHeader {
+    uint64_t s_totalSize;              // Bytes in the whole payload.
+    uint32_t s_chunkSize;              // Bytes per chunk (last may be short).
+    int32_t  s_tag;                    // Tag the payload would have had.
+};
+
+void     MPITcl_setChunkSize(size_t nBytes);
+size_t   MPITcl_getChunkSize();
+void     MPITcl_setChunkWindow(unsigned nChunks);
+unsigned MPITcl_getChunkWindow();
+
+void MPITcl_sendLarge(
+    const void* pData, uint64_t nBytes, int tag, int dest, MPI_Comm comm
+);
+void MPITcl_sendChunks(
+    const void* pData, const MPIChunkHeader& header, int dest, MPI_Comm comm
+);
+
+/**
+ * @class CMPIChunkReceiver
+ *    Receives the chunks that follow an MPIChunkHeader.  Up to the
+ *    configured window of chunks are in flight at any time:
+ *    -  receiveInto places them directly into a caller buffer big enough
+ *       for the whole payload.
+ *    -  receive cycles them through a ring of window chunk sized buffers
+ *       handing each to a consumer, in order, as it completes.  Memory
+ *       use is bounded by window*chunkSize regardless of payload size.
+ */
+class CMPIChunkReceiver
+{
+public:
+    typedef std::function<void(uint64_t, const void*, size_t)> Consumer;
+private:
+    unsigned                        m_window;
+    std::vector<std::vector<char> > m_buffers;
+public:
+    CMPIChunkReceiver(unsigned window = MPITcl_getChunkWindow());
+
+    void receiveInto(
+        void* pDest, const MPIChunkHeader& header, int source, MPI_Comm comm
+    );
+    void receive(
+        Consumer consumer, const MPIChunkHeader& header, int source,
+        MPI_Comm comm
+    );
+private:
+    void pipeline(
+        const MPIChunkHeader& header, int source, MPI_Comm comm,
+        std::function<char*(uint64_t)> slot, Consumer consumer
+    );
+    static size_t chunkBytes(const MPIChunkHeader& header, uint64_t chunk);
+};
+
+#endif
@@ -0,0 +1,319 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Giordano Cerriza
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  mpiCodec.cpp
+ *  @brief: Implement the binary Tcl object codec.
+ */
+#include "mpiCodec.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+
+static const unsigned MAXDEPTH(1000);        // Deepest nesting decoded.
+
+/**
+ * append
+ *    Append bytes to an encoding.
+ */
+static inline void
+append(std::vector<char>& result, const void* pData, size_t nBytes)
+{
+    const char* p = static_cast<const char*>(pData);
+    result.insert(result.end(), p, p + nBytes);
+}
+/**
+ * appendVarint
+ *    Append an unsigned varint.
+ */
+static inline void
+appendVarint(std::vector<char>& result, uint64_t value)
+{
+    while (value >= 0x80) {
+        result.push_back(static_cast<char>((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    result.push_back(static_cast<char>(value));
+}
+/**
+ * appendCount
+ *    Append a type byte and a length or count.
+ */
+static inline void
+appendCount(std::vector<char>& result, char type, size_t count)
+{
+    result.push_back(type);
+    appendVarint(result, count);
+}
+/**
+ * take
+ *    Take bytes from an encoding, checking they're there.
+ */
+static inline void
+take(const char*& p, const char* pEnd, void* pData, size_t nBytes)
+{
+    if (static_cast<size_t>(pEnd - p) < nBytes) {
+        throw std::string("Truncated binary Tcl object");
+    }
+    memcpy(pData, p, nBytes);
+    p += nBytes;
+}
+/**
+ * takeVarint
+ *    Take an unsigned varint from an encoding.
+ */
+static inline uint64_t
+takeVarint(const char*& p, const char* pEnd)
+{
+    uint64_t value = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+        if (p == pEnd) {
+            throw std::string("Truncated binary Tcl object");
+        }
+        uint8_t byte = *p++;
+        value |= uint64_t(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return value;
+    }
+    throw std::string("Bad varint in binary Tcl object");
+}
+/**
+ * takeCount
+ *    Take a length or count; it must fit in a Tcl int.
+ */
+static inline size_t
+takeCount(const char*& p, const char* pEnd)
+{
+    uint64_t n = takeVarint(p, pEnd);
+    if (n > INT32_MAX) {
+        throw std::string("Bad length in binary Tcl object");
+    }
+    return n;
+}
+
+/**
+ * sameString
+ *    @return bool - true if an object has no string representation or
+ *                   it's the given one.
+ */
+static inline bool
+sameString(Tcl_Obj* pObj, const char* pString)
+{
+    return !pObj->bytes
+        || ((static_cast<size_t>(pObj->length) == strlen(pString))
+            && !memcmp(pObj->bytes, pString, pObj->length));
+}
+
+/**
+ * release
+ *    Drop our references to decoded items.
+ */
+static void
+release(std::vector<Tcl_Obj*>& items)
+{
+    for (size_t i = 0; i < items.size(); i++) {
+        Tcl_DecrRefCount(items[i]);
+    }
+}
+
+/**
+ * encode
+ *    Encode an object.
+ * @param pObj   - the object.
+ * @param result - the encoding is appended to this.
+ */
+void
+CMPITclCodec::encode(Tcl_Obj* pObj, std::vector<char>& result)
+{
+    encodeValue(pObj, result);
+}
+/**
+ * decode
+ *    Decode an object.
+ * @param pData  - the encoding.
+ * @param nBytes - its size; it must be exactly one value.
+ * @return Tcl_Obj* - new object (reference count zero).
+ * @throw std::string - if the encoding is bad.
+ */
+Tcl_Obj*
+CMPITclCodec::decode(const void* pData, size_t nBytes)
+{
+    const char* p    = static_cast<const char*>(pData);
+    const char* pEnd = p + nBytes;
+    Tcl_Obj*    pObj = decodeValue(p, pEnd, 0);
+    if (p != pEnd) {
+        Tcl_IncrRefCount(pObj);
+        Tcl_DecrRefCount(pObj);
+        throw std::string("Trailing bytes after binary Tcl object");
+    }
+    return pObj;
+}
+
+/**
+ * encodeValue
+ *    Encode a value by its internal representation.  Only strings and
+ *    objects with unlisted types get string representations made.  A
+ *    number's existing string representation is only compared with the
+ *    one its value would get; if they differ the string goes.
+ */
+void
+CMPITclCodec::encodeValue(Tcl_Obj* pObj, std::vector<char>& result)
+{
+    static const Tcl_ObjType* pIntType    = Tcl_GetObjType("int");
+    static const Tcl_ObjType* pWideType   = Tcl_GetObjType("wideInt");
+    static const Tcl_ObjType* pDoubleType = Tcl_GetObjType("double");
+    static const Tcl_ObjType* pListType   = Tcl_GetObjType("list");
+    static const Tcl_ObjType* pDictType   = Tcl_GetObjType("dict");
+    static const Tcl_ObjType* pBytesType  = Tcl_GetObjType("bytearray");
+    
+    const Tcl_ObjType* pType = pObj->typePtr;
+    char               canonical[TCL_DOUBLE_SPACE + 32];
+    if (pType && ((pType == pIntType) || (pType == pWideType))) {
+        Tcl_WideInt value;
+        Tcl_GetWideIntFromObj(nullptr, pObj, &value);
+        if (pObj->bytes) {
+            snprintf(canonical, sizeof(canonical), "%lld", static_cast<long long>(value));
+        }
+        if (sameString(pObj, canonical)) {
+            uint64_t u = value;
+            result.push_back('i');
+            appendVarint(result, (u << 1) ^ (0 - (u >> 63)));   // Zigzag.
+            return;
+        }
+    } else if (pType && (pType == pDoubleType)) {
+        double d;
+        Tcl_GetDoubleFromObj(nullptr, pObj, &d);
+        if (pObj->bytes) {
+            Tcl_PrintDouble(nullptr, d, canonical);
+        }
+        if (sameString(pObj, canonical)) {
+            result.push_back('d');
+            append(result, &d, sizeof(d));
+            return;
+        }
+    }
+    if (pType && (pType == pListType)) {
+        int       n;
+        Tcl_Obj** pItems;
+        Tcl_ListObjGetElements(nullptr, pObj, &n, &pItems);
+        appendCount(result, 'l', n);
+        for (int i = 0; i < n; i++) {
+            encodeValue(pItems[i], result);
+        }
+    } else if (pType && (pType == pDictType)) {
+        int            n;
+        Tcl_DictSearch search;
+        Tcl_Obj*       pKey;
+        Tcl_Obj*       pValue;
+        int            done;
+        Tcl_DictObjSize(nullptr, pObj, &n);
+        appendCount(result, 'D', n);
+        Tcl_DictObjFirst(nullptr, pObj, &search, &pKey, &pValue, &done);
+        for (; !done; Tcl_DictObjNext(&search, &pKey, &pValue, &done)) {
+            encodeValue(pKey, result);
+            encodeValue(pValue, result);
+        }
+        Tcl_DictObjDone(&search);
+    } else if (pType && (pType == pBytesType)) {
+        int            n;
+        unsigned char* pBytes = Tcl_GetByteArrayFromObj(pObj, &n);
+        appendCount(result, 'b', n);
+        append(result, pBytes, n);
+    } else {
+        int         n;
+        const char* pString = Tcl_GetStringFromObj(pObj, &n);
+        appendCount(result, 's', n);
+        append(result, pString, n);
+    }
+}
+/**
+ * decodeValue
+ *    Decode a value and, for containers, what's in it.
+ * @param[inout] p - where it starts; on return, where it ended.
+ * @param pEnd     - end of the encoding.
+ * @param depth    - how deeply nested we are.
+ * @return Tcl_Obj* - new object (reference count zero).
+ */
+Tcl_Obj*
+CMPITclCodec::decodeValue(const char*& p, const char* pEnd, unsigned depth)
+{
+    if (depth > MAXDEPTH) {
+        throw std::string("Binary Tcl object nested too deeply");
+    }
+    char type;
+    take(p, pEnd, &type, sizeof(type));
+    switch (type) {
+    case 'i':
+        {
+            uint64_t u = takeVarint(p, pEnd);
+            return Tcl_NewWideIntObj(static_cast<Tcl_WideInt>((u >> 1) ^ (0 - (u & 1))));
+        }
+    case 'd':
+        {
+            double d;
+            take(p, pEnd, &d, sizeof(d));
+            return Tcl_NewDoubleObj(d);
+        }
+    case 's':
+    case 'b':
+        {
+            size_t n = takeCount(p, pEnd);
+            if (static_cast<size_t>(pEnd - p) < n) {
+                throw std::string("Truncated binary Tcl object");
+            }
+            Tcl_Obj* pObj = (type == 's') ?
+                Tcl_NewStringObj(p, n) :
+                Tcl_NewByteArrayObj(reinterpret_cast<const unsigned char*>(p), n);
+            p += n;
+            return pObj;
+        }
+    case 'l':
+    case 'D':
+        {
+            size_t n      = takeCount(p, pEnd);
+            size_t nItems = (type == 'l') ? n : 2*n;
+            if (static_cast<size_t>(pEnd - p) < nItems) {   // Each at least a byte.
+                throw std::string("Truncated binary Tcl object");
+            }
+            std::vector<Tcl_Obj*> items;
+            items.reserve(nItems);
+            try {
+                for (size_t i = 0; i < nItems; i++) {
+                    Tcl_Obj* pItem = decodeValue(p, pEnd, depth + 1);
+                    Tcl_IncrRefCount(pItem);
+                    items.push_back(pItem);
+                }
+            } catch (...) {
+                release(items);
+                throw;
+            }
+            Tcl_Obj* pObj;
+            if (type == 'l') {
+                pObj = Tcl_NewListObj(items.size(), items.data());
+            } else {
+                pObj = Tcl_NewDictObj();
+                for (size_t i = 0; i < nItems; i += 2) {
+                    Tcl_DictObjPut(nullptr, pObj, items[i], items[i+1]);
+                }
+            }
+            release(items);                  // The container has its own.
+            return pObj;
+        }
+    default:
+        throw std::string("Unknown type in binary Tcl object");
+    }
+}
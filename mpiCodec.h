@@ -0,0 +1,62 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Giordano Cerriza
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  mpiCodec.h
+ *  @brief: Binary wire format for Tcl objects.
+ *
+ *  mpi send -binary ships Tcl objects in this format rather than as
+ *  strings so that neither end formats or parses string representations
+ *  of lists, dicts and numbers.  Each value is a type byte followed by:
+ *
+ *  -  'i' - a zigzag encoded varint (64 bit).
+ *  -  'd' - a double.
+ *  -  's' - a varint length and that many bytes of (Tcl) UTF-8.
+ *  -  'b' - a varint length and that many bytes of a byte array.
+ *  -  'l' - a varint count and that many values.
+ *  -  'D' - a varint count and that many key, value pairs.
+ *
+ *  Varints are little endian base 128: seven bits a byte, the top bit
+ *  set on all but the last, so small integers and counts (the usual
+ *  case) take a byte or two.  Doubles are in host byte order; all ranks
+ *  are assumed to share it.
+ *  Objects that have no internal representation, or one not listed
+ *  above, go as strings.  So do integers and doubles whose string
+ *  representation isn't the one Tcl makes of their value (0x10, 1.50)
+ *  so that they arrive as they were written.
+ */
+#ifndef MPICODEC_H
+#define MPICODEC_H
+
+#include <tcl.h>
+#include <stddef.h>
+#include <vector>
+
+/**
+ * @class CMPITclCodec
+ *     Encodes and decodes Tcl objects.  Stateless and thread safe.
+ */
+class CMPITclCodec
+{
+public:
+    static void     encode(Tcl_Obj* pObj, std::vector<char>& result);
+    static Tcl_Obj* decode(const void* pData, size_t nBytes);
+private:
+    static void     encodeValue(Tcl_Obj* pObj, std::vector<char>& result);
+    static Tcl_Obj* decodeValue(const char*& p, const char* pEnd, unsigned depth);
+};
+
+#endif
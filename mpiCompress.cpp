@@ -0,0 +1,432 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Giordano Cerriza
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  mpiCompress.cpp
+ *  @brief: Implement the LZ4 block codec and adaptive compression policy.
+ */
+#include "mpiCompress.h"
+
+#include <string.h>
+#include <algorithm>
+
+// Parameters of the LZ4 block format:
+
+static const size_t   MINMATCH(4);           // Shortest encodable match.
+static const size_t   LASTLITERALS(5);       // Trailing bytes that must be literals
+static const size_t   MFLIMIT(12);           // Last match must start this far from end.
+static const size_t   MAXDISTANCE(65535);    // Offsets are 16 bits.
+static const unsigned HASHLOG(12);           // 4K entry match table.
+
+// Policy tuning:
+
+static const double   INCOMPRESSIBLE(0.9);   // Ratio above which we don't bother.
+static const unsigned MAXBACKOFF(64);        // Most blocks skipped on bad ratio.
+static const unsigned CPUPROBEINTERVAL(256); // Blocks skipped when CPU bound.
+static const double   SMOOTHING(0.125);      // Weight of new rate measurements.
+
+static inline uint32_t
+read32(const uint8_t* p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t
+hash4(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - HASHLOG);
+}
+/**
+ * putLength
+ *    Write the 255 run length encoded part of a literal or match length
+ *    that did not fit in its token nybble.
+ *
+ * @param op   - References the output pointer (updated).
+ * @param oend - End of the output buffer.
+ * @param len  - Remaining length.
+ * @return bool - false if the output buffer is too small.
+ */
+static bool
+putLength(uint8_t*& op, uint8_t* oend, size_t len)
+{
+    while (len >= 255) {
+        if (op >= oend) return false;
+        *op++ = 255;
+        len  -= 255;
+    }
+    if (op >= oend) return false;
+    *op++ = static_cast<uint8_t>(len);
+    return true;
+}
+/**
+ * getLength
+ *    Decode the extension of a literal or match length.
+ *
+ * @param ip   - References the input pointer (updated).
+ * @param iend - End of input.
+ * @param len  - References the length to add to.
+ * @return bool - false if the input is truncated.
+ */
+static bool
+getLength(const uint8_t*& ip, const uint8_t* iend, size_t& len)
+{
+    uint8_t b;
+    do {
+        if (ip >= iend) return false;
+        b    = *ip++;
+        len += b;
+    } while (b == 255);
+    return true;
+}
+/**
+ * putSequence
+ *    Emit one LZ4 sequence (literals followed by an optional match).
+ *
+ * @param op       - output pointer (updated).
+ * @param oend     - end of output buffer.
+ * @param pLiterals - Pointer to the literals.
+ * @param litLen   - Number of literals.
+ * @param offset   - Match offset (0 for the final, literal only sequence).
+ * @param matchLen - Match length less MINMATCH.
+ * @return bool    - false if the output buffer was too small.
+ */
+static bool
+putSequence(
+    uint8_t*& op, uint8_t* oend, const uint8_t* pLiterals, size_t litLen,
+    size_t offset, size_t matchLen
+)
+{
+    if (op >= oend) return false;
+    uint8_t* token = op++;
+    *token = static_cast<uint8_t>((litLen >= 15 ? 15 : litLen) << 4);
+    if ((litLen >= 15) && !putLength(op, oend, litLen - 15)) return false;
+    if (static_cast<size_t>(oend - op) < litLen) return false;
+    if (litLen) memcpy(op, pLiterals, litLen);
+    op += litLen;
+
+    if (offset) {
+        if ((oend - op) < 2) return false;
+        *op++ = static_cast<uint8_t>(offset & 0xff);
+        *op++ = static_cast<uint8_t>(offset >> 8);
+        if (matchLen >= 15) {
+            *token |= 15;
+            if (!putLength(op, oend, matchLen - 15)) return false;
+        } else {
+            *token |= static_cast<uint8_t>(matchLen);
+        }
+    }
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// CMPICompressor implementation.
+
+/**
+ * constructor
+ *    Allocate the hash table.
+ */
+CMPICompressor::CMPICompressor() :
+    m_hashTable(1 << HASHLOG, 0)
+{}
+
+/**
+ * bound
+ *    Worst case size of the compressed form of a block.
+ * @param nBytes - uncompressed size.
+ * @return size_t
+ */
+size_t
+CMPICompressor::bound(size_t nBytes)
+{
+    return nBytes + nBytes/255 + 16;
+}
+/**
+ * expansion
+ *    Most a block can decompress to.  No sequence gives more than 255
+ *    bytes per byte it's encoded in.
+ * @param nBytes - compressed size.
+ * @return uint64_t
+ */
+uint64_t
+CMPICompressor::expansion(size_t nBytes)
+{
+    return uint64_t(nBytes)*255 + MINMATCH + 15;
+}
+/**
+ * compress
+ *    Greedy single pass LZ4 block compression.  Match candidates are
+ *    remembered in a hash table indexed by the next four bytes.  When no
+ *    match is found the scan step grows with the length of the current
+ *    literal run so incompressible data are skipped through quickly.
+ *
+ * @param pSrc     - data to compress.
+ * @param nBytes   - Number of bytes of data.
+ * @param pDest    - Where the compressed data go.
+ * @param capacity - Bytes available in pDest.
+ * @return size_t  - Size of the compressed data; 0 if it did not fit in
+ *                   capacity.
+ */
+size_t
+CMPICompressor::compress(
+    const void* pSrc, size_t nBytes, void* pDest, size_t capacity
+)
+{
+    const uint8_t* base   = static_cast<const uint8_t*>(pSrc);
+    const uint8_t* ip     = base;
+    const uint8_t* iend   = base + nBytes;
+    const uint8_t* anchor = base;
+    uint8_t*       op     = static_cast<uint8_t*>(pDest);
+    uint8_t*       obase  = op;
+    uint8_t*       oend   = op + capacity;
+
+    if (nBytes > MFLIMIT) {
+        const uint8_t* mflimit    = iend - MFLIMIT;
+        const uint8_t* matchlimit = iend - LASTLITERALS;
+        std::fill(m_hashTable.begin(), m_hashTable.end(), 0);
+        ip++;                           // first byte can't be a match.
+
+        while (ip < mflimit) {
+            uint32_t       seq = read32(ip);
+            uint32_t       h   = hash4(seq);
+            const uint8_t* ref = base + m_hashTable[h];
+            m_hashTable[h]     = static_cast<uint32_t>(ip - base);
+
+            if ((ref >= ip) || (static_cast<size_t>(ip - ref) > MAXDISTANCE)
+                || (read32(ref) != seq)) {
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+            // Extend the match backwards into the literals and forwards:
+
+            while ((ip > anchor) && (ref > base) && (ip[-1] == ref[-1])) {
+                ip--;
+                ref--;
+            }
+            const uint8_t* mp = ip  + MINMATCH;
+            const uint8_t* rp = ref + MINMATCH;
+            while ((mp < matchlimit) && (*mp == *rp)) {
+                mp++;
+                rp++;
+            }
+            if (!putSequence(
+                op, oend, anchor, ip - anchor, ip - ref, mp - ip - MINMATCH
+            )) {
+                return 0;
+            }
+            ip = anchor = mp;
+            if (ip < mflimit) {    // Helps ratio for short repeats.
+                m_hashTable[hash4(read32(ip - 2))] =
+                    static_cast<uint32_t>(ip - 2 - base);
+            }
+        }
+    }
+    // The tail is always literals:
+
+    if (!putSequence(op, oend, anchor, iend - anchor, 0, 0)) {
+        return 0;
+    }
+    return op - obase;
+}
+/**
+ * decompress
+ *    Decode an LZ4 block.  All lengths and offsets are checked so that
+ *    corrupt input can't write outside of pDest.
+ *
+ * @param pSrc        - Compressed data.
+ * @param nBytes      - Size of compressed data.
+ * @param pDest       - Buffer that receives the data.
+ * @param originalSize - Size of pDest which must be exactly the size of
+ *                      the uncompressed data.
+ * @return bool - true if the block decoded to exactly originalSize bytes.
+ */
+bool
+CMPICompressor::decompress(
+    const void* pSrc, size_t nBytes, void* pDest, size_t originalSize
+)
+{
+    const uint8_t* ip    = static_cast<const uint8_t*>(pSrc);
+    const uint8_t* iend  = ip + nBytes;
+    uint8_t*       op    = static_cast<uint8_t*>(pDest);
+    uint8_t*       obase = op;
+    uint8_t*       oend  = op + originalSize;
+
+    while (ip < iend) {
+        uint8_t token  = *ip++;
+        size_t  litLen = token >> 4;
+        if ((litLen == 15) && !getLength(ip, iend, litLen)) return false;
+        if ((litLen > static_cast<size_t>(iend - ip)) ||
+            (litLen > static_cast<size_t>(oend - op))) {
+            return false;
+        }
+        memcpy(op, ip, litLen);
+        op += litLen;
+        ip += litLen;
+        if (ip == iend) break;                 // Final sequence.
+
+        if ((iend - ip) < 2) return false;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if ((offset == 0) || (offset > static_cast<size_t>(op - obase))) {
+            return false;
+        }
+        size_t matchLen = token & 15;
+        if ((matchLen == 15) && !getLength(ip, iend, matchLen)) return false;
+        matchLen += MINMATCH;
+        if (matchLen > static_cast<size_t>(oend - op)) return false;
+
+        const uint8_t* match = op - offset;
+        if (offset >= matchLen) {
+            memcpy(op, match, matchLen);
+            op += matchLen;
+        } else {
+            while (matchLen--) *op++ = *match++;     // Overlapping copy.
+        }
+    }
+    return op == oend;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// CMPICompressionPolicy implementation.
+
+/**
+ * constructor
+ *   @param mode      - Initial compression mode.
+ *   @param threshold - Blocks smaller than this are never compressed.
+ */
+CMPICompressionPolicy::CMPICompressionPolicy(Mode mode, size_t threshold) :
+    m_mode(mode), m_threshold(threshold), m_skip(0), m_backoff(0),
+    m_compressRate(0.0), m_wireRate(0.0)
+{}
+
+/**
+ * setMode
+ *    Change the mode.  This also forgets any adaptive state.
+ * @param mode - new mode.
+ */
+void
+CMPICompressionPolicy::setMode(Mode mode)
+{
+    m_mode    = mode;
+    m_skip    = 0;
+    m_backoff = 0;
+}
+/**
+ * shouldCompress
+ *    @param nBytes - size of a block about to be sent.
+ *    @return bool  - true if compression should be attempted.
+ */
+bool
+CMPICompressionPolicy::shouldCompress(size_t nBytes)
+{
+    if ((m_mode == off) || (nBytes < m_threshold)) return false;
+    if (m_mode == on) return true;
+
+    if (m_skip) {
+        m_skip--;
+        return false;
+    }
+    return true;
+}
+/**
+ * compressed
+ *    Record the result of a compression attempt.
+ *
+ *  @param in      - uncompressed size.
+ *  @param out     - compressed size (0 if the compressor gave up).
+ *  @param seconds - time spent compressing.
+ *  @return bool   - true if the compressed data should be sent, false if
+ *                   the block was not worth it.
+ */
+bool
+CMPICompressionPolicy::compressed(size_t in, size_t out, double seconds)
+{
+    if (seconds > 0) {
+        double rate = in/seconds;
+        m_compressRate = (m_compressRate == 0.0) ?
+            rate : (1.0 - SMOOTHING)*m_compressRate + SMOOTHING*rate;
+    }
+    if ((out == 0) || (out > in*INCOMPRESSIBLE)) {
+        if (m_mode == automatic) {
+            m_backoff = std::min(std::max(1U, 2*m_backoff), MAXBACKOFF);
+            m_skip    = m_backoff;
+        }
+        return false;
+    }
+    m_backoff = 0;
+
+    // Are we CPU bound?  That's the case if compressing takes longer than
+    // sending the bytes it saves would have.
+
+    if ((m_mode == automatic) && (m_compressRate > 0) && (m_wireRate > 0)) {
+        double compressTime = in/m_compressRate;
+        double savedTime    = (in - out)/m_wireRate;
+        if (compressTime > savedTime) {
+            m_skip = CPUPROBEINTERVAL;
+        }
+    }
+    return true;
+}
+/**
+ * sent
+ *    Record the time needed to send a block so that the wire rate can be
+ *    estimated.  Note that for small (eager) messages this overestimates
+ *    the rate which biases us towards not compressing them.
+ *
+ * @param nBytes  - Bytes that went over the wire.
+ * @param seconds - How long the send took.
+ */
+void
+CMPICompressionPolicy::sent(size_t nBytes, double seconds)
+{
+    if ((nBytes == 0) || (seconds <= 0)) return;
+    double rate = nBytes/seconds;
+    m_wireRate = (m_wireRate == 0.0) ?
+        rate : (1.0 - SMOOTHING)*m_wireRate + SMOOTHING*rate;
+}
+/**
+ * modeFromString
+ *    @param mode - one of off, on or auto.
+ *    @return Mode
+ *    @throw std::string - invalid mode.
+ */
+CMPICompressionPolicy::Mode
+CMPICompressionPolicy::modeFromString(const std::string& mode)
+{
+    if (mode == "off")  return off;
+    if (mode == "on")   return on;
+    if (mode == "auto") return automatic;
+
+    throw std::string("Compression mode must be one of off, on or auto");
+}
+/**
+ * modeToString
+ *   @param mode - a mode.
+ *   @return const char* - its textual form.
+ */
+const char*
+CMPICompressionPolicy::modeToString(Mode mode)
+{
+    switch (mode) {
+    case off:
+        return "off";
+    case on:
+        return "on";
+    default:
+        return "auto";
+    }
+}
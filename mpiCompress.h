@@ -0,0 +1,99 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Giordano Cerriza
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  mpiCompress.h
+ *  @brief: Block compression used by the mpitcl transports.
+ *
+ *  The codec produces/consumes the LZ4 block format (no frame header),
+ *  so data compressed here can be checked with stock lz4 tools.  It is
+ *  vendored here to avoid yet another external dependency at the DAQ
+ *  sites.  The code lives in the mpitcl executable and is exported to
+ *  loadable packages (e.g. mpispectcl).
+ */
+#ifndef MPICOMPRESS_H
+#define MPICOMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/**
+ * @class CMPICompressor
+ *     LZ4 block format compressor.  An object holds the match hash table
+ *     so that it is not re-allocated for each block.  Objects are not
+ *     thread safe; each thread that compresses needs its own.
+ */
+class CMPICompressor
+{
+private:
+    std::vector<uint32_t> m_hashTable;
+public:
+    CMPICompressor();
+
+    size_t compress(const void* pSrc, size_t nBytes, void* pDest, size_t capacity);
+
+    static size_t bound(size_t nBytes);
+    static uint64_t expansion(size_t nBytes);
+    static bool   decompress(
+        const void* pSrc, size_t nBytes, void* pDest, size_t originalSize
+    );
+};
+
+/**
+ * @class CMPICompressionPolicy
+ *     Decides, block by block, whether compression is worth trying.
+ *     -  off       - never compress.
+ *     -  on        - compress every block at least threshold bytes long.
+ *     -  automatic - as for on but:
+ *        * Blocks that don't compress to better than 90% cause an
+ *          exponentially growing number of subsequent blocks to be sent
+ *          without trying.
+ *        * If the time spent compressing exceeds the estimated wire time
+ *          saved (i.e. we're CPU rather than bandwidth bound) compression
+ *          is turned off for a while and then probed again.
+ */
+class CMPICompressionPolicy
+{
+public:
+    typedef enum _Mode {
+        off, on, automatic
+    } Mode;
+private:
+    Mode     m_mode;
+    size_t   m_threshold;
+    unsigned m_skip;                // Blocks left to send uncompressed.
+    unsigned m_backoff;             // Current incompressible backoff.
+    double   m_compressRate;        // Bytes/sec compressing (smoothed).
+    double   m_wireRate;            // Bytes/sec sending (smoothed).
+public:
+    CMPICompressionPolicy(Mode mode = automatic, size_t threshold = 4096);
+
+    void   setMode(Mode mode);
+    Mode   mode() const { return m_mode; }
+    void   setThreshold(size_t nBytes) { m_threshold = nBytes; }
+    size_t threshold() const { return m_threshold; }
+
+    bool shouldCompress(size_t nBytes);
+    bool compressed(size_t in, size_t out, double seconds);
+    void sent(size_t nBytes, double seconds);
+
+    static Mode        modeFromString(const std::string& mode);
+    static const char* modeToString(Mode mode);
+};
+
+#endif
@@ -0,0 +1,157 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Giordano Cerriza
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  mpiFilter.cpp
+ *  @brief: Implement receive filters.
+ */
+#include "mpiFilter.h"
+
+/**
+ * constructor
+ *    A filter that keeps everything.
+ */
+CMPIReceiveFilter::CMPIReceiveFilter() :
+    m_match(false), m_index(0), m_sample(1), m_latest(false),
+    m_passed(0), m_dropped(0)
+{}
+
+/**
+ * setMatch
+ *    Keep only data whose list element index matches pattern.
+ * @param index   - list index of the field.
+ * @param pattern - glob pattern it must match.
+ */
+void
+CMPIReceiveFilter::setMatch(int index, const std::string& pattern)
+{
+    if (index < 0) {
+        throw std::string("Filter field index must be >= 0");
+    }
+    m_match   = true;
+    m_index   = index;
+    m_pattern = pattern;
+}
+/**
+ * clearMatch
+ *    Stop matching.
+ */
+void
+CMPIReceiveFilter::clearMatch()
+{
+    m_match = false;
+    m_pattern.clear();
+}
+/**
+ * setSample
+ *    Keep one in every `every` matching messages from each source.
+ * @param every - 1 keeps them all.
+ */
+void
+CMPIReceiveFilter::setSample(unsigned every)
+{
+    if (every == 0) {
+        throw std::string("Filter sample rate must be > 0");
+    }
+    m_sample = every;
+    m_seen.clear();
+}
+
+/**
+ * keep
+ *    Decide on data the match can't look at (binary data).  Only the
+ *    sampling applies.
+ * @param source - rank that sent them.
+ * @return bool  - true to keep them.
+ */
+bool
+CMPIReceiveFilter::keep(int source)
+{
+    return sampled(source, true);
+}
+/**
+ * keepText
+ *    Decide on text data.  Data that aren't a list don't match.
+ * @param source - rank that sent them.
+ * @param pText  - the data.
+ * @return bool  - true to keep them.
+ */
+bool
+CMPIReceiveFilter::keepText(int source, const char* pText)
+{
+    bool matched = true;
+    if (m_match) {
+        int          argc;
+        const char** argv;
+        matched = false;
+        if (Tcl_SplitList(nullptr, pText, &argc, &argv) == TCL_OK) {
+            matched = (m_index < argc) &&
+                Tcl_StringMatch(argv[m_index], m_pattern.c_str());
+            Tcl_Free(reinterpret_cast<char*>(argv));
+        }
+    }
+    return sampled(source, matched);
+}
+/**
+ * keepObject
+ *    Decide on object data (mpi send -binary).
+ * @param source - rank that sent them.
+ * @param pObj   - the data.
+ * @return bool  - true to keep them.
+ */
+bool
+CMPIReceiveFilter::keepObject(int source, Tcl_Obj* pObj)
+{
+    bool matched = true;
+    if (m_match) {
+        Tcl_Obj* pField = nullptr;
+        matched = (Tcl_ListObjIndex(nullptr, pObj, m_index, &pField) == TCL_OK)
+            && pField && Tcl_StringMatch(Tcl_GetString(pField), m_pattern.c_str());
+    }
+    return sampled(source, matched);
+}
+/**
+ * coalesced
+ *    A message that was kept was then replaced by a newer one.
+ */
+void
+CMPIReceiveFilter::coalesced()
+{
+    m_passed--;
+    m_dropped++;
+}
+
+/**
+ * sampled
+ *    Apply the sampling to a message and count it.  The first matching
+ *    message from each source is kept.
+ * @param source  - rank that sent it.
+ * @param matched - whether it matched.
+ * @return bool   - true to keep it.
+ */
+bool
+CMPIReceiveFilter::sampled(int source, bool matched)
+{
+    if (matched && (m_sample > 1)) {
+        matched = (m_seen[source]++ % m_sample) == 0;
+    }
+    if (matched) {
+        m_passed++;
+    } else {
+        m_dropped++;
+    }
+    return matched;
+}
@@ -0,0 +1,81 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Giordano Cerriza
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  mpiFilter.h
+ *  @brief: Predicates that decide if received data reach the interpreter.
+ *
+ *  Rank 0's receiver threads run these on mpi send data and binary data
+ *  as they take them so messages a handler would only throw away never
+ *  wake the interpreter.  A filter can:
+ *
+ *  -  match:  keep only data whose list element index matches a glob
+ *             pattern (string match rules).
+ *  -  sample: of the data that match, keep only one in n from each
+ *             source.
+ *  -  latest: keep only the newest message from each source of those
+ *             still waiting for the interpreter.  The filter just says
+ *             so; coalescing is up to whatever holds the waiting ones.
+ */
+#ifndef MPIFILTER_H
+#define MPIFILTER_H
+
+#include <tcl.h>
+#include <stdint.h>
+#include <string>
+#include <map>
+
+/**
+ * @class CMPIReceiveFilter
+ *     A filter and how many messages it kept and dropped.  Not thread
+ *     safe; callers serialize.
+ */
+class CMPIReceiveFilter
+{
+private:
+    bool                    m_match;
+    int                     m_index;
+    std::string             m_pattern;
+    unsigned                m_sample;       // Keep one in this many.
+    bool                    m_latest;
+    std::map<int, uint64_t> m_seen;         // Matching messages by source.
+    uint64_t                m_passed;
+    uint64_t                m_dropped;
+public:
+    CMPIReceiveFilter();
+
+    void setMatch(int index, const std::string& pattern);
+    void clearMatch();
+    bool matching() const { return m_match; }
+    int  matchIndex() const { return m_index; }
+    std::string matchPattern() const { return m_pattern; }
+    void setSample(unsigned every);
+    unsigned sample() const { return m_sample; }
+    void setLatest(bool latest) { m_latest = latest; }
+    bool latest() const { return m_latest; }
+    bool active() const { return m_match || (m_sample > 1) || m_latest; }
+
+    bool keep(int source);
+    bool keepText(int source, const char* pText);
+    bool keepObject(int source, Tcl_Obj* pObj);
+    void coalesced();
+    uint64_t passed() const { return m_passed; }
+    uint64_t dropped() const { return m_dropped; }
+private:
+    bool sampled(int source, bool matched);
+};
+
+#endif
@@ -0,0 +1,598 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Giordano Cerriza
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  mpiHistory.cpp
+ *  @brief: Implement the time sliced spectrum history.
+ */
+#include "mpiHistory.h"
+
+#include <TCLInterpreter.h>
+#include <SpecTcl.h>
+#include <Spectrum.h>
+#include <tcl.h>
+
+#include <sys/time.h>
+#include <errno.h>
+#include <string.h>
+#include <set>
+#include <iostream>
+
+static const size_t COMPRESS_THRESHOLD(4096);   // Smaller payloads aren't.
+
+/**
+ * summable
+ *    @param type - channel type.
+ *    @return bool - true if history can be kept for it.
+ */
+static bool
+summable(DataType_t type)
+{
+    return (type == keByte) || (type == keWord) || (type == keLong)
+        || (type == keFloat) || (type == keDouble);
+}
+/**
+ * readExactly
+ *    @param pFile  - file to read.
+ *    @param pData  - where to put what's read.
+ *    @param nBytes - how much to read.
+ *    @throw std::string - couldn't read it all.
+ */
+static void
+readExactly(FILE* pFile, void* pData, size_t nBytes)
+{
+    if (fread(pData, 1, nBytes, pFile) != nBytes) {
+        throw std::string("History file is truncated or unreadable");
+    }
+}
+/**
+ * writeExactly
+ *    @param pFile  - file to write.
+ *    @param pData  - what to write.
+ *    @param nBytes - how much.
+ *    @throw std::string - the write failed.
+ */
+static void
+writeExactly(FILE* pFile, const void* pData, size_t nBytes)
+{
+    if (fwrite(pData, 1, nBytes, pFile) != nBytes) {
+        throw std::string("Unable to write spectrum history: ") + strerror(errno);
+    }
+}
+
+/**
+ * changedChannels/applyDeltas
+ *    Typed workers for changes and apply.
+ */
+template<class T>
+static uint64_t
+changedChannels(
+    const T* pNow, const T* pLast, size_t nChannels,
+    std::vector<char>& gaps, std::vector<char>& deltas
+)
+{
+    uint64_t count    = 0;
+    uint64_t previous = UINT64_MAX;           // i.e. -1.
+    for (size_t i = 0; i < nChannels; i++) {
+        T last = pLast ? pLast[i] : T(0);
+        if (pNow[i] != last) {
+            uint64_t gap   = i - previous;
+            T        delta = static_cast<T>(pNow[i] - last);
+            previous = i;
+            const char* p = reinterpret_cast<const char*>(&gap);
+            gaps.insert(gaps.end(), p, p + sizeof(gap));
+            p = reinterpret_cast<const char*>(&delta);
+            deltas.insert(deltas.end(), p, p + sizeof(delta));
+            count++;
+        }
+    }
+    return count;
+}
+template<class T>
+static void
+applyDeltas(
+    T* pStorage, size_t nChannels, const char* pGaps, const char* pDeltas,
+    uint64_t nChanges
+)
+{
+    uint64_t index = UINT64_MAX;
+    for (uint64_t i = 0; i < nChanges; i++) {
+        uint64_t gap;
+        T        delta;
+        memcpy(&gap, pGaps + i*sizeof(gap), sizeof(gap));
+        memcpy(&delta, pDeltas + i*sizeof(delta), sizeof(delta));
+        index += gap;
+        if (index >= nChannels) {
+            throw std::string("History slice has a channel outside its spectrum");
+        }
+        pStorage[index] = static_cast<T>(pStorage[index] + delta);
+    }
+}
+
+CMPISpectrumHistory* CMPISpectrumHistory::m_pInstance(nullptr);
+
+/**
+ * getInstance
+ *    @return CMPISpectrumHistory* - the singleton.
+ */
+CMPISpectrumHistory*
+CMPISpectrumHistory::getInstance()
+{
+    if (!m_pInstance) {
+        m_pInstance = new CMPISpectrumHistory;
+    }
+    return m_pInstance;
+}
+/**
+ * constructor
+ *    We hear about every snapshot that lands but only record while a
+ *    history file is open.
+ */
+CMPISpectrumHistory::CMPISpectrumHistory() :
+    m_pFile(nullptr), m_pIndexFile(nullptr), m_pInterp(nullptr), m_period(0),
+    m_timer(nullptr), m_slices(0)
+{
+    CMPISnapshots::getInstance()->addObserver(this);
+}
+
+/**
+ * start
+ *    Start recording a new history file.  Any history being recorded is
+ *    stopped first.
+ *
+ * @param interp   - interpreter SpecTcl's commands are in.
+ * @param filename - history file; the index is filename.idx.
+ * @param period   - seconds between snapshots.
+ * @throw std::string - not rank 0 or the files can't be made.
+ */
+void
+CMPISpectrumHistory::start(
+    CTCLInterpreter& interp, const std::string& filename, double period
+)
+{
+    int rank;
+    if (MPISpecTcl_comm() == MPI_COMM_NULL) {
+        throw std::string("Spectrum history needs mpispectcl setup first");
+    }
+    MPI_Comm_rank(MPISpecTcl_comm(), &rank);
+    if (rank != 0) {
+        throw std::string("Spectrum history is recorded by rank 0");
+    }
+    if (period <= 0) {
+        throw std::string("Spectrum history period must be positive");
+    }
+    stop();
+    m_pFile = fopen(filename.c_str(), "w+b");
+    if (!m_pFile) {
+        throw std::string("Unable to create ") + filename + ": " + strerror(errno);
+    }
+    std::string indexName = filename + ".idx";
+    m_pIndexFile = fopen(indexName.c_str(), "w+b");
+    if (!m_pIndexFile) {
+        std::string msg = std::string("Unable to create ") + indexName + ": " + strerror(errno);
+        fclose(m_pFile);
+        m_pFile = nullptr;
+        throw msg;
+    }
+    m_filename = filename;
+    m_pInterp  = &interp;
+    m_period   = period;
+    m_slices   = 0;
+    schedule();
+}
+/**
+ * stop
+ *    Stop recording.  The files are kept for rebuilding.  A snapshot in
+ *    flight is not recorded.
+ */
+void
+CMPISpectrumHistory::stop()
+{
+    if (m_timer) {
+        Tcl_DeleteTimerHandler(m_timer);
+        m_timer = nullptr;
+    }
+    if (m_pFile) {
+        fclose(m_pFile);
+        fclose(m_pIndexFile);
+        m_pFile      = nullptr;
+        m_pIndexFile = nullptr;
+    }
+    m_last.clear();
+}
+/**
+ * setFilename
+ *    Choose an existing history to rebuild from.
+ * @param filename - the history file.
+ * @throw std::string - a history is being recorded.
+ */
+void
+CMPISpectrumHistory::setFilename(const std::string& filename)
+{
+    if (m_pFile) {
+        throw std::string("Can't change history files while recording");
+    }
+    m_filename = filename;
+}
+/**
+ * slices
+ *    @param[out] result - the index of the current (or last) history.
+ *    @throw std::string - there's no history or it can't be read.
+ */
+void
+CMPISpectrumHistory::slices(std::vector<MPIHistoryIndex>& result) const
+{
+    if (m_filename.empty()) {
+        throw std::string("No spectrum history has been recorded");
+    }
+    std::string indexName = m_filename + ".idx";
+    FILE* pIndex = fopen(indexName.c_str(), "rb");
+    if (!pIndex) {
+        throw std::string("Unable to open ") + indexName + ": " + strerror(errno);
+    }
+    MPIHistoryIndex entry;
+    while (fread(&entry, sizeof(entry), 1, pIndex) == 1) {
+        result.push_back(entry);
+    }
+    fclose(pIndex);
+}
+/**
+ * rebuild
+ *    Rebuild the counts of a time window into spectra.  Each spectrum in
+ *    the history whose target exists is cleared and gets the sum of the
+ *    window's deltas.  A target whose storage size or channel type
+ *    differs from the history's is an error.
+ *
+ * @param from   - window start (exclusive).
+ * @param to     - window end (inclusive).
+ * @param suffix - appended to each spectrum's name to get the target.
+ *                 Empty rebuilds into the spectra themselves.
+ * @return unsigned - the number of slices in the window.
+ * @throw std::string - no history, it can't be read or it doesn't fit
+ *                      a target spectrum.
+ */
+unsigned
+CMPISpectrumHistory::rebuild(double from, double to, const std::string& suffix) const
+{
+    std::vector<MPIHistoryIndex> index;
+    slices(index);
+    FILE* pFile = fopen(m_filename.c_str(), "rb");
+    if (!pFile) {
+        throw std::string("Unable to open ") + m_filename + ": " + strerror(errno);
+    }
+
+    SpecTcl*              pApi    = SpecTcl::getInstance();
+    std::set<CSpectrum*>  cleared;
+    std::vector<char>     stored;
+    std::vector<char>     payload;
+    unsigned              nSlices = 0;
+    try {
+        for (size_t i = 0; i < index.size(); i++) {
+            if ((index[i].s_time <= from) || (index[i].s_time > to)) continue;
+
+            MPIHistorySlice header;
+            if (fseeko(pFile, index[i].s_offset, SEEK_SET)) {
+                throw std::string("History index points outside the history file");
+            }
+            readExactly(pFile, &header, sizeof(header));
+            if (header.s_magic != MPIHISTORY_MAGIC) {
+                throw std::string("History index doesn't match the history file");
+            }
+            stored.resize(header.s_storedBytes);
+            readExactly(pFile, stored.data(), stored.size());
+            const char* p = stored.data();
+            if (header.s_flags & MPIHISTORY_COMPRESSED) {
+                if (header.s_bytes > CMPICompressor::expansion(stored.size())) {
+                    throw std::string("Corrupt compressed history slice");
+                }
+                payload.resize(header.s_bytes);
+                if (!CMPICompressor::decompress(
+                    stored.data(), stored.size(), payload.data(), payload.size()
+                )) {
+                    throw std::string("Corrupt compressed history slice");
+                }
+                p = payload.data();
+            } else if (header.s_bytes > stored.size()) {
+                throw std::string("History slice is truncated");
+            }
+            const char* pEnd = p + header.s_bytes;
+
+            while (p < pEnd) {
+                MPIHistorySpectrum spectrum;
+                if (size_t(pEnd - p) < sizeof(spectrum)) {
+                    throw std::string("History slice is truncated");
+                }
+                memcpy(&spectrum, p, sizeof(spectrum));
+                p += sizeof(spectrum);
+                DataType_t  type      = static_cast<DataType_t>(spectrum.s_type);
+                size_t      elSize    = CMPISpectrumReducer::elementSize(type);
+                size_t      left      = pEnd - p;
+                if ((spectrum.s_nameLength > left)
+                    || (spectrum.s_changes > (left - spectrum.s_nameLength)
+                                             / (sizeof(uint64_t) + elSize))) {
+                    throw std::string("History slice is truncated");
+                }
+                std::string name(p, spectrum.s_nameLength);
+                p += spectrum.s_nameLength;
+                const char* pGaps     = p;
+                const char* pDeltas   = p + spectrum.s_changes*sizeof(uint64_t);
+                p = pDeltas + spectrum.s_changes*elSize;
+
+                CSpectrum* pTarget = pApi->FindSpectrum(name + suffix);
+                if (!pTarget) continue;
+                if ((pTarget->StorageNeeded() != spectrum.s_bytes)
+                    || (pTarget->StorageType() != type)) {
+                    throw std::string("History of ") + name
+                        + " doesn't match the storage of " + name + suffix;
+                }
+                if (cleared.insert(pTarget).second) {
+                    pTarget->Clear();
+                }
+                apply(
+                    pTarget->getStorage(), spectrum.s_bytes, pGaps, pDeltas,
+                    spectrum.s_changes, type
+                );
+            }
+            nSlices++;
+        }
+    }
+    catch (...) {
+        fclose(pFile);
+        throw;
+    }
+    fclose(pFile);
+    return nSlices;
+}
+
+/**
+ * reduced
+ *    A snapshot has landed in rank 0's spectra; record a slice if we're
+ *    recording.  Errors can't go anywhere useful from here so they are
+ *    reported and recording stops.
+ */
+void
+CMPISpectrumHistory::reduced(CTCLInterpreter& interp)
+{
+    if (!m_pFile) return;
+    try {
+        record();
+    }
+    catch (std::string msg) {
+        std::cerr << "Spectrum history stopped: " << msg << std::endl;
+        stop();
+    }
+}
+/**
+ * record
+ *    Append a slice with the changes since the last one.
+ */
+void
+CMPISpectrumHistory::record()
+{
+    SpecTcl*                 pApi = SpecTcl::getInstance();
+    std::vector<std::string> names;
+    MPISpecTcl_spectrumNames(*m_pInterp, names);
+
+    std::map<std::string, std::vector<char> > now;
+    std::vector<char> gaps;
+    std::vector<char> deltas;
+    m_payload.clear();
+    for (size_t i = 0; i < names.size(); i++) {
+        CSpectrum* pSpectrum = pApi->FindSpectrum(names[i]);
+        if (!pSpectrum || !summable(pSpectrum->StorageType())) continue;
+        MPIHistorySpectrum spectrum;
+        spectrum.s_nameLength = names[i].size();
+        spectrum.s_type       = pSpectrum->StorageType();
+        spectrum.s_bytes      = pSpectrum->StorageNeeded();
+
+        std::vector<char>& counts(now[names[i]]);
+        const char* pStorage = static_cast<const char*>(pSpectrum->getStorage());
+        counts.assign(pStorage, pStorage + spectrum.s_bytes);
+        std::map<std::string, std::vector<char> >::iterator pLast = m_last.find(names[i]);
+        const char* pPrevious = nullptr;
+        if ((pLast != m_last.end()) && (pLast->second.size() == counts.size())) {
+            pPrevious = pLast->second.data();
+        }
+        gaps.clear();
+        deltas.clear();
+        spectrum.s_changes = changes(
+            counts.data(), pPrevious, spectrum.s_bytes,
+            static_cast<DataType_t>(spectrum.s_type), gaps, deltas
+        );
+        append(m_payload, &spectrum, sizeof(spectrum));
+        append(m_payload, names[i].data(), names[i].size());
+        append(m_payload, gaps.data(), gaps.size());
+        append(m_payload, deltas.data(), deltas.size());
+    }
+    m_last.swap(now);
+
+    MPIHistorySlice header;
+    header.s_magic       = MPIHISTORY_MAGIC;
+    header.s_flags       = 0;
+    header.s_slice       = m_slices;
+    header.s_bytes       = m_payload.size();
+    header.s_storedBytes = m_payload.size();
+    const char* pStored  = m_payload.data();
+    struct timeval now_tv;
+    gettimeofday(&now_tv, nullptr);
+    header.s_time        = now_tv.tv_sec + now_tv.tv_usec*1.0e-6;
+    if (m_payload.size() >= COMPRESS_THRESHOLD) {
+        m_compressed.resize(CMPICompressor::bound(m_payload.size()));
+        size_t zBytes = m_compressor.compress(
+            m_payload.data(), m_payload.size(), m_compressed.data(),
+            m_compressed.size()
+        );
+        if (zBytes < m_payload.size()) {
+            header.s_flags      |= MPIHISTORY_COMPRESSED;
+            header.s_storedBytes = zBytes;
+            pStored              = m_compressed.data();
+        }
+    }
+
+    MPIHistoryIndex entry;
+    fseeko(m_pFile, 0, SEEK_END);
+    entry.s_slice  = m_slices;
+    entry.s_time   = header.s_time;
+    entry.s_offset = ftello(m_pFile);
+    writeExactly(m_pFile, &header, sizeof(header));
+    writeExactly(m_pFile, pStored, header.s_storedBytes);
+    fflush(m_pFile);
+    writeExactly(m_pIndexFile, &entry, sizeof(entry));    // After its slice.
+    fflush(m_pIndexFile);
+    m_slices++;
+}
+/**
+ * schedule
+ *    Set the timer for the next snapshot.
+ */
+void
+CMPISpectrumHistory::schedule()
+{
+    m_timer = Tcl_CreateTimerHandler(
+        static_cast<int>(m_period*1000.0), timer, this
+    );
+}
+/**
+ * timer
+ *    Time for a snapshot.  If the last one is still being reduced this
+ *    slice is skipped; the next will have its changes.
+ * @param pData - the history.
+ */
+void
+CMPISpectrumHistory::timer(ClientData pData)
+{
+    CMPISpectrumHistory* pThis = static_cast<CMPISpectrumHistory*>(pData);
+    pThis->m_timer = nullptr;
+    if (!pThis->m_pFile) return;
+    CMPISnapshots* pSnapshots = CMPISnapshots::getInstance();
+    if (pSnapshots->progress()) {
+        try {
+            pSnapshots->request(*pThis->m_pInterp);
+        }
+        catch (std::string msg) {
+            std::cerr << "Spectrum history snapshot failed: " << msg << std::endl;
+        }
+    }
+    pThis->schedule();
+}
+/**
+ * append
+ *    Append bytes to a buffer.
+ */
+void
+CMPISpectrumHistory::append(std::vector<char>& data, const void* pData, size_t nBytes)
+{
+    const char* p = static_cast<const char*>(pData);
+    data.insert(data.end(), p, p + nBytes);
+}
+/**
+ * changes
+ *    Find the channels that changed.
+ *
+ * @param pNow   - current counts.
+ * @param pLast  - counts at the last slice, nullptr for none.
+ * @param bytes  - storage size.
+ * @param type   - channel type.
+ * @param[out] gaps   - appended index gaps.
+ * @param[out] deltas - appended deltas.
+ * @return uint64_t - number of changed channels.
+ */
+uint64_t
+CMPISpectrumHistory::changes(
+    const void* pNow, const void* pLast, size_t bytes, DataType_t type,
+    std::vector<char>& gaps, std::vector<char>& deltas
+)
+{
+    switch (type) {
+    case keByte:
+        return changedChannels(
+            static_cast<const uint8_t*>(pNow), static_cast<const uint8_t*>(pLast),
+            bytes/sizeof(uint8_t), gaps, deltas
+        );
+    case keWord:
+        return changedChannels(
+            static_cast<const uint16_t*>(pNow), static_cast<const uint16_t*>(pLast),
+            bytes/sizeof(uint16_t), gaps, deltas
+        );
+    case keLong:
+        return changedChannels(
+            static_cast<const uint32_t*>(pNow), static_cast<const uint32_t*>(pLast),
+            bytes/sizeof(uint32_t), gaps, deltas
+        );
+    case keFloat:
+        return changedChannels(
+            static_cast<const float*>(pNow), static_cast<const float*>(pLast),
+            bytes/sizeof(float), gaps, deltas
+        );
+    case keDouble:
+        return changedChannels(
+            static_cast<const double*>(pNow), static_cast<const double*>(pLast),
+            bytes/sizeof(double), gaps, deltas
+        );
+    default:
+        return 0;                            // Not something we can sum.
+    }
+}
+/**
+ * apply
+ *    Add a spectrum's deltas from a slice to its storage.
+ *
+ * @param pStorage - the target's storage.
+ * @param bytes    - its size.
+ * @param pGaps    - index gaps.
+ * @param pDeltas  - deltas.
+ * @param nChanges - number of each.
+ * @param type     - channel type.
+ * @throw std::string - a change is outside the storage.
+ */
+void
+CMPISpectrumHistory::apply(
+    void* pStorage, size_t bytes, const char* pGaps, const char* pDeltas,
+    uint64_t nChanges, DataType_t type
+)
+{
+    switch (type) {
+    case keByte:
+        applyDeltas(static_cast<uint8_t*>(pStorage), bytes, pGaps, pDeltas, nChanges);
+        break;
+    case keWord:
+        applyDeltas(
+            static_cast<uint16_t*>(pStorage), bytes/sizeof(uint16_t), pGaps, pDeltas,
+            nChanges
+        );
+        break;
+    case keLong:
+        applyDeltas(
+            static_cast<uint32_t*>(pStorage), bytes/sizeof(uint32_t), pGaps, pDeltas,
+            nChanges
+        );
+        break;
+    case keFloat:
+        applyDeltas(
+            static_cast<float*>(pStorage), bytes/sizeof(float), pGaps, pDeltas,
+            nChanges
+        );
+        break;
+    case keDouble:
+        applyDeltas(
+            static_cast<double*>(pStorage), bytes/sizeof(double), pGaps, pDeltas,
+            nChanges
+        );
+        break;
+    default:
+        break;
+    }
+}
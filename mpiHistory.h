@@ -0,0 +1,126 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Giordano Cerriza
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  mpiHistory.h
+ *  @brief: Time sliced history of the summed spectra.
+ *
+ *  While recording, rank 0 takes a snapshot (see CMPISnapshots) every
+ *  period.  When each lands, the channels that changed since the last
+ *  slice are appended to a history file as a slice:
+ *
+ *  -  An MPIHistorySlice header.
+ *  -  s_storedBytes of payload, LZ4 compressed if s_flags says so.
+ *     Uncompressed, the payload is, for each spectrum: an
+ *     MPIHistorySpectrum, s_changes uint64_t gaps between the indices
+ *     of changed channels (the first from -1) and then s_changes deltas
+ *     of the spectrum's channel type.
+ *
+ *  Integer deltas are modulo the channel width so cleared or wrapped
+ *  spectra still rebuild exactly.  An index file (the history file name
+ *  with .idx appended) has an MPIHistoryIndex per slice so a time window
+ *  can be rebuilt by reading only its slices.
+ */
+#ifndef MPIHISTORY_H
+#define MPIHISTORY_H
+
+#include "mpiSpectra.h"
+#include "mpiCompress.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+
+struct MPIHistorySlice {
+    uint32_t s_magic;                  // MPIHISTORY_MAGIC.
+    uint32_t s_flags;                  // MPIHISTORY_* bits.
+    uint64_t s_slice;                  // Slice number from 0.
+    double   s_time;                   // When it landed (seconds since 1970).
+    uint64_t s_bytes;                  // Uncompressed payload size.
+    uint64_t s_storedBytes;            // Payload bytes in the file.
+};
+static const uint32_t MPIHISTORY_MAGIC(0x4849504d);   // "MPIH"
+static const uint32_t MPIHISTORY_COMPRESSED(1);
+
+struct MPIHistorySpectrum {
+    uint32_t s_nameLength;             // Name follows.
+    uint32_t s_type;                   // DataType_t of the channels.
+    uint64_t s_bytes;                  // Storage size.
+    uint64_t s_changes;                // Changed channels.
+};
+
+struct MPIHistoryIndex {
+    uint64_t s_slice;
+    double   s_time;
+    uint64_t s_offset;                 // Of the slice in the history file.
+};
+
+/**
+ * @class CMPISpectrumHistory
+ *    Records (rank 0) and rebuilds time windows of spectrum history.
+ *    A window (from, to] is rebuilt by summing the deltas of the slices
+ *    that landed in it, so a window starting before the first slice
+ *    gives the spectra as they were at its end.
+ */
+class CMPISpectrumHistory : public CMPIBackgroundReduction::Observer
+{
+private:
+    std::string                              m_filename;
+    FILE*                                    m_pFile;
+    FILE*                                    m_pIndexFile;
+    CTCLInterpreter*                         m_pInterp;
+    double                                   m_period;      // Seconds.
+    Tcl_TimerToken                           m_timer;
+    uint64_t                                 m_slices;
+    std::map<std::string, std::vector<char> > m_last;       // Last slice's counts.
+    CMPICompressor                           m_compressor;
+    std::vector<char>                        m_payload;
+    std::vector<char>                        m_compressed;
+
+    static CMPISpectrumHistory* m_pInstance;
+public:
+    static CMPISpectrumHistory* getInstance();
+
+    void start(CTCLInterpreter& interp, const std::string& filename, double period);
+    void stop();
+    bool recording() const { return m_pFile != nullptr; }
+    void setFilename(const std::string& filename);
+    std::string filename() const { return m_filename; }
+
+    void slices(std::vector<MPIHistoryIndex>& result) const;
+    unsigned rebuild(
+        double from, double to, const std::string& suffix = ""
+    ) const;
+
+    virtual void reduced(CTCLInterpreter& interp);
+private:
+    CMPISpectrumHistory();
+    void record();
+    void schedule();
+    static void timer(ClientData pData);
+    static void append(std::vector<char>& data, const void* pData, size_t nBytes);
+    static uint64_t changes(
+        const void* pNow, const void* pLast, size_t bytes, DataType_t type,
+        std::vector<char>& gaps, std::vector<char>& deltas
+    );
+    static void apply(
+        void* pStorage, size_t bytes, const char* pGaps, const char* pDeltas,
+        uint64_t nChanges, DataType_t type
+    );
+};
+
+#endif
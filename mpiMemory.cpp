@@ -0,0 +1,238 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Giordano Cerriza
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  mpiMemory.cpp
+ *  @brief: Implement the memory budget.
+ */
+#include "mpiMemory.h"
+#include <string.h>
+
+CMPIMemoryBudget* CMPIMemoryBudget::m_pInstance(nullptr);
+
+/**
+ * getInstance
+ *    @return CMPIMemoryBudget* - the one budget, made on first use.
+ *    @note The first use is from the main thread (loading the mpi
+ *          command) before any others could race to make it.
+ */
+CMPIMemoryBudget*
+CMPIMemoryBudget::getInstance()
+{
+    if (!m_pInstance) {
+        m_pInstance = new CMPIMemoryBudget;
+    }
+    return m_pInstance;
+}
+/**
+ * name
+ *    @param subsystem - a subsystem.
+ *    @return const char* - its name as reported by mpi memory.
+ */
+const char*
+CMPIMemoryBudget::name(Subsystem subsystem)
+{
+    static const char* names[subsystems] = {"receive", "distributor", "prefetch"};
+    return names[subsystem];
+}
+
+/**
+ * constructor
+ *    No budget, nothing used.
+ */
+CMPIMemoryBudget::CMPIMemoryBudget() :
+    m_budget(0), m_used(0), m_peak(0)
+{
+    memset(m_usage, 0, sizeof(m_usage));
+}
+
+/**
+ * setBudget
+ *    A bigger budget may let waiters go.
+ * @param bytes - the budget; 0 for none.
+ */
+void
+CMPIMemoryBudget::setBudget(uint64_t bytes)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_budget = bytes;
+    }
+    m_released.notify_all();
+}
+/**
+ * budget
+ *    @return uint64_t - the budget, 0 if none.
+ */
+uint64_t
+CMPIMemoryBudget::budget()
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    return m_budget;
+}
+/**
+ * reserve
+ *    Reserve memory, waiting until there's room for it.
+ * @param subsystem - whose it is.
+ * @param bytes     - how much.
+ */
+void
+CMPIMemoryBudget::reserve(Subsystem subsystem, uint64_t bytes)
+{
+    std::unique_lock<std::mutex> lock(m_lock);
+    if (!fits(subsystem, bytes)) {
+        m_usage[subsystem].s_waits++;
+        do {
+            m_released.wait(lock);
+        } while (!fits(subsystem, bytes));
+    }
+    take(subsystem, bytes);
+}
+/**
+ * reserve
+ *    Reserve memory, waiting until there's room for it unless a stop
+ *    test comes true first.  The test is made with the budget's lock
+ *    held each time we're woken (see wake).
+ * @param subsystem - whose it is.
+ * @param bytes     - how much.
+ * @param stop      - true to give up.
+ * @return bool     - true if it was reserved, false if we gave up.
+ */
+bool
+CMPIMemoryBudget::reserve(
+    Subsystem subsystem, uint64_t bytes, const std::function<bool()>& stop
+)
+{
+    std::unique_lock<std::mutex> lock(m_lock);
+    if (!fits(subsystem, bytes)) {
+        m_usage[subsystem].s_waits++;
+        do {
+            if (stop()) return false;
+            m_released.wait(lock);
+        } while (!fits(subsystem, bytes));
+    }
+    take(subsystem, bytes);
+    return true;
+}
+/**
+ * wake
+ *    Have waiting reservations look at their stop tests again.
+ */
+void
+CMPIMemoryBudget::wake()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+    }
+    m_released.notify_all();
+}
+/**
+ * tryReserve
+ *    Reserve memory if there's room for it now.
+ * @param subsystem - whose it is.
+ * @param bytes     - how much.
+ * @return bool     - true if it was reserved.
+ */
+bool
+CMPIMemoryBudget::tryReserve(Subsystem subsystem, uint64_t bytes)
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    if (!fits(subsystem, bytes)) {
+        m_usage[subsystem].s_refusals++;
+        return false;
+    }
+    take(subsystem, bytes);
+    return true;
+}
+/**
+ * charge
+ *    Account for memory that's needed whatever the budget says.
+ * @param subsystem - whose it is.
+ * @param bytes     - how much.
+ */
+void
+CMPIMemoryBudget::charge(Subsystem subsystem, uint64_t bytes)
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    take(subsystem, bytes);
+}
+/**
+ * release
+ *    Give back memory that was reserved or charged.
+ * @param subsystem - whose it was.
+ * @param bytes     - how much.
+ */
+void
+CMPIMemoryBudget::release(Subsystem subsystem, uint64_t bytes)
+{
+    if (!bytes) return;
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_usage[subsystem].s_current -= bytes;
+        m_used                       -= bytes;
+    }
+    m_released.notify_all();
+}
+
+/**
+ * usage
+ *    @param subsystem - a subsystem.
+ *    @return Usage    - what it's using, has used at most and how often
+ *                       it's been held back.
+ */
+CMPIMemoryBudget::Usage
+CMPIMemoryBudget::usage(Subsystem subsystem)
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    return m_usage[subsystem];
+}
+/**
+ * total
+ *    @param[out] used - what all subsystems are using.
+ *    @param[out] peak - the most they've used at once.
+ */
+void
+CMPIMemoryBudget::total(uint64_t& used, uint64_t& peak)
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    used = m_used;
+    peak = m_peak;
+}
+
+/**
+ * fits
+ *    Call with m_lock held.
+ * @return bool - true if a reservation can be had now.
+ */
+bool
+CMPIMemoryBudget::fits(Subsystem subsystem, uint64_t bytes) const
+{
+    return (m_budget == 0) || (m_usage[subsystem].s_current == 0)
+        || (m_used + bytes <= m_budget);
+}
+/**
+ * take
+ *    Add to a subsystem's use.  Call with m_lock held.
+ */
+void
+CMPIMemoryBudget::take(Subsystem subsystem, uint64_t bytes)
+{
+    Usage& usage(m_usage[subsystem]);
+    usage.s_current += bytes;
+    if (usage.s_current > usage.s_peak) usage.s_peak = usage.s_current;
+    m_used += bytes;
+    if (m_used > m_peak) m_peak = m_used;
+}
@@ -0,0 +1,90 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Giordano Cerriza
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  mpiMemory.h
+ *  @brief: Per rank memory budget that buffer owners reserve against.
+ *
+ *  The receive lanes, the push distributor's send slots and the data
+ *  getter's buffers each reserve what they hold in their subsystem's
+ *  account and release it when they let go.  With a budget set (mpi
+ *  configure -membudget) an owner that can wait for its own buffers to
+ *  drain waits for room (reserve) and one that can't either goes
+ *  without (tryReserve) or, if it must have the memory to make progress,
+ *  takes it anyway (charge) and the overrun shows in the usage.
+ *
+ *  So that nothing waits forever, a subsystem that holds nothing is
+ *  always given what it asks for: whatever it's waiting for is held by
+ *  itself and will be released by its own consumer.  A waiter that may
+ *  have to give up passes a stop test; whoever makes it true calls wake.
+ */
+#ifndef MPIMEMORY_H
+#define MPIMEMORY_H
+
+#include <stdint.h>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+/**
+ * @class CMPIMemoryBudget
+ *     The budget and each subsystem's current and peak use.  Thread safe.
+ */
+class CMPIMemoryBudget
+{
+public:
+    typedef enum _Subsystem {
+        receive, distributor, prefetch, subsystems
+    } Subsystem;
+    struct Usage {
+        uint64_t s_current;
+        uint64_t s_peak;
+        uint64_t s_waits;              // Reservations that had to wait.
+        uint64_t s_refusals;           // tryReserve said no.
+    };
+private:
+    std::mutex              m_lock;
+    std::condition_variable m_released;
+    uint64_t                m_budget;          // 0 - unlimited.
+    uint64_t                m_used;
+    uint64_t                m_peak;
+    Usage                   m_usage[subsystems];
+
+    static CMPIMemoryBudget* m_pInstance;
+public:
+    static CMPIMemoryBudget* getInstance();
+    static const char* name(Subsystem subsystem);
+
+    void     setBudget(uint64_t bytes);
+    uint64_t budget();
+    void     reserve(Subsystem subsystem, uint64_t bytes);
+    bool     reserve(
+        Subsystem subsystem, uint64_t bytes, const std::function<bool()>& stop
+    );
+    void     wake();
+    bool     tryReserve(Subsystem subsystem, uint64_t bytes);
+    void     charge(Subsystem subsystem, uint64_t bytes);
+    void     release(Subsystem subsystem, uint64_t bytes);
+
+    Usage    usage(Subsystem subsystem);
+    void     total(uint64_t& used, uint64_t& peak);
+private:
+    CMPIMemoryBudget();
+    bool fits(Subsystem subsystem, uint64_t bytes) const;
+    void take(Subsystem subsystem, uint64_t bytes);
+};
+
+#endif
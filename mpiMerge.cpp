@@ -0,0 +1,272 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Giordano Cerriza
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  mpiMerge.cpp
+ *  @brief: Implement the timestamp ordered merging data getter.
+ */
+#include "mpiMerge.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+
+/**
+ * constructor
+ *    Open the sources, read their first items and play the tournament.
+ * @param files     - the files to merge.
+ * @param blockSize - target size of the blocks given to SpecTcl.
+ */
+CMPIMergingDataGetter::CMPIMergingDataGetter(
+    const std::vector<std::string>& files, size_t blockSize
+) :
+    m_sources(files.size()), m_tree(files.size()), m_blockSize(blockSize)
+{
+    if (files.empty()) {
+        throw std::string("There must be at least one source to merge");
+    }
+    for (size_t i = 0; i < files.size(); i++) {
+        Source& source(m_sources[i]);
+        source.s_name      = files[i];
+        source.s_offset    = 0;
+        source.s_bytes     = 0;
+        source.s_timestamp = 0;
+        source.s_done      = false;
+        source.s_data.resize(m_blockSize);
+        source.s_fd        = open(files[i].c_str(), O_RDONLY);
+        if (source.s_fd < 0) {
+            std::string msg = "Unable to open " + files[i] + ": " + strerror(errno);
+            for (size_t j = 0; j < i; j++) close(m_sources[j].s_fd);
+            throw msg;
+        }
+    }
+
+    // Knuth's initialization: every node starts out holding a sentinel
+    // (index k) that beats everything.  Replaying each leaf pushes the
+    // sentinels up and out, leaving the real losers behind.  The
+    // destructor won't run if a source can't be read, so close them here.
+
+    for (size_t i = 0; i < m_tree.size(); i++) {
+        m_tree[i] = m_sources.size();
+    }
+    try {
+        for (size_t i = m_sources.size(); i > 0; i--) {
+            advance(m_sources[i-1]);
+            replay(i-1);
+        }
+    }
+    catch (...) {
+        for (size_t i = 0; i < m_sources.size(); i++) close(m_sources[i].s_fd);
+        throw;
+    }
+}
+/**
+ * destructor
+ *    Close the sources and release the blocks.  Blocks SpecTcl still
+ *    holds go too; it's done with us.
+ */
+CMPIMergingDataGetter::~CMPIMergingDataGetter()
+{
+    for (size_t i = 0; i < m_sources.size(); i++) {
+        close(m_sources[i].s_fd);
+    }
+    for (size_t i = 0; i < m_pool.size(); i++) {
+        delete m_pool[i];
+    }
+    for (auto p = m_held.begin(); p != m_held.end(); p++) {
+        delete p->second;
+    }
+}
+
+/**
+ * read
+ *    Pack the winners into a block until the next won't fit or all
+ *    sources are done.
+ * @return std::pair<size_t, void*> - size and pointer to the block.
+ *                 A zero size means all sources are done.
+ */
+std::pair<size_t, void*>
+CMPIMergingDataGetter::read()
+{
+    std::pair<size_t, void*> result(0, nullptr);
+    std::vector<char>* pBlock;
+    if (m_pool.empty()) {
+        pBlock = new std::vector<char>;
+    } else {
+        pBlock = m_pool.back();
+        m_pool.pop_back();
+    }
+    pBlock->clear();
+
+    while (!m_sources[m_tree[0]].s_done) {
+        size_t  winner = m_tree[0];
+        Source& source(m_sources[winner]);
+        MPIRingItemHeader header = item(source);
+        if (!pBlock->empty() && (pBlock->size() + header.s_size > m_blockSize)) {
+            break;
+        }
+        const char* p = source.s_data.data() + source.s_offset;
+        pBlock->insert(pBlock->end(), p, p + header.s_size);
+        source.s_offset += header.s_size;
+
+        advance(source);
+        replay(winner);
+    }
+    if (pBlock->empty()) {
+        m_pool.push_back(pBlock);
+        return result;
+    }
+    result.first  = pBlock->size();
+    result.second = pBlock->data();
+    m_held[result.second] = pBlock;
+    return result;
+}
+/**
+ * free
+ *    SpecTcl is done with a block; back to the pool.
+ * @param buffer - what read returned.
+ */
+void
+CMPIMergingDataGetter::free(std::pair<size_t, void*>& buffer)
+{
+    auto p = m_held.find(buffer.second);
+    if (p != m_held.end()) {
+        m_pool.push_back(p->second);
+        m_held.erase(p);
+    }
+}
+
+/**
+ * advance
+ *    Make sure a source's next item is whole in its buffer and get its
+ *    timestamp, or mark the source done.
+ * @param source - the source.
+ */
+void
+CMPIMergingDataGetter::advance(Source& source)
+{
+    if (!fill(source, sizeof(uint32_t))) {
+        source.s_done = true;
+        return;
+    }
+    uint32_t size;
+    memcpy(&size, source.s_data.data() + source.s_offset, sizeof(size));
+    if (size < sizeof(MPIRingItemHeader)) {
+        throw std::string("Invalid ring item size in ") + source.s_name;
+    }
+    if (!fill(source, size)) {
+        throw std::string("Truncated ring item at the end of ") + source.s_name;
+    }
+    MPIRingItemHeader header = item(source);
+    if ((size >= sizeof(MPIRingItemHeader) + sizeof(MPIBodyHeader) - sizeof(uint32_t))
+        && (header.s_bodyHeaderSize > sizeof(uint32_t))) {
+        MPIBodyHeader body;
+        memcpy(
+            &body, source.s_data.data() + source.s_offset + 2*sizeof(uint32_t),
+            sizeof(body)
+        );
+        source.s_timestamp = body.s_timestamp;
+    }
+}
+/**
+ * fill
+ *    Make sure a source has at least nBytes from its next item buffered,
+ *    moving what's left to the front and growing the buffer as needed.
+ * @param source - the source.
+ * @param nBytes - bytes wanted.
+ * @return bool  - false if the source ended first.  Ending with none
+ *                 left is the normal end of the source.
+ */
+bool
+CMPIMergingDataGetter::fill(Source& source, size_t nBytes)
+{
+    if (source.s_bytes - source.s_offset >= nBytes) return true;
+
+    size_t left = source.s_bytes - source.s_offset;
+    memmove(source.s_data.data(), source.s_data.data() + source.s_offset, left);
+    source.s_offset = 0;
+    source.s_bytes  = left;
+    if (source.s_data.size() < nBytes) {
+        source.s_data.resize(nBytes);
+    }
+    while (source.s_bytes < nBytes) {
+        ssize_t n = ::read(
+            source.s_fd, source.s_data.data() + source.s_bytes,
+            source.s_data.size() - source.s_bytes
+        );
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            throw std::string("Read failed on ") + source.s_name + ": " + strerror(errno);
+        }
+        if (n == 0) {
+            if (source.s_bytes) {
+                throw std::string("Truncated ring item at the end of ") + source.s_name;
+            }
+            return false;
+        }
+        source.s_bytes += n;
+    }
+    return true;
+}
+/**
+ * before
+ *    Does source a's next item go before source b's?  The sentinel
+ *    (index k) goes before everything, done sources after everything.
+ * @param a, b - source indices.
+ * @return bool
+ */
+bool
+CMPIMergingDataGetter::before(size_t a, size_t b) const
+{
+    if (a == m_sources.size()) return b != a;
+    if (b == m_sources.size()) return false;
+    const Source& sa(m_sources[a]);
+    const Source& sb(m_sources[b]);
+    if (sa.s_done != sb.s_done) return sb.s_done;
+    if (sa.s_done)              return a < b;
+    if (sa.s_timestamp != sb.s_timestamp) return sa.s_timestamp < sb.s_timestamp;
+    return a < b;
+}
+/**
+ * replay
+ *    A leaf's next item changed; replay the matches up its path.  Leaf
+ *    i is node k + i of the implicit tree so its parent is (k + i)/2.
+ * @param leaf - the source index.
+ */
+void
+CMPIMergingDataGetter::replay(size_t leaf)
+{
+    size_t winner = leaf;
+    for (size_t node = (leaf + m_sources.size())/2; node > 0; node /= 2) {
+        if (before(m_tree[node], winner)) {
+            std::swap(m_tree[node], winner);
+        }
+    }
+    m_tree[0] = winner;
+}
+/**
+ * item
+ *    Items needn't be aligned in the buffer so their headers are copied.
+ * @param source - a source that isn't done.
+ * @return MPIRingItemHeader - header of its next item.
+ */
+MPIRingItemHeader
+CMPIMergingDataGetter::item(const Source& source) const
+{
+    MPIRingItemHeader header;
+    memcpy(&header, source.s_data.data() + source.s_offset, sizeof(header));
+    return header;
+}
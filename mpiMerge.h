@@ -0,0 +1,101 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Giordano Cerriza
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  mpiMerge.h
+ *  @brief: Timestamp ordered merge of several ring item sources.
+ *
+ *  Per detector streams are merged by timestamp as they're read on the
+ *  distributing rank so the merged blocks go straight to mpisink's
+ *  distributor.  Ring items are in the NSCLDAQ 11 layout: a size
+ *  (inclusive) and type, then a body header size which, if more than
+ *  a uint32_t, is followed by the rest of a body header that has the
+ *  timestamp.
+ */
+#ifndef MPIMERGE_H
+#define MPIMERGE_H
+
+#include <CDataGetter.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <map>
+
+struct MPIRingItemHeader {
+    uint32_t s_size;                   // Includes this header.
+    uint32_t s_type;
+    uint32_t s_bodyHeaderSize;         // <= sizeof(uint32_t) if none.
+};
+struct MPIBodyHeader {
+    uint32_t s_size;
+    uint64_t s_timestamp;
+    uint32_t s_sourceId;
+    uint32_t s_barrier;
+} __attribute__((packed));
+
+/**
+ * @class CMPIMergingDataGetter
+ *    A data getter that reads ring items from several files and gives
+ *    them to SpecTcl in timestamp order, packed whole into blocks.
+ *
+ *    The next item of each source is a leaf of a loser (tournament)
+ *    tree; each internal node holds the source that lost the match
+ *    there, node 0 the overall winner.  Taking an item replays only the
+ *    matches on its leaf's path, log2(k) comparisons, and sources that
+ *    haven't run out can't lose to ones that have.  Items without a
+ *    body header take the timestamp of the previous item from their
+ *    source, so they stay where they were in their stream.  Equal
+ *    timestamps are taken in source order.
+ *
+ *    Blocks are handed out from a pool since SpecTcl may hold more than
+ *    one.  A block holds at least one item so an item bigger than the
+ *    block size gets a block of its own.
+ */
+class CMPIMergingDataGetter : public CDataGetter
+{
+private:
+    struct Source {
+        std::string       s_name;
+        int               s_fd;
+        std::vector<char> s_data;
+        size_t            s_offset;      // Next item.
+        size_t            s_bytes;       // Valid bytes in s_data.
+        uint64_t          s_timestamp;   // Of the next item.
+        bool              s_done;        // Has no next item.
+    };
+    std::vector<Source>           m_sources;
+    std::vector<size_t>           m_tree;         // Losers, winner at 0.
+    size_t                        m_blockSize;
+    std::vector<std::vector<char>*> m_pool;       // Free blocks.
+    std::map<void*, std::vector<char>*> m_held;   // Blocks SpecTcl has.
+public:
+    CMPIMergingDataGetter(
+        const std::vector<std::string>& files, size_t blockSize = 1024*1024
+    );
+    virtual ~CMPIMergingDataGetter();
+
+    virtual std::pair<size_t, void*> read();
+    virtual void free(std::pair<size_t, void*>& buffer);
+private:
+    void advance(Source& source);
+    bool fill(Source& source, size_t nBytes);
+    bool before(size_t a, size_t b) const;
+    void replay(size_t leaf);
+    MPIRingItemHeader item(const Source& source) const;
+};
+
+#endif
@@ -19,6 +19,13 @@
  *  @brief: provide mpispectcl loadable package. Requires mpitcl.
  */
 #include "mpitcl.h"
+#include "mpiCompress.h"
+#include "mpiChunked.h"
+#include "mpiMemory.h"
+#include "mpiSpectra.h"
+#include "mpiHistory.h"
+#include "mpiCheckpoint.h"
+#include "mpiMerge.h"
 #include <mpi.h>
 #include <TCLInterpreter.h>
 #include <TCLObjectProcessor.h>
@@ -27,11 +34,23 @@
 #include <CDataGetter.h>
 #include <CDataDistributor.h>
 #include <CAnalyzeCommand.h>
+#include <SpecTcl.h>
+#include <Histogrammer.h>
 
 #include <tcl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sched.h>
+#include <stdint.h>
+#include <string.h>
 #include <stdexcept>
 #include <string>
 #include <set>
+#include <map>
+#include <deque>
+#include <list>
+#include <algorithm>
+#include <vector>
 #include <iostream>
 
 //////////////////////////////////////////////////////////////////////////////
@@ -39,171 +58,2923 @@
 //
 //   The distributor is rank 0 and getter all other ranks.
 //
+//   All of their traffic is on a private duplicate of MPI_COMM_WORLD.
+//   That keeps the notifier thread's MPI_ANY_TAG probes (and any binary
+//   data traffic) from ever matching block requests and replies.  The
+//   duplication is collective, as is making the shards, reducers and
+//   snapshots that have communicators of their own, so it's done at one
+//   explicit point: mpispectcl setup or the first mpisink or mpisource,
+//   whichever comes first.  Every rank must get there; loading the
+//   package isn't collective.
+//
+
+static MPI_Comm blockComm(MPI_COMM_NULL);
+static CTCLInterpreter* pPackageInterp(nullptr);   // SpecTcl's, for idle cuts.
+
+/**
+ * setupRanks
+ *    (collective) Make the block communicator and the singletons with
+ *    communicators of their own.  Does nothing after the first time.
+ */
+static void
+setupRanks()
+{
+    if (blockComm == MPI_COMM_NULL) {
+        MPI_Comm_dup(MPI_COMM_WORLD, &blockComm);
+        CMPISpectrumShards::getInstance();
+        CMPISpectrumReducer::getInstance();
+        CMPINodeSpectra::getInstance();
+        CMPIRunReducer::getInstance();
+        CMPISnapshots::getInstance();
+    }
+}
+/**
+ * MPISpecTcl_comm
+ *    @return MPI_Comm - the package's duplicate of MPI_COMM_WORLD,
+ *                       MPI_COMM_NULL until setupRanks.
+ */
+MPI_Comm
+MPISpecTcl_comm()
+{
+    return blockComm;
+}
+/**
+ * requireSetup
+ *    Commands that use the communicators can't make them on their own
+ *    since they may not be run by every rank.
+ * @param what - the command, for the message.
+ * @throw std::string - setupRanks hasn't been done yet.
+ */
+static void
+requireSetup(const std::string& what)
+{
+    if (blockComm == MPI_COMM_NULL) {
+        throw what + " needs mpispectcl setup (or mpisink/mpisource) first";
+    }
+}
+
+/**
+ * Each non-empty block sent by the distributor is preceded by this header.
+ * A zero length message or a header with MPIBLOCK_END set is the end of
+ * data indicator.
+ * The header is followed by s_journalBytes of configuration journal
+ * entries the receiver must apply before analyzing the block and then
+ * the payload (or an MPIChunkHeader if the payload is chunked).
+ * An end's payload is s_size bytes of bitmap of the workers that took
+ * part in the run (bit r%8 of byte r/8 for rank r).  A worker that
+ * isn't in it was dropped; a zero length end means all ranks took part.
+ * A header with MPIBLOCK_CUT set is all there is of its message: rank 0
+ * sends one to every rank when it defines a snapshot cut so that ranks
+ * that aren't getting blocks take it too.
+ */
+struct MPIBlockHeader {
+    uint32_t s_flags;                // MPIBLOCK_* bits.
+    uint32_t s_epoch;                // Configuration epoch of the block.
+    uint64_t s_size;                 // Uncompressed size of the block.
+    uint64_t s_sequence;             // Block number within the run.
+    uint32_t s_journalBytes;         // Journal entries ahead of the payload.
+    uint32_t s_snapshot;             // Snapshot cuts defined when sent.
+    uint32_t s_queueDepth;           // Requests the sender has waiting.
+    uint32_t s_unused;
+};
+static const uint32_t MPIBLOCK_COMPRESSED(1);    // Payload is LZ4 compressed.
+static const uint32_t MPIBLOCK_CHUNKED(2);       // MPIChunkHeader follows; the
+                                                 // block comes as chunks.
+static const uint32_t MPIBLOCK_JOURNALINCHUNKS(4); // Journal entries are too big
+                                                 // for the request buffer and
+                                                 // head the chunked payload.
+static const uint32_t MPIBLOCK_END(8);           // End of data, the payload
+                                                 // is the participants.
+static const uint32_t MPIBLOCK_CUT(16);          // Snapshot cut, no payload.
+
+/**
+ * A data request.  Carries the size of the buffer the reply will be
+ * received into and the last configuration epoch the requestor applied.
+ */
+struct MPIBlockRequest {
+    uint64_t s_capacity;
+    uint32_t s_epoch;
+    uint32_t s_flags;                // MPIREQUEST_* bits.
+};
+static const uint32_t MPIREQUEST_READERS(1);     // Requestor pulls from
+                                                 // several readers.
+
+/**
+ * In push mode, workers send this once, when their getter is made,
+ * instead of a request per block.  It says how much the distributor can
+ * send before the worker has to analyze something and what share of
+ * the blocks the worker wants.
+ */
+struct MPIPushHello {
+    uint64_t s_capacity;             // Size of each receive buffer.
+    uint32_t s_epoch;                // Configuration epoch we're at.
+    uint32_t s_buffers;              // Receive buffers kept posted.
+    uint32_t s_weight;               // Relative share of the blocks.
+    uint32_t s_unused;
+};
+
+/**
+ * Each entry in the configuration journal has this header followed by
+ * s_length bytes of data whose interpretation depends on s_type.
+ */
+struct MPIJournalEntry {
+    uint32_t s_epoch;                // Epoch this entry brings us to.
+    uint32_t s_type;                 // MPIJOURNAL_* entry type.
+    uint32_t s_length;               // Bytes of data that follow.
+};
+static const uint32_t MPIJOURNAL_SCRIPT(1);      // Tcl script to evaluate.
+static const uint32_t MPIJOURNAL_DEFINITIONS(2); // Definition deltas.
+
+/**
+ * @class CMPIConfigJournal
+ *    Keeps analysis configuration (gates, spectra...) of the workers in
+ *    step with the data.  In the distributing rank, configuration changes
+ *    are appended to the journal, each advancing the configuration
+ *    epoch.  Blocks are tagged with the epoch current when they're sent
+ *    and carry any entries the requesting worker has not yet applied.  The
+ *    worker applies those entries just before it analyzes the block.
+ *    Every block is therefore analyzed with exactly the configuration
+ *    rank 0 had when it was distributed, without pausing the data.
+ *
+ *    In a worker epoch() is the last epoch applied, in the distributor
+ *    the last epoch appended.
+ *
+ *    The distributor tells the journal the epoch each worker is known to
+ *    have (acknowledge) and entries every worker has are dropped (trim).
+ *    Ranks that were ever workers count as well as the current ones
+ *    since a later distributor may send them blocks again.
+ */
+class CMPIConfigJournal
+{
+public:
+    typedef void (*Applier)(CTCLInterpreter& interp, const char* pData, size_t nBytes);
+    
+    /**
+     * Sources batch up changes and append them to the journal when
+     * asked to flush.
+     */
+    class Source {
+    public:
+        virtual ~Source() {}
+        virtual void flush(CMPIConfigJournal& journal) = 0;
+    };
+private:
+    struct Entry {
+        uint32_t    s_epoch;
+        uint32_t    s_type;
+        std::string s_data;
+    };
+    std::deque<Entry>           m_entries;
+    uint32_t                    m_epoch;
+    uint32_t                    m_trimmed;   // Entries to here are dropped.
+    std::map<int, uint32_t>     m_acknowledged; // Rank -> epoch it has.
+    std::map<uint32_t, Applier> m_appliers;
+    std::vector<Source*>        m_sources;
+    static CMPIConfigJournal*   m_pInstance;
+public:
+    static CMPIConfigJournal* getInstance();
+    
+    uint32_t epoch() const { return m_epoch; }
+    uint32_t append(uint32_t type, const std::string& data);
+    size_t   entriesSince(uint32_t epoch, std::vector<char>& entries) const;
+    void     acknowledge(int rank, uint32_t epoch);
+    void     trim(const std::set<int>& workers);
+    void     apply(CTCLInterpreter& interp, const char* pEntries, size_t nBytes);
+    void     setApplier(uint32_t type, Applier applier);
+    void     addSource(Source* pSource);
+    void     sync();
+private:
+    CMPIConfigJournal();
+    static void applyScript(CTCLInterpreter& interp, const char* pData, size_t nBytes);
+};
+
+CMPIConfigJournal* CMPIConfigJournal::m_pInstance(nullptr);
+
+/**
+ * getInstance
+ *    @return CMPIConfigJournal* - the journal, created if needed.
+ */
+CMPIConfigJournal*
+CMPIConfigJournal::getInstance()
+{
+    if (!m_pInstance) {
+        m_pInstance = new CMPIConfigJournal;
+    }
+    return m_pInstance;
+}
+/**
+ * constructor
+ *    Epoch zero is the configuration before any journaled changes.
+ *    Script entries are understood from the start.
+ */
+CMPIConfigJournal::CMPIConfigJournal() :
+    m_epoch(0), m_trimmed(0)
+{
+    m_appliers[MPIJOURNAL_SCRIPT] = applyScript;
+}
+/**
+ * append
+ *    Add an entry to the journal (distributor side).
+ * @param type - Entry type.
+ * @param data - Entry data.
+ * @return uint32_t - the new epoch.
+ */
+uint32_t
+CMPIConfigJournal::append(uint32_t type, const std::string& data)
+{
+    Entry entry;
+    entry.s_epoch = ++m_epoch;
+    entry.s_type  = type;
+    entry.s_data  = data;
+    m_entries.push_back(entry);
+    
+    return m_epoch;
+}
+/**
+ * entriesSince
+ *    Marshall the entries a worker at some epoch is missing.  A worker
+ *    that's behind the entries we've dropped is given what we have;
+ *    that's reported since its configuration won't match ours.
+ *
+ * @param epoch   - The epoch the worker has applied.
+ * @param entries - Receives the marshalled entries.
+ * @return size_t - Number of bytes of entries.
+ */
+size_t
+CMPIConfigJournal::entriesSince(uint32_t epoch, std::vector<char>& entries) const
+{
+    entries.clear();
+    if (epoch < m_trimmed) {
+        std::cerr << "A worker at configuration epoch " << epoch
+                  << " missed journal entries dropped up to epoch "
+                  << m_trimmed << std::endl;
+        epoch = m_trimmed;
+    }
+    
+    // Epochs are dense so entry i is epoch m_trimmed+i+1:
+    
+    for (size_t i = epoch - m_trimmed; i < m_entries.size(); i++) {
+        const Entry& e(m_entries[i]);
+        MPIJournalEntry header;
+        header.s_epoch  = e.s_epoch;
+        header.s_type   = e.s_type;
+        header.s_length = e.s_data.size();
+        const char* p = reinterpret_cast<const char*>(&header);
+        entries.insert(entries.end(), p, p + sizeof(header));
+        entries.insert(entries.end(), e.s_data.begin(), e.s_data.end());
+    }
+    return entries.size();
+}
+/**
+ * acknowledge
+ *    Note that a worker has (or is sure to get before it needs them) the
+ *    entries up to an epoch.
+ * @param rank  - the worker.
+ * @param epoch - the epoch.
+ */
+void
+CMPIConfigJournal::acknowledge(int rank, uint32_t epoch)
+{
+    uint32_t& acknowledged(m_acknowledged[rank]);
+    acknowledged = std::max(acknowledged, epoch);
+}
+/**
+ * trim
+ *    Drop the entries every worker has acknowledged.
+ * @param workers - the current workers; any that have never acknowledged
+ *                  anything keep all entries.
+ */
+void
+CMPIConfigJournal::trim(const std::set<int>& workers)
+{
+    if (m_entries.empty()) return;
+    for (auto p = workers.begin(); p != workers.end(); p++) {
+        if (!m_acknowledged.count(*p)) return;
+    }
+    uint32_t lowest = m_epoch;
+    for (auto p = m_acknowledged.begin(); p != m_acknowledged.end(); p++) {
+        lowest = std::min(lowest, p->second);
+    }
+    while (m_trimmed < lowest) {
+        m_entries.pop_front();
+        m_trimmed++;
+    }
+}
+/**
+ * apply
+ *    Apply marshalled entries (worker side).  Entries for epochs we've
+ *    already applied are skipped.  Errors are reported but don't stop
+ *    the data flow, the epoch still advances so the same broken entry
+ *    isn't retried with every block.
+ *
+ * @param interp   - Interpreter the configuration lives in.
+ * @param pEntries - The marshalled entries.
+ * @param nBytes   - Size of the entries.
+ */
+void
+CMPIConfigJournal::apply(CTCLInterpreter& interp, const char* pEntries, size_t nBytes)
+{
+    const char* pEnd = pEntries + nBytes;
+    while (pEntries + sizeof(MPIJournalEntry) <= pEnd) {
+        MPIJournalEntry header;
+        memcpy(&header, pEntries, sizeof(header));
+        pEntries += sizeof(header);
+        if (header.s_length > static_cast<size_t>(pEnd - pEntries)) {
+            std::cerr << "Truncated configuration journal entry ignored\n";
+            return;
+        }
+        if (header.s_epoch > m_epoch) {
+            std::map<uint32_t, Applier>::iterator p = m_appliers.find(header.s_type);
+            try {
+                if (p == m_appliers.end()) {
+                    std::cerr << "Unrecognized journal entry type " << header.s_type
+                              << " ignored\n";
+                } else {
+                    (*p->second)(interp, pEntries, header.s_length);
+                }
+            }
+            catch (CException& e) {
+                std::cerr << "Failed to apply configuration epoch " << header.s_epoch
+                          << ": " << e.ReasonText() << std::endl;
+            }
+            catch (std::string msg) {
+                std::cerr << "Failed to apply configuration epoch " << header.s_epoch
+                          << ": " << msg << std::endl;
+            }
+            m_epoch = header.s_epoch;
+        }
+        pEntries += header.s_length;
+    }
+}
+/**
+ * setApplier
+ *    Register the function that applies a type of journal entry.
+ * @param type    - Entry type.
+ * @param applier - Function to apply it.
+ */
+void
+CMPIConfigJournal::setApplier(uint32_t type, Applier applier)
+{
+    m_appliers[type] = applier;
+}
+/**
+ * addSource
+ *    Register a source of batched journal entries.
+ * @param pSource - the source.
+ */
+void
+CMPIConfigJournal::addSource(Source* pSource)
+{
+    m_sources.push_back(pSource);
+}
+/**
+ * sync
+ *    Have all sources append their pending entries.  This must be done
+ *    before the epoch is used to tag anything.
+ */
+void
+CMPIConfigJournal::sync()
+{
+    for (size_t i = 0; i < m_sources.size(); i++) {
+        m_sources[i]->flush(*this);
+    }
+}
+/**
+ * applyScript
+ *    Applier for MPIJOURNAL_SCRIPT - evaluate the script at global level.
+ */
+void
+CMPIConfigJournal::applyScript(CTCLInterpreter& interp, const char* pData, size_t nBytes)
+{
+    interp.GlobalEval(std::string(pData, nBytes));
+}
+
+/**
+ * Definition journal entries (MPIJOURNAL_DEFINITIONS) start with this
+ * header.  The records that follow are LZ4 compressed if s_compressed is
+ * nonzero.  Each record is an MPIDefinitionRecord followed by the name
+ * and then the definition.  A record with an empty definition deletes the
+ * object.  Definitions are the -list descriptions less the ids, which
+ * differ from rank to rank (parameters keep theirs as the decoders use
+ * them).  An application's definition is the gate applied to the
+ * spectrum named; empty means it's ungated.
+ */
+struct MPIDefinitionsHeader {
+    uint32_t s_records;
+    uint32_t s_compressed;
+    uint64_t s_size;                 // Uncompressed bytes of records.
+};
+struct MPIDefinitionRecord {
+    uint8_t  s_kind;                 // MPIDEF_* what's being defined.
+    uint8_t  s_unused[3];
+    uint32_t s_nameLength;
+    uint32_t s_definitionLength;
+};
+static const uint8_t MPIDEF_PARAMETER(0);
+static const uint8_t MPIDEF_SPECTRUM(1);
+static const uint8_t MPIDEF_GATE(2);
+static const uint8_t MPIDEF_APPLICATION(3);
+
+/**
+ * @class CMPIDefinitionSync
+ *    Keeps worker parameter, spectrum and gate definitions in step with
+ *    those of the distributing rank by journaling only what changed:
+ *    -  SpecTcl spectrum and gate dictionary observers note the names
+ *       that were added, changed or removed.
+ *    -  An execution trace on the parameter command notes that the
+ *       parameter dictionary may have changed, one on apply and ungate
+ *       that gate applications may have.  Applications are diffed when
+ *       spectra or gates change too.
+ *    -  When the journal is synced (a block is about to go out or a
+ *       script is journaled), the current definition of each noted name
+ *       is fetched and compared with what was last shipped.  The ones
+ *       that really changed go out as a single MPIJOURNAL_DEFINITIONS
+ *       entry.  Changes are thus coalesced: a spectrum created and
+ *       deleted between two blocks costs nothing.
+ *    -  Workers apply a record only if it differs from their own
+ *       definition.  Changes they make while applying are not noted.
+ */
+class CMPIDefinitionSync : public CMPIConfigJournal::Source,
+                           public SpectrumDictionaryObserver,
+                           public CGateObserver
+{
+private:
+    typedef std::pair<uint8_t, std::string> Key;
+    CTCLInterpreter&                  m_interp;
+    std::vector<Key>                  m_pending;    // In order noted.
+    std::set<Key>                     m_noted;
+    bool                              m_parametersChanged;
+    bool                              m_applicationsChanged;
+    std::map<Key, std::string>        m_shipped;
+    bool                              m_enabled;
+    bool                              m_applying;
+    CMPICompressor                    m_compressor;
+    static CMPIDefinitionSync*        m_pInstance;
+public:
+    static CMPIDefinitionSync* getInstance(CTCLInterpreter& interp);
+    
+    void setEnabled(bool enabled) { m_enabled = enabled; }
+    bool enabled() const { return m_enabled; }
+    
+    virtual void flush(CMPIConfigJournal& journal);
+    
+    virtual void onAdd(std::string name, CSpectrum*& item);
+    virtual void onRemove(std::string name, CSpectrum*& item);
+    virtual void onAdd(std::string name, CGateContainer& item);
+    virtual void onRemove(std::string name, CGateContainer& item);
+    virtual void onChange(std::string name, CGateContainer& item);
+    
+private:
+    CMPIDefinitionSync(CTCLInterpreter& interp);
+    void note(uint8_t kind, const std::string& name);
+    void diffParameters(std::vector<std::pair<Key, std::string> >& changes);
+    void diffApplications(std::vector<std::pair<Key, std::string> >& changes);
+    void diff(
+        uint8_t kind, const std::map<std::string, std::string>& current,
+        std::vector<std::pair<Key, std::string> >& changes
+    );
+    std::string definition(uint8_t kind, const std::string& name);
+    std::string canonical(uint8_t kind, Tcl_Obj* pDescription);
+    
+    static void applyDefinitions(
+        CTCLInterpreter& interp, const char* pData, size_t nBytes
+    );
+    void apply(uint8_t kind, const std::string& name, const std::string& newDef);
+    void applyApplication(const std::string& spectrum, const std::string& gate);
+    Tcl_Obj* list(uint8_t kind, const std::string& pattern);
+    static int parameterTrace(
+        ClientData pData, Tcl_Interp* pInterp, int objc, Tcl_Obj* const* objv
+    );
+    static int applicationTrace(
+        ClientData pData, Tcl_Interp* pInterp, int objc, Tcl_Obj* const* objv
+    );
+};
+
+CMPIDefinitionSync* CMPIDefinitionSync::m_pInstance(nullptr);
+
+/**
+ * The Tcl commands that list/create/delete each kind of definition and
+ * where the name and id (-1 if it's kept) are in the elements of their
+ * -list output.
+ */
+static const struct {
+    const char* s_command;
+    int         s_nameIndex;
+    int         s_idIndex;
+} definitionCommands[] = {
+    {"parameter", 0, -1}, {"spectrum", 1, 0}, {"gate", 0, 1}, {"apply", 0, -1}
+};
+
+/**
+ * getInstance
+ *    @param interp - interpreter SpecTcl's commands are in.  Only used
+ *                    when the singleton is created.
+ *    @return CMPIDefinitionSync* - the singleton.
+ */
+CMPIDefinitionSync*
+CMPIDefinitionSync::getInstance(CTCLInterpreter& interp)
+{
+    if (!m_pInstance) {
+        m_pInstance = new CMPIDefinitionSync(interp);
+    }
+    return m_pInstance;
+}
+/**
+ * constructor
+ *    Hook into SpecTcl's dictionaries, the parameter command and the
+ *    journal.
+ */
+CMPIDefinitionSync::CMPIDefinitionSync(CTCLInterpreter& interp) :
+    m_interp(interp), m_parametersChanged(true), m_applicationsChanged(true),
+    m_enabled(true), m_applying(false)
+{
+    SpecTcl* pApi = SpecTcl::getInstance();
+    pApi->addSpectrumDictionaryObserver(this);
+    pApi->addGateDictionaryObserver(this);
+    
+    Tcl_CreateObjCommand(
+        interp.getInterpreter(), "::mpispectcl::parameterTrace",
+        parameterTrace, this, nullptr
+    );
+    Tcl_CreateObjCommand(
+        interp.getInterpreter(), "::mpispectcl::applicationTrace",
+        applicationTrace, this, nullptr
+    );
+    interp.GlobalEval(
+        "foreach command {parameter treeparameter} {\n"
+        "    catch {trace add execution $command leave ::mpispectcl::parameterTrace}\n"
+        "}\n"
+        "foreach command {apply ungate} {\n"
+        "    catch {trace add execution $command leave ::mpispectcl::applicationTrace}\n"
+        "}\n"
+    );
+    
+    CMPIConfigJournal* pJournal = CMPIConfigJournal::getInstance();
+    pJournal->addSource(this);
+    pJournal->setApplier(MPIJOURNAL_DEFINITIONS, applyDefinitions);
+}
+
+/**
+ * Observer methods - note the name of what changed.
+ */
+void
+CMPIDefinitionSync::onAdd(std::string name, CSpectrum*& item)
+{
+    note(MPIDEF_SPECTRUM, name);
+}
+void
+CMPIDefinitionSync::onRemove(std::string name, CSpectrum*& item)
+{
+    note(MPIDEF_SPECTRUM, name);
+}
+void
+CMPIDefinitionSync::onAdd(std::string name, CGateContainer& item)
+{
+    note(MPIDEF_GATE, name);
+}
+void
+CMPIDefinitionSync::onRemove(std::string name, CGateContainer& item)
+{
+    note(MPIDEF_GATE, name);
+}
+void
+CMPIDefinitionSync::onChange(std::string name, CGateContainer& item)
+{
+    note(MPIDEF_GATE, name);
+}
+/**
+ * note
+ *    Remember that a definition may have changed.  The observers are
+ *    called from inside SpecTcl's dictionaries so nothing else is done
+ *    here.
+ */
+void
+CMPIDefinitionSync::note(uint8_t kind, const std::string& name)
+{
+    if (m_applying) return;
+    Key key(kind, name);
+    if (m_noted.insert(key).second) {
+        m_pending.push_back(key);
+    }
+}
+/**
+ * parameterTrace
+ *    Execution trace on the parameter command; parameter definitions
+ *    must be diffed at the next flush.
+ */
+int
+CMPIDefinitionSync::parameterTrace(
+    ClientData pData, Tcl_Interp* pInterp, int objc, Tcl_Obj* const* objv
+)
+{
+    CMPIDefinitionSync* pThis = static_cast<CMPIDefinitionSync*>(pData);
+    if (!pThis->m_applying) {
+        pThis->m_parametersChanged = true;
+    }
+    return TCL_OK;
+}
+/**
+ * applicationTrace
+ *    Execution trace on apply and ungate; gate applications must be
+ *    diffed at the next flush.
+ */
+int
+CMPIDefinitionSync::applicationTrace(
+    ClientData pData, Tcl_Interp* pInterp, int objc, Tcl_Obj* const* objv
+)
+{
+    CMPIDefinitionSync* pThis = static_cast<CMPIDefinitionSync*>(pData);
+    if (!pThis->m_applying) {
+        pThis->m_applicationsChanged = true;
+    }
+    return TCL_OK;
+}
+
+/**
+ * flush
+ *    Journal the definitions that changed since the last flush.
+ *    Parameters go first as spectra and gates depend on them, the rest
+ *    are in the order they changed so that e.g. compound gates follow
+ *    their dependencies.  Applications go last; they need both.
+ *
+ * @param journal - journal to append to.
+ */
+void
+CMPIDefinitionSync::flush(CMPIConfigJournal& journal)
+{
+    if (!m_enabled
+        || (m_pending.empty() && !m_parametersChanged && !m_applicationsChanged)) {
+        return;
+    }
+    
+    std::vector<std::pair<Key, std::string> > changes;
+    if (m_parametersChanged) {
+        diffParameters(changes);
+        m_parametersChanged = false;
+    }
+    if (!m_pending.empty()) {
+        m_applicationsChanged = true;   // Spectra and gates take theirs along.
+    }
+    for (size_t i = 0; i < m_pending.size(); i++) {
+        const Key&  key(m_pending[i]);
+        std::string def = definition(key.first, key.second);
+        std::map<Key, std::string>::iterator p = m_shipped.find(key);
+        std::string shipped = (p == m_shipped.end()) ? "" : p->second;
+        if (def != shipped) {
+            changes.push_back(std::make_pair(key, def));
+        }
+    }
+    m_pending.clear();
+    m_noted.clear();
+    if (m_applicationsChanged) {
+        diffApplications(changes);
+        m_applicationsChanged = false;
+    }
+    if (changes.empty()) return;
+    
+    // Marshall the records:
+    
+    std::vector<char> records;
+    for (size_t i = 0; i < changes.size(); i++) {
+        const std::string& name(changes[i].first.second);
+        const std::string& def(changes[i].second);
+        MPIDefinitionRecord record;
+        memset(&record, 0, sizeof(record));
+        record.s_kind             = changes[i].first.first;
+        record.s_nameLength       = name.size();
+        record.s_definitionLength = def.size();
+        const char* p = reinterpret_cast<const char*>(&record);
+        records.insert(records.end(), p, p + sizeof(record));
+        records.insert(records.end(), name.begin(), name.end());
+        records.insert(records.end(), def.begin(), def.end());
+        
+        if (def.empty()) {
+            m_shipped.erase(changes[i].first);
+        } else {
+            m_shipped[changes[i].first] = def;
+        }
+    }
+    
+    // Definition lists are very repetitive so big ones are compressed:
+    
+    MPIDefinitionsHeader header;
+    header.s_records    = changes.size();
+    header.s_compressed = 0;
+    header.s_size       = records.size();
+    std::string entry(sizeof(header), '\0');
+    if (records.size() >= 4096) {
+        entry.resize(sizeof(header) + CMPICompressor::bound(records.size()));
+        size_t zBytes = m_compressor.compress(
+            records.data(), records.size(), &entry[sizeof(header)],
+            entry.size() - sizeof(header)
+        );
+        if (zBytes && (zBytes < records.size())) {
+            header.s_compressed = 1;
+            entry.resize(sizeof(header) + zBytes);
+        }
+    }
+    if (!header.s_compressed) {
+        entry.resize(sizeof(header));
+        entry.append(records.data(), records.size());
+    }
+    memcpy(&entry[0], &header, sizeof(header));
+    journal.append(MPIJOURNAL_DEFINITIONS, entry);
+}
+/**
+ * diffParameters
+ *    Compare the parameter dictionary with what was last shipped.
+ * @param[out] changes - changed and deleted parameters are appended.
+ */
+void
+CMPIDefinitionSync::diffParameters(
+    std::vector<std::pair<Key, std::string> >& changes
+)
+{
+    std::map<std::string, std::string> current;
+    Tcl_Interp* pInterp = m_interp.getInterpreter();
+    Tcl_Obj*    pList   = list(MPIDEF_PARAMETER, "*");
+    int         nDefs;
+    Tcl_Obj**   pDefs;
+    Tcl_ListObjGetElements(pInterp, pList, &nDefs, &pDefs);
+    for (int i = 0; i < nDefs; i++) {
+        Tcl_Obj* pName;
+        Tcl_ListObjIndex(pInterp, pDefs[i], 0, &pName);
+        if (pName) current[Tcl_GetString(pName)] = Tcl_GetString(pDefs[i]);
+    }
+    Tcl_DecrRefCount(pList);
+    diff(MPIDEF_PARAMETER, current, changes);
+}
+/**
+ * diffApplications
+ *    Compare the gates applied to spectra with what was last shipped.
+ * @param[out] changes - changed applications and spectra that are no
+ *                       longer gated (or no longer exist) are appended.
+ */
+void
+CMPIDefinitionSync::diffApplications(
+    std::vector<std::pair<Key, std::string> >& changes
+)
+{
+    std::map<std::string, std::string> current;
+    Tcl_Interp* pInterp = m_interp.getInterpreter();
+    Tcl_Obj*    pList   = list(MPIDEF_APPLICATION, "*");
+    int         nDefs;
+    Tcl_Obj**   pDefs;
+    Tcl_ListObjGetElements(pInterp, pList, &nDefs, &pDefs);
+    for (int i = 0; i < nDefs; i++) {
+        Tcl_Obj* pName;
+        Tcl_ListObjIndex(pInterp, pDefs[i], 0, &pName);
+        std::string gate = canonical(MPIDEF_APPLICATION, pDefs[i]);
+        if (pName && !gate.empty()) current[Tcl_GetString(pName)] = gate;
+    }
+    Tcl_DecrRefCount(pList);
+    diff(MPIDEF_APPLICATION, current, changes);
+}
+/**
+ * diff
+ *    Compare all the definitions of a kind with what was last shipped.
+ * @param kind    - MPIDEF_* kind.
+ * @param current - name -> definition of those there are now.
+ * @param[out] changes - changed and deleted ones are appended.
+ */
+void
+CMPIDefinitionSync::diff(
+    uint8_t kind, const std::map<std::string, std::string>& current,
+    std::vector<std::pair<Key, std::string> >& changes
+)
+{
+    for (auto p = current.begin(); p != current.end(); p++) {
+        Key key(kind, p->first);
+        std::map<Key, std::string>::iterator s = m_shipped.find(key);
+        if ((s == m_shipped.end()) || (s->second != p->second)) {
+            changes.push_back(std::make_pair(key, p->second));
+        }
+    }
+    for (std::map<Key, std::string>::iterator s = m_shipped.begin();
+         s != m_shipped.end(); s++) {
+        if ((s->first.first == kind) && !current.count(s->first.second)) {
+            changes.push_back(std::make_pair(s->first, std::string()));
+        }
+    }
+}
+/**
+ * definition
+ *    @param kind - MPIDEF_* kind of object.
+ *    @param name - its name.
+ *    @return std::string - its definition (see canonical), empty if
+ *                  there's no such object.
+ */
+std::string
+CMPIDefinitionSync::definition(uint8_t kind, const std::string& name)
+{
+    // The -list subcommands take glob patterns; quote any glob
+    // characters in the name.
+    
+    std::string pattern;
+    for (size_t i = 0; i < name.size(); i++) {
+        if (strchr("*?[]\\", name[i])) pattern += '\\';
+        pattern += name[i];
+    }
+    Tcl_Interp* pInterp = m_interp.getInterpreter();
+    Tcl_Obj*    pList   = list(kind, pattern);
+    std::string result;
+    int         nDefs;
+    Tcl_Obj**   pDefs;
+    Tcl_ListObjGetElements(pInterp, pList, &nDefs, &pDefs);
+    for (int i = 0; i < nDefs; i++) {
+        Tcl_Obj* pName;
+        Tcl_ListObjIndex(
+            pInterp, pDefs[i], definitionCommands[kind].s_nameIndex, &pName
+        );
+        if (pName && (name == Tcl_GetString(pName))) {
+            result = canonical(kind, pDefs[i]);
+            break;
+        }
+    }
+    Tcl_DecrRefCount(pList);
+    return result;
+}
+/**
+ * canonical
+ *    The definition we compare and ship for an element of -list output:
+ *    -  Ids, which each rank hands out itself, are removed.
+ *    -  For an application, it's the gate's name; empty if the spectrum
+ *       is ungated (-TRUE- or -Ungated-).
+ * @param kind         - MPIDEF_* kind.
+ * @param pDescription - the -list element.
+ * @return std::string - the definition.
+ */
+std::string
+CMPIDefinitionSync::canonical(uint8_t kind, Tcl_Obj* pDescription)
+{
+    Tcl_Interp* pInterp = m_interp.getInterpreter();
+    if (kind == MPIDEF_APPLICATION) {
+        // spectrum {gate id type ...}:
+        
+        Tcl_Obj* pGate = nullptr;
+        Tcl_ListObjIndex(pInterp, pDescription, 1, &pGate);
+        if (!pGate) return "";
+        Tcl_Obj* pGateName = nullptr;
+        Tcl_ListObjIndex(pInterp, pGate, 0, &pGateName);
+        std::string gate = pGateName ? Tcl_GetString(pGateName) : "";
+        return ((gate == "-TRUE-") || (gate == "-Ungated-")) ? "" : gate;
+    }
+    int idIndex = definitionCommands[kind].s_idIndex;
+    if (idIndex < 0) return Tcl_GetString(pDescription);
+    
+    Tcl_Obj* pCopy = Tcl_DuplicateObj(pDescription);
+    Tcl_IncrRefCount(pCopy);
+    std::string result;
+    if (Tcl_ListObjReplace(pInterp, pCopy, idIndex, 1, 0, nullptr) == TCL_OK) {
+        result = Tcl_GetString(pCopy);
+    }
+    Tcl_DecrRefCount(pCopy);
+    return result;
+}
+/**
+ * list
+ *    Run the -list subcommand for a kind of definition.
+ * @param kind    - MPIDEF_* kind.
+ * @param pattern - glob pattern to match.
+ * @return Tcl_Obj* - the result with a reference count the caller
+ *                    must decrement.
+ * @throw std::string - the command failed.
+ */
+Tcl_Obj*
+CMPIDefinitionSync::list(uint8_t kind, const std::string& pattern)
+{
+    Tcl_Interp* pInterp = m_interp.getInterpreter();
+    Tcl_Obj*    words[3] = {
+        Tcl_NewStringObj(definitionCommands[kind].s_command, -1),
+        Tcl_NewStringObj("-list", -1),
+        Tcl_NewStringObj(pattern.c_str(), pattern.size())
+    };
+    Tcl_Obj* pCommand = Tcl_NewListObj(3, words);
+    Tcl_IncrRefCount(pCommand);
+    int status = Tcl_EvalObjEx(pInterp, pCommand, TCL_EVAL_GLOBAL);
+    Tcl_DecrRefCount(pCommand);
+    if (status != TCL_OK) {
+        throw std::string(Tcl_GetStringResult(pInterp));
+    }
+    Tcl_Obj* pResult = Tcl_GetObjResult(pInterp);
+    Tcl_IncrRefCount(pResult);
+    Tcl_ResetResult(pInterp);
+    return pResult;
+}
+
+/**
+ * applyDefinitions
+ *    Applier for MPIJOURNAL_DEFINITIONS entries (worker side).
+ */
+void
+CMPIDefinitionSync::applyDefinitions(
+    CTCLInterpreter& interp, const char* pData, size_t nBytes
+)
+{
+    CMPIDefinitionSync* pThis = getInstance(interp);
+    MPIDefinitionsHeader header;
+    if (nBytes < sizeof(header)) {
+        throw std::string("Truncated definitions journal entry");
+    }
+    memcpy(&header, pData, sizeof(header));
+    pData  += sizeof(header);
+    nBytes -= sizeof(header);
+    std::vector<char> records;
+    if (header.s_compressed) {
+        records.resize(header.s_size);
+        if (!CMPICompressor::decompress(pData, nBytes, records.data(), header.s_size)) {
+            throw std::string("Corrupt compressed definitions journal entry");
+        }
+        pData  = records.data();
+        nBytes = records.size();
+    }
+    
+    const char* pEnd = pData + nBytes;
+    pThis->m_applying = true;
+    try {
+        for (uint32_t i = 0; i < header.s_records; i++) {
+            MPIDefinitionRecord record;
+            if (pData + sizeof(record) > pEnd) break;
+            memcpy(&record, pData, sizeof(record));
+            pData += sizeof(record);
+            if (record.s_nameLength + record.s_definitionLength >
+                static_cast<size_t>(pEnd - pData)) break;
+            if (record.s_kind > MPIDEF_APPLICATION) {
+                throw std::string("Invalid definition record kind");
+            }
+            std::string name(pData, record.s_nameLength);
+            pData += record.s_nameLength;
+            std::string def(pData, record.s_definitionLength);
+            pData += record.s_definitionLength;
+            
+            try {
+                pThis->apply(record.s_kind, name, def);
+            }
+            catch (std::string msg) {
+                std::cerr << "Unable to synchronize " 
+                          << definitionCommands[record.s_kind].s_command
+                          << " " << name << ": " << msg << std::endl;
+            }
+        }
+    }
+    catch (...) {
+        pThis->m_applying = false;
+        throw;
+    }
+    pThis->m_applying = false;
+}
+/**
+ * apply
+ *    Make one of our definitions match the distributor's.
+ *    -  Nothing is done if they already match.
+ *    -  Gates are redefined in place so that their applications survive.
+ *    -  Parameters and spectra are deleted and recreated.
+ *    -  When spectra are sharded, the ones we don't own aren't made.
+ *    -  Applications are made with apply or ungate.
+ *
+ * @param kind - MPIDEF_* kind of object.
+ * @param name - Its name.
+ * @param newDef - The definition (see canonical); empty to delete.
+ * @throw std::string - a command failed.
+ */
+void
+CMPIDefinitionSync::apply(uint8_t kind, const std::string& name, const std::string& newDef)
+{
+    // Sharding needs to know about every spectrum and gate but we only
+    // hold the spectra we own.
+    
+    CMPISpectrumShards* pShards = CMPISpectrumShards::getInstance();
+    std::string         def     = newDef;
+    if (kind == MPIDEF_SPECTRUM) {
+        pShards->spectrumDefined(m_interp, name, def);
+        if (!pShards->owns(name)) def.clear();
+    } else if (kind == MPIDEF_GATE) {
+        pShards->gateDefined(m_interp, name, def);
+    } else if (kind == MPIDEF_PARAMETER) {
+        pShards->parametersChanged();
+    } else if (!pShards->owns(name)) {
+        return;                              // No spectrum to gate.
+    }
+    
+    std::string current = definition(kind, name);
+    if (current == def) return;
+    if (kind == MPIDEF_APPLICATION) {
+        applyApplication(name, def);
+        return;
+    }
+    
+    Tcl_Interp* pInterp  = m_interp.getInterpreter();
+    Tcl_Obj*    pCommand = Tcl_NewListObj(0, nullptr);
+    Tcl_IncrRefCount(pCommand);
+    Tcl_ListObjAppendElement(
+        pInterp, pCommand, Tcl_NewStringObj(definitionCommands[kind].s_command, -1)
+    );
+    int status = TCL_OK;
+    if (!current.empty() && (def.empty() || (kind != MPIDEF_GATE))) {
+        Tcl_Obj* pDelete = Tcl_DuplicateObj(pCommand);
+        Tcl_IncrRefCount(pDelete);
+        Tcl_ListObjAppendElement(pInterp, pDelete, Tcl_NewStringObj("-delete", -1));
+        Tcl_ListObjAppendElement(
+            pInterp, pDelete, Tcl_NewStringObj(name.c_str(), name.size())
+        );
+        status = Tcl_EvalObjEx(pInterp, pDelete, TCL_EVAL_GLOBAL);
+        Tcl_DecrRefCount(pDelete);
+    }
+    if ((status == TCL_OK) && !def.empty()) {
+        // With the ids gone the definitions are what -new takes:
+        //   parameter: name id ...
+        //   spectrum:  name type ...
+        //   gate:      name type description
+        
+        Tcl_Obj*  pDef = Tcl_NewStringObj(def.c_str(), def.size());
+        Tcl_IncrRefCount(pDef);
+        int       nWords;
+        Tcl_Obj** pWords;
+        status = Tcl_ListObjGetElements(pInterp, pDef, &nWords, &pWords);
+        if ((status == TCL_OK) && (nWords >= 2)) {
+            Tcl_ListObjAppendElement(pInterp, pCommand, Tcl_NewStringObj("-new", -1));
+            Tcl_ListObjReplace(pInterp, pCommand, INT_MAX, 0, nWords, pWords);
+            status = Tcl_EvalObjEx(pInterp, pCommand, TCL_EVAL_GLOBAL);
+        }
+        Tcl_DecrRefCount(pDef);
+    }
+    Tcl_DecrRefCount(pCommand);
+    if (status != TCL_OK) {
+        std::string msg = Tcl_GetStringResult(pInterp);
+        Tcl_ResetResult(pInterp);
+        throw msg;
+    }
+    Tcl_ResetResult(pInterp);
+}
+/**
+ * applyApplication
+ *    Gate a spectrum: apply gate spectrum, or ungate spectrum.
+ * @param spectrum - the spectrum.
+ * @param gate     - the gate, empty to ungate it.
+ * @throw std::string - the command failed.
+ */
+void
+CMPIDefinitionSync::applyApplication(
+    const std::string& spectrum, const std::string& gate
+)
+{
+    Tcl_Interp* pInterp  = m_interp.getInterpreter();
+    Tcl_Obj*    pCommand = Tcl_NewListObj(0, nullptr);
+    Tcl_IncrRefCount(pCommand);
+    if (gate.empty()) {
+        Tcl_ListObjAppendElement(pInterp, pCommand, Tcl_NewStringObj("ungate", -1));
+    } else {
+        Tcl_ListObjAppendElement(pInterp, pCommand, Tcl_NewStringObj("apply", -1));
+        Tcl_ListObjAppendElement(
+            pInterp, pCommand, Tcl_NewStringObj(gate.c_str(), gate.size())
+        );
+    }
+    Tcl_ListObjAppendElement(
+        pInterp, pCommand, Tcl_NewStringObj(spectrum.c_str(), spectrum.size())
+    );
+    int status = Tcl_EvalObjEx(pInterp, pCommand, TCL_EVAL_GLOBAL);
+    Tcl_DecrRefCount(pCommand);
+    if (status != TCL_OK) {
+        std::string msg = Tcl_GetStringResult(pInterp);
+        Tcl_ResetResult(pInterp);
+        throw msg;
+    }
+    Tcl_ResetResult(pInterp);
+}
+
+/**
+ * @class CMPIDataGetter
+ *     Gets data from an MPI data source (usually rank 0).
+ *     This uses a pull protocol:
+ *     -  We send a request for data to some rank with MPI_TAG_BIN_DATA.
+ *        The request carries the size of the buffer the reply will land in
+ *        and the configuration epoch we've reached.
+ *     -  Configuration journal entries that come with a block are applied
+ *        before the block is given to SpecTcl.
+ *     -  That rank always replies with something.  The reply is an end of
+ *        data header (or a zero length block) if there's no more data to give.
+ *     -  Data blocks start with an MPIBlockHeader.  If that says the
+ *        block is compressed it's expanded before being handed to SpecTcl.
+ *     -  Blocks too big for one message, or for our buffers, are chunked.
+ *        The chunks are received straight into the block with a window of
+ *        receives posted.
+ *
+ *     Replies are received into a fixed set of buffers.  As a block is
+ *     handed to SpecTcl the request for the next one is sent and the
+ *     receive of its reply posted on a free buffer so that its transfer
+ *     overlaps the analysis of the current one.  Only one request is ever
+ *     outstanding so end of data rundown in the distributor is unchanged.
+ *     These are ordinary nonblocking requests: persistent ones measured
+ *     no faster (see benchBlocks.cpp) and would be needed per reader.
+ *
+ *     In push mode there are no requests.  An MPIPushHello is sent once
+ *     and then the receives of all buffers SpecTcl isn't holding are kept
+ *     posted.  The distributor sends blocks, in the same format, as it
+ *     sees fit.  Receives match in the order they're posted so the
+ *     order the buffers were posted in is kept to know which gets the
+ *     next block.
+ *
+ *     If spectra are reduced in the background, the reduction is moved
+ *     along as each block is read and the run's spectra are retired when
+ *     the end of data comes.  The snapshot count in each block header
+ *     and end of data is checked before anything in it is used, so
+ *     that snapshots are taken at rank 0's cuts.  Rank 0 also sends each
+ *     rank a cut message when it defines a cut.  It comes in order with
+ *     the blocks, so read takes it like any other; while the worker is
+ *     idle (between runs) takeCuts, from the idle poller, takes those
+ *     that have arrived.
+ *
+ *     In pull mode there can be several readers, each a distributor with
+ *     its own data source.  Every reply says how many requests the reader
+ *     has waiting and each request goes to the reader that last said it
+ *     had the fewest (least recently asked on ties).  Estimates for
+ *     readers we're not asking age towards zero so that they're tried
+ *     again.  A reader's end of data means it has no more this run; the
+ *     run ends for us when all readers have ended it.  Rank 0 must be a
+ *     reader; configuration journal entries and snapshot cuts only come
+ *     from it.
+ *
+ *     Buffers and blocks are charged to the prefetch account of the
+ *     memory budget.  A buffer is only added to prefetch the next block
+ *     if the budget has room for it; otherwise the next block is
+ *     requested when it's wanted.
+ */
+class CMPIDataGetter : public CDataGetter
+{
+private:
+    struct Buffer {
+        std::vector<char>        s_data;
+        MPIBlockRequest          s_requestMsg; // Sent as the request.
+        MPI_Request              s_request;    // Its send.
+        MPI_Request              s_reply;      // Receive of the reply.
+        bool                     s_held;       // SpecTcl has the data.
+        bool                     s_arrived;    // s_reply completed with
+        MPI_Status               s_status;     //   this in takeCuts.
+    };
+    struct Reader {
+        int      s_rank;
+        uint32_t s_depth;                 // Advertised (and aged) queue.
+        uint64_t s_lastAsked;
+        bool     s_ended;                 // Has ended this run.
+    };
+    CTCLInterpreter&     m_interp;
+    std::vector<Reader>  m_readers;
+    CMPIChunkReceiver    m_chunkReceiver;
+    std::vector<Buffer*> m_buffers;
+    size_t               m_bufferSize;
+    int                  m_inFlight;      // Buffer with a request going.
+    size_t               m_inFlightReader;
+    uint64_t             m_requests;
+    std::map<void*, std::pair<char*, size_t> > m_allocations; // Blocks not in our buffers.
+    bool                 m_push;
+    std::deque<size_t>   m_posted;        // Push mode receives in post order.
+    std::set<int>        m_participants;  // Workers in the run, from its ends.
+
+    static CMPIDataGetter* m_pCurrent;
+public:
+    CMPIDataGetter(
+        CTCLInterpreter& interp, const std::vector<int>& readers,
+        unsigned nBuffers = 2, size_t bufferSize = 1024*1024, bool push = false,
+        unsigned weight = 1
+    );
+    virtual ~CMPIDataGetter();
+    
+    virtual std::pair<size_t, void*> read();
+    virtual void free(std::pair<size_t, void*>& data);
+
+    bool takeCuts();
+    static CMPIDataGetter* current() { return m_pCurrent; }
+private:
+    Buffer* newBuffer();
+    char*   newBlock(size_t nBytes);
+    void    startRequest(bool prefetch = false);
+    void    post(size_t buffer);
+    bool    othersRunning(size_t reader);
+    void    addParticipants(const char* pEnd, int nBytes);
+    void    waitReply(size_t buffer, MPI_Status& status);
+    bool    takeCut(size_t buffer, size_t reader, int nBytes);
+};
+
+// Implementation:
+
+CMPIDataGetter* CMPIDataGetter::m_pCurrent(nullptr);
+
+/**
+ * constructor
+ *   @param interp - Interpreter in which configuration journal entries
+ *                   are applied.
+ *   @param readers - the MPI ranks of the processes from which we get
+ *                   data.  Only one in push mode.
+ *   @param nBuffers - Number of fixed receive buffers.  More than one lets
+ *                   the next block be fetched while the current one is
+ *                   analyzed.
+ *   @param bufferSize - Size of each buffer.  Larger blocks still work but
+ *                   are received into dynamically allocated storage.
+ *   @param push   - Data are pushed to us (mpisink -push) rather than
+ *                   requested.
+ *   @param weight - Push mode share of the blocks we ask for.
+ */
+CMPIDataGetter::CMPIDataGetter(
+    CTCLInterpreter& interp, const std::vector<int>& readers, unsigned nBuffers,
+    size_t bufferSize, bool push, unsigned weight
+) :
+    m_interp(interp), m_bufferSize(bufferSize), m_inFlight(-1), m_inFlightReader(0),
+    m_requests(0), m_push(push)
+{
+    for (size_t i = 0; i < readers.size(); i++) {
+        Reader reader;
+        reader.s_rank      = readers[i];
+        reader.s_depth     = 0;
+        reader.s_lastAsked = 0;
+        reader.s_ended     = false;
+        m_readers.push_back(reader);
+    }
+    if (m_bufferSize < 4096) m_bufferSize = 4096;   // Room for any header.
+    if (m_bufferSize > INT_MAX) m_bufferSize = INT_MAX;
+    CMPIMemoryBudget::getInstance()->charge(
+        CMPIMemoryBudget::prefetch, uint64_t(nBuffers)*m_bufferSize
+    );
+    for (unsigned i = 0; i < nBuffers; i++) {
+        m_buffers.push_back(newBuffer());
+    }
+    if (m_push) {
+        for (size_t i = 0; i < m_buffers.size(); i++) {
+            post(i);
+        }
+        MPIPushHello hello;
+        hello.s_capacity = m_bufferSize;
+        hello.s_epoch    = CMPIConfigJournal::getInstance()->epoch();
+        hello.s_buffers  = m_buffers.size();
+        hello.s_weight   = weight ? weight : 1;
+        hello.s_unused   = 0;
+        MPI_Send(
+            &hello, sizeof(hello), MPI_CHAR, m_readers[0].s_rank, MPI_TAG_BINDATA,
+            blockComm
+        );
+    }
+    m_pCurrent = this;
+}
+/**
+ * destructor
+ *    Cancel any request in flight and release the buffers and blocks.
+ */
+CMPIDataGetter::~CMPIDataGetter()
+{
+    if (m_inFlight >= 0) {
+        Buffer* pBuffer = m_buffers[m_inFlight];
+        if (!pBuffer->s_arrived) {
+            MPI_Cancel(&pBuffer->s_reply);
+            MPI_Wait(&pBuffer->s_reply, MPI_STATUS_IGNORE);
+        }
+        MPI_Wait(&pBuffer->s_request, MPI_STATUS_IGNORE);
+    }
+    for (size_t i = 0; i < m_posted.size(); i++) {
+        if (m_buffers[m_posted[i]]->s_arrived) continue;
+        MPI_Cancel(&m_buffers[m_posted[i]]->s_reply);
+        MPI_Wait(&m_buffers[m_posted[i]]->s_reply, MPI_STATUS_IGNORE);
+    }
+    for (size_t i = 0; i < m_buffers.size(); i++) {
+        delete m_buffers[i];
+    }
+    CMPIMemoryBudget* pBudget = CMPIMemoryBudget::getInstance();
+    pBudget->release(CMPIMemoryBudget::prefetch, uint64_t(m_buffers.size())*m_bufferSize);
+    for (auto p = m_allocations.begin(); p != m_allocations.end(); p++) {
+        delete []p->second.first;
+        pBudget->release(CMPIMemoryBudget::prefetch, p->second.second);
+    }
+    if (m_pCurrent == this) m_pCurrent = nullptr;
+}
+
+/**
+ * read
+ *   - If the next block wasn't prefetched, request it.
+ *   - Wait for the reply to land in its buffer.
+ *   - Apply any configuration journal entries that came with it.
+ *   - Receive the chunks or decompress it if needed.
+ *   - Request the block after that.
+ *   In push mode, the next block is just waited for and its buffer
+ *   reposted as soon as SpecTcl isn't using it.  Snapshot cut messages
+ *   are taken and their buffer posted again for the block.
+ * @return std::pair<size_t, void*> - describing the read data.
+ *                                    size == 0 means expect no more data.
+ * @note The pointer we return is either into one of our buffers or in
+ *       storage we allocated and remembered in m_allocations.
+ */
+std::pair<size_t, void*>
+CMPIDataGetter::read()
+{
+    MPI_Status     stat;
+    int            nBytes;
+    size_t         nBuffer;
+    size_t         reader = 0;
+    Buffer*        pBuffer;
+    char*          pData;
+    MPIBlockHeader header;
+    bool           end;
+    memset(&header, 0, sizeof(header));
+    CMPIRunReducer::getInstance()->progress();  // Last run's spectra.
+    CMPISnapshots::getInstance()->progress();
+    for (;;) {                               // Until data or all readers end.
+        if (m_push) {
+            if (m_posted.empty()) {          // SpecTcl holds them all.
+                CMPIMemoryBudget::getInstance()->charge(
+                    CMPIMemoryBudget::prefetch, m_bufferSize
+                );
+                m_buffers.push_back(newBuffer());
+                post(m_buffers.size() - 1);
+            }
+            nBuffer = m_posted.front();
+            m_posted.pop_front();
+            waitReply(nBuffer, stat);
+        } else {
+            if (m_inFlight < 0) {
+                startRequest();
+            }
+            nBuffer    = m_inFlight;
+            reader     = m_inFlightReader;
+            m_inFlight = -1;
+            waitReply(nBuffer, stat);
+            MPI_Wait(&m_buffers[nBuffer]->s_request, MPI_STATUS_IGNORE);
+        }
+        pBuffer = m_buffers[nBuffer];
+        pData   = pBuffer->s_data.data();
+        MPI_Get_count(&stat, MPI_CHAR, &nBytes);
+        if (takeCut(nBuffer, reader, nBytes)) continue;  // The block's still coming.
+        
+        end = true;                          // Unless it has a whole header.
+        if (nBytes >= static_cast<int>(sizeof(header))) {
+            memcpy(&header, pData, sizeof(header));
+            end = (header.s_flags & MPIBLOCK_END) != 0;
+            m_readers[reader].s_depth = header.s_queueDepth;
+            if (m_readers[reader].s_rank == 0) {
+                CMPISnapshots::getInstance()->cut(m_interp, header.s_snapshot);
+            }
+        }
+        if (end) addParticipants(pData, nBytes);
+        if (!end || !othersRunning(reader)) break;
+    }
+    
+    std::pair<size_t, void*> result;
+    result.first = 0;
+    result.second= pData + sizeof(MPIBlockHeader);
+    if (end) {
+        if (m_push) post(nBuffer);
+        CMPISpectrumShards::getInstance()->endOfData(m_participants);
+        int me;
+        MPI_Comm_rank(blockComm, &me);
+        bool dropped = (m_participants.count(me) == 0);
+        m_participants.clear();
+        CMPIRunReducer* pRunReducer = CMPIRunReducer::getInstance();
+        if (dropped) {
+            std::cerr << "mpisink: rank " << me << " was dropped from the run; "
+                      << (pRunReducer->enabled() ?
+                          "its counts for the run are discarded\n" :
+                          "its counts may include blocks re-issued to others\n");
+        }
+        pRunReducer->retire(dropped);
+        return result;                       // End of data.
+    }
+    
+    CMPIConfigJournal* pJournal = CMPIConfigJournal::getInstance();
+    size_t payloadOffset = sizeof(header);
+    if (!(header.s_flags & MPIBLOCK_JOURNALINCHUNKS)) {
+        if (header.s_journalBytes) {
+            pJournal->apply(m_interp, pData + sizeof(header), header.s_journalBytes);
+        }
+        payloadOffset += header.s_journalBytes;
+    }
+    
+    if (header.s_flags & MPIBLOCK_CHUNKED) {
+        MPIChunkHeader chunking;
+        memcpy(&chunking, pData + payloadOffset, sizeof(chunking));
+        char* pBlock = newBlock(chunking.s_totalSize);
+        m_chunkReceiver.receiveInto(
+            pBlock, chunking, m_readers[reader].s_rank, blockComm
+        );
+        if (header.s_flags & MPIBLOCK_JOURNALINCHUNKS) {
+            pJournal->apply(m_interp, pBlock, header.s_journalBytes);
+            result.second = pBlock + header.s_journalBytes;
+        } else {
+            result.second = pBlock;
+        }
+        m_allocations[result.second] = std::make_pair(pBlock, chunking.s_totalSize);
+    } else if (header.s_flags & MPIBLOCK_COMPRESSED) {
+        if (header.s_size > CMPICompressor::expansion(nBytes - payloadOffset)) {
+            throw std::string("Corrupt compressed data block from distributor");
+        }
+        char* pBlock = newBlock(header.s_size);
+        if (!CMPICompressor::decompress(
+            pData + payloadOffset, nBytes - payloadOffset, pBlock, header.s_size
+        )) {
+            delete []pBlock;
+            CMPIMemoryBudget::getInstance()->release(
+                CMPIMemoryBudget::prefetch, header.s_size
+            );
+            throw std::string("Corrupt compressed data block from distributor");
+        }
+        result.second = pBlock;
+        m_allocations[result.second] = std::make_pair(pBlock, header.s_size);
+    } else {
+        pBuffer->s_held = true;             // Analyzed in place.
+        result.second = pData + payloadOffset;
+    }
+    if (m_push) {
+        if (!pBuffer->s_held) post(nBuffer);
+    } else {
+        startRequest(true);                 // Prefetch the next block.
+    }
+    
+    result.first = header.s_size;
+    
+    return result;
+}
+
+/**
+ * free
+ *    Free data gotten by read.  If the data are in one of our buffers,
+ *    that buffer is available again, otherwise it was allocated.
+ * @param data - descriptor of  data gotten from read.
+ */
+void
+CMPIDataGetter::free(std::pair<size_t, void*>& data)
+{
+    auto p = m_allocations.find(data.second);
+    if (p != m_allocations.end()) {
+        delete []p->second.first;
+        CMPIMemoryBudget::getInstance()->release(
+            CMPIMemoryBudget::prefetch, p->second.second
+        );
+        m_allocations.erase(p);
+        return;
+    }
+    char* pBytes = static_cast<char*>(data.second);
+    for (size_t i = 0; i < m_buffers.size(); i++) {
+        char* pBuffer = m_buffers[i]->s_data.data();
+        if ((pBytes >= pBuffer) && (pBytes <= pBuffer + m_bufferSize)) {
+            if (m_buffers[i]->s_held && m_push) {
+                post(i);
+            }
+            m_buffers[i]->s_held = false;
+            return;
+        }
+    }
+}
+/**
+ * newBuffer
+ *    Create a receive buffer.
+ * @return Buffer* - the new buffer.
+ */
+CMPIDataGetter::Buffer*
+CMPIDataGetter::newBuffer()
+{
+    Buffer* pBuffer = new Buffer;
+    pBuffer->s_data.resize(m_bufferSize);
+    pBuffer->s_requestMsg.s_capacity = m_bufferSize;
+    pBuffer->s_requestMsg.s_epoch    = 0;
+    pBuffer->s_requestMsg.s_flags    =
+        (m_readers.size() > 1) ? MPIREQUEST_READERS : 0;
+    pBuffer->s_held     = false;
+    pBuffer->s_arrived  = false;
+    pBuffer->s_request  = MPI_REQUEST_NULL;
+    pBuffer->s_reply    = MPI_REQUEST_NULL;
+    return pBuffer;
+}
+/**
+ * newBlock
+ *    Allocate storage for a block that won't be in one of our buffers
+ *    and charge it to the budget.  The block's needed now so the budget
+ *    can't refuse it.
+ * @param nBytes - its size.
+ * @return char* - the storage.
+ */
+char*
+CMPIDataGetter::newBlock(size_t nBytes)
+{
+    char* pBlock = new char[nBytes];
+    CMPIMemoryBudget::getInstance()->charge(CMPIMemoryBudget::prefetch, nBytes);
+    return pBlock;
+}
+/**
+ * startRequest
+ *    Post the reply receive and send the request of a buffer SpecTcl
+ *    isn't holding.  The receive is started first so the reply
+ *    never has to be buffered as unexpected.  If SpecTcl is holding all
+ *    buffers, another one is made unless this is a prefetch and the
+ *    memory budget has no room for it.  The request tells the distributor
+ *    which configuration epoch we're at.  It goes to the running reader
+ *    that advertised the shortest queue; the others' estimates age.
+ * @param prefetch - the block isn't wanted yet.
+ */
+void
+CMPIDataGetter::startRequest(bool prefetch)
+{
+    for (size_t i = 0; i < m_buffers.size(); i++) {
+        if (!m_buffers[i]->s_held) {
+            m_inFlight = i;
+            break;
+        }
+    }
+    if (m_inFlight < 0) {
+        CMPIMemoryBudget* pBudget = CMPIMemoryBudget::getInstance();
+        if (!prefetch) {
+            pBudget->charge(CMPIMemoryBudget::prefetch, m_bufferSize);
+        } else if (!pBudget->tryReserve(CMPIMemoryBudget::prefetch, m_bufferSize)) {
+            return;                         // read will ask when it's wanted.
+        }
+        m_buffers.push_back(newBuffer());
+        m_inFlight = m_buffers.size() - 1;
+    }
+    size_t best = m_readers.size();
+    for (size_t i = 0; i < m_readers.size(); i++) {
+        const Reader& reader(m_readers[i]);
+        if (reader.s_ended) continue;
+        if ((best == m_readers.size()) || (reader.s_depth < m_readers[best].s_depth)
+            || ((reader.s_depth == m_readers[best].s_depth)
+                && (reader.s_lastAsked < m_readers[best].s_lastAsked))) {
+            best = i;
+        }
+    }
+    for (size_t i = 0; i < m_readers.size(); i++) {
+        if ((i != best) && m_readers[i].s_depth) m_readers[i].s_depth--;
+    }
+    m_readers[best].s_lastAsked = ++m_requests;
+    m_inFlightReader            = best;
+    
+    Buffer* pBuffer = m_buffers[m_inFlight];
+    pBuffer->s_requestMsg.s_epoch = CMPIConfigJournal::getInstance()->epoch();
+    int     rank    = m_readers[best].s_rank;
+    MPI_Irecv(
+        pBuffer->s_data.data(), m_bufferSize, MPI_CHAR, rank, MPI_TAG_BINDATA,
+        blockComm, &pBuffer->s_reply
+    );
+    MPI_Isend(
+        &pBuffer->s_requestMsg, sizeof(pBuffer->s_requestMsg), MPI_CHAR, rank,
+        MPI_TAG_BINDATA, blockComm, &pBuffer->s_request
+    );
+}
+/**
+ * post
+ *    Push mode - start the receive of a buffer and remember it's the
+ *    last one that will match.
+ * @param buffer - index of the buffer.
+ */
+void
+CMPIDataGetter::post(size_t buffer)
+{
+    MPI_Irecv(
+        m_buffers[buffer]->s_data.data(), m_bufferSize, MPI_CHAR,
+        m_readers[0].s_rank, MPI_TAG_BINDATA, blockComm, &m_buffers[buffer]->s_reply
+    );
+    m_posted.push_back(buffer);
+}
+/**
+ * othersRunning
+ *    A reader has ended the run.
+ * @param reader - index of the reader.
+ * @return bool - true if other readers still have data.  If not, all
+ *                are marked running again for the next run.
+ */
+bool
+CMPIDataGetter::othersRunning(size_t reader)
+{
+    m_readers[reader].s_ended = true;
+    for (size_t i = 0; i < m_readers.size(); i++) {
+        if (!m_readers[i].s_ended) return true;
+    }
+    for (size_t i = 0; i < m_readers.size(); i++) {
+        m_readers[i].s_ended = false;
+        m_readers[i].s_depth = 0;
+    }
+    return false;
+}
+/**
+ * addParticipants
+ *    Add the workers a reader's end of data says took part in the run.
+ *    A zero length end says they all did.
+ * @param pEnd   - the end.
+ * @param nBytes - its size.
+ */
+void
+CMPIDataGetter::addParticipants(const char* pEnd, int nBytes)
+{
+    int nRanks;
+    MPI_Comm_size(blockComm, &nRanks);
+    if (nBytes < static_cast<int>(sizeof(MPIBlockHeader))) {
+        for (int rank = 1; rank < nRanks; rank++) {
+            m_participants.insert(rank);
+        }
+        return;
+    }
+    const uint8_t* pBits = reinterpret_cast<const uint8_t*>(pEnd + sizeof(MPIBlockHeader));
+    size_t         nBits = 8*(nBytes - sizeof(MPIBlockHeader));
+    for (int rank = 0; (rank < nRanks) && (size_t(rank) < nBits); rank++) {
+        if (pBits[rank/8] & (1 << (rank % 8))) {
+            m_participants.insert(rank);
+        }
+    }
+}
+/**
+ * waitReply
+ *    Wait for a buffer's receive unless takeCuts already saw it complete.
+ * @param buffer      - index of the buffer.
+ * @param[out] status - the receive's status.
+ */
+void
+CMPIDataGetter::waitReply(size_t buffer, MPI_Status& status)
+{
+    Buffer* pBuffer = m_buffers[buffer];
+    if (pBuffer->s_arrived) {
+        status             = pBuffer->s_status;
+        pBuffer->s_arrived = false;
+    } else {
+        MPI_Wait(&pBuffer->s_reply, &status);
+    }
+}
+/**
+ * takeCut
+ *    If what a buffer got is a snapshot cut message, take the cut and
+ *    receive into the buffer again: in push mode it's posted last, in
+ *    pull mode it waits for the reply to the same request.
+ * @param buffer - index of the buffer (not in m_posted).
+ * @param reader - index of the reader it was received from.
+ * @param nBytes - bytes received.
+ * @return bool - true if it was a cut.
+ */
+bool
+CMPIDataGetter::takeCut(size_t buffer, size_t reader, int nBytes)
+{
+    Buffer*        pBuffer = m_buffers[buffer];
+    MPIBlockHeader header;
+    if ((m_readers[reader].s_rank != 0)
+        || (nBytes != static_cast<int>(sizeof(header)))) return false;
+    memcpy(&header, pBuffer->s_data.data(), sizeof(header));
+    if (!(header.s_flags & MPIBLOCK_CUT)) return false;
+    
+    CMPISnapshots::getInstance()->cut(m_interp, header.s_snapshot);
+    if (m_push) {
+        post(buffer);
+    } else {
+        MPI_Irecv(
+            pBuffer->s_data.data(), m_bufferSize, MPI_CHAR, 0, MPI_TAG_BINDATA,
+            blockComm, &pBuffer->s_reply
+        );
+        m_inFlight       = buffer;
+        m_inFlightReader = reader;
+    }
+    return true;
+}
+/**
+ * takeCuts
+ *    While read isn't being called - take the cut messages that have
+ *    landed in the receive rank 0's messages match next (the oldest
+ *    posted buffer in push mode, the block in flight in pull mode).  We
+ *    stop at anything else; read takes it as usual.
+ * @return bool - false if no receive from rank 0 is posted, so cuts
+ *                wait unmatched (see takeCutMessages).
+ */
+bool
+CMPIDataGetter::takeCuts()
+{
+    for (;;) {
+        size_t nBuffer;
+        size_t reader = 0;
+        if (m_push) {
+            if (m_readers[0].s_rank != 0) return false;
+            if (m_posted.empty()) return true;
+            nBuffer = m_posted.front();
+        } else {
+            if ((m_inFlight < 0) || (m_readers[m_inFlightReader].s_rank != 0)) {
+                return false;
+            }
+            nBuffer = m_inFlight;
+            reader  = m_inFlightReader;
+        }
+        Buffer* pBuffer = m_buffers[nBuffer];
+        int     arrived;
+        int     nBytes;
+        if (pBuffer->s_arrived) return true;
+        MPI_Test(&pBuffer->s_reply, &arrived, &pBuffer->s_status);
+        if (!arrived) return true;
+        
+        MPI_Get_count(&pBuffer->s_status, MPI_CHAR, &nBytes);
+        if (m_push) m_posted.pop_front();
+        if (!takeCut(nBuffer, reader, nBytes)) {
+            if (m_push) m_posted.push_front(nBuffer);
+            pBuffer->s_arrived = true;
+            return true;
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
 
 /**
- * @class CMPIDataGetter
- *     Gets data from an MPI data source (usually rank 0).
- *     This uses a pull protocol:
- *     -  We send a request for data to some rank with MPI_TAG_BIN_DATA.
- *     -  That rank always replies with something.  The reply is a zero length
- *        block of data if there's no more data to give.
+ * @class CMPIDistributor
+ *    Distributes data to  parallel workers.
+ *    - Waits for a data request.
+ *    - Remebers the requestor in the set of requestors.
+ *    - If there's more data send it to the requestor otherwise,
+ *      send end of data indicators to requestors until none are left
+ *    - Blocks are compressed as the compression policy dictates.
+ *    - Blocks bigger than the chunk size or the requestor's buffer
+ *      are sent as chunks.
+ *
+ *    - Blocks are tagged with a sequence number and the configuration
+ *      epoch and carry the configuration journal entries the requestor
+ *      has not yet applied.
  *
+ *    Requests are received by a receive that is posted again as soon as
+ *    each request is taken so there's almost always one posted.
+ *    Whenever one is wanted, all that have arrived are taken into a
+ *    queue and served in order; each block says how many are still
+ *    queued so that workers with several readers can go to the least
+ *    loaded one.  Such readers are told the whole worker pool (-clients)
+ *    since a worker may not ask them for anything until they've ended
+ *    the run, and only rank 0 sends configuration journal entries.
+ *
+ *    In push mode (roundRobin or weighted) there are no requests.  When
+ *    the first block is to be sent we wait for an MPIPushHello from
+ *    every worker: the pool (-clients) if there is one, otherwise every
+ *    other rank.  Blocks are then sent to the workers in a fixed
+ *    rotation, smooth weighted round robin by the weights in the hellos
+ *    (all one for roundRobin), so which worker gets which block depends
+ *    only on the block's sequence.  Sends are synchronous mode and
+ *    nonblocking with at most as many in flight to a worker as it has
+ *    buffers posted; a send completing means its buffer was matched.
+ *    The block is copied to one of the worker's send slots since SpecTcl
+ *    reuses it once we return.  A worker's epoch is taken to be that of
+ *    the last block we sent it.  Send slots are charged to the
+ *    distributor account of the memory budget; when it has no room,
+ *    slots whose sends are done are emptied, then we wait for sends in
+ *    flight, before the new block is copied.
+ *
+ *    With a lease time (pull mode only) a copy of each block is kept
+ *    until we know it was analyzed.  Workers only ask for the next block
+ *    once they have the one they asked for before, so a request means
+ *    all but the last block we sent that worker are done.  A worker that
+ *    has blocks and hasn't asked again within the lease time of the last
+ *    one is taken to have died or hung: it's dropped from the clients,
+ *    its blocks go to the next requests and any request it makes later
+ *    gets an end of data.  blockComm returns errors rather than aborting
+ *    on this rank so a failed send also drops the worker.  A dropped
+ *    worker sees it's not in its end's participants; see mpisink -lease
+ *    for what happens to its counts.
+ *
+ *    A hung worker may never take a block that needs a rendezvous so,
+ *    with leases, blocks are copied into a message and sent without
+ *    waiting; the copy is kept until the send completes.  Chunked blocks
+ *    are still sent by waiting for each chunk.  At the end of a run the
+ *    ends are held until all the clients have asked so that blocks of a
+ *    worker that fails meanwhile can still be re-issued.  The copies are
+ *    charged to the distributor account of the budget.
+ *
+ *    Rank 0's distributor announces snapshot cuts: it sends a header
+ *    with MPIBLOCK_CUT to every other rank, through the send slots for
+ *    push workers so it stays in sequence with their blocks.  Other
+ *    ranks' distributors take the cut messages their request receive
+ *    matches.
  */
-class CMPIDataGetter : public CDataGetter
+class CMPIDistributor : public CDataDistributor, public CMPISnapshots::Announcer
 {
+public:
+    typedef enum _Distribution {
+        pull, roundRobin, weighted
+    } Distribution;
 private:
-    int m_sourceRank;
+    struct Worker {
+        int                             s_rank;
+        MPIBlockRequest                 s_state;   // Capacity and epoch.
+        int64_t                         s_weight;
+        int64_t                         s_current; // Weighted RR credit.
+        std::vector<std::vector<char> > s_slots;
+        std::vector<size_t>             s_reserved; // Budget each slot holds.
+        std::vector<MPI_Request>        s_sends;
+        size_t                          s_nextSlot;
+    };
+    struct Lease {
+        std::deque<std::vector<char> >  s_blocks;   // Not known analyzed.
+        double                          s_deadline; // 0 while we hold a request.
+    };
+    struct Sending {
+        int                             s_rank;
+        MPI_Request                     s_request;
+        std::vector<char>*              s_pMessage;
+        double                          s_start;
+    };
+    std::set<int>   m_clientRanks;
+    std::set<int>   m_pool;              // Clients that must get ends/push workers.
+    CMPICompressor        m_compressor;
+    CMPICompressionPolicy m_compression;
+    std::vector<char>     m_compressed;
+    std::vector<char>     m_staging;     // Journal + payload when chunked.
+    std::vector<char>     m_journal;
+    union {
+        MPIBlockRequest   s_request;
+        MPIBlockHeader    s_cut;            // From rank 0 when we're not it.
+    }                     m_received;
+    MPI_Request           m_requestReceive;
+    std::deque<std::pair<int, MPIBlockRequest> > m_queued;
+    uint32_t              m_queueDepth;     // Left when the last was taken.
+    bool                  m_journaling;
+    bool                  m_severalReaders; // A requestor pulls from others too.
+    uint64_t              m_sequence;
+    Distribution          m_distribution;
+    std::vector<Worker>   m_workers;
+    std::map<int, size_t> m_workerIndex;    // Rank -> m_workers index.
+    double                m_leaseTime;      // Seconds, 0 to not lease blocks.
+    std::map<int, Lease>  m_leases;
+    std::deque<std::vector<char> > m_reissue;   // Blocks of failed workers.
+    std::set<int>         m_failed;
+    std::list<Sending>    m_sending;        // Leased sends in flight.
+    std::vector<uint8_t>  m_participants;   // Bitmap sent with ends.
+    MPI_Errhandler        m_errors;         // blockComm's own, put back after.
+
+    static CMPIDistributor* m_pCurrent;
 public:
-    CMPIDataGetter(int rank);
+    CMPIDistributor(
+        CMPICompressionPolicy::Mode compression, Distribution distribution = pull,
+        const std::set<int>& pool = std::set<int>(), double lease = 0.0
+    );
+    virtual ~CMPIDistributor();
     
-    virtual std::pair<size_t, void*> read();
-    virtual void free(std::pair<size_t, void*>& data);
+    virtual void handleData(std::pair<size_t, void*>& info);
+    virtual void announce(uint32_t count);
+    
+    void takeCuts();
+    static CMPIDistributor* current() { return m_pCurrent; }
+private:
+    int  nextRequest(MPIBlockRequest& request);
+    void takeRequests(bool wait);
+    void postRequestReceive();
+    void trimJournal();
+    void runDownConsumers();
+    void endFileToConsumer(int rank);
+    void endMessage(std::vector<char>& message);
+    void setParticipants(const std::set<int>& ranks);
+    void sendBlock(
+        int rank, std::pair<size_t, void*>& info, const MPIBlockRequest& request
+    );
+    void sendMessage(
+        int rank, const MPIBlockHeader& header, const void* pPayload,
+        size_t nBytes
+    );
+    void   meetWorkers();
+    size_t nextWorker();
+    void   pushMessage(
+        Worker& worker, const MPIBlockHeader* pHeader, size_t journalBytes,
+        const void* pPayload, size_t nBytes
+    );
+    void   drain(Worker& worker);
+    void   reserveSlot(Worker& worker, size_t slot, size_t nBytes);
+    bool   emptySlot(const std::vector<char>* pKeep);
+    void   sendLeased(
+        int rank, std::pair<size_t, void*>& info, const MPIBlockRequest& request
+    );
+    void   reissue(int rank, const MPIBlockRequest& request);
+    void   renew(Lease& lease);
+    bool   expireLeases();
+    void   failWorker(int rank);
+    void   endLeases();
+    void   postMessage(
+        int rank, MPI_Datatype message, size_t nBytes
+    );
+    void   reapSends();
+public:
+    static Distribution distributionFromString(const std::string& mode);
 };
 
-// Implementation:
+// CMPIDistributor implementation.
+
+CMPIDistributor* CMPIDistributor::m_pCurrent(nullptr);
 
 /**
  * constructor
- *   @param rank - the MPI rank of the process from which we get data.
+ *   @param compression  - Compression mode for the blocks we send.
+ *   @param distribution - How blocks are given to workers.
+ *   @param pool         - Ranks that get ends of data whether or not they
+ *                         asked us for anything (pull mode), the workers
+ *                         (push mode; empty for all other ranks).
+ *   @param lease        - Seconds a worker has to ask again after being
+ *                         sent a block (pull mode), 0 to not lease blocks.
  */
-CMPIDataGetter::CMPIDataGetter(int rank) :
-    m_sourceRank(rank)
-{}
+CMPIDistributor::CMPIDistributor(
+    CMPICompressionPolicy::Mode compression, Distribution distribution,
+    const std::set<int>& pool, double lease
+) :
+    m_pool(pool), m_compression(compression), m_requestReceive(MPI_REQUEST_NULL),
+    m_queueDepth(0), m_severalReaders(false), m_sequence(0),
+    m_distribution(distribution),
+    m_leaseTime(m_distribution == pull ? lease : 0.0), m_errors(MPI_ERRHANDLER_NULL)
+{
+    int rank;
+    MPI_Comm_rank(blockComm, &rank);
+    m_journaling = (rank == 0);
+
+    if (m_distribution == pull) {
+        postRequestReceive();
+    }
+    if (m_leaseTime > 0) {
+        MPI_Comm_get_errhandler(blockComm, &m_errors);
+        MPI_Comm_set_errhandler(blockComm, MPI_ERRORS_RETURN);
+    }
+    if (m_journaling) {
+        CMPISnapshots::getInstance()->setAnnouncer(this);
+    }
+    m_pCurrent = this;
+}
+/**
+ * destructor
+ *    Stop announcing cuts and cancel the posted request receive.
+ *    In push mode, let the sends in flight finish and give back the
+ *    slots' budget.  Leased blocks give theirs back too and blockComm
+ *    gets its error handler back.  Leased sends to failed workers may
+ *    never complete; they're cancelled and their messages left to MPI.
+ */
+CMPIDistributor::~CMPIDistributor()
+{
+    if (CMPISnapshots::getInstance()->announcer() == this) {
+        CMPISnapshots::getInstance()->setAnnouncer(nullptr);
+    }
+    if (m_pCurrent == this) m_pCurrent = nullptr;
+    if (m_requestReceive != MPI_REQUEST_NULL) {
+        MPI_Cancel(&m_requestReceive);
+        MPI_Wait(&m_requestReceive, MPI_STATUS_IGNORE);
+    }
+    for (size_t i = 0; i < m_workers.size(); i++) {
+        drain(m_workers[i]);
+        for (size_t s = 0; s < m_workers[i].s_reserved.size(); s++) {
+            CMPIMemoryBudget::getInstance()->release(
+                CMPIMemoryBudget::distributor, m_workers[i].s_reserved[s]
+            );
+        }
+    }
+    for (auto p = m_sending.begin(); p != m_sending.end(); p++) {
+        CMPIMemoryBudget::getInstance()->release(
+            CMPIMemoryBudget::distributor, p->s_pMessage->size()
+        );
+        if (m_failed.count(p->s_rank)) {
+            MPI_Cancel(&p->s_request);
+            MPI_Request_free(&p->s_request);
+        } else {
+            MPI_Wait(&p->s_request, MPI_STATUS_IGNORE);
+            delete p->s_pMessage;
+        }
+    }
+    endLeases();
+    if (m_errors != MPI_ERRHANDLER_NULL) {
+        MPI_Comm_set_errhandler(blockComm, m_errors);
+        MPI_Errhandler_free(&m_errors);
+    }
+}
+
+/**
+ * handleData
+ *    Distribute the data we've been given to the next requestor or,
+ *    in the case of an end data indicator to all currently known consumers.
+ *    When resuming from a checkpoint, data before its position are
+ *    discarded.  A checkpoint that's due is started first, so its cut
+ *    is before these data.
+ *
+ * @param info - size and pointer to the data.
+ * @throw std::string - checkpointing or resuming while workers pull
+ *                      from several readers.
+ */
+void
+CMPIDistributor::handleData(std::pair<size_t, void*>& info)
+{
+    CMPIRunReducer* pRunReducer = CMPIRunReducer::getInstance();
+    pRunReducer->progress();
+    CMPISnapshots::getInstance()->progress();
+    CMPICheckpoints* pCheckpoints = CMPICheckpoints::getInstance();
+    pCheckpoints->poll();
+    
+    // A checkpoint only has our position, not those of other readers,
+    // so checkpoints are refused if workers pull from several.  Wait for
+    // the first request to find out before anything is counted or
+    // discarded.
+    if (info.first && (m_distribution == pull)
+        && (pCheckpoints->recording() || pCheckpoints->resuming())) {
+        if (m_queued.empty() && m_clientRanks.empty()) {
+            takeRequests(true);
+        }
+        if (m_severalReaders) {
+            pCheckpoints->stop();
+            pCheckpoints->rewind();
+            throw std::string(
+                "mpisink -checkpoint and -resume can't be used when workers "
+                "pull from several readers (mpisource -readers)"
+            );
+        }
+    }
+    
+    // If the data are an end rundown the consumers and, if reducing in
+    // the background, start reducing the run's spectra.  The next run
+    // can be distributed as soon as we return.
+    if(info.first == 0) {
+        if (!pCheckpoints->end()) return;
+        runDownConsumers();
+        pRunReducer->retire();
+    } else if (!pCheckpoints->block(info.first)) {
+        return;
+    } else if (m_distribution != pull) {
+        if (m_workers.empty()) {
+            meetWorkers();
+        }
+        Worker& worker(m_workers[nextWorker()]);
+        sendBlock(worker.s_rank, info, worker.s_state);
+        worker.s_state.s_epoch = CMPIConfigJournal::getInstance()->epoch();
+        CMPIConfigJournal::getInstance()->acknowledge(
+            worker.s_rank, worker.s_state.s_epoch
+        );
+        trimJournal();
+    } else {
+        // Get the next request; blocks of failed workers go first.
+        
+        MPIBlockRequest request;
+        int to;
+        do {
+            to = nextRequest(request);
+            if ((to >= 0) && !m_reissue.empty()) {
+                reissue(to, request);
+                to = -1;
+            }
+        } while (to < 0);
+        
+        m_clientRanks.insert(to);
+        sendLeased(to, info, request);
+        trimJournal();
+    }
+}
+/**
+ * nextRequest
+ *    Take the oldest queued data request, waiting for one if none are
+ *    queued.  While blocks are leased we poll instead, and look for
+ *    leases that have run out even when requests are queued since the
+ *    other workers may keep us busy.
+ *
+ * @param[out] request - The request.
+ * @return int - rank of the requestor, -1 if a worker failed while we
+ *               waited so its blocks are waiting to be re-issued.
+ */
+int
+CMPIDistributor::nextRequest(MPIBlockRequest& request)
+{
+    takeRequests(false);
+    if ((m_leaseTime > 0) && expireLeases()) return -1;
+    for (unsigned idle = 0; m_queued.empty(); idle++) {
+        if (m_leaseTime <= 0) {
+            takeRequests(true);
+            break;
+        }
+        if (expireLeases()) return -1;
+        if (idle < 1000) {
+            sched_yield();
+        } else {
+            usleep(100);
+        }
+        takeRequests(false);
+    }
+    int rank = m_queued.front().first;
+    request  = m_queued.front().second;
+    m_queued.pop_front();
+    m_queueDepth = m_queued.size();
+    
+    return rank;
+}
+/**
+ * postRequestReceive
+ *    Post the receive of the next block request.
+ */
+void
+CMPIDistributor::postRequestReceive()
+{
+    MPI_Irecv(
+        &m_received, sizeof(m_received), MPI_CHAR, MPI_ANY_SOURCE, MPI_TAG_BINDATA,
+        blockComm, &m_requestReceive
+    );
+}
+/**
+ * trimJournal
+ *    Drop the journal entries all workers have.  They're the pool (all
+ *    other ranks if there isn't one) or, in push mode, the ranks we met,
+ *    less any that failed.
+ */
+void
+CMPIDistributor::trimJournal()
+{
+    if (!m_journaling) return;
+    std::set<int> workers;
+    if (m_distribution != pull) {
+        for (size_t i = 0; i < m_workers.size(); i++) {
+            workers.insert(m_workers[i].s_rank);
+        }
+    } else if (!m_pool.empty()) {
+        workers = m_pool;
+    } else {
+        int me, nRanks;
+        MPI_Comm_rank(blockComm, &me);
+        MPI_Comm_size(blockComm, &nRanks);
+        for (int rank = 0; rank < nRanks; rank++) {
+            if (rank != me) workers.insert(rank);
+        }
+    }
+    for (auto p = m_failed.begin(); p != m_failed.end(); p++) {
+        workers.erase(*p);
+    }
+    CMPIConfigJournal::getInstance()->trim(workers);
+}
+/**
+ * takeRequests
+ *    Queue the requests that have arrived, posting the receive again
+ *    after each.  Empty requests are treated as being able to
+ *    take anything and being up to date with the configuration.
+ *    A request renews the requestor's lease; failed workers are sent an
+ *    end instead.  Leased sends that are done are reaped first.  Cut
+ *    messages from rank 0 are taken rather than queued.
+ *
+ * @param wait - if true wait for the first one.
+ */
+void
+CMPIDistributor::takeRequests(bool wait)
+{
+    reapSends();
+    for (;;) {
+        MPI_Status stat;
+        int        nBytes;
+        int        arrived = 1;
+        if (wait) {
+            MPI_Wait(&m_requestReceive, &stat);
+            wait = false;
+        } else {
+            MPI_Test(&m_requestReceive, &arrived, &stat);
+        }
+        if (!arrived) break;
+        
+        std::pair<int, MPIBlockRequest> queued;
+        queued.first = stat.MPI_SOURCE;
+        MPI_Get_count(&stat, MPI_CHAR, &nBytes);
+        if ((queued.first == 0) && !m_journaling
+            && (nBytes == sizeof(MPIBlockHeader))) {
+            uint32_t count = m_received.s_cut.s_snapshot;
+            postRequestReceive();
+            CMPISnapshots::getInstance()->cut(*pPackageInterp, count);
+            continue;
+        }
+        if (nBytes == sizeof(MPIBlockRequest)) {
+            queued.second = m_received.s_request;
+        } else {
+            queued.second.s_capacity = UINT64_MAX;
+            queued.second.s_epoch    = CMPIConfigJournal::getInstance()->epoch();
+            queued.second.s_flags    = 0;
+        }
+        if (queued.second.s_flags & MPIREQUEST_READERS) {
+            m_severalReaders = true;
+        }
+        postRequestReceive();
+        if (m_failed.count(queued.first)) {
+            endFileToConsumer(queued.first);
+            continue;
+        }
+        if (m_journaling) {
+            CMPIConfigJournal::getInstance()->acknowledge(
+                queued.first, queued.second.s_epoch
+            );
+        }
+        auto lease = m_leases.find(queued.first);
+        if (lease != m_leases.end()) {
+            renew(lease->second);
+        }
+        m_queued.push_back(queued);
+    }
+}
+/**
+ * sendBlock
+ *    Send a block of data to a consumer, compressing it if the
+ *    compression policy thinks that's a good idea.  If what we'd send
+ *    won't fit in a chunk or the consumer's receive buffer, the
+ *    uncompressed block is sent in chunks.
+ *
+ *  @param rank - the consumer.
+ *  @param info - size and pointer to the data.
+ *  @param request - the consumer's request.
+ */
+void
+CMPIDistributor::sendBlock(
+    int rank, std::pair<size_t, void*>& info, const MPIBlockRequest& request
+)
+{
+    CMPIConfigJournal* pJournal = CMPIConfigJournal::getInstance();
+    pJournal->sync();
+    MPIBlockHeader header;
+    header.s_flags        = 0;
+    header.s_epoch        = pJournal->epoch();
+    header.s_size         = info.first;
+    header.s_sequence     = m_sequence++;
+    header.s_journalBytes = 0;
+    header.s_snapshot     = CMPISnapshots::getInstance()->count();
+    header.s_queueDepth   = m_queueDepth;
+    header.s_unused       = 0;
+    if (m_journaling && (request.s_epoch < header.s_epoch)) {
+        header.s_journalBytes = pJournal->entriesSince(request.s_epoch, m_journal);
+    }
+    
+    uint64_t limit = std::min<uint64_t>(request.s_capacity, MPITcl_getChunkSize());
+    if (sizeof(header) + header.s_journalBytes + sizeof(MPIChunkHeader) > limit) {
+        // The journal alone won't fit the request buffer.  Ship it as the
+        // head of a chunked payload; this should only happen after a big
+        // reconfiguration so the copy doesn't matter.
+        
+        m_staging.resize(header.s_journalBytes + info.first);
+        memcpy(m_staging.data(), m_journal.data(), header.s_journalBytes);
+        memcpy(m_staging.data() + header.s_journalBytes, info.second, info.first);
+        MPIChunkHeader chunking;
+        chunking.s_totalSize = m_staging.size();
+        chunking.s_chunkSize = MPITcl_getChunkSize();
+        chunking.s_tag       = MPI_TAG_BINDATA;
+        header.s_flags |= MPIBLOCK_CHUNKED | MPIBLOCK_JOURNALINCHUNKS;
+        sendMessage(rank, header, &chunking, sizeof(chunking));
+        MPITcl_sendChunks(m_staging.data(), chunking, rank, blockComm);
+        m_staging.clear();
+        return;
+    }
+    limit -= header.s_journalBytes;
+    
+    if (m_compression.shouldCompress(info.first)) {
+        m_compressed.resize(CMPICompressor::bound(info.first));
+        double start = MPI_Wtime();
+        size_t zBytes = m_compressor.compress(
+            info.second, info.first, m_compressed.data(), m_compressed.size()
+        );
+        if (m_compression.compressed(info.first, zBytes, MPI_Wtime() - start)
+            && (sizeof(header) + zBytes <= limit)) {
+            header.s_flags |= MPIBLOCK_COMPRESSED;
+            sendMessage(rank, header, m_compressed.data(), zBytes);
+            return;
+        }
+    }
+    if (sizeof(header) + info.first > limit) {
+        MPIChunkHeader chunking;
+        chunking.s_totalSize = info.first;
+        chunking.s_chunkSize = MPITcl_getChunkSize();
+        chunking.s_tag       = MPI_TAG_BINDATA;
+        header.s_flags |= MPIBLOCK_CHUNKED;
+        sendMessage(rank, header, &chunking, sizeof(chunking));
+        MPITcl_sendChunks(info.second, chunking, rank, blockComm);
+        return;
+    }
+    sendMessage(rank, header, info.second, info.first);
+}
+/**
+ * sendMessage
+ *    Send a header, any journal entries and payload as a single message
+ *    without copying them together.  An hindexed datatype describes
+ *    where the pieces are.
+ *    The time needed to send is fed back to the compression policy.
+ *    In push mode the pieces are handed to pushMessage instead, with
+ *    leases they're posted by postMessage.
+ *
+ * @param rank    - receiver.
+ * @param header  - block header.
+ * @param pPayload - the payload.
+ * @param nBytes  - number of payload bytes.
+ */
+void
+CMPIDistributor::sendMessage(
+    int rank, const MPIBlockHeader& header, const void* pPayload, size_t nBytes
+)
+{
+    size_t       journalBytes =
+        (header.s_flags & MPIBLOCK_JOURNALINCHUNKS) ? 0 : header.s_journalBytes;
+    if (m_distribution != pull) {
+        pushMessage(
+            m_workers[m_workerIndex[rank]], &header, journalBytes, pPayload, nBytes
+        );
+        return;
+    }
+    int          lengths[3] = {
+        static_cast<int>(sizeof(header)),
+        static_cast<int>(journalBytes), static_cast<int>(nBytes)
+    };
+    MPI_Aint     displacements[3];
+    MPI_Datatype message;
+    MPI_Get_address(&header, &displacements[0]);
+    MPI_Get_address(m_journal.data(), &displacements[1]);
+    MPI_Get_address(pPayload, &displacements[2]);
+    MPI_Type_create_hindexed(3, lengths, displacements, MPI_CHAR, &message);
+    MPI_Type_commit(&message);
+    
+    if (m_leaseTime > 0) {
+        postMessage(rank, message, sizeof(header) + journalBytes + nBytes);
+        MPI_Type_free(&message);
+        return;
+    }
+    double start = MPI_Wtime();
+    if (MPI_Send(MPI_BOTTOM, 1, message, rank, MPI_TAG_BINDATA, blockComm)
+        == MPI_SUCCESS) {
+        m_compression.sent(
+            sizeof(header) + journalBytes + nBytes, MPI_Wtime() - start
+        );
+    } else {
+        failWorker(rank);
+    }
+    
+    MPI_Type_free(&message);
+}
+/**
+ * postMessage
+ *    Copy a message to a buffer of its own and start sending it.  The
+ *    buffer is charged to the distributor account until reapSends sees
+ *    the send complete.
+ *
+ * @param rank    - receiver.
+ * @param message - datatype describing the pieces from MPI_BOTTOM.
+ * @param nBytes  - message size.
+ */
+void
+CMPIDistributor::postMessage(int rank, MPI_Datatype message, size_t nBytes)
+{
+    Sending sending;
+    sending.s_rank     = rank;
+    sending.s_pMessage = new std::vector<char>(nBytes);
+    sending.s_start    = MPI_Wtime();
+    int position = 0;
+    MPI_Pack(
+        MPI_BOTTOM, 1, message, sending.s_pMessage->data(), nBytes, &position,
+        blockComm
+    );
+    if (MPI_Isend(
+            sending.s_pMessage->data(), nBytes, MPI_PACKED, rank,
+            MPI_TAG_BINDATA, blockComm, &sending.s_request
+        ) != MPI_SUCCESS) {
+        delete sending.s_pMessage;
+        failWorker(rank);
+        return;
+    }
+    CMPIMemoryBudget::getInstance()->charge(CMPIMemoryBudget::distributor, nBytes);
+    m_sending.push_back(sending);
+}
+/**
+ * reapSends
+ *    Free the messages of leased sends that have completed, feeding the
+ *    time they took back to the compression policy.  One that failed
+ *    fails its worker.
+ */
+void
+CMPIDistributor::reapSends()
+{
+    auto p = m_sending.begin();
+    while (p != m_sending.end()) {
+        int done;
+        int status = MPI_Test(&p->s_request, &done, MPI_STATUS_IGNORE);
+        if ((status == MPI_SUCCESS) && !done) {
+            p++;
+            continue;
+        }
+        size_t nBytes = p->s_pMessage->size();
+        if (status == MPI_SUCCESS) {
+            m_compression.sent(nBytes, MPI_Wtime() - p->s_start);
+        } else if (!m_failed.count(p->s_rank)) {
+            failWorker(p->s_rank);
+        }
+        CMPIMemoryBudget::getInstance()->release(CMPIMemoryBudget::distributor, nBytes);
+        delete p->s_pMessage;
+        p = m_sending.erase(p);
+    }
+}
+/**
+ * runDownConsumers
+ *     Send end datas to all known consumers and the pool.  Journal
+ *     entries are not sent with the ends, workers pick them up with the
+ *     next run's first block.  The ends do carry the snapshot count.
+ *     With leases, the requests are held until every client has asked
+ *     and re-issued blocks go to held requests.  If every client has
+ *     failed, blocks still to be re-issued are lost.
+ */
+void
+CMPIDistributor::runDownConsumers()
+{
+    
+    MPIBlockRequest request;
 
+    if (m_distribution != pull) {
+        std::set<int> workers;
+        for (size_t i = 0; i < m_workers.size(); i++) {
+            workers.insert(m_workers[i].s_rank);
+        }
+        setParticipants(workers);
+        for (size_t i = 0; i < m_workers.size(); i++) {
+            pushMessage(m_workers[i], nullptr, 0, nullptr, 0);
+        }
+        for (size_t i = 0; i < m_workers.size(); i++) {
+            drain(m_workers[i]);
+            m_workers[i].s_current = 0;      // Same rotation next run.
+        }
+    } else {
+        m_clientRanks.insert(m_pool.begin(), m_pool.end());
+    }
+    if (m_leaseTime > 0) {
+        std::map<int, MPIBlockRequest> held;
+        while (!m_reissue.empty() || (held.size() < m_clientRanks.size())) {
+            if (!m_reissue.empty() && !held.empty()) {
+                std::pair<int, MPIBlockRequest> to = *held.begin();
+                held.erase(held.begin());
+                reissue(to.first, to.second);
+                continue;
+            }
+            if (m_clientRanks.empty()) {
+                std::cerr << "mpisink: all clients failed, " << m_reissue.size()
+                          << " blocks were not analyzed\n";
+                break;
+            }
+            int rank = nextRequest(request);
+            if (rank >= 0) {
+                m_clientRanks.insert(rank);
+                held[rank] = request;
+            }
+        }
+        setParticipants(m_clientRanks);
+        for (auto p = held.begin(); p != held.end(); p++) {
+            endFileToConsumer(p->first);
+        }
+        endLeases();
+    } else {
+        setParticipants(m_clientRanks);
+    }
+    while (!m_clientRanks.empty()) {
+        endFileToConsumer(nextRequest(request));
+    }
+    m_participants.clear();                  // Ends before the next are drops.
+    m_sequence = 0;                          // Next run starts over.
+}
+/**
+ * endFileToConsumer
+ *    Send and end of file to a consumer.
+ *
+ *    @param rank - the rank of the consumer.
+*/
+void
+CMPIDistributor::endFileToConsumer(int rank)
+{
+    std::vector<char> message;
+    endMessage(message);
+    if ((MPI_Send(message.data(), message.size(), MPI_CHAR, rank, MPI_TAG_BINDATA, blockComm)
+         != MPI_SUCCESS) && !m_failed.count(rank)) {
+        failWorker(rank);
+    }
+    m_clientRanks.erase(rank);
+}
+/**
+ * endMessage
+ *    Build an end of data: a header carrying the snapshot count and the
+ *    participants bitmap.
+ * @param[out] message - the message.
+ */
+void
+CMPIDistributor::endMessage(std::vector<char>& message)
+{
+    MPIBlockHeader header;
+    header.s_flags        = MPIBLOCK_END;
+    header.s_epoch        = CMPIConfigJournal::getInstance()->epoch();
+    header.s_size         = m_participants.size();
+    header.s_sequence     = m_sequence;
+    header.s_journalBytes = 0;
+    header.s_snapshot     = CMPISnapshots::getInstance()->count();
+    header.s_queueDepth   = m_queueDepth;
+    header.s_unused       = 0;
+    message.resize(sizeof(header) + m_participants.size());
+    memcpy(message.data(), &header, sizeof(header));
+    if (!m_participants.empty()) {
+        memcpy(
+            message.data() + sizeof(header), m_participants.data(),
+            m_participants.size()
+        );
+    }
+}
+/**
+ * setParticipants
+ *    Say which workers took part in the run that's being ended: those
+ *    that will get ends at rundown.  Until this is done for a run ends
+ *    (e.g. to failed workers) say they didn't take part.
+ * @param ranks - the workers.
+ */
+void
+CMPIDistributor::setParticipants(const std::set<int>& ranks)
+{
+    int nRanks;
+    MPI_Comm_size(blockComm, &nRanks);
+    m_participants.assign((nRanks + 7)/8, 0);
+    for (auto p = ranks.begin(); p != ranks.end(); p++) {
+        if (!m_failed.count(*p)) {
+            m_participants[*p / 8] |= 1 << (*p % 8);
+        }
+    }
+}
+/**
+ * meetWorkers
+ *    Push mode - collect the hellos of the workers.  These tell us
+ *    how big their receive buffers are, how many they keep posted
+ *    (our window for them) and their weights.
+ */
+void
+CMPIDistributor::meetWorkers()
+{
+    int me, nRanks;
+    MPI_Comm_rank(blockComm, &me);
+    MPI_Comm_size(blockComm, &nRanks);
+    for (int rank = 0; rank < nRanks; rank++) {
+        if ((rank == me) || (!m_pool.empty() && !m_pool.count(rank))) continue;
+        MPIPushHello hello;
+        MPI_Recv(
+            &hello, sizeof(hello), MPI_CHAR, rank, MPI_TAG_BINDATA, blockComm,
+            MPI_STATUS_IGNORE
+        );
+        Worker worker;
+        worker.s_rank              = rank;
+        worker.s_state.s_capacity  = hello.s_capacity;
+        worker.s_state.s_epoch     = hello.s_epoch;
+        worker.s_state.s_flags     = 0;
+        worker.s_weight            =
+            (m_distribution == weighted) ? hello.s_weight : 1;
+        worker.s_current           = 0;
+        worker.s_slots.resize(hello.s_buffers ? hello.s_buffers : 1);
+        worker.s_reserved.resize(worker.s_slots.size(), 0);
+        worker.s_sends.resize(worker.s_slots.size(), MPI_REQUEST_NULL);
+        worker.s_nextSlot          = 0;
+        m_workerIndex[rank]        = m_workers.size();
+        m_workers.push_back(worker);
+        if (m_journaling) {
+            CMPIConfigJournal::getInstance()->acknowledge(rank, hello.s_epoch);
+        }
+    }
+    if (m_workers.empty()) {
+        throw std::string("mpisink -push needs at least one worker rank");
+    }
+}
+/**
+ * nextWorker
+ *    Smooth weighted round robin:  every worker's credit goes up by its
+ *    weight, the one with the most credit (lowest rank on ties) gets the
+ *    block and its credit goes down by the total weight.  With weights
+ *    3,1,1 this gives A B A C A ... rather than A A A B C.
+ * @return size_t - index of the worker to send to.
+ */
+size_t
+CMPIDistributor::nextWorker()
+{
+    int64_t total = 0;
+    size_t  best  = 0;
+    for (size_t i = 0; i < m_workers.size(); i++) {
+        m_workers[i].s_current += m_workers[i].s_weight;
+        total += m_workers[i].s_weight;
+        if (m_workers[i].s_current > m_workers[best].s_current) {
+            best = i;
+        }
+    }
+    m_workers[best].s_current -= total;
+    return best;
+}
+/**
+ * pushMessage
+ *    Push mode - send a message to a worker from its next send slot.  If
+ *    the send last made from that slot hasn't completed, the worker has
+ *    no buffer for this one yet and we wait.
+ *    The wait is as much the worker's analysis time as wire time so it's
+ *    not fed to the compression policy.
+ *
+ * @param worker       - the worker.
+ * @param pHeader      - block header; nullptr for an end of data.
+ * @param journalBytes - bytes of m_journal to send after the header.
+ * @param pPayload     - the payload.
+ * @param nBytes       - payload bytes.
+ */
+void
+CMPIDistributor::pushMessage(
+    Worker& worker, const MPIBlockHeader* pHeader, size_t journalBytes,
+    const void* pPayload, size_t nBytes
+)
+{
+    size_t             slot  = worker.s_nextSlot;
+    std::vector<char>& data(worker.s_slots[slot]);
+    worker.s_nextSlot = (slot + 1) % worker.s_slots.size();
+    
+    MPI_Wait(&worker.s_sends[slot], MPI_STATUS_IGNORE);
+    reserveSlot(
+        worker, slot,
+        sizeof(MPIBlockHeader) + (pHeader ? journalBytes + nBytes : m_participants.size())
+    );
+    if (pHeader) {
+        data.resize(sizeof(MPIBlockHeader) + journalBytes + nBytes);
+        memcpy(data.data(), pHeader, sizeof(MPIBlockHeader));
+        if (journalBytes) {
+            memcpy(data.data() + sizeof(MPIBlockHeader), m_journal.data(), journalBytes);
+        }
+        memcpy(data.data() + sizeof(MPIBlockHeader) + journalBytes, pPayload, nBytes);
+    } else {
+        endMessage(data);
+    }
+    MPI_Issend(
+        data.data(), data.size(), MPI_CHAR, worker.s_rank, MPI_TAG_BINDATA,
+        blockComm, &worker.s_sends[slot]
+    );
+}
+/**
+ * drain
+ *    Wait for all sends in flight to a worker.
+ * @param worker - the worker.
+ */
+void
+CMPIDistributor::drain(Worker& worker)
+{
+    MPI_Waitall(worker.s_sends.size(), worker.s_sends.data(), MPI_STATUSES_IGNORE);
+}
+/**
+ * reserveSlot
+ *    Account for what a send slot will hold.  Its send is done.  If the
+ *    budget has no room, other slots are emptied until it does or there
+ *    are none left to empty, when the memory is taken anyway.
+ * @param worker - the worker.
+ * @param slot   - index of the slot.
+ * @param nBytes - what it will hold.
+ */
+void
+CMPIDistributor::reserveSlot(Worker& worker, size_t slot, size_t nBytes)
+{
+    CMPIMemoryBudget*  pBudget = CMPIMemoryBudget::getInstance();
+    std::vector<char>& data(worker.s_slots[slot]);
+    size_t             bytes   = std::max(nBytes, data.capacity());
+    pBudget->release(CMPIMemoryBudget::distributor, worker.s_reserved[slot]);
+    worker.s_reserved[slot] = 0;
+    while (!pBudget->tryReserve(CMPIMemoryBudget::distributor, bytes)) {
+        if (!emptySlot(&data)) {
+            pBudget->charge(CMPIMemoryBudget::distributor, bytes);
+            break;
+        }
+    }
+    worker.s_reserved[slot] = bytes;
+}
+/**
+ * emptySlot
+ *    Free the storage of a send slot other than the one being filled:
+ *    one whose send is done if there is one, otherwise the first with a
+ *    send in flight once that's done.
+ * @param pKeep - the slot being filled.
+ * @return bool - false if there was none to empty.
+ */
+bool
+CMPIDistributor::emptySlot(const std::vector<char>* pKeep)
+{
+    for (int pass = 0; pass < 2; pass++) {
+        for (size_t w = 0; w < m_workers.size(); w++) {
+            Worker& worker(m_workers[w]);
+            for (size_t i = 0; i < worker.s_slots.size(); i++) {
+                if ((&worker.s_slots[i] == pKeep) || !worker.s_reserved[i]) continue;
+                if (pass == 0) {
+                    int done;
+                    MPI_Test(&worker.s_sends[i], &done, MPI_STATUS_IGNORE);
+                    if (!done) continue;
+                } else {
+                    MPI_Wait(&worker.s_sends[i], MPI_STATUS_IGNORE);
+                }
+                std::vector<char>().swap(worker.s_slots[i]);
+                CMPIMemoryBudget::getInstance()->release(
+                    CMPIMemoryBudget::distributor, worker.s_reserved[i]
+                );
+                worker.s_reserved[i] = 0;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+/**
+ * sendLeased
+ *    Send a block to a requestor, first keeping a copy under its lease
+ *    if we lease blocks.
+ *
+ * @param rank    - the requestor.
+ * @param info    - size and pointer to the data.
+ * @param request - its request.
+ */
+void
+CMPIDistributor::sendLeased(
+    int rank, std::pair<size_t, void*>& info, const MPIBlockRequest& request
+)
+{
+    if (m_leaseTime > 0) {
+        const char* p = static_cast<const char*>(info.second);
+        Lease& lease(m_leases[rank]);
+        lease.s_blocks.push_back(std::vector<char>(p, p + info.first));
+        lease.s_deadline = MPI_Wtime() + m_leaseTime;
+        CMPIMemoryBudget::getInstance()->charge(
+            CMPIMemoryBudget::distributor, info.first
+        );
+    }
+    sendBlock(rank, info, request);
+}
 /**
- * read
- *   - Send a data request to rank 0 for a block of data.
- *   - Use MPI_Probe to figure out how much data I'm going to get.
- *   - Read the data
- * @return std::pair<size_t, void*> - describing the read data.
- *                                    size == 0 means expect no more data.
+ * reissue
+ *    Send the oldest block of a failed worker to a requestor; the copy
+ *    moves to the requestor's lease.  It gets a new sequence number and
+ *    the current snapshot count.
+ *
+ * @param rank    - the requestor.
+ * @param request - its request.
  */
-std::pair<size_t, void*>
-CMPIDataGetter::read()
+void
+CMPIDistributor::reissue(int rank, const MPIBlockRequest& request)
 {
-    char dummy;
-    MPI_Send(&dummy, 0, MPI_CHAR, 0, MPI_TAG_BINDATA, MPI_COMM_WORLD); // data req.
-    
-    MPI_Status stat;
-    int        nBytes;
-    MPI_Probe(0, MPI_TAG_BINDATA, MPI_COMM_WORLD, &stat);
-    MPI_Get_elements(&stat, MPI_CHAR, &nBytes);
+    Lease& lease(m_leases[rank]);
+    lease.s_blocks.push_back(std::vector<char>());
+    lease.s_blocks.back().swap(m_reissue.front());
+    lease.s_deadline = MPI_Wtime() + m_leaseTime;
+    m_reissue.pop_front();
+    m_clientRanks.insert(rank);
     
-    char* pData = new char[nBytes];
-    MPI_Recv(
-        pData, nBytes, MPI_CHAR, 0, MPI_TAG_BINDATA, MPI_COMM_WORLD,
-        MPI_STATUS_IGNORE
+    std::pair<size_t, void*> info(
+        lease.s_blocks.back().size(), lease.s_blocks.back().data()
     );
-    std::pair<size_t, void*> result;
-    result.first = nBytes;
-    result.second= pData;
-    
-    return result;
+    sendBlock(rank, info, request);
 }
-
 /**
- * free
- *    Free dynamic data gotten by read
- * @param data - descriptor of  data gotten from read.
+ * renew
+ *    A worker asked again: all but the last block we sent it have been
+ *    analyzed and it's waiting for us, not the other way round.
+ *
+ * @param lease - its lease.
  */
 void
-CMPIDataGetter::free(std::pair<size_t, void*>& data)
+CMPIDistributor::renew(Lease& lease)
 {
-    char* pBytes = static_cast<char*>(data.second);
-    delete []pBytes;
+    while (lease.s_blocks.size() > 1) {
+        CMPIMemoryBudget::getInstance()->release(
+            CMPIMemoryBudget::distributor, lease.s_blocks.front().size()
+        );
+        lease.s_blocks.pop_front();
+    }
+    lease.s_deadline = 0;
 }
-
-////////////////////////////////////////////////////////////////////////////////
-
 /**
- * @class CMPIDistributor
- *    Distributes data to  parallel workers.
- *    - Waits for a data request.
- *    - Remebers the requestor in the set of requestors.
- *    - If there's more data send it to the requestor otherwise,
- *      send end of data indicators to requestors until none are left
+ * expireLeases
+ *    Fail the workers whose leases have run out.
+ *
+ * @return bool - true if any did.
  */
-class CMPIDistributor : public CDataDistributor
+bool
+CMPIDistributor::expireLeases()
 {
-private:
-    std::set<int>   m_clientRanks;
-public:
-    
-    virtual void handleData(std::pair<size_t, void*>& info);
-    
-private:
-    void runDownConsumers();
-    void endFileToConsumer(int rank);
-};
-
-// CMPIDistributor implementation.
-
+    double           now = MPI_Wtime();
+    std::vector<int> expired;
+    for (auto p = m_leases.begin(); p != m_leases.end(); p++) {
+        if (p->second.s_deadline && (now > p->second.s_deadline)) {
+            expired.push_back(p->first);
+        }
+    }
+    for (size_t i = 0; i < expired.size(); i++) {
+        failWorker(expired[i]);
+    }
+    return !expired.empty();
+}
 /**
- * handleData
- *    Distribute the data we've been given to the next requestor or,
- *    in the case of an end data indicator to all currently known consumers.
+ * failWorker
+ *    A worker died or hung.  Its blocks are queued to be re-issued and
+ *    it's no longer a client.
  *
- * @param info - size and pointer to the data.
+ * @param rank - the worker.
  */
 void
-CMPIDistributor::handleData(std::pair<size_t, void*>& info)
+CMPIDistributor::failWorker(int rank)
 {
-    // If the data are an end rundown the consumers:
-    if(info.first == 0) {
-        runDownConsumers();
-    } else {
-        // Get the next request
-        
-        char data;
-        MPI_Status stat;
-        MPI_Recv(
-            &data, 0, MPI_CHAR, MPI_ANY_SOURCE, MPI_TAG_BINDATA,  MPI_COMM_WORLD,
-            &stat
-        );
-        int to = stat.MPI_SOURCE;
-        
-        MPI_Send(
-            info.second, info.first, MPI_CHAR, to, MPI_TAG_BINDATA, MPI_COMM_WORLD
-        );
-        m_clientRanks.insert(to);
+    auto p = m_leases.find(rank);
+    size_t nBlocks = 0;
+    if (p != m_leases.end()) {
+        std::deque<std::vector<char> >& blocks(p->second.s_blocks);
+        nBlocks = blocks.size();
+        for (size_t i = 0; i < blocks.size(); i++) {
+            m_reissue.push_back(std::vector<char>());
+            m_reissue.back().swap(blocks[i]);
+        }
+        m_leases.erase(p);
+    }
+    m_failed.insert(rank);
+    m_clientRanks.erase(rank);
+    m_pool.erase(rank);
+    std::cerr << "mpisink: worker rank " << rank << " failed, re-issuing "
+              << nBlocks << " blocks\n";
+}
+/**
+ * endLeases
+ *    At the end of a run (or when we're done), forget the blocks we
+ *    couldn't know were analyzed and give back their budget.
+ */
+void
+CMPIDistributor::endLeases()
+{
+    CMPIMemoryBudget* pBudget = CMPIMemoryBudget::getInstance();
+    for (auto p = m_leases.begin(); p != m_leases.end(); p++) {
+        for (size_t i = 0; i < p->second.s_blocks.size(); i++) {
+            pBudget->release(
+                CMPIMemoryBudget::distributor, p->second.s_blocks[i].size()
+            );
+        }
     }
+    for (size_t i = 0; i < m_reissue.size(); i++) {
+        pBudget->release(CMPIMemoryBudget::distributor, m_reissue[i].size());
+    }
+    m_leases.clear();
+    m_reissue.clear();
 }
 /**
- * runDownConsumers
- *     Send end datas to all known consumers.
+ * announce
+ *    Rank 0 - send a snapshot cut to every other rank that hasn't
+ *    failed.  Push workers get it through their send slots, after the
+ *    blocks sent before it; the rest get it directly.
+ * @param count - cuts defined so far.
  */
 void
-CMPIDistributor::runDownConsumers()
+CMPIDistributor::announce(uint32_t count)
 {
+    MPIBlockHeader header;
+    memset(&header, 0, sizeof(header));
+    header.s_flags      = MPIBLOCK_CUT;
+    header.s_epoch      = CMPIConfigJournal::getInstance()->epoch();
+    header.s_sequence   = m_sequence;
+    header.s_snapshot   = count;
+    header.s_queueDepth = m_queueDepth;
     
-    MPI_Status stat;
-    char       data;
-
-    while (!m_clientRanks.empty()) {
-    
-        MPI_Recv(
-            &data, 0, MPI_CHAR, MPI_ANY_SOURCE, MPI_TAG_BINDATA, MPI_COMM_WORLD,
-            &stat
-        );
-        endFileToConsumer(stat.MPI_SOURCE);
+    int me, nRanks;
+    MPI_Comm_rank(blockComm, &me);
+    MPI_Comm_size(blockComm, &nRanks);
+    for (int rank = 0; rank < nRanks; rank++) {
+        if ((rank == me) || m_failed.count(rank)) continue;
+        auto worker = m_workerIndex.find(rank);
+        if (worker != m_workerIndex.end()) {
+            pushMessage(m_workers[worker->second], &header, 0, &header, 0);
+        } else if ((MPI_Send(
+            &header, sizeof(header), MPI_CHAR, rank, MPI_TAG_BINDATA, blockComm
+        ) != MPI_SUCCESS) && (m_leaseTime > 0)) {
+            failWorker(rank);
+        }
     }
 }
 /**
- * endFileToConsumer
- *    Send and end of file to a consumer.
- *
- *    @param rank - the rank of the consumer.
-*/
+ * takeCuts
+ *    While no data are being distributed - take the cut messages the
+ *    request receive has matched (pull mode on ranks other than 0).
+ */
 void
-CMPIDistributor::endFileToConsumer(int rank)
+CMPIDistributor::takeCuts()
 {
-    char data;
-    MPI_Send(&data, 0, MPI_CHAR, rank, MPI_TAG_BINDATA, MPI_COMM_WORLD);
-    m_clientRanks.erase(rank);
+    if ((m_distribution == pull) && !m_journaling) {
+        takeRequests(false);
+    }
+}
+/**
+ * distributionFromString
+ *    @param mode - pull, roundrobin or weighted.
+ *    @return Distribution - corresponding value.
+ *    @throw std::string - invalid mode.
+ */
+CMPIDistributor::Distribution
+CMPIDistributor::distributionFromString(const std::string& mode)
+{
+    if (mode == "pull")       return pull;
+    if (mode == "roundrobin") return roundRobin;
+    if (mode == "weighted")   return weighted;
+    throw std::string("Distribution must be pull, roundrobin or weighted: ") + mode;
 }
 ///////////////////////////////////////////////////////////////////////////////
 // Commands to set the data getter and the data distributor.
 
+/**
+ * rankList
+ *    Decode a Tcl list of ranks.
+ * @param interp - interpreter.
+ * @param list   - the list object.
+ * @return std::vector<int> - the ranks.
+ */
+static std::vector<int>
+rankList(CTCLInterpreter& interp, CTCLObject& list)
+{
+    Tcl_Interp* pInterp = interp.getInterpreter();
+    Tcl_Obj**   pRanks;
+    int         nRanks;
+    int         nProcs;
+    MPI_Comm_size(blockComm, &nProcs);
+    if (Tcl_ListObjGetElements(pInterp, list.getObject(), &nRanks, &pRanks) != TCL_OK) {
+        throw std::string("Not a list of ranks: ") + std::string(list);
+    }
+    std::vector<int> result;
+    for (int i = 0; i < nRanks; i++) {
+        int rank;
+        if ((Tcl_GetIntFromObj(pInterp, pRanks[i], &rank) != TCL_OK)
+            || (rank < 0) || (rank >= nProcs)) {
+            throw std::string("Invalid rank: ") + Tcl_GetString(pRanks[i]);
+        }
+        result.push_back(rank);
+    }
+    return result;
+}
+
 /**
  * @class CMPISourceCommand
  *     Command processor that sets the data source to be an MPI data
@@ -230,7 +3001,14 @@ CMPISourceCommand::CMPISourceCommand(CTCLInterpreter& interp) :
 /**
  * operator()
  *     Execute the mpisource command.
- *     - Ensure there are no parameters.
+ *        mpisource ?-buffers n? ?-buffersize bytes? ?-push? ?-weight w?
+ *                  ?-readers ranks?
+ *     -push must be used if the distributor is mpisink -push.  -weight
+ *     is then this rank's share of the blocks for mpisink -push weighted.
+ *     -readers lists the ranks running distributors that we can pull
+ *     from (default 0).  It must include 0 and can't be used with -push.
+ *     - Do the collective setup if this is the first mpisource here.
+ *     - Process the options.
  *     - Create an MPIDataGetter object.
  *     - Set it as the data getter for the analyze command.
  * @param interp - references the interpreter running the command.
@@ -243,9 +3021,58 @@ int
 CMPISourceCommand::operator()(CTCLInterpreter& interp, std::vector<CTCLObject>& objv)
 {
     try {
-        requireExactly(objv, 1);
+        bindAll(interp, objv);
+        setupRanks();
+        int  nBuffers   = 2;
+        int  bufferSize = 1024*1024;
+        bool push       = false;
+        int  weight     = 1;
+        std::vector<int> readers(1, 0);
+        for (size_t i = 1; i < objv.size(); i += 2) {
+            std::string option = objv[i];
+            if (option == "-push") {
+                push = true;
+                i--;                         // No value.
+                continue;
+            }
+            if (i + 1 >= objv.size()) {
+                throw std::string("Missing value for mpisource option ") + option;
+            }
+            if (option == "-buffers") {
+                nBuffers = objv[i+1];
+                if (nBuffers < 1) {
+                    throw std::string("-buffers must be at least 1");
+                }
+            } else if (option == "-buffersize") {
+                bufferSize = objv[i+1];
+                if (bufferSize <= 0) {
+                    throw std::string("-buffersize must be positive");
+                }
+            } else if (option == "-weight") {
+                weight = objv[i+1];
+                if (weight < 1) {
+                    throw std::string("-weight must be at least 1");
+                }
+            } else if (option == "-readers") {
+                readers = rankList(interp, objv[i+1]);
+                std::sort(readers.begin(), readers.end());
+                readers.erase(
+                    std::unique(readers.begin(), readers.end()), readers.end()
+                );
+                if (readers.empty() || (readers[0] != 0)) {
+                    throw std::string("-readers must include rank 0");
+                }
+            } else {
+                throw std::string("Invalid mpisource option: ") + option;
+            }
+        }
+        if (push && (readers.size() > 1)) {
+            throw std::string("-push can only be used with a single reader");
+        }
         
-        CAnalyzeCommand::setDataGetter(new CMPIDataGetter(0));
+        CAnalyzeCommand::setDataGetter(
+            new CMPIDataGetter(interp, readers, nBuffers, bufferSize, push, weight)
+        );
     }
     catch (CException& e) {
         interp.setResult(e.ReasonText());
@@ -292,16 +3119,331 @@ CMPISinkCommand::CMPISinkCommand(CTCLInterpreter& interp) :
 /**
  * operator()
  *    Run the command.
+ *       mpisink ?-compress off|on|auto? ?-push roundrobin|weighted|pull?
+ *               ?-clients ranks? ?-lease seconds?
+ *               ?-checkpoint file? ?-every seconds? ?-resume file?
+ *    In push mode the -clients ranks, or all other ranks if there's no
+ *    -clients, must be workers (mpisource -push).
+ *    -lease (pull mode) re-issues the blocks of workers that don't ask
+ *    again within that many seconds of being sent a block.  It trades
+ *    correctness for liveness.  Re-issued blocks aren't fenced: a
+ *    dropped worker that was only slow still analyzes the blocks it
+ *    was holding (at most those sent since its last request) and the
+ *    workers they're re-issued to count them as well.  With mpispectcl
+ *    runs on, the dropped worker discards its counts for the run at its
+ *    end (losing those of the blocks it did finish too) so the sums are
+ *    right.  Otherwise those blocks are counted twice: spectra and
+ *    snapshots taken after the lease runs out may include them twice
+ *    and the final sums do.  A worker that died still can't take part
+ *    in any reduction, so those hang.
+ *    -checkpoint writes a checkpoint to file every -every seconds
+ *    (default 600) and -resume continues from one; the spectra must be
+ *    defined first.  Each mpisink starts counting the data over.
+ *    When workers pull from several readers (mpisource -readers), each
+ *    reader's -clients must list all of the workers.  A checkpoint only
+ *    records rank 0's position so the first block distributed fails if
+ *    -checkpoint or -resume is used that way.  The first mpisink
+ *    does the collective setup (see mpispectcl setup).
  *  @param interp -the interpreter in which the command is being run.
- *  @param objv   -the vector of command words (there can be only one).
+ *  @param objv   -the vector of command words.
  *  @return int   - Tcl status of the command.
  */
 int
 CMPISinkCommand::operator()(CTCLInterpreter& interp, std::vector<CTCLObject>& objv)
 {
     try {
-       requireExactly(objv, 1);
-       CAnalyzeCommand::setDistributor(new CMPIDistributor);
+       bindAll(interp, objv);
+       setupRanks();
+       CMPICompressionPolicy::Mode compression = CMPICompressionPolicy::off;
+       CMPIDistributor::Distribution distribution = CMPIDistributor::pull;
+       std::set<int> pool;
+       double        lease = 0.0;
+       std::string   checkpoint;
+       double        every = 600.0;
+       std::string   resume;
+       for (size_t i = 1; i < objv.size(); i += 2) {
+           std::string option = objv[i];
+           if (i + 1 >= objv.size()) {
+               throw std::string("Missing value for mpisink option ") + option;
+           }
+           if (option == "-compress") {
+               compression = CMPICompressionPolicy::modeFromString(
+                   std::string(objv[i+1])
+               );
+           } else if (option == "-push") {
+               distribution = CMPIDistributor::distributionFromString(
+                   std::string(objv[i+1])
+               );
+           } else if (option == "-clients") {
+               std::vector<int> clients = rankList(interp, objv[i+1]);
+               pool.insert(clients.begin(), clients.end());
+           } else if (option == "-lease") {
+               lease = static_cast<double>(objv[i+1]);
+               if (lease < 0) {
+                   throw std::string("-lease must not be negative");
+               }
+           } else if (option == "-checkpoint") {
+               checkpoint = std::string(objv[i+1]);
+           } else if (option == "-every") {
+               every = static_cast<double>(objv[i+1]);
+               if (!(every > 0) || (every > INT_MAX/1000.0)) {
+                   throw std::string("-every must be a positive number of seconds");
+               }
+           } else if (option == "-resume") {
+               resume = std::string(objv[i+1]);
+           } else {
+               throw std::string("Invalid mpisink option: ") + option;
+           }
+       }
+       if (pool.count(0) && (distribution != CMPIDistributor::pull)) {
+           throw std::string("-clients can't include the distributor with -push");
+       }
+       if ((lease > 0) && (distribution != CMPIDistributor::pull)) {
+           throw std::string("-lease can only be used with pull distribution");
+       }
+       CMPICheckpoints* pCheckpoints = CMPICheckpoints::getInstance();
+       pCheckpoints->stop();
+       pCheckpoints->rewind();
+       if (!resume.empty()) {
+           pCheckpoints->resume(interp, resume);
+       }
+       if (!checkpoint.empty()) {
+           pCheckpoints->start(interp, checkpoint, every);
+       }
+       CAnalyzeCommand::setDistributor(
+           new CMPIDistributor(compression, distribution, pool, lease)
+       );
+    } catch (CException& e) {
+        interp.setResult(e.ReasonText());
+        return TCL_ERROR;
+    } catch (std::exception& e) {
+        interp.setResult(e.what());
+        return TCL_ERROR;
+    } catch (std::string msg) {
+        interp.setResult(msg);
+        return TCL_ERROR;
+    } catch (const char* msg) {
+        interp.setResult(msg);
+        return TCL_ERROR;
+    } catch(...) {
+        interp.setResult("Unanticipated exception type thrown");
+        return TCL_ERROR;
+    }
+
+    return TCL_OK;
+}
+/**
+ * @class CMPIMergeCommand
+ *    The mpimerge command sets the analyzer's data source to a timestamp
+ *    ordered merge of several ring item files.  This is normally done in
+ *    rank 0 along with mpisink so that the merged blocks are distributed.
+ */
+class CMPIMergeCommand : public CTCLObjectProcessor
+{
+public:
+    CMPIMergeCommand(CTCLInterpreter& interp);
+    int operator()(CTCLInterpreter& interp, std::vector<CTCLObject>& objv);
+};
+/**
+ * constructor
+ *    @param interp - the interpreter on which the command is registered.
+ *    @note the command is hard-coded to "mpimerge"
+ */
+CMPIMergeCommand::CMPIMergeCommand(CTCLInterpreter& interp) :
+    CTCLObjectProcessor(interp, "mpimerge", true)
+{
+}
+/**
+ * operator()
+ *    Run the command.
+ *       mpimerge ?-blocksize bytes? file ?file...?
+ *  @param interp -the interpreter in which the command is being run.
+ *  @param objv   -the vector of command words.
+ *  @return int   - Tcl status of the command.
+ */
+int
+CMPIMergeCommand::operator()(CTCLInterpreter& interp, std::vector<CTCLObject>& objv)
+{
+    try {
+        bindAll(interp, objv);
+        int    blockSize = 1024*1024;
+        size_t i         = 1;
+        if ((objv.size() > 2) && (std::string(objv[1]) == "-blocksize")) {
+            blockSize = objv[2];
+            if (blockSize <= 0) {
+                throw std::string("-blocksize must be positive");
+            }
+            i = 3;
+        }
+        std::vector<std::string> files;
+        for (; i < objv.size(); i++) {
+            files.push_back(std::string(objv[i]));
+        }
+        if (files.empty()) {
+            throw std::string("Usage: mpimerge ?-blocksize bytes? file ?file...?");
+        }
+        CAnalyzeCommand::setDataGetter(new CMPIMergingDataGetter(files, blockSize));
+    } catch (CException& e) {
+        interp.setResult(e.ReasonText());
+        return TCL_ERROR;
+    } catch (std::exception& e) {
+        interp.setResult(e.what());
+        return TCL_ERROR;
+    } catch (std::string msg) {
+        interp.setResult(msg);
+        return TCL_ERROR;
+    } catch (const char* msg) {
+        interp.setResult(msg);
+        return TCL_ERROR;
+    } catch(...) {
+        interp.setResult("Unanticipated exception type thrown");
+        return TCL_ERROR;
+    }
+
+    return TCL_OK;
+}
+
+
+/**
+ * @class CMPISpecTclCommand
+ *    The mpispectcl command is an ensemble of operations on the parallel
+ *    analysis:
+ *
+ *    mpispectcl setup         - (collective) Make the communicators the
+ *                               package uses.  Every rank must do this,
+ *                               or mpisink/mpisource, before any of
+ *                               shard, nodeshare, reduce, pipeline,
+ *                               snapshot or history.  Later calls do
+ *                               nothing.
+ *    mpispectcl config script - (distributor only) Evaluates script locally
+ *                               and journals it so that every worker
+ *                               evaluates it just before analyzing the
+ *                               first block distributed after this.
+ *    mpispectcl epoch         - Returns the configuration epoch; in the
+ *                               distributor, the most recent one in a
+ *                               worker, the last one applied.
+ *    mpispectcl sync ?on|off? - Turns journaling of parameter, spectrum
+ *                               and gate definition changes on or off.
+ *                               Changes made while off are journaled
+ *                               when it's turned back on.
+ *                               Returns the (new) state.
+ *    mpispectcl shard ?on|off? - Turns sharding of spectra among the
+ *                               workers on or off.  This must be done
+ *                               the same way in all ranks and every
+ *                               rank but 0 should be a worker.  Returns
+ *                               the (new) state.
+ *    mpispectcl nodeshare ?off|locked|striped? - (collective) Puts
+ *                               the spectra of the workers on each node
+ *                               in node shared memory, one copy updated
+ *                               under per spectrum locks or one copy per worker
+ *                               summed by the node's leader, or takes
+ *                               them out again.  Returns the (new) mode.
+ *    mpispectcl reduce        - (collective) Sum the workers' spectra
+ *                               into rank 0's.
+ *    mpispectcl pipeline ?on|off? - Turns background reduction of each
+ *                               run's spectra on or off.  When on, the
+ *                               spectra are summed into rank 0 at the
+ *                               end of each run while the next run is
+ *                               analyzed into cleared spectra.  This
+ *                               must be done the same way in all ranks.
+ *                               Returns the (new) state.
+ *    mpispectcl pipeline wait - Wait for the background reduction in
+ *                               progress to finish.  Returns the number
+ *                               of runs reduced so far.
+ *    mpispectcl pipeline command ?script? - (rank 0) Sets or returns
+ *                               the script run when a run's spectra
+ *                               have been reduced (e.g. to write them).
+ *    mpispectcl snapshot      - (distributor) Define a cut after the
+ *                               blocks distributed so far.  Each worker
+ *                               contributes its spectra as they are when
+ *                               it gets to the cut and goes on analyzing.
+ *                               The sum replaces rank 0's spectra in the
+ *                               background.  Returns the snapshot number.
+ *    mpispectcl snapshot wait - Wait for the snapshot in progress to
+ *                               land.  Returns the number of snapshots
+ *                               completed.
+ *    mpispectcl snapshot command ?script? - (rank 0) Sets or returns the
+ *                               script run when a snapshot lands.
+ *    mpispectcl history start file seconds - (rank 0) Snapshot every
+ *                               seconds and append the changes since the
+ *                               last one to file (indexed in file.idx).
+ *    mpispectcl history stop  - Stop recording history.
+ *    mpispectcl history file ?file? - Sets or returns the history file
+ *                               rebuilt from.
+ *    mpispectcl history slices - Returns a list of {slice time} pairs.
+ *    mpispectcl history rebuild from to ?suffix? - Replace the counts of
+ *                               spectra (or of spectra with suffix
+ *                               appended to their names) with the counts
+ *                               that came in from time from to time to.
+ *                               Returns the number of slices summed.
+ */
+class CMPISpecTclCommand : public CTCLObjectProcessor
+{
+public:
+    CMPISpecTclCommand(CTCLInterpreter& interp);
+    int operator()(CTCLInterpreter& interp, std::vector<CTCLObject>& objv);
+private:
+    void config(CTCLInterpreter& interp, std::vector<CTCLObject>& objv);
+    void epoch(CTCLInterpreter& interp, std::vector<CTCLObject>& objv);
+    void sync(CTCLInterpreter& interp, std::vector<CTCLObject>& objv);
+    void shard(CTCLInterpreter& interp, std::vector<CTCLObject>& objv);
+    void nodeshare(CTCLInterpreter& interp, std::vector<CTCLObject>& objv);
+    void reduce(CTCLInterpreter& interp, std::vector<CTCLObject>& objv);
+    void pipeline(CTCLInterpreter& interp, std::vector<CTCLObject>& objv);
+    void snapshot(CTCLInterpreter& interp, std::vector<CTCLObject>& objv);
+    void history(CTCLInterpreter& interp, std::vector<CTCLObject>& objv);
+    
+    static bool optionalBoolean(
+        CTCLInterpreter& interp, std::vector<CTCLObject>& objv, bool current
+    );
+};
+/**
+ * constructor
+ *    @param interp - interpreter on which the mpispectcl command is
+ *                    registered.
+ */
+CMPISpecTclCommand::CMPISpecTclCommand(CTCLInterpreter& interp) :
+    CTCLObjectProcessor(interp, "mpispectcl", true)
+{}
+
+/**
+ * operator()
+ *    Dispatch to the subcommand.
+ *  @param interp -the interpreter in which the command is being run.
+ *  @param objv   -the vector of command words.
+ *  @return int   - Tcl status of the command.
+ */
+int
+CMPISpecTclCommand::operator()(CTCLInterpreter& interp, std::vector<CTCLObject>& objv)
+{
+    try {
+        requireAtLeast(objv, 2);
+        bindAll(interp, objv);
+        std::string subcommand = objv[1];
+        if (subcommand == "setup") {
+            requireExactly(objv, 2);
+            setupRanks();
+        } else if (subcommand == "config") {
+            config(interp, objv);
+        } else if (subcommand == "epoch") {
+            epoch(interp, objv);
+        } else if (subcommand == "sync") {
+            sync(interp, objv);
+        } else if (subcommand == "shard") {
+            shard(interp, objv);
+        } else if (subcommand == "nodeshare") {
+            nodeshare(interp, objv);
+        } else if (subcommand == "reduce") {
+            reduce(interp, objv);
+        } else if (subcommand == "pipeline") {
+            pipeline(interp, objv);
+        } else if (subcommand == "snapshot") {
+            snapshot(interp, objv);
+        } else if (subcommand == "history") {
+            history(interp, objv);
+        } else {
+            throw std::string("Invalid mpispectcl subcommand: ") + subcommand;
+        }
     } catch (CException& e) {
         interp.setResult(e.ReasonText());
         return TCL_ERROR;
@@ -321,7 +3463,288 @@ CMPISinkCommand::operator()(CTCLInterpreter& interp, std::vector<CTCLObject>& ob
 
     return TCL_OK;
 }
+/**
+ * config
+ *    Evaluate a configuration script here and journal it for the workers.
+ *    The script is only journaled if it succeeds locally.
+ *    The result is the new epoch.
+ */
+void
+CMPISpecTclCommand::config(CTCLInterpreter& interp, std::vector<CTCLObject>& objv)
+{
+    requireExactly(objv, 3);
+    std::string script = objv[2];
+    
+    // Definition changes made before the script must be journaled ahead
+    // of it.  The ones it makes will go out later and be found to
+    // already match in the workers.
+    
+    CMPIConfigJournal::getInstance()->sync();
+    interp.GlobalEval(script);
+    
+    CTCLObject result;
+    result.Bind(interp);
+    result = static_cast<int>(
+        CMPIConfigJournal::getInstance()->append(MPIJOURNAL_SCRIPT, script)
+    );
+    interp.setResult(result);
+}
+/**
+ * epoch
+ *    Return the configuration epoch.
+ */
+void
+CMPISpecTclCommand::epoch(CTCLInterpreter& interp, std::vector<CTCLObject>& objv)
+{
+    requireExactly(objv, 2);
+    CMPIConfigJournal::getInstance()->sync();
+    CTCLObject result;
+    result.Bind(interp);
+    result = static_cast<int>(CMPIConfigJournal::getInstance()->epoch());
+    interp.setResult(result);
+}
+/**
+ * sync
+ *    Query or set whether definition changes are journaled.
+ */
+void
+CMPISpecTclCommand::sync(CTCLInterpreter& interp, std::vector<CTCLObject>& objv)
+{
+    requireAtMost(objv, 3);
+    CMPIDefinitionSync* pSync = CMPIDefinitionSync::getInstance(interp);
+    pSync->setEnabled(optionalBoolean(interp, objv, pSync->enabled()));
+    interp.setResult(pSync->enabled() ? "on" : "off");
+}
+/**
+ * shard
+ *    Query or set whether spectra are sharded.
+ */
+void
+CMPISpecTclCommand::shard(CTCLInterpreter& interp, std::vector<CTCLObject>& objv)
+{
+    requireAtMost(objv, 3);
+    requireSetup("mpispectcl shard");
+    CMPISpectrumShards* pShards = CMPISpectrumShards::getInstance();
+    bool enable = optionalBoolean(interp, objv, pShards->enabled());
+    if (enable != pShards->enabled()) {
+        pShards->enable(interp, enable);
+    }
+    interp.setResult(pShards->enabled() ? "on" : "off");
+}
+/**
+ * nodeshare
+ *    Query or set how the spectra of a node's workers are shared.
+ */
+void
+CMPISpecTclCommand::nodeshare(CTCLInterpreter& interp, std::vector<CTCLObject>& objv)
+{
+    requireAtMost(objv, 3);
+    requireSetup("mpispectcl nodeshare");
+    CMPINodeSpectra* pNode = CMPINodeSpectra::getInstance();
+    if (objv.size() == 3) {
+        CMPINodeSpectra::Mode mode = CMPINodeSpectra::modeFromString(objv[2]);
+        if (mode != pNode->mode()) {
+            pNode->setMode(interp, mode);
+        }
+    }
+    interp.setResult(CMPINodeSpectra::modeToString(pNode->mode()));
+}
+/**
+ * reduce
+ *    Sum the workers' spectra into rank 0.
+ */
+void
+CMPISpecTclCommand::reduce(CTCLInterpreter& interp, std::vector<CTCLObject>& objv)
+{
+    requireExactly(objv, 2);
+    requireSetup("mpispectcl reduce");
+    CMPISpectrumReducer::getInstance()->reduce(interp);
+}
+/**
+ * pipeline
+ *    Control background reduction of run spectra.
+ */
+void
+CMPISpecTclCommand::pipeline(CTCLInterpreter& interp, std::vector<CTCLObject>& objv)
+{
+    requireAtMost(objv, 4);
+    requireSetup("mpispectcl pipeline");
+    CMPIRunReducer* pRunReducer = CMPIRunReducer::getInstance();
+    std::string     what        = (objv.size() > 2) ? std::string(objv[2]) : "";
+    if (what == "wait") {
+        requireExactly(objv, 3);
+        pRunReducer->wait();
+        CTCLObject result;
+        result.Bind(interp);
+        result = static_cast<int>(pRunReducer->runs());
+        interp.setResult(result);
+    } else if (what == "command") {
+        if (objv.size() == 4) {
+            pRunReducer->setCommand(objv[3]);
+        }
+        interp.setResult(pRunReducer->command());
+    } else {
+        requireAtMost(objv, 3);
+        pRunReducer->setEnabled(
+            interp, optionalBoolean(interp, objv, pRunReducer->enabled())
+        );
+        interp.setResult(pRunReducer->enabled() ? "on" : "off");
+    }
+}
+/**
+ * snapshot
+ *    Take or control consistent snapshots of the summed spectra.
+ */
+void
+CMPISpecTclCommand::snapshot(CTCLInterpreter& interp, std::vector<CTCLObject>& objv)
+{
+    requireAtMost(objv, 4);
+    requireSetup("mpispectcl snapshot");
+    CMPISnapshots* pSnapshots = CMPISnapshots::getInstance();
+    std::string    what       = (objv.size() > 2) ? std::string(objv[2]) : "";
+    CTCLObject     result;
+    result.Bind(interp);
+    if (what == "wait") {
+        requireExactly(objv, 3);
+        pSnapshots->wait();
+        result = static_cast<int>(pSnapshots->completed());
+    } else if (what == "command") {
+        if (objv.size() == 4) {
+            pSnapshots->setCommand(objv[3]);
+        }
+        result = pSnapshots->command();
+    } else {
+        requireExactly(objv, 2);
+        CMPIConfigJournal::getInstance()->sync();
+        result = static_cast<int>(pSnapshots->request(interp));
+    }
+    interp.setResult(result);
+}
+/**
+ * history
+ *    Record and rebuild time sliced spectrum history.
+ */
+void
+CMPISpecTclCommand::history(CTCLInterpreter& interp, std::vector<CTCLObject>& objv)
+{
+    requireAtLeast(objv, 3);
+    requireSetup("mpispectcl history");
+    CMPISpectrumHistory* pHistory = CMPISpectrumHistory::getInstance();
+    std::string          what     = objv[2];
+    if (what == "start") {
+        requireExactly(objv, 5);
+        pHistory->start(interp, objv[3], static_cast<double>(objv[4]));
+    } else if (what == "stop") {
+        requireExactly(objv, 3);
+        pHistory->stop();
+    } else if (what == "file") {
+        requireAtMost(objv, 4);
+        if (objv.size() == 4) {
+            pHistory->setFilename(objv[3]);
+        }
+        interp.setResult(pHistory->filename());
+    } else if (what == "slices") {
+        requireExactly(objv, 3);
+        std::vector<MPIHistoryIndex> index;
+        pHistory->slices(index);
+        CTCLObject result;
+        result.Bind(interp);
+        for (size_t i = 0; i < index.size(); i++) {
+            CTCLObject slice;
+            slice.Bind(interp);
+            slice += static_cast<int>(index[i].s_slice);
+            slice += index[i].s_time;
+            result += slice;
+        }
+        interp.setResult(result);
+    } else if (what == "rebuild") {
+        requireAtLeast(objv, 5);
+        requireAtMost(objv, 6);
+        std::string suffix = (objv.size() == 6) ? std::string(objv[5]) : "";
+        CTCLObject result;
+        result.Bind(interp);
+        result = static_cast<int>(pHistory->rebuild(
+            static_cast<double>(objv[3]), static_cast<double>(objv[4]), suffix
+        ));
+        interp.setResult(result);
+    } else {
+        throw std::string("Invalid mpispectcl history subcommand: ") + what;
+    }
+}
+/**
+ * optionalBoolean
+ *    Get the optional boolean that's the third word of on/off
+ *    subcommands.
+ * @param interp  - interpreter.
+ * @param objv    - command words.
+ * @param current - value to return if there's no third word.
+ * @return bool
+ * @throw std::string - the word isn't a boolean.
+ */
+bool
+CMPISpecTclCommand::optionalBoolean(
+    CTCLInterpreter& interp, std::vector<CTCLObject>& objv, bool current
+)
+{
+    if (objv.size() < 3) return current;
+    int value;
+    if (Tcl_GetBooleanFromObj(
+        interp.getInterpreter(), objv[2].getObject(), &value
+    ) != TCL_OK) {
+        throw std::string("mpispectcl ") + std::string(objv[1]) + " needs a boolean";
+    }
+    return value != 0;
+}
 
+/**
+ * takeCutMessages
+ *    Take the snapshot cut messages from rank 0 that no receive of ours
+ *    will match.  Only cuts come from rank 0 unasked for.
+ */
+static void
+takeCutMessages()
+{
+    for (;;) {
+        MPI_Message    message;
+        MPI_Status     status;
+        MPIBlockHeader header;
+        int            found;
+        int            nBytes;
+        MPI_Improbe(0, MPI_TAG_BINDATA, blockComm, &found, &message, &status);
+        if (!found) break;
+        MPI_Get_count(&status, MPI_CHAR, &nBytes);
+        std::vector<char> data(nBytes);
+        MPI_Mrecv(data.data(), nBytes, MPI_CHAR, &message, MPI_STATUS_IGNORE);
+        if (nBytes >= static_cast<int>(sizeof(header))) {
+            memcpy(&header, data.data(), sizeof(header));
+            CMPISnapshots::getInstance()->cut(*pPackageInterp, header.s_snapshot);
+        }
+    }
+}
+/**
+ * pollReductions
+ *    Idle poller (see MPITcl_addIdlePoller): take the snapshot cuts that
+ *    have come from rank 0, through whatever receive matches them, and
+ *    move the background reductions along while a rank waits for
+ *    messages.
+ * @return bool - true if any are still in flight.
+ */
+static bool
+pollReductions()
+{
+    if (blockComm == MPI_COMM_NULL) return false;     // Not set up yet.
+    int rank;
+    MPI_Comm_rank(blockComm, &rank);
+    if (rank != 0) {
+        CMPIDataGetter*  pGetter      = CMPIDataGetter::current();
+        CMPIDistributor* pDistributor = CMPIDistributor::current();
+        if (pDistributor) pDistributor->takeCuts();
+        if (!pGetter || !pGetter->takeCuts()) takeCutMessages();
+    }
+    bool runs      = !CMPIRunReducer::getInstance()->progress();
+    bool snapshots = !CMPISnapshots::getInstance()->progress();
+    return runs || snapshots;
+}
 
 ///////////////////////////////////////////////////////////////////////////////
 //  Package initialization.
@@ -336,11 +3759,17 @@ extern "C" {
         Tcl_PkgRequire(pRawInterp, "spectcl", "1.0", 0);   // We depend on the spectcl pkg.
         Tcl_PkgProvide(pRawInterp, packageName, version);
         
+        // Nothing collective here; see setupRanks.
         
         CTCLInterpreter* pInterp = new CTCLInterpreter(pRawInterp);
+        pPackageInterp           = pInterp;
         
         new CMPISourceCommand(*pInterp);     // add mpisource command.
         new CMPISinkCommand(*pInterp);       
+        new CMPIMergeCommand(*pInterp);
+        new CMPISpecTclCommand(*pInterp);
+        CMPIDefinitionSync::getInstance(*pInterp);
+        MPITcl_addIdlePoller(pollReductions);
         
         
         return TCL_OK;              // Package successful init.
@@ -0,0 +1,1788 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Giordano Cerriza
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  mpiSpectra.cpp
+ *  @brief: Implement sharded spectra, node shared spectra and spectrum
+ *          reduction, in the foreground or in the background.
+ */
+#include "mpiSpectra.h"
+
+#include <TCLInterpreter.h>
+#include <SpecTcl.h>
+#include <Histogrammer.h>
+#include <GateContainer.h>
+#include <Spectrum.h>
+#include <Parameter.h>
+#include <Event.h>
+#include <EventList.h>
+#include <tcl.h>
+
+#include <sched.h>
+#include <string.h>
+#include <algorithm>
+#include <iostream>
+#include <new>
+
+static const int SHARD_TUPLES(1);          // A batch of parameter tuples.
+static const int SHARD_END(2);             // No more tuples this run.
+
+static const int REDUCE_STATUS(1);         // Owner has the spectrum or not.
+static const int REDUCE_DATA(2);           // Spectrum storage pieces.
+
+static const size_t PIECEBYTES(1024*1024*1024);   // Max bytes per MPI call.
+static const size_t CACHELINE(64);
+
+/**
+ * MPISpecTcl_spectrumNames
+ *    @param interp - interpreter SpecTcl's commands are in.
+ *    @param[out] names - the names of the defined spectra, in spectrum
+ *                        -list order.
+ *    @throw std::string - spectrum -list failed.
+ */
+void
+MPISpecTcl_spectrumNames(CTCLInterpreter& interp, std::vector<std::string>& names)
+{
+    Tcl_Interp* pInterp = interp.getInterpreter();
+    if (Tcl_EvalEx(pInterp, "spectrum -list", -1, TCL_EVAL_GLOBAL) != TCL_OK) {
+        throw std::string(Tcl_GetStringResult(pInterp));
+    }
+    Tcl_Obj*  pList = Tcl_GetObjResult(pInterp);
+    Tcl_IncrRefCount(pList);
+    Tcl_ResetResult(pInterp);
+    int       nDefs;
+    Tcl_Obj** pDefs;
+    Tcl_ListObjGetElements(pInterp, pList, &nDefs, &pDefs);
+    for (int i = 0; i < nDefs; i++) {
+        Tcl_Obj* pName;
+        if ((Tcl_ListObjIndex(pInterp, pDefs[i], 1, &pName) == TCL_OK) && pName) {
+            names.push_back(Tcl_GetString(pName));
+        }
+    }
+    Tcl_DecrRefCount(pList);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// CMPISpectrumShards implementation.
+
+CMPISpectrumShards* CMPISpectrumShards::m_pInstance(nullptr);
+
+/**
+ * getInstance
+ *    The first call is collective over MPI_COMM_WORLD as it makes our
+ *    communicator.  It's made by mpispectcl setup (or the first
+ *    mpisink/mpisource).
+ * @return CMPISpectrumShards* - the singleton.
+ */
+CMPISpectrumShards*
+CMPISpectrumShards::getInstance()
+{
+    if (!m_pInstance) {
+        m_pInstance = new CMPISpectrumShards;
+    }
+    return m_pInstance;
+}
+/**
+ * constructor
+ */
+CMPISpectrumShards::CMPISpectrumShards() :
+    m_enabled(false), m_sinkRegistered(false), m_neededValid(false),
+    m_pEvent(nullptr), m_batchBytes(64*1024)
+{
+    MPI_Comm_dup(MPI_COMM_WORLD, &m_comm);
+    MPI_Comm_rank(m_comm, &m_rank);
+    MPI_Comm_size(m_comm, &m_nRanks);
+    m_outboxes.resize(m_nRanks);
+    for (size_t i = 0; i < m_outboxes.size(); i++) {
+        m_outboxes[i].s_requests[0] = MPI_REQUEST_NULL;
+        m_outboxes[i].s_requests[1] = MPI_REQUEST_NULL;
+        m_outboxes[i].s_current     = 0;
+    }
+}
+
+/**
+ * enable
+ *    Turn sharding on or off.  When a worker turns it on, the spectra it
+ *    doesn't own are deleted and our event sink is added to the event
+ *    sink pipeline if it's not already there.
+ *
+ * @param interp - interpreter SpecTcl's commands are in.
+ * @param enable - new state.
+ */
+void
+CMPISpectrumShards::enable(CTCLInterpreter& interp, bool enable)
+{
+    if (enable && (CMPINodeSpectra::getInstance()->mode() != CMPINodeSpectra::off)) {
+        throw std::string("Spectra can't be sharded and node shared at the same time");
+    }
+    if (enable && CMPIRunReducer::getInstance()->enabled()) {
+        throw std::string("Spectra can't be sharded while reduced in the background");
+    }
+    m_enabled     = enable;
+    m_neededValid = false;
+    if (!m_enabled || (m_rank == 0)) return;
+
+    std::vector<std::string> defined;
+    std::vector<std::string> names;
+    MPISpecTcl_spectrumNames(interp, defined);
+    for (size_t i = 0; i < defined.size(); i++) {
+        if (!owns(defined[i])) names.push_back(defined[i]);
+    }
+    for (size_t i = 0; i < names.size(); i++) {
+        Tcl_Obj* words[3] = {
+            Tcl_NewStringObj("spectrum", -1), Tcl_NewStringObj("-delete", -1),
+            Tcl_NewStringObj(names[i].c_str(), names[i].size())
+        };
+        Tcl_Obj* pCommand = Tcl_NewListObj(3, words);
+        Tcl_IncrRefCount(pCommand);
+        Tcl_EvalObjEx(interp.getInterpreter(), pCommand, TCL_EVAL_GLOBAL);
+        Tcl_DecrRefCount(pCommand);
+    }
+
+    if (!m_sinkRegistered) {
+        SpecTcl::getInstance()->AddEventSink(*this, "mpishards");
+        m_sinkRegistered = true;
+    }
+}
+/**
+ * ownerOf
+ *    @param spectrum - name of a spectrum.
+ *    @return int - rank of the worker that owns it.
+ */
+int
+CMPISpectrumShards::ownerOf(const std::string& spectrum) const
+{
+    if (m_nRanks < 2) return 0;
+    return 1 + hash(spectrum) % (m_nRanks - 1);
+}
+/**
+ * owns
+ *    @param spectrum - name of a spectrum.
+ *    @return bool - true if this rank should hold it.  Rank 0 holds
+ *                   all spectra as do all ranks if not sharding.
+ */
+bool
+CMPISpectrumShards::owns(const std::string& spectrum) const
+{
+    return !m_enabled || (m_rank == 0) || (ownerOf(spectrum) == m_rank);
+}
+
+/**
+ * spectrumDefined
+ *    Learn the parameters a spectrum needs.  Called for every spectrum
+ *    definition change the journal brings, owned or not.
+ *
+ * @param interp - interpreter.
+ * @param name   - spectrum name.
+ * @param def    - spectrum definition (-list description less the id:
+ *                 name type parameters ...), empty if deleted.
+ */
+void
+CMPISpectrumShards::spectrumDefined(
+    CTCLInterpreter& interp, const std::string& name, const std::string& def
+)
+{
+    if (def.empty()) {
+        m_spectrumParameters.erase(name);
+    } else {
+        parameterNames(interp, def, 2, m_spectrumParameters[name]);
+    }
+    m_neededValid = false;
+}
+/**
+ * gateDefined
+ *    Learn the parameters a gate needs.  Gates can be applied to any
+ *    spectrum so every worker is sent these.
+ *
+ * @param interp - interpreter.
+ * @param name   - gate name.
+ * @param def    - gate definition (-list description less the id:
+ *                 name type description), empty if deleted.
+ */
+void
+CMPISpectrumShards::gateDefined(
+    CTCLInterpreter& interp, const std::string& name, const std::string& def
+)
+{
+    if (def.empty()) {
+        m_gateParameters.erase(name);
+    } else {
+        parameterNames(interp, def, 2, m_gateParameters[name]);
+    }
+    m_neededValid = false;
+}
+
+/**
+ * operator()
+ *    Event sink - route each event's parameters to the workers that need
+ *    them and histogram whatever has come in from the others.
+ *
+ * @param events - the events.
+ */
+void
+CMPISpectrumShards::operator()(CEventList& events)
+{
+    if (!m_enabled) return;
+    if (!m_neededValid) computeNeeded();
+
+    for (CEventListIterator p = events.begin(); p != events.end(); p++) {
+        if (!*p) break;
+        route(**p);
+    }
+    poll(false);
+}
+/**
+ * endOfData
+ *    Called by the data getter when the distributor says there's no more
+ *    data.  Send the partial batches, then exchange end markers with the
+ *    other workers that took part in the run, histogramming what they
+ *    send until they've all ended too.  A worker that was dropped from
+ *    the run exchanges nothing.  Ends are counted per worker since one
+ *    that's gone on to end the next run may already have sent that
+ *    run's.
+ *
+ * @param participants - the workers that took part in the run.
+ */
+void
+CMPISpectrumShards::endOfData(const std::set<int>& participants)
+{
+    if (!m_enabled || (m_rank == 0)) return;
+
+    for (int rank = 1; rank < m_nRanks; rank++) {
+        if (rank != m_rank) ship(rank);
+    }
+    if (!participants.count(m_rank)) return;
+
+    std::vector<MPI_Request> ends;
+    for (auto p = participants.begin(); p != participants.end(); p++) {
+        if ((*p == 0) || (*p == m_rank) || (*p >= m_nRanks)) continue;
+        MPI_Request end;
+        MPI_Isend(nullptr, 0, MPI_CHAR, *p, SHARD_END, m_comm, &end);
+        ends.push_back(end);
+    }
+    for (auto p = participants.begin(); p != participants.end(); p++) {
+        if ((*p == 0) || (*p == m_rank) || (*p >= m_nRanks)) continue;
+        while (!m_ends[*p]) {
+            poll(true);
+        }
+        m_ends[*p]--;
+    }
+    for (size_t i = 0; i < ends.size(); i++) {
+        waitFor(ends[i]);
+    }
+    for (auto p = participants.begin(); p != participants.end(); p++) {
+        if ((*p == 0) || (*p == m_rank) || (*p >= m_nRanks)) continue;
+        waitFor(m_outboxes[*p].s_requests[0]);
+        waitFor(m_outboxes[*p].s_requests[1]);
+    }
+}
+
+/**
+ * computeNeeded
+ *    Work out the parameter ids each worker needs from the parameters of
+ *    the spectra it owns and those of all gates.
+ */
+void
+CMPISpectrumShards::computeNeeded()
+{
+    SpecTcl* pApi = SpecTcl::getInstance();
+    m_needed.assign(m_nRanks, std::vector<unsigned>());
+
+    std::vector<unsigned> gateIds;
+    for (std::map<std::string, std::vector<std::string> >::iterator p =
+             m_gateParameters.begin(); p != m_gateParameters.end(); p++) {
+        for (size_t i = 0; i < p->second.size(); i++) {
+            CParameter* pParam = pApi->FindParameter(p->second[i]);
+            if (pParam) gateIds.push_back(pParam->getNumber());
+        }
+    }
+    for (std::map<std::string, std::vector<std::string> >::iterator p =
+             m_spectrumParameters.begin(); p != m_spectrumParameters.end(); p++) {
+        std::vector<unsigned>& needed(m_needed[ownerOf(p->first)]);
+        for (size_t i = 0; i < p->second.size(); i++) {
+            CParameter* pParam = pApi->FindParameter(p->second[i]);
+            if (pParam) needed.push_back(pParam->getNumber());
+        }
+    }
+    for (int rank = 1; rank < m_nRanks; rank++) {
+        std::vector<unsigned>& needed(m_needed[rank]);
+        if (!needed.empty()) {
+            needed.insert(needed.end(), gateIds.begin(), gateIds.end());
+        }
+        std::sort(needed.begin(), needed.end());
+        needed.erase(std::unique(needed.begin(), needed.end()), needed.end());
+    }
+    m_neededValid = true;
+}
+/**
+ * route
+ *    Append the tuple of parameters each other worker needs from an
+ *    event to its batch.  Workers that need none of the event's
+ *    parameters get nothing.
+ *
+ * @param event - the event.
+ */
+void
+CMPISpectrumShards::route(CEvent& event)
+{
+    for (int rank = 1; rank < m_nRanks; rank++) {
+        const std::vector<unsigned>& needed(m_needed[rank]);
+        if ((rank == m_rank) || needed.empty()) continue;
+
+        Outbox&            box(m_outboxes[rank]);
+        std::vector<char>& batch(box.s_data[box.s_current]);
+        size_t             countAt = batch.size();
+        uint32_t           count   = 0;
+        batch.resize(countAt + sizeof(count));
+        for (size_t i = 0; i < needed.size(); i++) {
+            unsigned id = needed[i];
+            if ((id < event.size()) && event[id].isValid()) {
+                double value = event[id];
+                uint32_t id32 = id;
+                size_t at = batch.size();
+                batch.resize(at + sizeof(id32) + sizeof(value));
+                memcpy(&batch[at], &id32, sizeof(id32));
+                memcpy(&batch[at + sizeof(id32)], &value, sizeof(value));
+                count++;
+            }
+        }
+        if (count) {
+            memcpy(&batch[countAt], &count, sizeof(count));
+            if (batch.size() >= m_batchBytes) ship(rank);
+        } else {
+            batch.resize(countAt);
+        }
+    }
+}
+/**
+ * ship
+ *    Send a worker's current batch, if any, and make its other buffer
+ *    current once the send from it has completed.
+ *
+ * @param rank - the worker.
+ */
+void
+CMPISpectrumShards::ship(int rank)
+{
+    Outbox& box(m_outboxes[rank]);
+    int     current = box.s_current;
+    if (box.s_data[current].empty()) return;
+
+    MPI_Isend(
+        box.s_data[current].data(), box.s_data[current].size(), MPI_CHAR,
+        rank, SHARD_TUPLES, m_comm, &box.s_requests[current]
+    );
+    box.s_current = 1 - current;
+    waitFor(box.s_requests[box.s_current]);
+    box.s_data[box.s_current].clear();
+}
+/**
+ * waitFor
+ *    Wait for one of our sends to complete.  While waiting, batches from
+ *    the other workers are histogrammed as they may be waiting for us
+ *    to receive before they can receive from us.
+ *
+ * @param request - the send.
+ */
+void
+CMPISpectrumShards::waitFor(MPI_Request& request)
+{
+    int done = 0;
+    MPI_Test(&request, &done, MPI_STATUS_IGNORE);
+    while (!done) {
+        poll(false);
+        MPI_Test(&request, &done, MPI_STATUS_IGNORE);
+    }
+}
+/**
+ * poll
+ *    Receive and histogram batches from other workers.
+ *
+ * @param block - If true, wait for and process one message.  Otherwise,
+ *                process all messages that have arrived.
+ */
+void
+CMPISpectrumShards::poll(bool block)
+{
+    for (;;) {
+        MPI_Status stat;
+        int        flag = 1;
+        if (block) {
+            MPI_Probe(MPI_ANY_SOURCE, MPI_ANY_TAG, m_comm, &stat);
+        } else {
+            MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, m_comm, &flag, &stat);
+        }
+        if (!flag) return;
+
+        int nBytes;
+        MPI_Get_count(&stat, MPI_CHAR, &nBytes);
+        m_inbox.resize(nBytes);
+        MPI_Recv(
+            m_inbox.data(), nBytes, MPI_CHAR, stat.MPI_SOURCE, stat.MPI_TAG,
+            m_comm, MPI_STATUS_IGNORE
+        );
+        if (stat.MPI_TAG == SHARD_END) {
+            m_ends[stat.MPI_SOURCE]++;
+        } else {
+            histogram(m_inbox.data(), nBytes);
+        }
+        if (block) return;
+    }
+}
+/**
+ * histogram
+ *    Rebuild the events in a batch of tuples and give them to the
+ *    histogrammer.  Only the spectra we own exist here so only those are
+ *    incremented.  A truncated event and what follows it are dropped.
+ *
+ * @param pData  - the batch.
+ * @param nBytes - its size.
+ */
+void
+CMPISpectrumShards::histogram(const char* pData, size_t nBytes)
+{
+    if (!m_pEvent) m_pEvent = new CEvent;
+    CHistogrammer* pHistogrammer = SpecTcl::getInstance()->GetHistogrammer();
+    const char*    pEnd          = pData + nBytes;
+    const size_t   tuple         = sizeof(uint32_t) + sizeof(double);
+
+    while (pData + sizeof(uint32_t) <= pEnd) {
+        uint32_t count;
+        memcpy(&count, pData, sizeof(count));
+        pData += sizeof(count);
+        if (uint64_t(count)*tuple > static_cast<uint64_t>(pEnd - pData)) {
+            std::cerr << "Truncated shard batch; " << (pEnd - pData)
+                      << " bytes of it ignored" << std::endl;
+            return;
+        }
+        m_pEvent->clear();
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t id;
+            double   value;
+            memcpy(&id, pData, sizeof(id));
+            memcpy(&value, pData + sizeof(id), sizeof(value));
+            pData += tuple;
+            (*m_pEvent)[id] = value;
+        }
+        (*pHistogrammer)(*m_pEvent);
+    }
+    if (pData != pEnd) {
+        std::cerr << "Truncated shard batch; " << (pEnd - pData)
+                  << " bytes of it ignored" << std::endl;
+    }
+}
+/**
+ * parameterNames
+ *    Pull the words out of one element of a -list description that might
+ *    be parameter names.  The element is flattened however deeply its
+ *    lists nest; words that turn out not to be parameters are ignored
+ *    later.
+ *
+ * @param interp - interpreter.
+ * @param list   - the description.
+ * @param index  - the element with the parameters.
+ * @param[out] names - receives the words.
+ */
+void
+CMPISpectrumShards::parameterNames(
+    CTCLInterpreter& interp, const std::string& list, size_t index,
+    std::vector<std::string>& names
+)
+{
+    Tcl_Interp* pInterp = interp.getInterpreter();
+    Tcl_Obj*    pList   = Tcl_NewStringObj(list.c_str(), list.size());
+    Tcl_IncrRefCount(pList);
+    names.clear();
+
+    std::vector<Tcl_Obj*> pending;
+    Tcl_Obj* pElement = nullptr;
+    Tcl_ListObjIndex(pInterp, pList, index, &pElement);
+    if (pElement) pending.push_back(pElement);
+    while (!pending.empty()) {
+        Tcl_Obj* pItem = pending.back();
+        pending.pop_back();
+        int       nWords;
+        Tcl_Obj** pWords;
+        if (Tcl_ListObjGetElements(pInterp, pItem, &nWords, &pWords) != TCL_OK) {
+            Tcl_ResetResult(pInterp);
+            continue;
+        }
+        if ((nWords == 1) && (strcmp(Tcl_GetString(pWords[0]), Tcl_GetString(pItem)) == 0)) {
+            names.push_back(Tcl_GetString(pItem));
+        } else {
+            for (int i = 0; i < nWords; i++) pending.push_back(pWords[i]);
+        }
+    }
+    Tcl_DecrRefCount(pList);
+}
+/**
+ * hash
+ *    FNV-1a hash of a name.  It must give the same value in all ranks.
+ */
+uint32_t
+CMPISpectrumShards::hash(const std::string& name)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < name.size(); i++) {
+        h ^= static_cast<uint8_t>(name[i]);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// CMPINodeSpectra implementation.
+
+CMPINodeSpectra* CMPINodeSpectra::m_pInstance(nullptr);
+
+/**
+ * getInstance
+ *    The first call is collective over MPI_COMM_WORLD as it makes the
+ *    node and leader communicators.
+ * @return CMPINodeSpectra* - the singleton.
+ */
+CMPINodeSpectra*
+CMPINodeSpectra::getInstance()
+{
+    if (!m_pInstance) {
+        m_pInstance = new CMPINodeSpectra;
+    }
+    return m_pInstance;
+}
+/**
+ * constructor
+ *    Group the workers by node and make a communicator of the node
+ *    leaders (lowest world rank of each node) with rank 0 at its rank 0.
+ */
+CMPINodeSpectra::CMPINodeSpectra() :
+    m_mode(off), m_nodeComm(MPI_COMM_NULL), m_leaderComm(MPI_COMM_NULL),
+    m_nodeRank(0), m_nodeSize(1), m_window(MPI_WIN_NULL), m_copyBytes(0),
+    m_histogrammer(*this), m_histogrammerReplaced(false)
+{
+    MPI_Comm_rank(MPI_COMM_WORLD, &m_worldRank);
+    MPI_Comm workers;
+    MPI_Comm_split(
+        MPI_COMM_WORLD, (m_worldRank == 0) ? MPI_UNDEFINED : 0, m_worldRank,
+        &workers
+    );
+    if (workers != MPI_COMM_NULL) {
+        MPI_Comm_split_type(
+            workers, MPI_COMM_TYPE_SHARED, m_worldRank, MPI_INFO_NULL, &m_nodeComm
+        );
+        MPI_Comm_rank(m_nodeComm, &m_nodeRank);
+        MPI_Comm_size(m_nodeComm, &m_nodeSize);
+        MPI_Comm_free(&workers);
+    }
+    MPI_Comm_split(
+        MPI_COMM_WORLD, leader() ? 0 : MPI_UNDEFINED, m_worldRank, &m_leaderComm
+    );
+}
+
+/**
+ * setMode
+ *    Change the node sharing mode.  Must be done in all ranks at the same
+ *    time as workers on a node share the window allocation.
+ *
+ * @param interp - interpreter SpecTcl's commands are in.
+ * @param mode   - new mode.
+ * @throw std::string - the spectra of the node's workers differ or
+ *                      spectra are sharded.
+ */
+void
+CMPINodeSpectra::setMode(CTCLInterpreter& interp, Mode mode)
+{
+    if ((mode != off) && CMPISpectrumShards::getInstance()->enabled()) {
+        throw std::string("Spectra can't be sharded and node shared at the same time");
+    }
+    if ((mode != off) && CMPIRunReducer::getInstance()->enabled()) {
+        throw std::string("Spectra can't be node shared while reduced in the background");
+    }
+    if (m_worldRank == 0) {
+        m_mode = mode;                       // Nothing to share.
+        return;
+    }
+    if (m_mode != off) {
+        detach();
+    }
+    m_mode = mode;
+    if (m_mode != off) {
+        try {
+            attach(interp);
+        }
+        catch (...) {
+            m_mode = off;
+            throw;
+        }
+    }
+}
+/**
+ * leader
+ *    @return bool - true if we take part in reductions when node sharing
+ *                   (rank 0 and the lowest ranked worker of each node).
+ */
+bool
+CMPINodeSpectra::leader() const
+{
+    return (m_worldRank == 0) || (m_nodeRank == 0);
+}
+/**
+ * synchronize
+ *    Collective over the node's workers: once it returns, whatever each
+ *    of them stored in the window before calling it can be read by all
+ *    of them.  Does nothing in rank 0 or when sharing is off.
+ */
+void
+CMPINodeSpectra::synchronize()
+{
+    if ((m_mode == off) || (m_window == MPI_WIN_NULL)) return;
+    MPI_Win_sync(m_window);
+    MPI_Barrier(m_nodeComm);
+    MPI_Win_sync(m_window);
+}
+/**
+ * nodeSum
+ *    Striped mode (leader) - sum the node's copies of a spectrum.
+ *
+ * @param name  - spectrum name.
+ * @param bytes - storage size rank 0 expects.
+ * @param type  - channel type rank 0 expects.
+ * @param[out] sum - storage for the sum.
+ * @return const char* - the sum or nullptr if the spectrum isn't
+ *                       shared or doesn't match.
+ */
+const char*
+CMPINodeSpectra::nodeSum(
+    const std::string& name, uint64_t bytes, DataType_t type,
+    std::vector<char>& sum
+)
+{
+    std::map<std::string, Slab>::iterator p = m_slabs.find(name);
+    if ((m_mode != striped) || (p == m_slabs.end())
+        || (p->second.s_bytes != bytes) || (p->second.s_type != type)) {
+        return nullptr;
+    }
+    sum.resize(bytes);
+    for (int rank = 0; rank < m_nodeSize; rank++) {
+        MPI_Aint size;
+        int      unit;
+        char*    pBase;
+        MPI_Win_shared_query(m_window, rank, &size, &unit, &pBase);
+        const char* pCopy = pBase + p->second.s_offset;
+        if (rank == 0) {
+            memcpy(sum.data(), pCopy, bytes);
+        } else {
+            add(sum.data(), pCopy, bytes, type);
+        }
+    }
+    return sum.data();
+}
+/**
+ * modeFromString
+ *    @param mode - off, locked or striped.
+ *    @return Mode
+ *    @throw std::string - invalid mode.
+ */
+CMPINodeSpectra::Mode
+CMPINodeSpectra::modeFromString(const std::string& mode)
+{
+    if (mode == "off")     return off;
+    if (mode == "locked")  return locked;
+    if (mode == "striped") return striped;
+    throw std::string("Node sharing mode must be off, locked or striped: ") + mode;
+}
+const char*
+CMPINodeSpectra::modeToString(Mode mode)
+{
+    switch (mode) {
+    case locked:
+        return "locked";
+    case striped:
+        return "striped";
+    default:
+        return "off";
+    }
+}
+/**
+ * add
+ *    Add one spectrum's channels into another's.
+ *
+ * @param pDest - sum.
+ * @param pSrc  - what to add.
+ * @param bytes - storage size.
+ * @param type  - channel type.
+ */
+template<class T>
+static void
+addChannels(void* pDest, const void* pSrc, size_t bytes)
+{
+    T*       d = static_cast<T*>(pDest);
+    const T* s = static_cast<const T*>(pSrc);
+    for (size_t i = 0; i < bytes/sizeof(T); i++) {
+        d[i] += s[i];
+    }
+}
+void
+CMPINodeSpectra::add(void* pDest, const void* pSrc, size_t bytes, DataType_t type)
+{
+    switch (type) {
+    case keByte:
+        addChannels<uint8_t>(pDest, pSrc, bytes);
+        break;
+    case keWord:
+        addChannels<uint16_t>(pDest, pSrc, bytes);
+        break;
+    case keLong:
+        addChannels<uint32_t>(pDest, pSrc, bytes);
+        break;
+    case keFloat:
+        addChannels<float>(pDest, pSrc, bytes);
+        break;
+    case keDouble:
+        addChannels<double>(pDest, pSrc, bytes);
+        break;
+    default:
+        throw std::string("Spectrum has a channel type that can't be summed");
+    }
+}
+
+/**
+ * attach
+ *    Lay out the spectra, allocate the node window and move the spectra
+ *    into it keeping their counts.  In locked mode each spectrum is
+ *    preceded by a cache line holding its lock, the leader's counts are
+ *    copied into the shared copy and the others add theirs to it.
+ *
+ * @param interp - interpreter.
+ * @throw std::string - the node's workers don't have the same spectra.
+ */
+void
+CMPINodeSpectra::attach(CTCLInterpreter& interp)
+{
+    SpecTcl* pApi = SpecTcl::getInstance();
+
+    // Lay out the spectra in name order.  Each starts on a cache line
+    // (after the one with its lock in locked mode).
+
+    std::vector<std::string> names;
+    MPISpecTcl_spectrumNames(interp, names);
+    for (size_t i = 0; i < names.size(); i++) {
+        const std::string& name      = names[i];
+        CSpectrum*         pSpectrum = pApi->FindSpectrum(name);
+        if (!pSpectrum) continue;
+        Slab slab;
+        slab.s_pSpectrum = pSpectrum;
+        slab.s_bytes     = pSpectrum->StorageNeeded();
+        slab.s_type      = pSpectrum->StorageType();
+        slab.s_pLock     = nullptr;
+        m_slabs[name]    = slab;
+    }
+
+    uint64_t layoutHash = 14695981039346656037ull;
+    m_copyBytes = 0;
+    for (std::map<std::string, Slab>::iterator p = m_slabs.begin();
+         p != m_slabs.end(); p++) {
+        if (m_mode == locked) {
+            m_copyBytes += CACHELINE;
+        }
+        p->second.s_offset = m_copyBytes;
+        m_copyBytes += (p->second.s_bytes + CACHELINE - 1)/CACHELINE*CACHELINE;
+        std::string key = p->first + ":" + std::to_string(p->second.s_bytes);
+        for (size_t i = 0; i < key.size(); i++) {
+            layoutHash = (layoutHash ^ static_cast<uint8_t>(key[i]))*1099511628211ull;
+        }
+    }
+    uint64_t hashes[2] = {layoutHash, ~layoutHash};
+    uint64_t maxima[2];
+    MPI_Allreduce(hashes, maxima, 2, MPI_UINT64_T, MPI_MAX, m_nodeComm);
+    if ((maxima[0] != layoutHash) || (maxima[1] != ~layoutHash)) {
+        m_slabs.clear();
+        throw std::string("The workers on a node must have the same spectra to share them");
+    }
+
+    // Allocate the window.  Striped copies are better each in memory
+    // local to its worker.
+
+    MPI_Info info;
+    MPI_Info_create(&info);
+    MPI_Aint size = m_copyBytes;
+    if (m_mode == striped) {
+        MPI_Info_set(info, "alloc_shared_noncontig", "true");
+    } else if (m_nodeRank != 0) {
+        size = 0;
+    }
+    char* pBase;
+    MPI_Win_allocate_shared(size, 1, info, m_nodeComm, &pBase, &m_window);
+    MPI_Info_free(&info);
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, m_window);
+    if (m_mode == locked) {
+        MPI_Aint leaderSize;
+        int      unit;
+        MPI_Win_shared_query(m_window, 0, &leaderSize, &unit, &pBase);
+        for (std::map<std::string, Slab>::iterator p = m_slabs.begin();
+             p != m_slabs.end(); p++) {
+            void* pLock = pBase + p->second.s_offset - CACHELINE;
+            p->second.s_pLock = (m_nodeRank == 0) ?
+                new(pLock) std::atomic<uint32_t>(0) :
+                static_cast<std::atomic<uint32_t>*>(pLock);
+        }
+    }
+
+    // Move the counts into the window.
+
+    for (int pass = 0; pass < 2; pass++) {
+        bool adding = (m_mode == locked) && (m_nodeRank != 0);
+        if (pass != (adding ? 1 : 0)) {
+            MPI_Barrier(m_nodeComm);        // Leader copies before adds.
+            continue;
+        }
+        for (std::map<std::string, Slab>::iterator p = m_slabs.begin();
+             p != m_slabs.end(); p++) {
+            const Slab& slab(p->second);
+            char* pShared = pBase + slab.s_offset;
+            if (adding) {
+                lock(slab.s_pLock);
+                add(pShared, slab.s_pSpectrum->getStorage(), slab.s_bytes, slab.s_type);
+                unlock(slab.s_pLock);
+            } else {
+                memcpy(pShared, slab.s_pSpectrum->getStorage(), slab.s_bytes);
+            }
+        }
+    }
+    MPI_Win_sync(m_window);
+    MPI_Barrier(m_nodeComm);
+    for (std::map<std::string, Slab>::iterator p = m_slabs.begin();
+         p != m_slabs.end(); p++) {
+        p->second.s_pSpectrum->ReplaceStorage(pBase + p->second.s_offset, false);
+    }
+
+    if (m_mode == locked) {
+        replaceHistogrammer(true);
+    }
+}
+/**
+ * detach
+ *    Give the spectra private storage again and free the window.  In
+ *    locked mode only the leader keeps the counts so they're not counted
+ *    once per worker.  Spectra deleted since they were attached are
+ *    skipped.
+ */
+void
+CMPINodeSpectra::detach()
+{
+    SpecTcl* pApi = SpecTcl::getInstance();
+    char*    pBase;
+    MPI_Aint size;
+    int      unit;
+    replaceHistogrammer(false);
+    MPI_Win_shared_query(m_window, (m_mode == locked) ? 0 : m_nodeRank, &size, &unit, &pBase);
+    bool keep = (m_mode == striped) || (m_nodeRank == 0);
+
+    for (std::map<std::string, Slab>::iterator p = m_slabs.begin();
+         p != m_slabs.end(); p++) {
+        const Slab& slab(p->second);
+        if (pApi->FindSpectrum(p->first) != slab.s_pSpectrum) continue;
+        char* pPrivate = new char[slab.s_bytes];
+        if (keep) {
+            memcpy(pPrivate, pBase + slab.s_offset, slab.s_bytes);
+        } else {
+            memset(pPrivate, 0, slab.s_bytes);
+        }
+        slab.s_pSpectrum->ReplaceStorage(pPrivate, true);
+    }
+    m_slabs.clear();
+    MPI_Barrier(m_nodeComm);                // Everyone's copied out.
+    MPI_Win_unlock_all(m_window);
+    MPI_Win_free(&m_window);
+    m_copyBytes = 0;
+}
+/**
+ * replaceHistogrammer
+ *    Swap our histogrammer in for SpecTcl's in the event sink pipeline
+ *    (locked mode) or put SpecTcl's back.
+ *
+ * @param replace - true to swap ours in.
+ */
+void
+CMPINodeSpectra::replaceHistogrammer(bool replace)
+{
+    if (replace == m_histogrammerReplaced) return;
+    SpecTcl*       pApi          = SpecTcl::getInstance();
+    CHistogrammer* pHistogrammer = pApi->GetHistogrammer();
+    if (replace) {
+        pApi->InsertEventSink(
+            m_histogrammer, pApi->FindSink(*pHistogrammer), "mpinodehistogrammer"
+        );
+        pApi->RemoveEventSink(*pHistogrammer);
+    } else {
+        pApi->InsertEventSink(
+            *pHistogrammer, pApi->FindSink(m_histogrammer), "Histogrammer"
+        );
+        pApi->RemoveEventSink(m_histogrammer);
+    }
+    m_histogrammerReplaced = replace;
+}
+/**
+ * lock/unlock
+ *    Take/drop a spectrum's lock.  Acquiring and releasing the lock word
+ *    orders our stores to the channels with the other workers'.  The
+ *    spectra are small compared with the rest of an event's work so a
+ *    waiter spins a little before yielding.
+ *
+ * @param pLock - the spectrum's lock word.
+ */
+void
+CMPINodeSpectra::lock(std::atomic<uint32_t>* pLock)
+{
+    int spins = 0;
+    while (pLock->exchange(1, std::memory_order_acquire)) {
+        while (pLock->load(std::memory_order_relaxed)) {
+            if (++spins > 100) {
+                sched_yield();
+            }
+        }
+    }
+}
+void
+CMPINodeSpectra::unlock(std::atomic<uint32_t>* pLock)
+{
+    pLock->store(0, std::memory_order_release);
+}
+/**
+ * CNodeHistogrammer::operator()
+ *    Locked mode - histogram an event list in place of SpecTcl's
+ *    histogrammer.  As it does, the gate cache is reset before each event
+ *    and every spectrum is given the event; the shared spectra are
+ *    incremented holding their own lock.  Each worker starts at a
+ *    different spectrum so that workers on the node tend to be working
+ *    on different spectra.  Spectra defined since the window was laid
+ *    out aren't shared so they need no lock.
+ *
+ * @param events - the event list.
+ */
+void
+CMPINodeSpectra::CNodeHistogrammer::operator()(CEventList& events)
+{
+    SpecTcl* pApi = SpecTcl::getInstance();
+    m_targets.clear();
+    for (SpectrumDictionaryIterator p = pApi->SpectrumBegin();
+         p != pApi->SpectrumEnd(); p++) {
+        Target target = {p->second, nullptr};
+        std::map<std::string, Slab>::iterator pSlab = m_owner.m_slabs.find(p->first);
+        if ((pSlab != m_owner.m_slabs.end())
+            && (pSlab->second.s_pSpectrum == p->second)) {
+            target.s_pLock = pSlab->second.s_pLock;
+        }
+        m_targets.push_back(target);
+    }
+    if (m_targets.empty()) return;
+    size_t first = m_owner.m_nodeRank % m_targets.size();
+
+    for (CEventListIterator p = events.begin(); p != events.end(); p++) {
+        CEvent* pEvent = *p;
+        if (!pEvent) break;
+        for (CGateDictionaryIterator g = pApi->GateBegin(); g != pApi->GateEnd(); g++) {
+            g->second->RecursiveReset();
+        }
+        for (size_t i = 0; i < m_targets.size(); i++) {
+            const Target& target(m_targets[(first + i) % m_targets.size()]);
+            if (target.s_pLock) lock(target.s_pLock);
+            (*target.s_pSpectrum)(*pEvent);
+            if (target.s_pLock) unlock(target.s_pLock);
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// CMPISpectrumReducer implementation.
+
+CMPISpectrumReducer* CMPISpectrumReducer::m_pInstance(nullptr);
+
+/**
+ * getInstance
+ *    The first call is collective over MPI_COMM_WORLD.
+ * @return CMPISpectrumReducer* - the singleton.
+ */
+CMPISpectrumReducer*
+CMPISpectrumReducer::getInstance()
+{
+    if (!m_pInstance) {
+        m_pInstance = new CMPISpectrumReducer;
+    }
+    return m_pInstance;
+}
+/**
+ * constructor
+ *    The reductions get their own communicator so they can't be confused
+ *    with anything else going on.
+ */
+CMPISpectrumReducer::CMPISpectrumReducer()
+{
+    MPI_Comm_dup(MPI_COMM_WORLD, &m_worldComm);
+    m_comm = m_worldComm;
+    MPI_Comm_rank(m_comm, &m_rank);
+}
+
+/**
+ * reduce
+ *    Replace the contents of rank 0's spectra with the sum of the
+ *    workers'.  Must be called in all ranks.  If spectra are node shared
+ *    only node leaders take part.  Each node's workers synchronize
+ *    before the leader reads the window, so it sees every count stored
+ *    in it, and again once it's done, so nobody increments what it's
+ *    reading.
+ *
+ * @param interp - interpreter SpecTcl's commands are in.
+ */
+void
+CMPISpectrumReducer::reduce(CTCLInterpreter& interp)
+{
+    CMPINodeSpectra* pNode = CMPINodeSpectra::getInstance();
+    bool             shared = pNode->mode() != CMPINodeSpectra::off;
+    m_comm = m_worldComm;
+    if (shared) {
+        pNode->synchronize();
+        if (!pNode->leader()) {
+            pNode->synchronize();
+            return;
+        }
+        m_comm = pNode->leaderComm();
+    }
+    MPI_Comm_rank(m_comm, &m_rank);
+    
+    std::vector<Spectrum> list;
+    spectra(interp, list);
+
+    CMPISpectrumShards* pShards = CMPISpectrumShards::getInstance();
+    for (size_t i = 0; i < list.size(); i++) {
+        if (pShards->enabled()) {
+            gatherOne(list[i], pShards->ownerOf(list[i].s_name));
+        } else {
+            reduceOne(list[i]);
+        }
+    }
+    if (shared) {
+        pNode->synchronize();
+    }
+}
+/**
+ * spectra
+ *    Rank 0 describes its spectra and broadcasts the descriptions.
+ *    Each is marshalled as a uint32 name length, the name, uint64 bytes
+ *    of storage and uint32 storage type.
+ *
+ * @param interp - interpreter.
+ * @param[out] result - the spectra.
+ */
+void
+CMPISpectrumReducer::spectra(CTCLInterpreter& interp, std::vector<Spectrum>& result)
+{
+    std::vector<char> marshalled;
+    if (m_rank == 0) {
+        SpecTcl*                 pApi = SpecTcl::getInstance();
+        std::vector<std::string> names;
+        MPISpecTcl_spectrumNames(interp, names);
+        for (size_t i = 0; i < names.size(); i++) {
+            const std::string& name      = names[i];
+            CSpectrum*         pSpectrum = pApi->FindSpectrum(name);
+            if (!pSpectrum) continue;
+
+            uint32_t nameLength = name.size();
+            uint64_t bytes      = pSpectrum->StorageNeeded();
+            uint32_t type       = pSpectrum->StorageType();
+            const char* p = reinterpret_cast<const char*>(&nameLength);
+            marshalled.insert(marshalled.end(), p, p + sizeof(nameLength));
+            marshalled.insert(marshalled.end(), name.begin(), name.end());
+            p = reinterpret_cast<const char*>(&bytes);
+            marshalled.insert(marshalled.end(), p, p + sizeof(bytes));
+            p = reinterpret_cast<const char*>(&type);
+            marshalled.insert(marshalled.end(), p, p + sizeof(type));
+        }
+    }
+    uint64_t size = marshalled.size();
+    MPI_Bcast(&size, 1, MPI_UINT64_T, 0, m_comm);
+    marshalled.resize(size);
+    MPI_Bcast(marshalled.data(), size, MPI_CHAR, 0, m_comm);
+
+    const char* p    = marshalled.data();
+    const char* pEnd = p + size;
+    while (p < pEnd) {
+        Spectrum spectrum;
+        uint32_t nameLength;
+        memcpy(&nameLength, p, sizeof(nameLength));
+        p += sizeof(nameLength);
+        spectrum.s_name.assign(p, nameLength);
+        p += nameLength;
+        memcpy(&spectrum.s_bytes, p, sizeof(spectrum.s_bytes));
+        p += sizeof(spectrum.s_bytes);
+        memcpy(&spectrum.s_type, p, sizeof(spectrum.s_type));
+        p += sizeof(spectrum.s_type);
+        result.push_back(spectrum);
+    }
+}
+/**
+ * reduceOne
+ *    Sum one unsharded spectrum into rank 0.  Rank 0's own counts are
+ *    cleared first so reducing again doesn't count anything twice; it
+ *    contributes only the baseline.
+ *    Workers without a matching spectrum contribute zeroes.  Striped node
+ *    leaders contribute the sum of their node's copies.
+ *
+ * @param spectrum - what rank 0 said about the spectrum.
+ */
+void
+CMPISpectrumReducer::reduceOne(const Spectrum& spectrum)
+{
+    DataType_t   type     = static_cast<DataType_t>(spectrum.s_type);
+    MPI_Datatype mpiT     = mpiType(type);
+    size_t       elSize   = elementSize(type);
+    uint64_t     nElements= spectrum.s_bytes/elSize;
+    size_t       piece    = PIECEBYTES/elSize;
+
+    CSpectrum*        pSpectrum = SpecTcl::getInstance()->FindSpectrum(spectrum.s_name);
+    char*             pStorage  = nullptr;
+    const char*       pContribution;
+    std::vector<char> local;
+    if (m_rank == 0) {
+        pSpectrum->Clear();
+        pStorage = static_cast<char*>(pSpectrum->getStorage());
+        pContribution = pStorage;
+        CMPISpectrumBaseline::getInstance()->addTo(
+            spectrum.s_name, pStorage, spectrum.s_bytes, type
+        );
+    } else if ((pContribution = CMPINodeSpectra::getInstance()->nodeSum(
+                   spectrum.s_name, spectrum.s_bytes, type, local))) {
+    } else if (pSpectrum && (pSpectrum->StorageNeeded() == spectrum.s_bytes)
+               && (pSpectrum->StorageType() == type)) {
+        pContribution = static_cast<const char*>(pSpectrum->getStorage());
+    } else {
+        local.assign(spectrum.s_bytes, 0);
+        pContribution = local.data();
+    }
+
+    for (uint64_t offset = 0; offset < nElements; offset += piece) {
+        int n = std::min<uint64_t>(piece, nElements - offset);
+        if (m_rank == 0) {
+            MPI_Reduce(MPI_IN_PLACE, pStorage + offset*elSize, n, mpiT, MPI_SUM, 0, m_comm);
+        } else {
+            MPI_Reduce(
+                pContribution + offset*elSize, nullptr, n, mpiT, MPI_SUM, 0, m_comm
+            );
+        }
+    }
+}
+/**
+ * gatherOne
+ *    Get a sharded spectrum from its owner.  The owner first says if it
+ *    has a matching spectrum; if not rank 0's is left cleared.  Rank 0
+ *    then adds the baseline.
+ *
+ * @param spectrum - what rank 0 said about the spectrum.
+ * @param owner    - rank that owns it.
+ */
+void
+CMPISpectrumReducer::gatherOne(const Spectrum& spectrum, int owner)
+{
+    if ((m_rank != 0) && (m_rank != owner)) return;
+
+    DataType_t type      = static_cast<DataType_t>(spectrum.s_type);
+    CSpectrum* pSpectrum = SpecTcl::getInstance()->FindSpectrum(spectrum.s_name);
+    int32_t    have;
+    if (m_rank == 0) {
+        pSpectrum->Clear();
+        MPI_Recv(&have, 1, MPI_INT32_T, owner, REDUCE_STATUS, m_comm, MPI_STATUS_IGNORE);
+    } else {
+        have = pSpectrum && (pSpectrum->StorageNeeded() == spectrum.s_bytes)
+            && (pSpectrum->StorageType() == type);
+        MPI_Send(&have, 1, MPI_INT32_T, 0, REDUCE_STATUS, m_comm);
+    }
+    if (have) {
+        char* pStorage = static_cast<char*>(pSpectrum->getStorage());
+        for (uint64_t offset = 0; offset < spectrum.s_bytes; offset += PIECEBYTES) {
+            int n = std::min<uint64_t>(PIECEBYTES, spectrum.s_bytes - offset);
+            if (m_rank == 0) {
+                MPI_Recv(
+                    pStorage + offset, n, MPI_CHAR, owner, REDUCE_DATA, m_comm,
+                    MPI_STATUS_IGNORE
+                );
+            } else {
+                MPI_Send(pStorage + offset, n, MPI_CHAR, 0, REDUCE_DATA, m_comm);
+            }
+        }
+    }
+    if (m_rank == 0) {
+        CMPISpectrumBaseline::getInstance()->addTo(
+            spectrum.s_name, pSpectrum->getStorage(), spectrum.s_bytes, type
+        );
+    }
+}
+/**
+ * mpiType
+ *    @param type - SpecTcl spectrum channel type.
+ *    @return MPI_Datatype - corresponding MPI type.
+ *    @throw std::string - unsupported type.
+ */
+MPI_Datatype
+CMPISpectrumReducer::mpiType(DataType_t type)
+{
+    switch (type) {
+    case keByte:
+        return MPI_UINT8_T;
+    case keWord:
+        return MPI_UINT16_T;
+    case keLong:
+        return MPI_UINT32_T;
+    case keFloat:
+        return MPI_FLOAT;
+    case keDouble:
+        return MPI_DOUBLE;
+    default:
+        throw std::string("Spectrum has a channel type that can't be reduced");
+    }
+}
+/**
+ * elementSize
+ *    @param type - SpecTcl spectrum channel type.
+ *    @return size_t - bytes per channel.
+ */
+size_t
+CMPISpectrumReducer::elementSize(DataType_t type)
+{
+    int size;
+    MPI_Type_size(mpiType(type), &size);
+    return size;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// CMPISpectrumBaseline implementation.
+
+CMPISpectrumBaseline* CMPISpectrumBaseline::m_pInstance(nullptr);
+
+/**
+ * getInstance
+ *    @return CMPISpectrumBaseline* - the singleton.
+ */
+CMPISpectrumBaseline*
+CMPISpectrumBaseline::getInstance()
+{
+    if (!m_pInstance) {
+        m_pInstance = new CMPISpectrumBaseline;
+    }
+    return m_pInstance;
+}
+/**
+ * set
+ *    Set a spectrum's baseline counts.
+ *
+ * @param name   - the spectrum.
+ * @param type   - its channel type.
+ * @param pData  - the counts.
+ * @param bytes  - their size.
+ */
+void
+CMPISpectrumBaseline::set(
+    const std::string& name, DataType_t type, const void* pData, size_t bytes
+)
+{
+    Counts& counts(m_counts[name]);
+    const char* p = static_cast<const char*>(pData);
+    counts.s_type = type;
+    counts.s_data.assign(p, p + bytes);
+}
+/**
+ * add
+ *    Add counts to a spectrum's baseline, setting it if there's none or
+ *    it no longer matches.
+ *
+ * @param name   - the spectrum.
+ * @param type   - its channel type.
+ * @param pData  - the counts.
+ * @param bytes  - their size.
+ */
+void
+CMPISpectrumBaseline::add(
+    const std::string& name, DataType_t type, const void* pData, size_t bytes
+)
+{
+    std::map<std::string, Counts>::iterator p = m_counts.find(name);
+    if ((p == m_counts.end()) || (p->second.s_type != type)
+        || (p->second.s_data.size() != bytes)) {
+        set(name, type, pData, bytes);
+    } else {
+        CMPINodeSpectra::add(p->second.s_data.data(), pData, bytes, type);
+    }
+}
+/**
+ * addTo
+ *    Add a spectrum's baseline to counts.  Nothing is added if there is
+ *    none or it no longer matches the spectrum's size and channel type.
+ *
+ * @param name     - the spectrum.
+ * @param pStorage - the counts.
+ * @param bytes    - their size.
+ * @param type     - their channel type.
+ */
+void
+CMPISpectrumBaseline::addTo(
+    const std::string& name, void* pStorage, size_t bytes, DataType_t type
+) const
+{
+    std::map<std::string, Counts>::const_iterator p = m_counts.find(name);
+    if ((p == m_counts.end()) || (p->second.s_type != type)
+        || (p->second.s_data.size() != bytes)) {
+        return;
+    }
+    CMPINodeSpectra::add(pStorage, p->second.s_data.data(), bytes, type);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// CMPIBackgroundReduction implementation.
+
+/**
+ * constructor
+ *    Collective over MPI_COMM_WORLD as it makes our communicator.
+ */
+CMPIBackgroundReduction::CMPIBackgroundReduction() :
+    m_pInterp(nullptr), m_timer(nullptr), m_completed(0)
+{
+    MPI_Comm_dup(MPI_COMM_WORLD, &m_comm);
+    MPI_Comm_rank(m_comm, &m_rank);
+}
+
+/**
+ * start
+ *    Retire the spectra and queue their reduction.  Rank 0 contributes
+ *    the baseline, which is dropped if the workers clear their spectra.
+ *
+ * @param interp  - interpreter SpecTcl's commands are in.
+ * @param clear   - workers clear their spectra once they're copied.
+ * @param discard - a worker contributes zeroes rather than its counts.
+ */
+void
+CMPIBackgroundReduction::start(CTCLInterpreter& interp, bool clear, bool discard)
+{
+    m_pInterp = &interp;
+
+    SpecTcl*                 pApi = SpecTcl::getInstance();
+    std::vector<std::string> names;
+    MPISpecTcl_spectrumNames(interp, names);
+    std::map<std::string, CSpectrum*> spectra;    // Same order everywhere.
+    for (size_t i = 0; i < names.size(); i++) {
+        CSpectrum* pSpectrum = pApi->FindSpectrum(names[i]);
+        if (pSpectrum) spectra[names[i]] = pSpectrum;
+    }
+
+    CMPISpectrumBaseline* pBaseline = CMPISpectrumBaseline::getInstance();
+    Retired* pRetired   = new Retired;
+    pRetired->s_stage   = Retired::queued;
+    pRetired->s_cleared = clear;
+    uint64_t hash      = 14695981039346656037ull;
+    for (std::map<std::string, CSpectrum*>::iterator p = spectra.begin();
+         p != spectra.end(); p++) {
+        Slice slice;
+        slice.s_name   = p->first;
+        slice.s_type   = p->second->StorageType();
+        slice.s_bytes  = p->second->StorageNeeded();
+        CMPISpectrumReducer::mpiType(slice.s_type);    // Throws if unsupported.
+        std::vector<char>& buffer(pRetired->s_buffers[slice.s_type]);
+        slice.s_offset = buffer.size();
+        if ((m_rank != 0) && discard) {
+            buffer.resize(buffer.size() + slice.s_bytes, 0);
+            if (clear) p->second->Clear();
+        } else if (m_rank == 0) {
+            buffer.resize(buffer.size() + slice.s_bytes, 0);
+            pBaseline->addTo(
+                slice.s_name, buffer.data() + slice.s_offset, slice.s_bytes,
+                slice.s_type
+            );
+        } else {
+            const char* pStorage = static_cast<const char*>(p->second->getStorage());
+            buffer.insert(buffer.end(), pStorage, pStorage + slice.s_bytes);
+            if (clear) p->second->Clear();
+        }
+        pRetired->s_slices.push_back(slice);
+
+        std::string key =
+            slice.s_name + ":" + std::to_string(slice.s_bytes) + ":"
+            + std::to_string(static_cast<int>(slice.s_type));
+        for (size_t i = 0; i < key.size(); i++) {
+            hash = (hash ^ static_cast<uint8_t>(key[i]))*1099511628211ull;
+        }
+    }
+    if (clear && (m_rank == 0)) {
+        pBaseline->clear();
+    }
+    pRetired->s_hashes[0] = hash;
+    pRetired->s_hashes[1] = ~hash;
+    m_retired.push_back(pRetired);
+    progress();
+}
+/**
+ * progress
+ *    Move the reductions in flight along and complete those that are
+ *    done, oldest first.
+ * @return bool - true if there's nothing (left) in flight.
+ */
+bool
+CMPIBackgroundReduction::progress()
+{
+    advance();
+    while (!m_retired.empty()) {
+        Retired* pRetired = m_retired.front();
+        if (pRetired->s_stage == Retired::reducing) {
+            int done;
+            MPI_Testall(
+                pRetired->s_requests.size(), pRetired->s_requests.data(), &done,
+                MPI_STATUSES_IGNORE
+            );
+            if (!done) break;
+            m_retired.pop_front();
+            complete(pRetired);
+        } else if (pRetired->s_stage == Retired::abandoned) {
+            m_retired.pop_front();
+            delete pRetired;
+        } else {
+            break;
+        }
+        advance();
+    }
+    if (!m_retired.empty()) {
+        schedule();
+        return false;
+    }
+    return true;
+}
+/**
+ * wait
+ *    Block until the reductions in flight, if any, are done.
+ */
+void
+CMPIBackgroundReduction::wait()
+{
+    while (!progress()) {
+        Retired* pRetired = m_retired.front();
+        MPI_Waitall(
+            pRetired->s_requests.size(), pRetired->s_requests.data(),
+            MPI_STATUSES_IGNORE
+        );
+    }
+}
+/**
+ * advance
+ *    Start the collectives of the queued reductions in order: a
+ *    reduction's hash agreement once the reduction before it has
+ *    started summing (or been abandoned), its sums once the ranks agree.
+ */
+void
+CMPIBackgroundReduction::advance()
+{
+    for (size_t i = 0; i < m_retired.size(); i++) {
+        Retired* pRetired = m_retired[i];
+        if (pRetired->s_stage == Retired::queued) {
+            if ((i > 0) && (m_retired[i-1]->s_stage == Retired::agreeing)) return;
+            pRetired->s_requests.resize(1);
+            MPI_Iallreduce(
+                pRetired->s_hashes, pRetired->s_maxima, 2, MPI_UINT64_T, MPI_MAX,
+                m_comm, &pRetired->s_requests[0]
+            );
+            pRetired->s_stage = Retired::agreeing;
+        }
+        if (pRetired->s_stage == Retired::agreeing) {
+            int done;
+            MPI_Test(&pRetired->s_requests[0], &done, MPI_STATUS_IGNORE);
+            if (!done) return;
+            if ((pRetired->s_maxima[0] != pRetired->s_hashes[0])
+                || (pRetired->s_maxima[1] != pRetired->s_hashes[1])) {
+                std::cerr << "Spectra differ among the ranks; they can't be "
+                          << "reduced in the background\n";
+                restore(pRetired);
+                pRetired->s_stage = Retired::abandoned;
+            } else {
+                startReductions(pRetired);
+                pRetired->s_stage = Retired::reducing;
+            }
+        }
+    }
+}
+/**
+ * startReductions
+ *    Start the reduction of each channel type's buffer into rank 0.
+ * @param pRetired - the retired spectra.
+ */
+void
+CMPIBackgroundReduction::startReductions(Retired* pRetired)
+{
+    pRetired->s_requests.clear();
+    for (std::map<int, std::vector<char> >::iterator p = pRetired->s_buffers.begin();
+         p != pRetired->s_buffers.end(); p++) {
+        DataType_t   type      = static_cast<DataType_t>(p->first);
+        MPI_Datatype mpiT      = CMPISpectrumReducer::mpiType(type);
+        size_t       elSize    = CMPISpectrumReducer::elementSize(type);
+        uint64_t     nElements = p->second.size()/elSize;
+        size_t       piece     = PIECEBYTES/elSize;
+        for (uint64_t offset = 0; offset < nElements; offset += piece) {
+            int         n = std::min<uint64_t>(piece, nElements - offset);
+            char*       pData = p->second.data() + offset*elSize;
+            MPI_Request request;
+            if (m_rank == 0) {
+                MPI_Ireduce(MPI_IN_PLACE, pData, n, mpiT, MPI_SUM, 0, m_comm, &request);
+            } else {
+                MPI_Ireduce(pData, nullptr, n, mpiT, MPI_SUM, 0, m_comm, &request);
+            }
+            pRetired->s_requests.push_back(request);
+        }
+    }
+}
+/**
+ * restore
+ *    A reduction that cleared the spectra is abandoned.  Put the counts
+ *    back: the workers add them to their spectra (which may have counts
+ *    of the next run by now), rank 0 to its baseline.  Spectra deleted or
+ *    changed since don't get theirs.
+ * @param pRetired - the retired spectra.
+ */
+void
+CMPIBackgroundReduction::restore(Retired* pRetired)
+{
+    if (!pRetired->s_cleared) return;
+    SpecTcl*              pApi      = SpecTcl::getInstance();
+    CMPISpectrumBaseline* pBaseline = CMPISpectrumBaseline::getInstance();
+    for (size_t i = 0; i < pRetired->s_slices.size(); i++) {
+        const Slice& slice(pRetired->s_slices[i]);
+        const char*  pCounts = pRetired->s_buffers[slice.s_type].data() + slice.s_offset;
+        if (m_rank == 0) {
+            pBaseline->add(slice.s_name, slice.s_type, pCounts, slice.s_bytes);
+            continue;
+        }
+        CSpectrum* pSpectrum = pApi->FindSpectrum(slice.s_name);
+        if (pSpectrum && (pSpectrum->StorageNeeded() == slice.s_bytes)
+            && (pSpectrum->StorageType() == slice.s_type)) {
+            CMPINodeSpectra::add(
+                pSpectrum->getStorage(), pCounts, slice.s_bytes, slice.s_type
+            );
+        }
+    }
+}
+/**
+ * complete
+ *    A reduction is done.  Rank 0 replaces its spectra with the sums
+ *    (spectra deleted or changed since don't get one), tells the
+ *    observers and runs the output command.
+ * @param pRetired - the retired spectra (deleted).
+ */
+void
+CMPIBackgroundReduction::complete(Retired* pRetired)
+{
+    m_completed++;
+    if (m_rank == 0) {
+        SpecTcl* pApi = SpecTcl::getInstance();
+        for (size_t i = 0; i < pRetired->s_slices.size(); i++) {
+            const Slice& slice(pRetired->s_slices[i]);
+            CSpectrum*   pSpectrum = pApi->FindSpectrum(slice.s_name);
+            if (pSpectrum && (pSpectrum->StorageNeeded() == slice.s_bytes)
+                && (pSpectrum->StorageType() == slice.s_type)) {
+                memcpy(
+                    pSpectrum->getStorage(),
+                    pRetired->s_buffers[slice.s_type].data() + slice.s_offset,
+                    slice.s_bytes
+                );
+            }
+        }
+    }
+    delete pRetired;
+
+    if (m_rank == 0) {
+        for (size_t i = 0; i < m_observers.size(); i++) {
+            m_observers[i]->reduced(*m_pInterp);
+        }
+    }
+    if ((m_rank == 0) && !m_command.empty()) {
+        Tcl_Interp* pInterp = m_pInterp->getInterpreter();
+        if (Tcl_EvalEx(pInterp, m_command.c_str(), -1, TCL_EVAL_GLOBAL) != TCL_OK) {
+            Tcl_BackgroundError(pInterp);
+        }
+        Tcl_ResetResult(pInterp);
+    }
+}
+/**
+ * schedule
+ *    Make sure the timer that moves things along while we're idle is
+ *    set.
+ */
+void
+CMPIBackgroundReduction::schedule()
+{
+    if (!m_timer) {
+        m_timer = Tcl_CreateTimerHandler(50, timer, this);
+    }
+}
+/**
+ * timer
+ *    Tcl timer handler.
+ * @param pData - the reduction stream.
+ */
+void
+CMPIBackgroundReduction::timer(ClientData pData)
+{
+    CMPIBackgroundReduction* pThis = static_cast<CMPIBackgroundReduction*>(pData);
+    pThis->m_timer = nullptr;
+    pThis->progress();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// CMPIRunReducer implementation.
+
+CMPIRunReducer* CMPIRunReducer::m_pInstance(nullptr);
+
+/**
+ * getInstance
+ *    The first call is collective over MPI_COMM_WORLD as it makes our
+ *    communicator.
+ * @return CMPIRunReducer* - the singleton.
+ */
+CMPIRunReducer*
+CMPIRunReducer::getInstance()
+{
+    if (!m_pInstance) {
+        m_pInstance = new CMPIRunReducer;
+    }
+    return m_pInstance;
+}
+/**
+ * constructor
+ */
+CMPIRunReducer::CMPIRunReducer() :
+    m_enabled(false), m_pInterp(nullptr)
+{}
+
+/**
+ * setEnabled
+ *    Turn background reduction on or off.  Turning it off finishes any
+ *    reduction in progress.  Must be done the same way in all ranks.
+ *
+ * @param interp - interpreter SpecTcl's commands are in.
+ * @param enable - new state.
+ * @throw std::string - spectra are sharded or node shared.
+ */
+void
+CMPIRunReducer::setEnabled(CTCLInterpreter& interp, bool enable)
+{
+    if (enable && (CMPISpectrumShards::getInstance()->enabled()
+                   || (CMPINodeSpectra::getInstance()->mode() != CMPINodeSpectra::off))) {
+        throw std::string("Sharded or node shared spectra can't be reduced in the background");
+    }
+    if (!enable) wait();
+    m_pInterp = &interp;
+    m_enabled = enable;
+}
+/**
+ * retire
+ *    End of a run - retire the spectra and start reducing them.
+ *    Workers' spectra are cleared for the next run.
+ * @param discard - we were dropped from the run; our counts aren't
+ *                  summed since the blocks we may not have finished
+ *                  were given to other workers.
+ */
+void
+CMPIRunReducer::retire(bool discard)
+{
+    if (!m_enabled) return;
+    m_reduction.start(*m_pInterp, true, discard);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// CMPISnapshots implementation.
+
+CMPISnapshots* CMPISnapshots::m_pInstance(nullptr);
+
+/**
+ * getInstance
+ *    The first call is collective over MPI_COMM_WORLD as it makes our
+ *    communicator.
+ * @return CMPISnapshots* - the singleton.
+ */
+CMPISnapshots*
+CMPISnapshots::getInstance()
+{
+    if (!m_pInstance) {
+        m_pInstance = new CMPISnapshots;
+    }
+    return m_pInstance;
+}
+/**
+ * constructor
+ */
+CMPISnapshots::CMPISnapshots() :
+    m_count(0), m_abandoned(0), m_pAnnouncer(nullptr)
+{}
+
+/**
+ * request
+ *    Rank 0 - define a cut after the blocks sent so far, start our
+ *    side of its reduction and have the announcer tell the other ranks.
+ *
+ * @param interp - interpreter SpecTcl's commands are in.
+ * @return uint32_t - the snapshot's number.
+ * @throw std::string - the last snapshot isn't done, spectra are
+ *                      sharded or node shared or there's no distributor.
+ */
+uint32_t
+CMPISnapshots::request(CTCLInterpreter& interp)
+{
+    if (CMPISpectrumShards::getInstance()->enabled()
+        || (CMPINodeSpectra::getInstance()->mode() != CMPINodeSpectra::off)) {
+        throw std::string("Sharded or node shared spectra can't be snapshotted");
+    }
+    if (!ready()) {
+        throw std::string("The last snapshot is still being reduced");
+    }
+    if (!m_pAnnouncer) {
+        throw std::string("Snapshots need a distributor (mpisink) to cut the workers' data");
+    }
+    m_count++;
+    m_reduction.start(interp, false);
+    m_pAnnouncer->announce(m_count);
+    return m_count;
+}
+/**
+ * ready
+ *    Rank 0 - move the snapshots in flight along.
+ * @return bool - true if another may be requested: none is in flight
+ *                or the last one was abandoned.
+ */
+bool
+CMPISnapshots::ready()
+{
+    return m_reduction.progress() || (m_abandoned == m_count);
+}
+/**
+ * cut
+ *    Worker - a block, end of data or cut message from rank 0 says how
+ *    many cuts it has defined.  If that's one we haven't taken, everything before it
+ *    has been analyzed so take it now.  Each cut needs its own reduction
+ *    so if rank 0 has defined several since the last we took (it
+ *    abandoned one), we take them all at once.
+ *
+ * @param interp - interpreter SpecTcl's commands are in.
+ * @param count  - cuts defined by rank 0.
+ */
+void
+CMPISnapshots::cut(CTCLInterpreter& interp, uint32_t count)
+{
+    while (m_count != count) {
+        m_count++;
+        m_reduction.start(interp, false);
+    }
+}
@@ -0,0 +1,475 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Giordano Cerriza
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  mpiSpectra.h
+ *  @brief: Parallel spectrum storage for the mpispectcl package.
+ *
+ *  Rank 0 distributes the data and holds the spectra users look at.  All
+ *  other ranks are workers that analyze the data.
+ *  -  CMPISpectrumShards optionally partitions the spectra among the
+ *     workers so that total spectrum memory grows with the number of
+ *     workers rather than being limited by the memory of one.
+ *  -  CMPINodeSpectra optionally moves the spectra of the workers on a
+ *     node into node shared memory so that the node's workers can share
+ *     one copy, or at least so the node's counts can be summed without
+ *     messages.
+ *  -  CMPISpectrumReducer brings the workers' spectra back into rank 0.
+ *  -  CMPISpectrumBaseline holds counts rank 0 adds to those sums.
+ *  -  CMPIBackgroundReduction does that with nonblocking collectives,
+ *     for CMPIRunReducer at the end of each run so the next run can
+ *     start at once and for CMPISnapshots at consistent cuts during a
+ *     run.
+ */
+#ifndef MPISPECTRA_H
+#define MPISPECTRA_H
+
+#include <mpi.h>
+#include <EventSink.h>
+#include <histotypes.h>
+#include <tcl.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <deque>
+#include <set>
+#include <map>
+
+class CTCLInterpreter;
+class CSpectrum;
+class CEvent;
+class CEventList;
+
+MPI_Comm MPISpecTcl_comm();
+void     MPISpecTcl_spectrumNames(CTCLInterpreter& interp, std::vector<std::string>& names);
+
+/**
+ * @class CMPISpectrumShards
+ *    When enabled, each spectrum lives in only one worker, its owner,
+ *    chosen by hashing its name.  Workers don't create the spectra they
+ *    don't own.  Since every worker still sees a share of all events,
+ *    an event sink ships the parameters the other workers' spectra (and
+ *    any gates) need to them:
+ *    -  Per event, the valid parameters a worker needs are packed as a
+ *       count followed by (id, value) pairs into a batch for it.
+ *    -  Full batches are sent with nonblocking sends, two buffers per
+ *       destination.
+ *    -  Batches that come in are unpacked into events that are given to
+ *       the histogrammer.
+ *    -  At the end of data each worker sends what's left and an end
+ *       marker to the other workers that took part in the run (the
+ *       distributor's ends say which) and histograms what comes in until
+ *       it has the ends of all of them.
+ *    What each worker needs is learned from the spectrum and gate
+ *    definitions the configuration journal brings.  Sharding must be
+ *    enabled (or not) the same way in all ranks.  Every rank but 0 owns
+ *    spectra so all of them should be workers; batches for one that
+ *    isn't taking part in a run can hold up its sender until it does.
+ */
+class CMPISpectrumShards : public CEventSink
+{
+private:
+    struct Outbox {
+        std::vector<char> s_data[2];
+        MPI_Request       s_requests[2];
+        int               s_current;
+    };
+
+    MPI_Comm                                        m_comm;
+    int                                             m_rank;
+    int                                             m_nRanks;
+    bool                                            m_enabled;
+    bool                                            m_sinkRegistered;
+    std::map<std::string, std::vector<std::string> > m_spectrumParameters;
+    std::map<std::string, std::vector<std::string> > m_gateParameters;
+    bool                                            m_neededValid;
+    std::vector<std::vector<unsigned> >             m_needed;     // By rank.
+    std::vector<Outbox>                             m_outboxes;
+    std::vector<char>                               m_inbox;
+    CEvent*                                         m_pEvent;
+    std::map<int, int>                              m_ends;  // Rank -> not yet used.
+    size_t                                          m_batchBytes;
+
+    static CMPISpectrumShards* m_pInstance;
+public:
+    static CMPISpectrumShards* getInstance();
+
+    void enable(CTCLInterpreter& interp, bool enable);
+    bool enabled() const { return m_enabled; }
+    int  ownerOf(const std::string& spectrum) const;
+    bool owns(const std::string& spectrum) const;
+
+    void spectrumDefined(
+        CTCLInterpreter& interp, const std::string& name, const std::string& def
+    );
+    void gateDefined(
+        CTCLInterpreter& interp, const std::string& name, const std::string& def
+    );
+    void parametersChanged() { m_neededValid = false; }
+
+    virtual void operator()(CEventList& events);
+    void endOfData(const std::set<int>& participants);
+private:
+    CMPISpectrumShards();
+    void computeNeeded();
+    void route(CEvent& event);
+    void ship(int rank);
+    void waitFor(MPI_Request& request);
+    void poll(bool block);
+    void histogram(const char* pData, size_t nBytes);
+    static void parameterNames(
+        CTCLInterpreter& interp, const std::string& list, size_t index,
+        std::vector<std::string>& names
+    );
+    static uint32_t hash(const std::string& name);
+};
+
+/**
+ * @class CMPINodeSpectra
+ *    Puts the workers' spectra in shared memory allocated, per node,
+ *    with MPI_Win_allocate_shared and given to the spectra with
+ *    CSpectrum::ReplaceStorage.  The spectra must be the same in all
+ *    workers of a node.  Two modes:
+ *    -  locked  - the node's workers share one copy of the spectra.
+ *                 SpecTcl increments with plain stores so each spectrum
+ *                 has a lock, a word in the cache line before its
+ *                 channels.  While this mode is on the histogrammer's
+ *                 event sink is replaced by one that histograms each
+ *                 event spectrum by spectrum, holding only that
+ *                 spectrum's lock; workers contend only when they
+ *                 increment the same spectrum at the same time.
+ *    -  striped - each worker has its own copy in the window, each
+ *                 spectrum starting on its own cache line so workers
+ *                 never share a line.  Nothing is locked; the node leader
+ *                 sums the copies from memory when reducing.
+ *    Either way only node leaders take part in reductions.  Spectra
+ *    defined while this is on are not in the window; turn it off and
+ *    back on after changing the spectra.  Rank 0 is not part of any
+ *    node group.
+ */
+class CMPINodeSpectra
+{
+public:
+    typedef enum _Mode {
+        off, locked, striped
+    } Mode;
+private:
+    struct Slab {
+        CSpectrum* s_pSpectrum;
+        size_t     s_offset;              // In each worker's copy.
+        size_t     s_bytes;
+        DataType_t s_type;
+        std::atomic<uint32_t>* s_pLock;   // Locked mode only.
+    };
+    class CNodeHistogrammer : public CEventSink {
+        struct Target {
+            CSpectrum*             s_pSpectrum;
+            std::atomic<uint32_t>* s_pLock;   // nullptr if not shared.
+        };
+        CMPINodeSpectra&    m_owner;
+        std::vector<Target> m_targets;
+    public:
+        CNodeHistogrammer(CMPINodeSpectra& owner) : m_owner(owner) {}
+        virtual void operator()(CEventList& events);
+    };
+
+    Mode                        m_mode;
+    int                         m_worldRank;
+    MPI_Comm                    m_nodeComm;    // Workers on our node.
+    MPI_Comm                    m_leaderComm;  // Rank 0 and node leaders.
+    int                         m_nodeRank;
+    int                         m_nodeSize;
+    MPI_Win                     m_window;
+    size_t                      m_copyBytes;   // Bytes per copy.
+    std::map<std::string, Slab> m_slabs;
+    CNodeHistogrammer           m_histogrammer;
+    bool                        m_histogrammerReplaced;
+
+    static CMPINodeSpectra* m_pInstance;
+public:
+    static CMPINodeSpectra* getInstance();
+
+    void     setMode(CTCLInterpreter& interp, Mode mode);
+    Mode     mode() const { return m_mode; }
+    bool     leader() const;
+    MPI_Comm leaderComm() const { return m_leaderComm; }
+    void     synchronize();
+    const char* nodeSum(
+        const std::string& name, uint64_t bytes, DataType_t type,
+        std::vector<char>& sum
+    );
+
+    static Mode        modeFromString(const std::string& mode);
+    static const char* modeToString(Mode mode);
+    static void        add(void* pDest, const void* pSrc, size_t bytes, DataType_t type);
+private:
+    CMPINodeSpectra();
+    void attach(CTCLInterpreter& interp);
+    void detach();
+    void replaceHistogrammer(bool replace);
+    static void lock(std::atomic<uint32_t>* pLock);
+    static void unlock(std::atomic<uint32_t>* pLock);
+};
+
+/**
+ * @class CMPISpectrumReducer
+ *    Sums the workers' spectra into rank 0's.  This is collective: all
+ *    ranks must reduce at the same time (e.g. mpi execute all).  Rank 0
+ *    says which spectra it has, their sizes and types.  Sharded spectra
+ *    are sent to rank 0 by their owner, the rest are MPI_Reduce'd.
+ *    Storage too big for an int count goes in pieces.
+ */
+class CMPISpectrumReducer
+{
+private:
+    struct Spectrum {
+        std::string s_name;
+        uint64_t    s_bytes;
+        uint32_t    s_type;
+    };
+    MPI_Comm m_worldComm;
+    MPI_Comm m_comm;                       // World or node leaders.
+    int      m_rank;
+
+    static CMPISpectrumReducer* m_pInstance;
+public:
+    static CMPISpectrumReducer* getInstance();
+
+    void reduce(CTCLInterpreter& interp);
+private:
+    CMPISpectrumReducer();
+    void spectra(CTCLInterpreter& interp, std::vector<Spectrum>& result);
+    void reduceOne(const Spectrum& spectrum);
+    void gatherOne(const Spectrum& spectrum, int owner);
+public:
+    static MPI_Datatype mpiType(DataType_t type);
+    static size_t       elementSize(DataType_t type);
+};
+
+/**
+ * @class CMPISpectrumBaseline
+ *    Counts rank 0 adds to every sum of the workers' spectra; those of a
+ *    checkpoint being resumed.  When a run's spectra are retired by a
+ *    background run reduction the baseline goes with them since the
+ *    workers start the next run from zero (and comes back if the
+ *    reduction is abandoned).
+ */
+class CMPISpectrumBaseline
+{
+private:
+    struct Counts {
+        DataType_t        s_type;
+        std::vector<char> s_data;
+    };
+    std::map<std::string, Counts> m_counts;
+
+    static CMPISpectrumBaseline* m_pInstance;
+public:
+    static CMPISpectrumBaseline* getInstance();
+
+    void set(
+        const std::string& name, DataType_t type, const void* pData, size_t bytes
+    );
+    void add(
+        const std::string& name, DataType_t type, const void* pData, size_t bytes
+    );
+    void clear() { m_counts.clear(); }
+    bool empty() const { return m_counts.empty(); }
+    void addTo(
+        const std::string& name, void* pStorage, size_t bytes, DataType_t type
+    ) const;
+private:
+    CMPISpectrumBaseline() {}
+};
+
+/**
+ * @class CMPIBackgroundReduction
+ *    A stream of nonblocking spectrum reductions into rank 0.  Starting
+ *    one copies the spectra into a retired buffer, one per channel type
+ *    (workers may clear theirs).  The buffers are then summed into rank
+ *    0 with nonblocking collectives on our own communicator:
+ *    -  First the ranks agree the spectra are the same everywhere (an
+ *       MPI_Iallreduce of a hash of the names, sizes and types).
+ *    -  Then an MPI_Ireduce per channel type (in pieces if huge).
+ *    Progress is made whenever progress is called, from a Tcl timer
+ *    while idle and, in the workers, while they wait for messages (see
+ *    MPITcl_addIdlePoller).  When the sum lands rank 0's spectra are
+ *    replaced with it, observers are told and the output command, if
+ *    any, is run there.  Starting a reduction doesn't wait for the ones
+ *    in flight; they're queued and each one's collectives are started
+ *    once those of the one before it have been, so the ranks start them
+ *    in the same order.  If the ranks' spectra differ the reduction is
+ *    abandoned and the counts it cleared are put back.  All ranks must
+ *    start the same reductions in the same order.
+ */
+class CMPIBackgroundReduction
+{
+public:
+    class Observer {
+    public:
+        virtual ~Observer() {}
+        virtual void reduced(CTCLInterpreter& interp) = 0;
+    };
+private:
+    struct Slice {
+        std::string s_name;
+        DataType_t  s_type;
+        size_t      s_offset;                 // In its type's buffer.
+        size_t      s_bytes;
+    };
+    struct Retired {
+        typedef enum _Stage {
+            queued, agreeing, reducing, abandoned
+        } Stage;
+        std::vector<Slice>               s_slices;
+        std::map<int, std::vector<char> > s_buffers;   // By channel type.
+        uint64_t                         s_hashes[2];
+        uint64_t                         s_maxima[2];
+        std::vector<MPI_Request>         s_requests;
+        Stage                            s_stage;
+        bool                             s_cleared;    // Spectra were.
+    };
+    MPI_Comm               m_comm;
+    int                    m_rank;
+    CTCLInterpreter*       m_pInterp;
+    std::string            m_command;
+    std::deque<Retired*>   m_retired;      // In flight, oldest first.
+    Tcl_TimerToken         m_timer;
+    unsigned               m_completed;
+    std::vector<Observer*> m_observers;
+public:
+    CMPIBackgroundReduction();
+    
+    void addObserver(Observer* pObserver) { m_observers.push_back(pObserver); }
+    void setCommand(const std::string& command) { m_command = command; }
+    std::string command() const { return m_command; }
+    unsigned completed() const { return m_completed; }
+    bool     busy() const { return !m_retired.empty(); }
+    size_t   inFlight() const { return m_retired.size(); }
+
+    void start(CTCLInterpreter& interp, bool clear, bool discard = false);
+    bool progress();
+    void wait();
+private:
+    void advance();
+    void startReductions(Retired* pRetired);
+    void restore(Retired* pRetired);
+    void complete(Retired* pRetired);
+    void schedule();
+    static void timer(ClientData pData);
+};
+
+/**
+ * @class CMPIRunReducer
+ *    Double buffers the spectra per run.  When enabled, at the end of
+ *    each run's data (a worker's getter sees the end, the distributor
+ *    has run down the workers) every rank starts a background reduction
+ *    of its spectra and workers clear theirs so the next run can be
+ *    analyzed at once.  Progress is made each time a block is read or
+ *    distributed and while the rank is idle.  Every rank must take part
+ *    in every run.  A worker the distributor dropped (-lease) still
+ *    does, but with zeroes: its blocks were given to other workers.
+ *    Can't be used with sharded or node shared spectra.
+ */
+class CMPIRunReducer
+{
+private:
+    bool                    m_enabled;
+    CTCLInterpreter*        m_pInterp;
+    CMPIBackgroundReduction m_reduction;
+
+    static CMPIRunReducer* m_pInstance;
+public:
+    static CMPIRunReducer* getInstance();
+
+    void setEnabled(CTCLInterpreter& interp, bool enable);
+    bool enabled() const { return m_enabled; }
+    void setCommand(const std::string& command) { m_reduction.setCommand(command); }
+    std::string command() const { return m_reduction.command(); }
+    unsigned runs() const { return m_reduction.completed(); }
+
+    void retire(bool discard = false);
+    bool progress() { return m_reduction.progress(); }
+    void wait() { m_reduction.wait(); }
+private:
+    CMPIRunReducer();
+};
+
+/**
+ * @class CMPISnapshots
+ *    Consistent snapshots of the summed spectra during a run.  Rank 0
+ *    defines a cut by counting it; every block and end of data it sends
+ *    after that carries the count.  Each worker gets its blocks in
+ *    sequence order so when one first sees a count it hasn't taken, all
+ *    the blocks it was sent before the cut have been analyzed.  It
+ *    starts a background reduction of its spectra right then (without
+ *    clearing them) and goes on analyzing.  Rank 0 starts its side (all
+ *    zeroes) when the cut is defined.  The sums land in rank 0's spectra,
+ *    which are what's displayed, and hold exactly the blocks sent before
+ *    the cut.  Only one snapshot is in flight at a time unless rank 0
+ *    abandons it: its collectives can't be cancelled, so it's still
+ *    reduced (a worker that sees a later cut first takes both at once)
+ *    but the next may be requested meanwhile.
+ *
+ *    A rank that isn't getting blocks (between runs, or one that isn't a
+ *    worker) would never see the count, so when rank 0 defines a cut its
+ *    announcer (the distributor) also sends it to every other rank in
+ *    sequence with the blocks.
+ */
+class CMPISnapshots
+{
+public:
+    class Announcer {
+    public:
+        virtual ~Announcer() {}
+        virtual void announce(uint32_t count) = 0;
+    };
+private:
+    uint32_t                m_count;     // Rank 0: defined, others: taken.
+    uint32_t                m_abandoned; // Rank 0: last cut given up on.
+    CMPIBackgroundReduction m_reduction;
+    Announcer*              m_pAnnouncer;
+
+    static CMPISnapshots* m_pInstance;
+public:
+    static CMPISnapshots* getInstance();
+
+    uint32_t request(CTCLInterpreter& interp);
+    bool     ready();
+    void     abandon() { m_abandoned = m_count; }
+    uint32_t count() const { return m_count; }
+    uint32_t landed() const {
+        return m_count - static_cast<uint32_t>(m_reduction.inFlight());
+    }
+    void     cut(CTCLInterpreter& interp, uint32_t count);
+    void setCommand(const std::string& command) { m_reduction.setCommand(command); }
+    std::string command() const { return m_reduction.command(); }
+    unsigned completed() const { return m_reduction.completed(); }
+    bool     busy() const { return m_reduction.busy(); }
+    void     addObserver(CMPIBackgroundReduction::Observer* pObserver) {
+        m_reduction.addObserver(pObserver);
+    }
+    bool     progress() { return m_reduction.progress(); }
+    void     wait() { m_reduction.wait(); }
+    void     setAnnouncer(Announcer* pAnnouncer) { m_pAnnouncer = pAnnouncer; }
+    Announcer* announcer() const { return m_pAnnouncer; }
+private:
+    CMPISnapshots();
+};
+
+#endif
@@ -7,33 +7,208 @@
 #include <TCLLiveEventLoop.h>
 
 #include <stdlib.h>
+#include <stddef.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
 #include <iostream>
 #include <stdexcept>
+#include <vector>
+#include <map>
+#include <deque>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <chrono>
 
 #include "mpitcl.h"
+#include "mpiCompress.h"
+#include "mpiChunked.h"
+#include "mpiCodec.h"
+#include "mpiFilter.h"
+#include "mpiMemory.h"
 
 static Tcl_AppInitProc initInteractive;
-static void startMpiReceiverThread(CTCLInterpreter& interp, Tcl_ThreadId mainThread);
+static void startReceivers(CTCLInterpreter& interp, Tcl_ThreadId mainThread);
+static void stopReceivers();
+static void evaluateInAll(
+  CTCLInterpreter& interp, int root, const char* script, CTCLObject* pResult
+);
+
+static MPI_Comm gEvalComm(MPI_COMM_NULL);    // Gathers evalall results.
+
+// Receive classes.  Each has its own duplicate of MPI_COMM_WORLD so a
+// receiver for one class never has to look at another's traffic.
+
+static const int RECEIVE_CONTROL(0);         // Scripts, evalall and share.
+static const int RECEIVE_TCLDATA(1);         // mpi send data.
+static const int RECEIVE_BINARY(2);          // Binary data.
+static const int RECEIVE_CLASSES(3);
+static const char* gClassNames[RECEIVE_CLASSES] = {"control", "tcldata", "binary"};
+static MPI_Comm    gClassComms[RECEIVE_CLASSES] = {
+  MPI_COMM_NULL, MPI_COMM_NULL, MPI_COMM_NULL
+};
+static MPI_Comm classComm(int tag);
+
+/**
+ * A receiver group: the classes one receiver thread takes messages for
+ * and what it's done with them.  Times are in microseconds.  Groups are
+ * retired when the receivers are restarted and deleted at a later
+ * restart once their thread has exited and none of their messages are
+ * left in the lanes.
+ */
+struct ReceiverGroup {
+  ReceiverGroup(
+    const std::vector<int>& classes, unsigned generation,
+    CTCLInterpreter* pInterp, Tcl_ThreadId mainThread
+  ) :
+    s_classes(classes), s_generation(generation), s_pInterp(pInterp),
+    s_mainThread(mainThread), s_probing(false), s_threads(0), s_queued(0),
+    s_messages(0), s_bytes(0), s_routed(0), s_coalesced(0), s_queueTime(0),
+    s_maxQueueTime(0), s_handleTime(0) {}
+  std::vector<int>      s_classes;
+  unsigned              s_generation;     // Of the receivers it's part of.
+  CTCLInterpreter*      s_pInterp;
+  Tcl_ThreadId          s_mainThread;     // Messages are queued to this thread.
+  std::atomic<bool>     s_probing;        // Its thread is waiting for a message.
+  std::atomic<int>      s_threads;        // Its thread is running (0 or 1).
+  std::atomic<uint64_t> s_queued;         // Its messages not yet deleted.
+  std::atomic<uint64_t> s_messages;
+  std::atomic<uint64_t> s_bytes;
+  std::atomic<uint64_t> s_routed;         // Thread data sent on directly.
+  std::atomic<uint64_t> s_coalesced;      // Replaced by a newer value.
+  std::atomic<uint64_t> s_queueTime;      // Waiting for the main thread.
+  std::atomic<uint64_t> s_maxQueueTime;
+  std::atomic<uint64_t> s_handleTime;     // Main thread handling them.
+};
+static std::vector<std::vector<int> > gReceiverConfig;     // Class groups.
+static std::vector<ReceiverGroup*>    gReceivers;          // Current groups.
+static std::vector<ReceiverGroup*>    gRetiredReceivers;
+static std::atomic<unsigned>          gReceiverGeneration(0);
+static CTCLInterpreter*               gpReceiverInterp(nullptr); // Rank 0's receivers
+static Tcl_ThreadId                   gReceiverMainThread;       //   were started with.
+static std::vector<MPIIdlePoller>     gIdlePollers;        // Non rank 0.
+
+// Priority lanes.  On rank 0 the receivers put the messages they take
+// in the lane of their class and the main thread takes them from the
+// lanes one at a time: strictly in class order or by weight.
+
+static const unsigned LANE_STRICT(0);
+static const unsigned LANE_WEIGHTED(1);
+static std::mutex              gLaneLock;       // Lanes and their settings.
+static std::condition_variable gLaneSpace;      // Lanes drained or receivers stopped.
+static unsigned                gDispatchPolicy(LANE_STRICT);
+static int                     gLaneWeights[RECEIVE_CLASSES] = {8, 2, 1};
+static size_t                  gLaneDepth(1000);   // Messages per lane.
+
+// Receive filters (mpi filter): one for mpi send data and one for
+// binary data.  Rank 0's receivers apply them.
+
+static const int FILTER_TCLDATA(0);
+static const int FILTER_BINARY(1);
+static const int FILTER_CHANNELS(2);
+static const char*       gFilterNames[FILTER_CHANNELS] = {"tcldata", "binary"};
+static std::mutex        gFilterLock;
+static CMPIReceiveFilter gFilters[FILTER_CHANNELS];
+
+class CTclMpi;
+static void addEndpoint(Tcl_ThreadId thread, CTCLInterpreter* pInterp, CTclMpi* pCommand);
+static void queueToThread(
+  Tcl_ThreadId thread, int source, int tag, const char* msg, size_t count
+);
+static Tcl_ThreadId gMainThread;               // Runs gpMpiCommand.
+static Tcl_PackageInitProc mpiThreadInit;
 
 /**
  * MPI extension class.
  *   mpi size    - returns size of application
  *   mpi rank    - returns my rank
  *   mpi execute rank script - sends script to rank.
- *   mpi send    rank data   - Sends Tcl text data to rank.
+ *   mpi send ?-binary? ?-priority high|normal? ?-coalesce key? rank data
+ *               - Sends Tcl text data to rank.  With -binary, the data
+ *               go in the binary object format of mpiCodec.h and arrive
+ *               with their types (numbers not written the way Tcl would
+ *               write them, such as 0x10, arrive as written).  High
+ *               priority data travel and are
+ *               handled with the control messages.  In rank 0, data sent
+ *               with -coalesce replace any from the same rank with the
+ *               same key still waiting for the handler, so the handler
+ *               sees only the current value.  rank can also be a
+ *               rank:threadid endpoint (see below) except with -coalesce.
+ *   mpi endpoint            - The rank:threadid endpoint of this thread.
+ *   mpi receivers           - Statistics of the receiver threads: a
+ *               list with a dict for each.
+ *   mpi memory              - Memory this rank's buffers use against
+ *               its budget (see memory below).
+ *   mpi filter tcldata|binary ?option value...? - (rank 0) Inspect or
+ *               set what the receivers drop before it reaches the
+ *               interpreter (see filter below).
+ *   mpi evalall script      - Evaluates script in every rank and returns
+ *               a dict keyed by rank of lists of the Tcl completion
+ *               code and result.
+ *   mpi share name value    - Makes value the next version of the shared
+ *               object name in every rank.
+ *   mpi shared name ?-version? - The local copy of a shared object (or
+ *               its version).
  *   mpi handle              - Specify event handler for data.
  *               the handler is invoked with two parameters:
  *               - the sender's rank
  *               - the data that was received from the sender.
+ *   mpi configure ?option value...? - Inspect/set transport options:
+ *               -compress off|on|auto  - compression of large mpi send data.
+ *               -compressthreshold n   - smallest payload compressed.
+ *               -chunksize n           - payloads bigger than this are
+ *                                        sent in chunks this big.
+ *               -chunkwindow n         - Number of chunks in flight.
+ *               -receivers groups      - (rank 0) Receiver threads: a
+ *                                        list of groups of the classes
+ *                                        control, tcldata and binary.
+ *               -dispatch strict|weighted - How the main thread picks
+ *                                        from the class lanes.
+ *               -laneweights {class weight...} - for weighted dispatch.
+ *               -lanedepth n           - Messages a lane holds before
+ *                                        its receiver waits.
+ *               -membudget bytes       - This rank's memory budget (see
+ *                                        mpiMemory.h), 0 for none.
  *
  *  Note that compiled code can TclMpi_SetDataHandler to catch binary data
  *  sent by other bits of the computation.
+ *
+ *  Each class of message travels on its own communicator.  In rank 0
+ *  each receiver group gets a thread that takes messages of its classes
+ *  and queues them to the main thread, so a flood of binary data can't
+ *  hold up control scripts behind it.  By default each class has a
+ *  thread to itself.  A thread with one class blocks in MPI_Mprobe; one
+ *  with several polls them.  The other ranks poll all classes in their
+ *  receive loop, control first.
+ *
+ *  Rank 0's receivers take the messages and put them in a lane per
+ *  class.  The main thread handles one at a time from the lanes, either
+ *  strictly (control, then tcldata, then binary) or in proportion to
+ *  the lane weights, so a backlog of data can't keep a stop or abort
+ *  script waiting.  Only chunked payloads are left for the main thread
+ *  to receive.
+ *
+ *  Data a rank sends itself (e.g. mpi send all) are queued straight to
+ *  the receiving thread as a Tcl event without going through MPI, so
+ *  they're never chunked and aren't filtered.
+ *
+ *  Threads made with Tcl's thread package can load {} Mpi to get an mpi
+ *  command of their own with its own handler.  Data sent to the
+ *  thread's endpoint (threadid as from thread::id) are queued straight
+ *  to that thread as Tcl events rather than going through the main
+ *  thread.  evalall, share, shared, startnotifier and stopnotifier are
+ *  only available in the main thread.
  */
 
 class CTclMpi : public CTCLObjectProcessor
 {
 public:
-  CTclMpi(const char* command, CTCLInterpreter& interp);
+  CTclMpi(const char* command, CTCLInterpreter& interp, bool inThread = false);
 
   int operator()(CTCLInterpreter& interp, std::vector<CTCLObject>& objv);
 protected:
@@ -41,14 +216,22 @@ protected:
   void rank(CTCLInterpreter& interp, std::vector<CTCLObject>& objv);
   void execute(CTCLInterpreter& interp, std::vector<CTCLObject>& objv);
   void send(CTCLInterpreter& interp, std::vector<CTCLObject>& objv);
+  void evalAll(CTCLInterpreter& interp, std::vector<CTCLObject>& objv);
+  void share(CTCLInterpreter& interp, std::vector<CTCLObject>& objv);
+  void shared(CTCLInterpreter& interp, std::vector<CTCLObject>& objv);
   void handle(CTCLInterpreter& interp, std::vector<CTCLObject>& objv);
+  void endpoint(CTCLInterpreter& interp, std::vector<CTCLObject>& objv);
+  void receivers(CTCLInterpreter& interp, std::vector<CTCLObject>& objv);
+  void filter(CTCLInterpreter& interp, std::vector<CTCLObject>& objv);
+  void memory(CTCLInterpreter& interp, std::vector<CTCLObject>& objv);
   void stopNotifier(CTCLInterpreter& interp, std::vector<CTCLObject>& objv);
   void startNotifier(CTCLInterpreter& interp, std::vector<CTCLObject>& objv);
+  void configure(CTCLInterpreter& interp, std::vector<CTCLObject>& objv);
 private:
   void executeScript(int rank, const std::string&  script) {
     MPI_Send(
        script.c_str(), script.size() + 1, MPI_CHAR, rank, MPI_TAG_SCRIPT,
-       MPI_COMM_WORLD
+       classComm(MPI_TAG_SCRIPT)
     );
   }
   int  myrank() {
@@ -63,15 +246,95 @@ private:
      MPI_Comm_size(MPI_COMM_WORLD, &size);
      return size;
   }
-  void sendData(int rank, const std::string& data) {
-    MPI_Send(
-      data.c_str(), data.size() + 1, MPI_CHAR, rank, MPI_TAG_TCLDATA,
-      MPI_COMM_WORLD
-    );
-  }
+  void preparePayload(const char* pData, size_t nBytes, int tag, int zTag);
+  void sendData(int rank, uint64_t thread = 0);
+  void requireMainThread(const std::string& subcommand);
+  static bool parseEndpoint(const std::string& endpoint, int& rank, uint64_t& thread);
+  CTCLObject receiverConfig(CTCLInterpreter& interp);
+  CTCLObject laneWeights(CTCLInterpreter& interp);
+  void setLaneWeights(CTCLInterpreter& interp, CTCLObject& weights);
+  void setReceiverConfig(CTCLInterpreter& interp, CTCLObject& groups);
+public:
+  void receiveShare(
+    CTCLInterpreter& interp, int source, const char* msg, size_t count
+  );
+private:
+  struct SharedObject {
+    SharedObject() : s_version(0), s_hash(0) {}
+    uint64_t                     s_version;
+    uint64_t                     s_hash;
+    std::map<uint64_t, Tcl_Obj*> s_values;    // By hash, current included.
+    std::deque<uint64_t>         s_history;   // Hashes, oldest first.
+  };
+  void installShared(
+    SharedObject& object, uint64_t version, uint64_t hash, Tcl_Obj* pValue
+  );
+  static uint64_t contentHash(const char* pData, size_t nBytes);
+  static Tcl_Obj* makeDelta(uint32_t kind, Tcl_Obj* pBase, Tcl_Obj* pValue);
+  static Tcl_Obj* applyDelta(uint32_t kind, Tcl_Obj* pBase, Tcl_Obj* pDelta);
 public:
   CTCLObject*  m_pDataHandler;
+private:
+  std::map<std::string, SharedObject> m_shared;
+  CMPICompressor        m_compressor;
+  CMPICompressionPolicy m_sendCompression;
+  std::vector<char>     m_payload;        // Compressed send data.
+  std::vector<char>     m_encoded;        // Binary encoded send data.
+  std::vector<char>     m_threadPayload;  // Payload with thread header.
+  std::vector<char>     m_keyedPayload;   // Payload with coalesce header.
+  const char*           m_pPayload;       // What sendData sends.
+  size_t                m_payloadSize;
+  int                   m_payloadTag;
+  bool                  m_urgent;         // Send with the control messages.
+  bool                  m_inThread;       // Command of a thread interp.
+};
+
+/**
+ * Header that precedes the data in MPI_TAG_TCLDATA_Z and
+ * MPI_TAG_TCLDATA_BZ messages.
+ */
+struct CompressedHeader {
+  uint64_t s_originalSize;               // Includes any null terminator.
+};
+/**
+ * Header that precedes the data in MPI_TAG_THREADDATA messages.  The
+ * data are what would have been sent with s_tag to the rank itself.
+ */
+struct ThreadDataHeader {
+  uint64_t s_thread;                     // Tcl_ThreadId of the receiver.
+  int32_t  s_tag;                        // MPI_TAG_TCLDATA{,_Z,_B,_BZ}
+  uint32_t s_unused;
 };
+/**
+ * Header of MPI_TAG_COALESCE messages.  The key follows and then the
+ * data as they'd have been sent with s_tag.
+ */
+struct CoalesceHeader {
+  int32_t  s_tag;                        // MPI_TAG_TCLDATA{,_Z,_B,_BZ}
+  uint32_t s_keyLength;
+};
+/**
+ * Header that precedes the script in MPI_TAG_EVALALL messages.
+ */
+struct EvalAllHeader {
+  int32_t s_root;                        // Rank results are gathered to.
+};
+/**
+ * Header of MPI_TAG_SHARE messages.  The object name follows and then,
+ * except for SHARE_HASH, the value or delta.
+ */
+struct ShareHeader {
+  uint32_t s_kind;                       // SHARE_* below.
+  uint32_t s_nameLength;
+  uint64_t s_version;
+  uint64_t s_hash;                       // Of the new value's string.
+  uint64_t s_baseHash;                   // Value a delta applies to.
+};
+static const uint32_t SHARE_FULL(0);     // The whole value.
+static const uint32_t SHARE_HASH(1);     // A value the receiver has.
+static const uint32_t SHARE_LISTDELTA(2);
+static const uint32_t SHARE_DICTDELTA(3);
+static const size_t   SHARE_KEEP(4);     // Values kept per object.
 
 /**
  * size subcommand.
@@ -161,254 +424,2374 @@ CTclMpi::execute(CTCLInterpreter& interp, std::vector<CTCLObject>& objv)
 void
 CTclMpi::send(CTCLInterpreter& interp, std::vector<CTCLObject>& objv)
 {
-  requireExactly(objv, 4);          // cmd, sub, rank, data.
+  requireAtLeast(objv, 4);          // cmd, sub, ?options? rank, data.
   bindAll(interp, objv);
 
-  std::string sRank = objv[2];
-  std::string data  = objv[3];
+  bool        binary   = false;
+  bool        urgent   = false;
+  bool        coalesce = false;
+  std::string key;
+  size_t      i        = 2;
+  while (i < objv.size() - 2) {
+    std::string option = objv[i];
+    if (option == "-binary") {
+      binary = true;
+      i++;
+    } else if (option == "-coalesce") {
+      if (i + 1 >= objv.size() - 2) {
+        throw std::string("-coalesce needs a key");
+      }
+      coalesce = true;
+      key      = std::string(objv[i+1]);
+      i += 2;
+    } else if (option == "-priority") {
+      if (i + 1 >= objv.size() - 2) {
+        throw std::string("-priority needs a value");
+      }
+      std::string priority = objv[i+1];
+      if (priority == "high") {
+        urgent = true;
+      } else if (priority == "normal") {
+        urgent = false;
+      } else {
+        throw std::string("Invalid send priority: ") + priority;
+      }
+      i += 2;
+    } else {
+      throw std::string("Invalid send option: ") + option;
+    }
+  }
+  m_urgent = urgent;
+  
+  std::string sRank = objv[i];
+  std::string data;
+  if (binary) {                          // Compress once for all receivers.
+    m_encoded.clear();
+    CMPITclCodec::encode(objv[i+1].getObject(), m_encoded);
+    preparePayload(
+      m_encoded.data(), m_encoded.size(), MPI_TAG_TCLDATA_B, MPI_TAG_TCLDATA_BZ
+    );
+  } else {
+    data = std::string(objv[i+1]);
+    preparePayload(
+      data.c_str(), data.size() + 1, MPI_TAG_TCLDATA, MPI_TAG_TCLDATA_Z
+    );
+  }
+  if (coalesce) {
+    CoalesceHeader hdr = {m_payloadTag, static_cast<uint32_t>(key.size())};
+    m_keyedPayload.resize(sizeof(hdr) + key.size() + m_payloadSize);
+    memcpy(m_keyedPayload.data(), &hdr, sizeof(hdr));
+    memcpy(m_keyedPayload.data() + sizeof(hdr), key.data(), key.size());
+    memcpy(
+      m_keyedPayload.data() + sizeof(hdr) + key.size(), m_pPayload, m_payloadSize
+    );
+    m_pPayload    = m_keyedPayload.data();
+    m_payloadSize = m_keyedPayload.size();
+    m_payloadTag  = MPI_TAG_COALESCE;
+  }
   
   // The special ranks other and all apply:
   
-  if (sRank == "others") {
+  int      r;
+  uint64_t thread;
+  if (parseEndpoint(sRank, r, thread)) {
+    if ((r < 0) || (r >= appsize())) {
+      throw std::string("Invalid rank for send");
+    }
+    if (coalesce) {
+      throw std::string("-coalesce can't be used to send to a thread");
+    }
+    sendData(r, thread);
+  } else if (sRank == "others") {
     for (int i =0; i < appsize(); i++) {
       if (i != myrank()) {
-        sendData(i, data);
+        sendData(i);
       }
     }
   } else if (sRank == "all") {
     for (int i =0; i < appsize(); i++) {
-      sendData(i, data);
+      sendData(i);
     }
   } else {
-    int r = objv[2];
+    int r = objv[i];
     if ((r < 0) || (r >= appsize())) {
       throw std::string("Invalid rank for send");
     }
-    sendData(r, data);
+    sendData(r);
   }
 }
-
 /**
- * handle
- *   Data receive handler manipulation:
- *      - If there's a nonempty extra parameter, that's the new handler script.
- *      - If there's an empty handler parameter, the current handler is removed.
- *      - If there's no handler parameter, the current handler script is passed back
- *        as the result.
+ * evalAll
+ *   Execute the evalall subcommand: evaluate a script in every rank,
+ *   this one included, and gather what each got.
  */
 void
-CTclMpi::handle(CTCLInterpreter& interp, std::vector<CTCLObject>& objv)
+CTclMpi::evalAll(CTCLInterpreter& interp, std::vector<CTCLObject>& objv)
 {
-  requireAtMost(objv, 3);
+  requireExactly(objv, 3);
   bindAll(interp, objv);
-
-  //  if there's no script parameter just return the current one if there is or
-  //  an empty string if there isn't
-
-  if (objv.size() == 2) {
-    if (m_pDataHandler != nullptr) {
-      interp.setResult(*m_pDataHandler);
-    } else {
-      interp.setResult("");                    // ther isn't a current handler.
-    }
-  } else {
-    // There's a script.  Is it an empty string:
-    
-    if (std::string(objv[2]) == "") {
-      delete m_pDataHandler;
-      m_pDataHandler = nullptr;
-    } else {
-      // Set the data handler script -- creating the object if needed.
-      
-      if (m_pDataHandler == nullptr) {
-        m_pDataHandler = new CTCLObject;
-        m_pDataHandler->Bind(interp);
+  
+  std::string script = objv[2];
+  CTCLObject  result;
+  result.Bind(interp);
+  evaluateInAll(interp, myrank(), script.c_str(), &result);
+  interp.setResult(result);
+}
+/**
+ * share
+ *   Execute the share subcommand.  The value becomes the next version of
+ *   the named object here and is shipped to every other rank as cheaply
+ *   as we can given that they have what we have:
+ *   - If one of the values we keep for the object has the same content
+ *     hash only the hash is sent.
+ *   - If the value is a list or dict and a delta from the current value
+ *     is smaller and rebuilds exactly the same string, the delta is sent.
+ *   - Otherwise the value is sent.
+ *   An object should only be shared from one rank at a time.
+ */
+void
+CTclMpi::share(CTCLInterpreter& interp, std::vector<CTCLObject>& objv)
+{
+  requireExactly(objv, 4);
+  bindAll(interp, objv);
+  
+  std::string   name    = objv[2];
+  Tcl_Obj*      pValue  = Tcl_DuplicateObj(objv[3].getObject());
+  Tcl_IncrRefCount(pValue);
+  int           valueBytes;
+  const char*   pString = Tcl_GetStringFromObj(pValue, &valueBytes);
+  SharedObject& object(m_shared[name]);
+  
+  ShareHeader hdr;
+  hdr.s_kind       = SHARE_FULL;
+  hdr.s_nameLength = name.size();
+  hdr.s_version    = object.s_version + 1;
+  hdr.s_hash       = contentHash(pString, valueBytes);
+  hdr.s_baseHash   = object.s_hash;
+  
+  Tcl_Obj* pPayload = pValue;
+  Tcl_Obj* pDelta   = nullptr;
+  if (object.s_values.count(hdr.s_hash)) {
+    hdr.s_kind = SHARE_HASH;
+  } else if (object.s_version) {
+    Tcl_Obj* pBase = object.s_values[object.s_hash];
+    for (uint32_t kind = SHARE_LISTDELTA; kind <= SHARE_DICTDELTA; kind++) {
+      pDelta = makeDelta(kind, pBase, pValue);
+      if (pDelta) {
+        Tcl_Obj* pRebuilt = applyDelta(kind, pBase, pDelta);
+        if (pRebuilt && (std::string(Tcl_GetString(pRebuilt)) == pString)
+            && (strlen(Tcl_GetString(pDelta)) < size_t(valueBytes))) {
+          hdr.s_kind = kind;
+          pPayload   = pDelta;
+        }
+        if (pRebuilt) Tcl_DecrRefCount(pRebuilt);
+        if (hdr.s_kind == kind) break;
+        Tcl_DecrRefCount(pDelta);
+        pDelta = nullptr;
       }
-      
-      (*m_pDataHandler) = objv[2].getObject();
     }
-    
-    
   }
+  
+  int         payloadBytes = 0;
+  const char* pPayloadData = "";
+  if (hdr.s_kind != SHARE_HASH) {
+    pPayloadData = Tcl_GetStringFromObj(pPayload, &payloadBytes);
+  }
+  std::vector<char> msg(sizeof(hdr) + name.size() + payloadBytes);
+  memcpy(msg.data(), &hdr, sizeof(hdr));
+  memcpy(msg.data() + sizeof(hdr), name.data(), name.size());
+  memcpy(msg.data() + sizeof(hdr) + name.size(), pPayloadData, payloadBytes);
+  if (pDelta) Tcl_DecrRefCount(pDelta);
+  
+  for (int i = 0; i < appsize(); i++) {
+    if (i != myrank()) {
+      MPITcl_sendLarge(
+        msg.data(), msg.size(), MPI_TAG_SHARE, i, classComm(MPI_TAG_SHARE)
+      );
+    }
+  }
+  if (hdr.s_kind == SHARE_HASH) {
+    installShared(object, hdr.s_version, hdr.s_hash, object.s_values[hdr.s_hash]);
+  } else {
+    installShared(object, hdr.s_version, hdr.s_hash, pValue);
+  }
+  Tcl_DecrRefCount(pValue);
 }
 /**
- * CtclMpi constructor  just register us.
+ * shared
+ *   Execute the shared subcommand: the local copy of a shared object or,
+ *   with -version, its version.
  */
-CTclMpi::CTclMpi(const char* command, CTCLInterpreter& interp) :
-  CTCLObjectProcessor(interp, command, true), m_pDataHandler(nullptr)
+void
+CTclMpi::shared(CTCLInterpreter& interp, std::vector<CTCLObject>& objv)
 {
+  requireAtLeast(objv, 3);
+  requireAtMost(objv, 4);
+  bindAll(interp, objv);
+  
+  std::string name = objv[2];
+  auto p = m_shared.find(name);
+  if ((p == m_shared.end()) || (p->second.s_version == 0)) {
+    throw std::string("No shared object named ") + name;
+  }
+  if (objv.size() == 4) {
+    if (std::string(objv[3]) != "-version") {
+      throw std::string("Invalid shared option: ") + std::string(objv[3]);
+    }
+    Tcl_SetObjResult(
+      interp.getInterpreter(), Tcl_NewWideIntObj(p->second.s_version)
+    );
+  } else {
+    Tcl_SetObjResult(interp.getInterpreter(), p->second.s_values[p->second.s_hash]);
+  }
 }
 /**
- * stopNotifier
- *    Only legal for rank 0 - stop the notifier thread.  This is done
- *    by sending ourselves a zer length message with MPI_TAG_STOPTHREAD.
- *    On receipt of this, the probe thread exits.
+ * receiveShare
+ *   Install a shared object version some other rank sent us.  If we
+ *   don't have the value a hash or delta refers to, or a delta doesn't
+ *   rebuild the value that was hashed, the update is dropped.
  *
- * @param interp -  interpreter running the thread.
- * @param objv   -  command parameters (none but the command word).
- * @note An error is signalled if this is called in a non rank0 process.
- * @note Calling this method when there is no notifier thread will result in
- *      an handled message with the MPI_TAG_STOPTHREAD tag and zero length
- *      queued to RANK 0 --  in general this is not desirable.
- * @note - If for some reason (see startNotifier) more than one notifier thread
- *         is running, this method will only stop one of them.  It's also possible
- *         in that case for MPI_Recv to block in one or all of the other notifier
- *         threads -- in other words; Dont't. Do. It.
+ * @param interp - interpreter.
+ * @param source - sending rank.
+ * @param msg    - the MPI_TAG_SHARE message.
+ * @param count  - its size.
  */
 void
-CTclMpi::stopNotifier(CTCLInterpreter& interp, std::vector<CTCLObject>& objv)
+CTclMpi::receiveShare(
+  CTCLInterpreter& interp, int source, const char* msg, size_t count
+)
 {
-  requireExactly(objv, 2);
-  if (myrank() != 0) {
-    throw std::string("stopnotifier can only be used in rank 0");
+  ShareHeader hdr;
+  if (count < sizeof(hdr)) {
+    std::cerr << "Runt share update from rank " << source << " message ignored\n";
+    return;
+  }
+  memcpy(&hdr, msg, sizeof(hdr));
+  if ((sizeof(hdr) + hdr.s_nameLength > count) || (hdr.s_kind > SHARE_DICTDELTA)) {
+    std::cerr << "Bad share update from rank " << source << " message ignored\n";
+    return;
+  }
+  std::string   name(msg + sizeof(hdr), hdr.s_nameLength);
+  const char*   pPayload     = msg + sizeof(hdr) + hdr.s_nameLength;
+  int           payloadBytes = count - sizeof(hdr) - hdr.s_nameLength;
+  SharedObject& object(m_shared[name]);
+  
+  Tcl_Obj* pValue = nullptr;
+  if (hdr.s_kind == SHARE_FULL) {
+    pValue = Tcl_NewStringObj(pPayload, payloadBytes);
+    Tcl_IncrRefCount(pValue);
+  } else {
+    uint64_t base = (hdr.s_kind == SHARE_HASH) ? hdr.s_hash : hdr.s_baseHash;
+    auto     p    = object.s_values.find(base);
+    if (p != object.s_values.end()) {
+      if (hdr.s_kind == SHARE_HASH) {
+        pValue = p->second;
+        Tcl_IncrRefCount(pValue);
+      } else {
+        Tcl_Obj* pDelta = Tcl_NewStringObj(pPayload, payloadBytes);
+        Tcl_IncrRefCount(pDelta);
+        pValue = applyDelta(hdr.s_kind, p->second, pDelta);
+        Tcl_DecrRefCount(pDelta);
+      }
+    }
+  }
+  int nBytes;
+  const char* pString = pValue ? Tcl_GetStringFromObj(pValue, &nBytes) : nullptr;
+  if (!pValue || (contentHash(pString, nBytes) != hdr.s_hash)) {
+    std::cerr << "Unable to rebuild version " << hdr.s_version
+              << " of shared object " << name << " from rank " << source
+              << "; update ignored\n";
+    if (pValue) Tcl_DecrRefCount(pValue);
+    return;
   }
-  char buf='0';
-  MPI_Send(&buf, 0, MPI_CHAR, 0, MPI_TAG_STOPTHREAD, MPI_COMM_WORLD);
+  installShared(object, hdr.s_version, hdr.s_hash, pValue);
+  Tcl_DecrRefCount(pValue);
 }
 /**
- * startNotifier
- *    Starts the notifier thread.  This is only legal in rank 0 processes.
- *    See  the notes in stopNotifier for som eof the pitfalls to avoid.
- *
- *  @param interp -the interpreter executing the command.
- *  @param objv   - The command parametesrs.
+ * installShared
+ *   Make a value the current version of an object, keeping the last
+ *   SHARE_KEEP distinct values.
+ * @param object  - the object.
+ * @param version - its new version.
+ * @param hash    - content hash of the value.
+ * @param pValue  - the value (we take our own reference).
  */
 void
-CTclMpi::startNotifier(CTCLInterpreter& interp, std::vector<CTCLObject>& objv)
+CTclMpi::installShared(
+  SharedObject& object, uint64_t version, uint64_t hash, Tcl_Obj* pValue
+)
 {
-  requireExactly(objv, 2);
-  if (myrank() != 0) {
-    throw std::string("startnotifier can only be used in rank 0");
+  object.s_version = version;
+  object.s_hash    = hash;
+  if (object.s_values.count(hash) == 0) {
+    Tcl_IncrRefCount(pValue);
+    object.s_values[hash] = pValue;
+    object.s_history.push_back(hash);
+  }
+  while (object.s_history.size() > SHARE_KEEP) {
+    uint64_t oldest = object.s_history.front();
+    if (oldest == hash) break;                 // Don't evict the current.
+    object.s_history.pop_front();
+    Tcl_DecrRefCount(object.s_values[oldest]);
+    object.s_values.erase(oldest);
   }
-  startMpiReceiverThread(interp, Tcl_GetCurrentThread());
-  
 }
 /**
- * operator()
- *   Executes the mpi::mpi command.
+ * contentHash
+ *   64 bit FNV-1a of some bytes.
  */
-int
-CTclMpi::operator()(CTCLInterpreter& interp, std::vector<CTCLObject>& objv)
+uint64_t
+CTclMpi::contentHash(const char* pData, size_t nBytes)
 {
-  // require a subcommand:
-
-  try {
-    requireAtLeast(objv, 2);
-    std::string subcommand = objv[1];
-    if (subcommand == "size") {
-      size(interp, objv);
-    } else if (subcommand == "rank") {
-      rank(interp, objv);
-    } else if (subcommand == "execute") {
-      execute(interp, objv);
-    } else if (subcommand == "send" ) {
-      send(interp, objv);
-    } else if (subcommand == "handle") {
-      handle(interp, objv);
-    } else if (subcommand == "stopnotifier") {
-      stopNotifier(interp, objv);
-    } else if (subcommand == "startnotifier") {
-      startNotifier(interp, objv);
-    } else {
-      std::string msg = "Unrecognized subcommand: ";
-      msg += std::string(objv[0]);
-      msg += " " ;
-      msg += subcommand;
-      throw msg;
-    }
-  }
-  catch (CException& e) {
-    interp.setResult(e.ReasonText());
-    return TCL_ERROR;
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < nBytes; i++) {
+    hash ^= static_cast<unsigned char>(pData[i]);
+    hash *= 1099511628211ULL;
   }
-  catch (std::string msg) {
-    interp.setResult(msg);
-    return TCL_ERROR;
+  return hash;
+}
+/**
+ * makeDelta
+ *   Describe how to turn a base list or dict into a new value:
+ *   - SHARE_LISTDELTA: {length {index element ...}} - the list is cut or
+ *     padded with empty elements to length and the elements replaced.
+ *   - SHARE_DICTDELTA: {{key ...} {key value ...}} - keys removed, then
+ *     keys set.
+ * @param kind    - SHARE_LISTDELTA or SHARE_DICTDELTA.
+ * @param pBase   - the value the receivers have.
+ * @param pValue  - the new value.
+ * @return Tcl_Obj* - the delta with a reference for the caller or nullptr
+ *                    if the values aren't of that kind.
+ */
+Tcl_Obj*
+CTclMpi::makeDelta(uint32_t kind, Tcl_Obj* pBase, Tcl_Obj* pValue)
+{
+  Tcl_Obj* pDelta = Tcl_NewListObj(0, nullptr);
+  Tcl_IncrRefCount(pDelta);
+  if (kind == SHARE_LISTDELTA) {
+    int       nBase, nValue;
+    Tcl_Obj** pBaseItems;
+    Tcl_Obj** pValueItems;
+    if ((Tcl_ListObjGetElements(nullptr, pBase, &nBase, &pBaseItems) != TCL_OK)
+        || (Tcl_ListObjGetElements(nullptr, pValue, &nValue, &pValueItems) != TCL_OK)
+        || (nValue < 2)) {
+      Tcl_DecrRefCount(pDelta);
+      return nullptr;
+    }
+    Tcl_Obj* pChanges = Tcl_NewListObj(0, nullptr);
+    for (int i = 0; i < nValue; i++) {
+      if ((i >= nBase)
+          || strcmp(Tcl_GetString(pBaseItems[i]), Tcl_GetString(pValueItems[i]))) {
+        Tcl_ListObjAppendElement(nullptr, pChanges, Tcl_NewIntObj(i));
+        Tcl_ListObjAppendElement(nullptr, pChanges, pValueItems[i]);
+      }
+    }
+    Tcl_ListObjAppendElement(nullptr, pDelta, Tcl_NewIntObj(nValue));
+    Tcl_ListObjAppendElement(nullptr, pDelta, pChanges);
+  } else {
+    int nBase, nValue;
+    if ((Tcl_DictObjSize(nullptr, pBase, &nBase) != TCL_OK)
+        || (Tcl_DictObjSize(nullptr, pValue, &nValue) != TCL_OK)) {
+      Tcl_DecrRefCount(pDelta);
+      return nullptr;
+    }
+    Tcl_Obj*       pRemoved = Tcl_NewListObj(0, nullptr);
+    Tcl_Obj*       pSet     = Tcl_NewListObj(0, nullptr);
+    Tcl_DictSearch search;
+    Tcl_Obj*       pKey;
+    Tcl_Obj*       pItem;
+    int            done;
+    Tcl_DictObjFirst(nullptr, pBase, &search, &pKey, &pItem, &done);
+    for (; !done; Tcl_DictObjNext(&search, &pKey, &pItem, &done)) {
+      Tcl_Obj* pNew;
+      Tcl_DictObjGet(nullptr, pValue, pKey, &pNew);
+      if (!pNew) Tcl_ListObjAppendElement(nullptr, pRemoved, pKey);
+    }
+    Tcl_DictObjDone(&search);
+    Tcl_DictObjFirst(nullptr, pValue, &search, &pKey, &pItem, &done);
+    for (; !done; Tcl_DictObjNext(&search, &pKey, &pItem, &done)) {
+      Tcl_Obj* pOld;
+      Tcl_DictObjGet(nullptr, pBase, pKey, &pOld);
+      if (!pOld || strcmp(Tcl_GetString(pOld), Tcl_GetString(pItem))) {
+        Tcl_ListObjAppendElement(nullptr, pSet, pKey);
+        Tcl_ListObjAppendElement(nullptr, pSet, pItem);
+      }
+    }
+    Tcl_DictObjDone(&search);
+    Tcl_ListObjAppendElement(nullptr, pDelta, pRemoved);
+    Tcl_ListObjAppendElement(nullptr, pDelta, pSet);
   }
-  catch (const char* msg) {
-    interp.setResult(msg);
-    return TCL_ERROR;
+  return pDelta;
+}
+/**
+ * applyDelta
+ *   Rebuild a value from its base and a delta made by makeDelta.
+ * @return Tcl_Obj* - the value with a reference for the caller or
+ *                    nullptr if the delta doesn't apply.
+ */
+Tcl_Obj*
+CTclMpi::applyDelta(uint32_t kind, Tcl_Obj* pBase, Tcl_Obj* pDelta)
+{
+  int       nDelta;
+  Tcl_Obj** pParts;
+  if ((Tcl_ListObjGetElements(nullptr, pDelta, &nDelta, &pParts) != TCL_OK)
+      || (nDelta != 2)) {
+    return nullptr;
   }
-  catch (std::exception& e) {
-    interp.setResult(e.what());
-    return TCL_ERROR;
+  int       nChanges;
+  Tcl_Obj** pChanges;
+  if ((Tcl_ListObjGetElements(nullptr, pParts[1], &nChanges, &pChanges) != TCL_OK)
+      || (nChanges % 2)) {
+    return nullptr;
   }
-  catch (...) {
-    interp.setResult("Unexpected exception type");
-    return TCL_ERROR;
+  Tcl_Obj* pResult = nullptr;
+  if (kind == SHARE_LISTDELTA) {
+    int       length, nBase;
+    Tcl_Obj** pBaseItems;
+    if ((Tcl_GetIntFromObj(nullptr, pParts[0], &length) != TCL_OK) || (length < 0)
+        || (Tcl_ListObjGetElements(nullptr, pBase, &nBase, &pBaseItems) != TCL_OK)) {
+      return nullptr;
+    }
+    std::vector<Tcl_Obj*> items(length, nullptr);
+    for (int i = 0; i < nChanges; i += 2) {
+      int index;
+      if ((Tcl_GetIntFromObj(nullptr, pChanges[i], &index) != TCL_OK)
+          || (index < 0) || (index >= length)) {
+        return nullptr;
+      }
+      items[index] = pChanges[i+1];
+    }
+    for (int i = 0; i < length; i++) {
+      if (!items[i]) items[i] = (i < nBase) ? pBaseItems[i] : Tcl_NewObj();
+    }
+    pResult = Tcl_NewListObj(length, items.data());
+  } else {
+    int       nRemoved;
+    Tcl_Obj** pRemoved;
+    if (Tcl_ListObjGetElements(nullptr, pParts[0], &nRemoved, &pRemoved) != TCL_OK) {
+      return nullptr;
+    }
+    pResult = Tcl_DuplicateObj(pBase);
+    bool ok = true;
+    for (int i = 0; ok && (i < nRemoved); i++) {
+      ok = Tcl_DictObjRemove(nullptr, pResult, pRemoved[i]) == TCL_OK;
+    }
+    for (int i = 0; ok && (i < nChanges); i += 2) {
+      ok = Tcl_DictObjPut(nullptr, pResult, pChanges[i], pChanges[i+1]) == TCL_OK;
+    }
+    if (!ok) {
+      Tcl_IncrRefCount(pResult);               // Frees it.
+      Tcl_DecrRefCount(pResult);
+      return nullptr;
+    }
   }
-  
-
-  return TCL_OK;
-}
-
-//////////////////////////////////////////////////////////////////////////////////////
-
-
-CTclMpi* gpMpiCommand(nullptr);
-void loadMPIExtensions(CTCLInterpreter& interp)
-{
-  Tcl_CreateNamespace(interp.getInterpreter(), "mpi", nullptr, nullptr);
-
-  gpMpiCommand = new CTclMpi("mpi::mpi", interp);
+  Tcl_IncrRefCount(pResult);
+  return pResult;
 }
-
-MPIBinDataHandler gpBinaryDataHandler(nullptr);
-
+/**
+ * preparePayload
+ *    Figure out what will actually be sent for a chunk of Tcl data.
+ *    If the compression policy says to try, the data are compressed
+ *    and, if that was worth it, sent with the compressed tag.
+ *    Otherwise the data themselves are sent with the plain tag.
+ *
+ * @param pData  - the data to send (a string's includes its null
+ *                 terminator).  Must live until the sends are done.
+ * @param nBytes - how much there is.
+ * @param tag    - tag if sent as is.
+ * @param zTag   - tag if compressed.
+ */
 void
-MPITcl_setBinaryDataHandler(MPIBinDataHandler handler)
+CTclMpi::preparePayload(const char* pData, size_t nBytes, int tag, int zTag)
 {
-  gpBinaryDataHandler = handler;
-}
+  m_pPayload    = pData;
+  m_payloadSize = nBytes;
+  m_payloadTag  = tag;
 
+  if (m_sendCompression.shouldCompress(nBytes)) {
+    m_payload.resize(sizeof(CompressedHeader) + CMPICompressor::bound(nBytes));
+    double start = MPI_Wtime();
+    size_t zBytes = m_compressor.compress(
+      pData, nBytes, m_payload.data() + sizeof(CompressedHeader),
+      m_payload.size() - sizeof(CompressedHeader)
+    );
+    if (m_sendCompression.compressed(nBytes, zBytes, MPI_Wtime() - start)) {
+      CompressedHeader hdr;
+      hdr.s_originalSize = nBytes;
+      memcpy(m_payload.data(), &hdr, sizeof(hdr));
+      m_pPayload    = m_payload.data();
+      m_payloadSize = sizeof(hdr) + zBytes;
+      m_payloadTag  = zTag;
+    }
+  }
+}
 /**
- * mpiEventProcessor
- *   Called to process an MPI event.
- *   @param interp - references the TCL interpeter we're running.
- *   @param probeStat - references probe status that caused this to be
- *                      called.
+ * sendData
+ *    Send the payload prepared by preparePayload to a rank, feeding the
+ *    time it took back to the compression policy.  Payloads too big
+ *    for a single message are chunked.  Payloads for a thread get a
+ *    ThreadDataHeader and go as MPI_TAG_THREADDATA.  Urgent payloads go
+ *    on the control communicator.  Payloads for this rank are queued
+ *    to the receiving thread: a chunked send to ourselves would wait
+ *    for chunks to be received by the thread that's sending them.
+ *
+ * @param rank   - receiver.
+ * @param thread - receiving thread (0 for the rank's mpi handler).
  */
 void
-mpiEventProcessor(CTCLInterpreter& interp, MPI_Status& probeStat)
+CTclMpi::sendData(int rank, uint64_t thread)
+{
+  if (rank == myrank()) {
+    const char* pData  = m_pPayload;
+    size_t      nBytes = m_payloadSize;
+    int         tag    = m_payloadTag;
+    if (tag == MPI_TAG_COALESCE) {         // Nothing waiting to replace.
+      CoalesceHeader hdr;
+      memcpy(&hdr, pData, sizeof(hdr));
+      tag     = hdr.s_tag;
+      pData  += sizeof(hdr) + hdr.s_keyLength;
+      nBytes -= sizeof(hdr) + hdr.s_keyLength;
+    }
+    queueToThread(
+      thread ?
+        reinterpret_cast<Tcl_ThreadId>(static_cast<uintptr_t>(thread)) : gMainThread,
+      rank, tag, pData, nBytes
+    );
+    return;
+  }
+  double   start = MPI_Wtime();
+  MPI_Comm comm  = m_urgent ?
+    classComm(MPI_TAG_SCRIPT) : classComm(thread ? MPI_TAG_THREADDATA : m_payloadTag);
+  if (thread) {
+    ThreadDataHeader hdr = {thread, m_payloadTag, 0};
+    m_threadPayload.resize(sizeof(hdr) + m_payloadSize);
+    memcpy(m_threadPayload.data(), &hdr, sizeof(hdr));
+    memcpy(m_threadPayload.data() + sizeof(hdr), m_pPayload, m_payloadSize);
+    MPITcl_sendLarge(
+      m_threadPayload.data(), m_threadPayload.size(), MPI_TAG_THREADDATA,
+      rank, comm
+    );
+  } else {
+    MPITcl_sendLarge(m_pPayload, m_payloadSize, m_payloadTag, rank, comm);
+  }
+  m_sendCompression.sent(m_payloadSize, MPI_Wtime() - start);
+}
+/**
+ * parseEndpoint
+ *    Split a rank:threadid endpoint.  The thread id is a hex address
+ *    as thread::id and mpi endpoint give it, with or without their
+ *    tid prefix.
+ *
+ * @param endpoint - what the user gave as the receiver.
+ * @param[out] rank   - the rank part.
+ * @param[out] thread - the thread part.
+ * @return bool - false if endpoint has no thread part.
+ * @throw std::string - it has one but it's bad.
+ */
+bool
+CTclMpi::parseEndpoint(const std::string& endpoint, int& rank, uint64_t& thread)
+{
+  size_t colon = endpoint.find(':');
+  if (colon == std::string::npos) return false;
+  
+  std::string sRank   = endpoint.substr(0, colon);
+  std::string sThread = endpoint.substr(colon + 1);
+  if (sThread.compare(0, 3, "tid") == 0) {
+    sThread = sThread.substr(3);
+  }
+  char* pEnd;
+  long  r = strtol(sRank.c_str(), &pEnd, 0);
+  if (sRank.empty() || *pEnd || (r < 0) || (r > INT_MAX)) {
+    throw std::string("Invalid rank in endpoint: ") + endpoint;
+  }
+  thread = strtoull(sThread.c_str(), &pEnd, 16);
+  if (sThread.empty() || *pEnd || (thread == 0)) {
+    throw std::string("Invalid thread in endpoint: ") + endpoint;
+  }
+  rank = r;
+  return true;
+}
+/**
+ * endpoint
+ *    Return this thread's rank:threadid endpoint.
+ */
+void
+CTclMpi::endpoint(CTCLInterpreter& interp, std::vector<CTCLObject>& objv)
+{
+  requireExactly(objv, 2);
+  
+  char endpoint[100];
+  snprintf(
+    endpoint, sizeof(endpoint), "%d:tid%p", myrank(),
+    static_cast<void*>(Tcl_GetCurrentThread())
+  );
+  interp.setResult(endpoint);
+}
+/**
+ * receivers
+ *    Return the statistics of the current receivers.  Each is a dict:
+ *    - classes      - the classes it receives.
+ *    - messages     - messages it received.
+ *    - bytes        - their size (chunked payloads count their
+ *                     announcement).
+ *    - routed       - how many were thread data it passed on itself.
+ *    - coalesced    - how many were replaced by a newer value (mpi send
+ *                     -coalesce) before the handler saw them.
+ *    - queuetime    - total seconds messages waited for the main thread.
+ *    - maxqueuetime - the longest one waited.
+ *    - handletime   - total seconds the main thread spent on them.
+ */
+void
+CTclMpi::receivers(CTCLInterpreter& interp, std::vector<CTCLObject>& objv)
+{
+  requireExactly(objv, 2);
+  
+  Tcl_Obj* pResult = Tcl_NewListObj(0, nullptr);
+  for (size_t i = 0; i < gReceivers.size(); i++) {
+    ReceiverGroup& group(*gReceivers[i]);
+    Tcl_Obj* pClasses = Tcl_NewListObj(0, nullptr);
+    for (size_t c = 0; c < group.s_classes.size(); c++) {
+      Tcl_ListObjAppendElement(
+        nullptr, pClasses, Tcl_NewStringObj(gClassNames[group.s_classes[c]], -1)
+      );
+    }
+    Tcl_Obj* pStats = Tcl_NewDictObj();
+    Tcl_DictObjPut(nullptr, pStats, Tcl_NewStringObj("classes", -1), pClasses);
+    Tcl_DictObjPut(
+      nullptr, pStats, Tcl_NewStringObj("messages", -1),
+      Tcl_NewWideIntObj(group.s_messages)
+    );
+    Tcl_DictObjPut(
+      nullptr, pStats, Tcl_NewStringObj("bytes", -1),
+      Tcl_NewWideIntObj(group.s_bytes)
+    );
+    Tcl_DictObjPut(
+      nullptr, pStats, Tcl_NewStringObj("routed", -1),
+      Tcl_NewWideIntObj(group.s_routed)
+    );
+    Tcl_DictObjPut(
+      nullptr, pStats, Tcl_NewStringObj("coalesced", -1),
+      Tcl_NewWideIntObj(group.s_coalesced)
+    );
+    Tcl_DictObjPut(
+      nullptr, pStats, Tcl_NewStringObj("queuetime", -1),
+      Tcl_NewDoubleObj(group.s_queueTime*1.0e-6)
+    );
+    Tcl_DictObjPut(
+      nullptr, pStats, Tcl_NewStringObj("maxqueuetime", -1),
+      Tcl_NewDoubleObj(group.s_maxQueueTime*1.0e-6)
+    );
+    Tcl_DictObjPut(
+      nullptr, pStats, Tcl_NewStringObj("handletime", -1),
+      Tcl_NewDoubleObj(group.s_handleTime*1.0e-6)
+    );
+    Tcl_ListObjAppendElement(nullptr, pResult, pStats);
+  }
+  interp.setResult(pResult);
+}
+/**
+ * filter
+ *    mpi filter channel ?option value...?
+ *    Inspect or set the receive filter for mpi send data (tcldata) or
+ *    binary data (binary); see mpiFilter.h.  With no options the result
+ *    is a dict of the options and the number of messages passed and
+ *    dropped.  Options:
+ *    - -match {index pattern} - keep data whose list element index
+ *                     matches pattern.  {} stops matching.  tcldata only.
+ *    - -sample n    - keep one in n matching messages from each source.
+ *    - -latest bool - keep only the newest waiting message from each
+ *                     source.
+ *    A bad option changes nothing.  Binary data taken by a thread safe
+ *    handler's pool never reach the interpreter and aren't filtered.
+ */
+void
+CTclMpi::filter(CTCLInterpreter& interp, std::vector<CTCLObject>& objv)
+{
+  requireAtLeast(objv, 3);
+  bindAll(interp, objv);
+  if (myrank() != 0) {
+    throw std::string("Receive filters can only be set in rank 0");
+  }
+  std::string name    = objv[2];
+  int         channel = 0;
+  while ((channel < FILTER_CHANNELS) && (name != gFilterNames[channel])) channel++;
+  if (channel == FILTER_CHANNELS) {
+    throw std::string("Invalid filter channel: ") + name;
+  }
+  if ((objv.size() - 3) % 2) {
+    throw std::string("mpi filter options need values");
+  }
+  
+  Tcl_Interp* pInterp = interp.getInterpreter();
+  if (objv.size() == 3) {
+    std::lock_guard<std::mutex> lock(gFilterLock);
+    CMPIReceiveFilter& filter(gFilters[channel]);
+    Tcl_Obj* pMatch = Tcl_NewListObj(0, nullptr);
+    if (filter.matching()) {
+      Tcl_ListObjAppendElement(nullptr, pMatch, Tcl_NewIntObj(filter.matchIndex()));
+      Tcl_ListObjAppendElement(
+        nullptr, pMatch, Tcl_NewStringObj(filter.matchPattern().c_str(), -1)
+      );
+    }
+    Tcl_Obj* pResult = Tcl_NewDictObj();
+    Tcl_DictObjPut(nullptr, pResult, Tcl_NewStringObj("-match", -1), pMatch);
+    Tcl_DictObjPut(
+      nullptr, pResult, Tcl_NewStringObj("-sample", -1),
+      Tcl_NewIntObj(filter.sample())
+    );
+    Tcl_DictObjPut(
+      nullptr, pResult, Tcl_NewStringObj("-latest", -1),
+      Tcl_NewBooleanObj(filter.latest())
+    );
+    Tcl_DictObjPut(
+      nullptr, pResult, Tcl_NewStringObj("passed", -1),
+      Tcl_NewWideIntObj(filter.passed())
+    );
+    Tcl_DictObjPut(
+      nullptr, pResult, Tcl_NewStringObj("dropped", -1),
+      Tcl_NewWideIntObj(filter.dropped())
+    );
+    interp.setResult(pResult);
+    return;
+  }
+  
+  bool        setMatch  = false;
+  bool        match     = false;
+  int         index     = 0;
+  std::string pattern;
+  int         sample    = 0;            // 0 - unchanged.
+  bool        setLatest = false;
+  int         latest    = 0;
+  for (size_t i = 3; i < objv.size(); i += 2) {
+    std::string option = objv[i];
+    if (option == "-match") {
+      Tcl_Obj** pItems;
+      int       nItems;
+      if ((Tcl_ListObjGetElements(pInterp, objv[i+1].getObject(), &nItems, &pItems) != TCL_OK)
+          || ((nItems != 0) && (nItems != 2))) {
+        throw std::string("-match must be {index pattern} or {}");
+      }
+      setMatch = true;
+      match    = (nItems == 2);
+      if (match) {
+        if (channel == FILTER_BINARY) {
+          throw std::string("Binary data can't be matched");
+        }
+        if ((Tcl_GetIntFromObj(pInterp, pItems[0], &index) != TCL_OK) || (index < 0)) {
+          throw std::string("-match index must be an integer >= 0");
+        }
+        pattern = Tcl_GetString(pItems[1]);
+      }
+    } else if (option == "-sample") {
+      sample = objv[i+1];
+      if (sample <= 0) {
+        throw std::string("-sample must be > 0");
+      }
+    } else if (option == "-latest") {
+      if (Tcl_GetBooleanFromObj(pInterp, objv[i+1].getObject(), &latest) != TCL_OK) {
+        throw std::string("-latest must be a boolean");
+      }
+      setLatest = true;
+    } else {
+      throw std::string("Invalid filter option: ") + option;
+    }
+  }
+  std::lock_guard<std::mutex> lock(gFilterLock);
+  CMPIReceiveFilter& filter(gFilters[channel]);
+  if (setMatch) {
+    if (match) {
+      filter.setMatch(index, pattern);
+    } else {
+      filter.clearMatch();
+    }
+  }
+  if (sample)    filter.setSample(sample);
+  if (setLatest) filter.setLatest(latest);
+}
+/**
+ * memory
+ *    mpi memory
+ *    A dict of this rank's memory budget (0 if none), what its buffers
+ *    use now and at most (used, peak) and, under subsystems, a dict for
+ *    each subsystem of its current and peak use and how often it had to
+ *    wait for room or was refused it.  All in bytes.
+ */
+void
+CTclMpi::memory(CTCLInterpreter& interp, std::vector<CTCLObject>& objv)
+{
+  requireExactly(objv, 2);
+  
+  CMPIMemoryBudget* pBudget = CMPIMemoryBudget::getInstance();
+  uint64_t used, peak;
+  pBudget->total(used, peak);
+  Tcl_Obj* pResult = Tcl_NewDictObj();
+  Tcl_DictObjPut(
+    nullptr, pResult, Tcl_NewStringObj("budget", -1),
+    Tcl_NewWideIntObj(pBudget->budget())
+  );
+  Tcl_DictObjPut(nullptr, pResult, Tcl_NewStringObj("used", -1), Tcl_NewWideIntObj(used));
+  Tcl_DictObjPut(nullptr, pResult, Tcl_NewStringObj("peak", -1), Tcl_NewWideIntObj(peak));
+  Tcl_Obj* pSubsystems = Tcl_NewDictObj();
+  for (int i = 0; i < CMPIMemoryBudget::subsystems; i++) {
+    CMPIMemoryBudget::Subsystem subsystem = static_cast<CMPIMemoryBudget::Subsystem>(i);
+    CMPIMemoryBudget::Usage     usage     = pBudget->usage(subsystem);
+    Tcl_Obj* pUsage = Tcl_NewDictObj();
+    Tcl_DictObjPut(
+      nullptr, pUsage, Tcl_NewStringObj("current", -1),
+      Tcl_NewWideIntObj(usage.s_current)
+    );
+    Tcl_DictObjPut(
+      nullptr, pUsage, Tcl_NewStringObj("peak", -1), Tcl_NewWideIntObj(usage.s_peak)
+    );
+    Tcl_DictObjPut(
+      nullptr, pUsage, Tcl_NewStringObj("waits", -1), Tcl_NewWideIntObj(usage.s_waits)
+    );
+    Tcl_DictObjPut(
+      nullptr, pUsage, Tcl_NewStringObj("refusals", -1),
+      Tcl_NewWideIntObj(usage.s_refusals)
+    );
+    Tcl_DictObjPut(
+      nullptr, pSubsystems,
+      Tcl_NewStringObj(CMPIMemoryBudget::name(subsystem), -1), pUsage
+    );
+  }
+  Tcl_DictObjPut(nullptr, pResult, Tcl_NewStringObj("subsystems", -1), pSubsystems);
+  interp.setResult(pResult);
+}
+/**
+ * receiverConfig
+ *    The receiver groups as a list of lists of class names.
+ */
+CTCLObject
+CTclMpi::receiverConfig(CTCLInterpreter& interp)
+{
+  CTCLObject result;
+  result.Bind(interp);
+  for (size_t i = 0; i < gReceiverConfig.size(); i++) {
+    CTCLObject group;
+    group.Bind(interp);
+    for (size_t c = 0; c < gReceiverConfig[i].size(); c++) {
+      group += gClassNames[gReceiverConfig[i][c]];
+    }
+    result += group;
+  }
+  return result;
+}
+/**
+ * setReceiverConfig
+ *    Set the receiver groups, restarting the receivers if they're
+ *    running.  Every class must be in exactly one group.
+ *
+ * @param groups - list of lists of class names.
+ */
+void
+CTclMpi::setReceiverConfig(CTCLInterpreter& interp, CTCLObject& groups)
+{
+  if (myrank() != 0) {
+    throw std::string("-receivers can only be set in rank 0");
+  }
+  Tcl_Interp* pInterp = interp.getInterpreter();
+  Tcl_Obj**   pGroups;
+  int         nGroups;
+  if (Tcl_ListObjGetElements(pInterp, groups.getObject(), &nGroups, &pGroups) != TCL_OK) {
+    throw std::string("Not a list of receiver groups: ") + std::string(groups);
+  }
+  std::vector<std::vector<int> > config;
+  std::vector<bool>              seen(RECEIVE_CLASSES, false);
+  for (int i = 0; i < nGroups; i++) {
+    Tcl_Obj** pClasses;
+    int       nClasses;
+    if (Tcl_ListObjGetElements(pInterp, pGroups[i], &nClasses, &pClasses) != TCL_OK) {
+      throw std::string("Not a list of receive classes: ") + Tcl_GetString(pGroups[i]);
+    }
+    if (nClasses == 0) {
+      throw std::string("-receivers groups can't be empty");
+    }
+    std::vector<int> group;
+    for (int c = 0; c < nClasses; c++) {
+      std::string name = Tcl_GetString(pClasses[c]);
+      int         cls  = 0;
+      while ((cls < RECEIVE_CLASSES) && (name != gClassNames[cls])) cls++;
+      if (cls == RECEIVE_CLASSES) {
+        throw std::string("Invalid receive class: ") + name;
+      }
+      if (seen[cls]) {
+        throw std::string("Receive class in more than one group: ") + name;
+      }
+      seen[cls] = true;
+      group.push_back(cls);
+    }
+    config.push_back(group);
+  }
+  for (int cls = 0; cls < RECEIVE_CLASSES; cls++) {
+    if (!seen[cls]) {
+      throw std::string("Receive class has no group: ") + gClassNames[cls];
+    }
+  }
+  gReceiverConfig = config;
+  if (!gReceivers.empty()) {
+    stopReceivers();
+    startReceivers(interp, Tcl_GetCurrentThread());
+  }
+}
+/**
+ * laneWeights
+ *    The lane weights as class weight pairs.
+ */
+CTCLObject
+CTclMpi::laneWeights(CTCLInterpreter& interp)
+{
+  CTCLObject result;
+  result.Bind(interp);
+  std::lock_guard<std::mutex> lock(gLaneLock);
+  for (int cls = 0; cls < RECEIVE_CLASSES; cls++) {
+    result += gClassNames[cls];
+    result += gLaneWeights[cls];
+  }
+  return result;
+}
+/**
+ * setLaneWeights
+ *    Set lane weights from class weight pairs.  Classes not given keep
+ *    their weights.
+ *
+ * @param weights - the pairs.
+ */
+void
+CTclMpi::setLaneWeights(CTCLInterpreter& interp, CTCLObject& weights)
+{
+  Tcl_Interp* pInterp = interp.getInterpreter();
+  Tcl_Obj**   pItems;
+  int         nItems;
+  if ((Tcl_ListObjGetElements(pInterp, weights.getObject(), &nItems, &pItems) != TCL_OK)
+      || (nItems % 2)) {
+    throw std::string("-laneweights must be class weight pairs");
+  }
+  int newWeights[RECEIVE_CLASSES];
+  std::copy(gLaneWeights, gLaneWeights + RECEIVE_CLASSES, newWeights);
+  for (int i = 0; i < nItems; i += 2) {
+    std::string name = Tcl_GetString(pItems[i]);
+    int         cls  = 0;
+    while ((cls < RECEIVE_CLASSES) && (name != gClassNames[cls])) cls++;
+    if (cls == RECEIVE_CLASSES) {
+      throw std::string("Invalid receive class: ") + name;
+    }
+    int weight;
+    if ((Tcl_GetIntFromObj(pInterp, pItems[i+1], &weight) != TCL_OK)
+        || (weight <= 0)) {
+      throw std::string("Lane weights must be integers > 0");
+    }
+    newWeights[cls] = weight;
+  }
+  std::lock_guard<std::mutex> lock(gLaneLock);
+  std::copy(newWeights, newWeights + RECEIVE_CLASSES, gLaneWeights);
+}
+/**
+ * requireMainThread
+ *    Complain if this is a thread interpreter's mpi command.
+ * @param subcommand - what they wanted.
+ */
+void
+CTclMpi::requireMainThread(const std::string& subcommand)
+{
+  if (m_inThread) {
+    throw std::string("mpi ") + subcommand + " can only be used in the main thread";
+  }
+}
+
+/**
+ * handle
+ *   Data receive handler manipulation:
+ *      - If there's a nonempty extra parameter, that's the new handler script.
+ *      - If there's an empty handler parameter, the current handler is removed.
+ *      - If there's no handler parameter, the current handler script is passed back
+ *        as the result.
+ */
+void
+CTclMpi::handle(CTCLInterpreter& interp, std::vector<CTCLObject>& objv)
+{
+  requireAtMost(objv, 3);
+  bindAll(interp, objv);
+
+  //  if there's no script parameter just return the current one if there is or
+  //  an empty string if there isn't
+
+  if (objv.size() == 2) {
+    if (m_pDataHandler != nullptr) {
+      interp.setResult(*m_pDataHandler);
+    } else {
+      interp.setResult("");                    // ther isn't a current handler.
+    }
+  } else {
+    // There's a script.  Is it an empty string:
+    
+    if (std::string(objv[2]) == "") {
+      delete m_pDataHandler;
+      m_pDataHandler = nullptr;
+    } else {
+      // Set the data handler script -- creating the object if needed.
+      
+      if (m_pDataHandler == nullptr) {
+        m_pDataHandler = new CTCLObject;
+        m_pDataHandler->Bind(interp);
+      }
+      
+      (*m_pDataHandler) = objv[2].getObject();
+    }
+    
+    
+  }
+}
+/**
+ * CtclMpi constructor  just register us.
+ */
+CTclMpi::CTclMpi(const char* command, CTCLInterpreter& interp, bool inThread) :
+  CTCLObjectProcessor(interp, command, true), m_pDataHandler(nullptr),
+  m_sendCompression(CMPICompressionPolicy::off), m_pPayload(nullptr), m_payloadSize(0), m_payloadTag(MPI_TAG_TCLDATA),
+  m_urgent(false), m_inThread(inThread)
+{
+}
+/**
+ * stopNotifier
+ *    Only legal for rank 0 - stop the receiver threads.  See
+ *    stopReceivers.
+ *
+ * @param interp -  interpreter running the thread.
+ * @param objv   -  command parameters (none but the command word).
+ * @note An error is signalled if this is called in a non rank0 process.
+ */
+void
+CTclMpi::stopNotifier(CTCLInterpreter& interp, std::vector<CTCLObject>& objv)
+{
+  requireExactly(objv, 2);
+  if (myrank() != 0) {
+    throw std::string("stopnotifier can only be used in rank 0");
+  }
+  stopReceivers();
+}
+/**
+ * startNotifier
+ *    Starts the receiver threads (restarting them if they're running).
+ *    This is only legal in rank 0 processes.
+ *
+ *  @param interp -the interpreter executing the command.
+ *  @param objv   - The command parametesrs.
+ */
+void
+CTclMpi::startNotifier(CTCLInterpreter& interp, std::vector<CTCLObject>& objv)
+{
+  requireExactly(objv, 2);
+  if (myrank() != 0) {
+    throw std::string("startnotifier can only be used in rank 0");
+  }
+  stopReceivers();
+  startReceivers(interp, Tcl_GetCurrentThread());
+}
+/**
+ * configure
+ *    Inspect or modify the transport options:
+ *    - With no options, the result is a list of option value pairs.
+ *    - With one option, the result is the value of that option.
+ *    - With option value pairs, the options are set.
+ *
+ *  @param interp - the interpreter executing the command.
+ *  @param objv   - The command parameters.
+ */
+void
+CTclMpi::configure(CTCLInterpreter& interp, std::vector<CTCLObject>& objv)
+{
+  bindAll(interp, objv);
+  CTCLObject result;
+  result.Bind(interp);
+
+  if (objv.size() == 2) {
+    result += "-compress";
+    result += CMPICompressionPolicy::modeToString(m_sendCompression.mode());
+    result += "-compressthreshold";
+    result += static_cast<int>(m_sendCompression.threshold());
+    result += "-chunksize";
+    result += static_cast<int>(MPITcl_getChunkSize());
+    result += "-chunkwindow";
+    result += static_cast<int>(MPITcl_getChunkWindow());
+    result += "-receivers";
+    result += receiverConfig(interp);
+    result += "-dispatch";
+    result += (gDispatchPolicy == LANE_STRICT) ? "strict" : "weighted";
+    result += "-laneweights";
+    result += laneWeights(interp);
+    result += "-lanedepth";
+    result += static_cast<int>(gLaneDepth);
+    result += "-membudget";
+    result += CTCLObject(Tcl_NewWideIntObj(CMPIMemoryBudget::getInstance()->budget()));
+  } else if (objv.size() == 3) {
+    std::string option = objv[2];
+    if (option == "-compress") {
+      result = CMPICompressionPolicy::modeToString(m_sendCompression.mode());
+    } else if (option == "-compressthreshold") {
+      result = static_cast<int>(m_sendCompression.threshold());
+    } else if (option == "-chunksize") {
+      result = static_cast<int>(MPITcl_getChunkSize());
+    } else if (option == "-chunkwindow") {
+      result = static_cast<int>(MPITcl_getChunkWindow());
+    } else if (option == "-receivers") {
+      result = receiverConfig(interp);
+    } else if (option == "-dispatch") {
+      result = (gDispatchPolicy == LANE_STRICT) ? "strict" : "weighted";
+    } else if (option == "-laneweights") {
+      result = laneWeights(interp);
+    } else if (option == "-lanedepth") {
+      result = static_cast<int>(gLaneDepth);
+    } else if (option == "-membudget") {
+      result = CTCLObject(Tcl_NewWideIntObj(CMPIMemoryBudget::getInstance()->budget()));
+    } else {
+      throw std::string("Invalid configuration option: ") + option;
+    }
+  } else {
+    if ((objv.size() % 2) != 0) {
+      throw std::string("configure options must be option value pairs");
+    }
+    for (size_t i = 2; i < objv.size(); i += 2) {
+      std::string option = objv[i];
+      if (option == "-compress") {
+        m_sendCompression.setMode(
+          CMPICompressionPolicy::modeFromString(std::string(objv[i+1]))
+        );
+      } else if (option == "-compressthreshold") {
+        int threshold = objv[i+1];
+        if (threshold < 0) {
+          throw std::string("-compressthreshold must be >= 0");
+        }
+        m_sendCompression.setThreshold(threshold);
+      } else if (option == "-chunksize") {
+        int nBytes = objv[i+1];
+        if (nBytes <= 0) {
+          throw std::string("-chunksize must be > 0");
+        }
+        MPITcl_setChunkSize(nBytes);
+      } else if (option == "-chunkwindow") {
+        int nChunks = objv[i+1];
+        if (nChunks <= 0) {
+          throw std::string("-chunkwindow must be > 0");
+        }
+        MPITcl_setChunkWindow(nChunks);
+      } else if (option == "-receivers") {
+        setReceiverConfig(interp, objv[i+1]);
+      } else if (option == "-dispatch") {
+        std::string policy = objv[i+1];
+        std::lock_guard<std::mutex> lock(gLaneLock);
+        if (policy == "strict") {
+          gDispatchPolicy = LANE_STRICT;
+        } else if (policy == "weighted") {
+          gDispatchPolicy = LANE_WEIGHTED;
+        } else {
+          throw std::string("-dispatch must be strict or weighted");
+        }
+      } else if (option == "-laneweights") {
+        setLaneWeights(interp, objv[i+1]);
+      } else if (option == "-lanedepth") {
+        int depth = objv[i+1];
+        if (depth <= 0) {
+          throw std::string("-lanedepth must be > 0");
+        }
+        {
+          std::lock_guard<std::mutex> lock(gLaneLock);
+          gLaneDepth = depth;
+        }
+        gLaneSpace.notify_all();
+      } else if (option == "-membudget") {
+        Tcl_WideInt budget;
+        if ((Tcl_GetWideIntFromObj(
+              interp.getInterpreter(), objv[i+1].getObject(), &budget
+            ) != TCL_OK) || (budget < 0)) {
+          throw std::string("-membudget must be an integer >= 0");
+        }
+        CMPIMemoryBudget::getInstance()->setBudget(budget);
+      } else {
+        throw std::string("Invalid configuration option: ") + option;
+      }
+    }
+  }
+  interp.setResult(result);
+}
+/**
+ * operator()
+ *   Executes the mpi::mpi command.
+ */
+int
+CTclMpi::operator()(CTCLInterpreter& interp, std::vector<CTCLObject>& objv)
+{
+  // require a subcommand:
+
+  try {
+    requireAtLeast(objv, 2);
+    std::string subcommand = objv[1];
+    if (subcommand == "size") {
+      size(interp, objv);
+    } else if (subcommand == "rank") {
+      rank(interp, objv);
+    } else if (subcommand == "execute") {
+      execute(interp, objv);
+    } else if (subcommand == "send" ) {
+      send(interp, objv);
+    } else if (subcommand == "evalall") {
+      requireMainThread(subcommand);
+      evalAll(interp, objv);
+    } else if (subcommand == "share") {
+      requireMainThread(subcommand);
+      share(interp, objv);
+    } else if (subcommand == "shared") {
+      requireMainThread(subcommand);
+      shared(interp, objv);
+    } else if (subcommand == "handle") {
+      handle(interp, objv);
+    } else if (subcommand == "endpoint") {
+      endpoint(interp, objv);
+    } else if (subcommand == "receivers") {
+      requireMainThread(subcommand);
+      receivers(interp, objv);
+    } else if (subcommand == "memory") {
+      memory(interp, objv);
+    } else if (subcommand == "filter") {
+      requireMainThread(subcommand);
+      filter(interp, objv);
+    } else if (subcommand == "stopnotifier") {
+      requireMainThread(subcommand);
+      stopNotifier(interp, objv);
+    } else if (subcommand == "startnotifier") {
+      requireMainThread(subcommand);
+      startNotifier(interp, objv);
+    } else if (subcommand == "configure") {
+      configure(interp, objv);
+    } else {
+      std::string msg = "Unrecognized subcommand: ";
+      msg += std::string(objv[0]);
+      msg += " " ;
+      msg += subcommand;
+      throw msg;
+    }
+  }
+  catch (CException& e) {
+    interp.setResult(e.ReasonText());
+    return TCL_ERROR;
+  }
+  catch (std::string msg) {
+    interp.setResult(msg);
+    return TCL_ERROR;
+  }
+  catch (const char* msg) {
+    interp.setResult(msg);
+    return TCL_ERROR;
+  }
+  catch (std::exception& e) {
+    interp.setResult(e.what());
+    return TCL_ERROR;
+  }
+  catch (...) {
+    interp.setResult("Unexpected exception type");
+    return TCL_ERROR;
+  }
+  
+
+  return TCL_OK;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////
+
+
+CTclMpi* gpMpiCommand(nullptr);
+void loadMPIExtensions(CTCLInterpreter& interp)
+{
+  Tcl_CreateNamespace(interp.getInterpreter(), "mpi", nullptr, nullptr);
+
+  gpMpiCommand = new CTclMpi("mpi::mpi", interp);
+  gMainThread  = Tcl_GetCurrentThread();
+  addEndpoint(gMainThread, &interp, gpMpiCommand);
+  if (gEvalComm == MPI_COMM_NULL) {
+    MPI_Comm_dup(MPI_COMM_WORLD, &gEvalComm);    // Every rank loads us once.
+    for (int i = 0; i < RECEIVE_CLASSES; i++) {
+      MPI_Comm_dup(MPI_COMM_WORLD, &gClassComms[i]);
+    }
+    Tcl_StaticPackage(nullptr, "Mpi", mpiThreadInit, nullptr);
+  }
+}
+
+// Threads that can be sent Tcl data: their interpreter and mpi command.
+
+struct ThreadEndpoint {
+  CTCLInterpreter* s_pInterp;
+  CTclMpi*         s_pCommand;
+};
+static std::map<Tcl_ThreadId, ThreadEndpoint> gThreadEndpoints;
+static std::mutex                              gThreadEndpointLock;
+
+/**
+ * addEndpoint
+ *    Make a thread one Tcl data can be sent to.
+ */
+static void
+addEndpoint(Tcl_ThreadId thread, CTCLInterpreter* pInterp, CTclMpi* pCommand)
+{
+  std::lock_guard<std::mutex> lock(gThreadEndpointLock);
+  ThreadEndpoint& endpoint(gThreadEndpoints[thread]);
+  endpoint.s_pInterp  = pInterp;
+  endpoint.s_pCommand = pCommand;
+}
+/**
+ * removeEndpoint
+ *    Tcl_CallWhenDeleted handler for thread interpreters; data for the
+ *    thread are dropped from now on and the mpi command and interpreter
+ *    wrapper mpiThreadInit made are deleted.
+ */
+static void
+removeEndpoint(ClientData pData, Tcl_Interp* pInterp)
+{
+  ThreadEndpoint endpoint;
+  {
+    std::lock_guard<std::mutex> lock(gThreadEndpointLock);
+    auto p = gThreadEndpoints.find(Tcl_GetCurrentThread());
+    if (p == gThreadEndpoints.end()) return;
+    endpoint = p->second;
+    gThreadEndpoints.erase(p);
+  }
+  delete endpoint.s_pCommand;
+  delete endpoint.s_pInterp;
+}
+/**
+ * findEndpoint
+ *    Get a thread's endpoint.
+ * @param thread - the thread.
+ * @param[out] endpoint - its endpoint.
+ * @return bool - false if it has none.
+ */
+static bool
+findEndpoint(Tcl_ThreadId thread, ThreadEndpoint& endpoint)
+{
+  std::lock_guard<std::mutex> lock(gThreadEndpointLock);
+  auto p = gThreadEndpoints.find(thread);
+  if (p == gThreadEndpoints.end()) return false;
+  endpoint = p->second;
+  return true;
+}
+/**
+ * mpiThreadInit
+ *    Initialization of the Mpi static package: load {} Mpi in a thread's
+ *    interpreter gives it an mpi command and makes the thread an
+ *    endpoint.
+ *
+ * @param pRawInterp - the thread's interpreter.
+ * @return int - TCL_OK or TCL_ERROR if the thread already has one.
+ */
+static int
+mpiThreadInit(Tcl_Interp* pRawInterp)
+{
+  ThreadEndpoint existing;
+  if (findEndpoint(Tcl_GetCurrentThread(), existing)) {
+    Tcl_SetObjResult(
+      pRawInterp, Tcl_NewStringObj("mpi is already loaded in this thread", -1)
+    );
+    return TCL_ERROR;
+  }
+  CTCLInterpreter* pInterp = new CTCLInterpreter(pRawInterp);
+  Tcl_CreateNamespace(pRawInterp, "mpi", nullptr, nullptr);
+  CTclMpi* pCommand = new CTclMpi("mpi::mpi", *pInterp, true);
+  addEndpoint(Tcl_GetCurrentThread(), pInterp, pCommand);
+  Tcl_CallWhenDeleted(pRawInterp, removeEndpoint, nullptr);
+  return TCL_OK;
+}
+
+MPIBinDataHandler gpBinaryDataHandler(nullptr);
+MPIBinChunkHandler gpBinaryChunkHandler(nullptr);
+
+// Thread safe binary data handler and the pool of receiver threads
+// that run it.
+
+static std::atomic<MPIBinDataHandler> gpThreadSafeBinaryHandler(nullptr);
+static std::vector<Tcl_ThreadId>      gBinaryPool;
+static std::atomic<bool>              gStoppingBinaryPool(false);
+
+static void stopBinaryPool();
+static void startBinaryPool(unsigned nThreads);
+static void restartReceivers();
+
+void
+MPITcl_setBinaryDataHandler(MPIBinDataHandler handler)
+{
+  bool pooled = !gBinaryPool.empty();
+  stopBinaryPool();
+  gpThreadSafeBinaryHandler = nullptr;
+  gpBinaryDataHandler = handler;
+  if (pooled) restartReceivers();      // They take binary data again.
+}
+/**
+ * MPITcl_setThreadSafeBinaryDataHandler
+ *    Register a binary data handler that can run on several threads at
+ *    once.  It's run by a pool of threads that receive MPI_TAG_BINDATA
+ *    messages themselves, in parallel and without involving the Tcl
+ *    thread.  Any previous pool is stopped first.  While there's a pool
+ *    the rank's Tcl receivers don't take the binary class at all, so
+ *    they're restarted when one starts or goes away.
+ *
+ * @param handler  - the handler (nullptr to remove).
+ * @param nThreads - number of receiver threads.  If zero the handler is
+ *                   run where a Tcl handler would have been.
+ */
+void
+MPITcl_setThreadSafeBinaryDataHandler(MPIBinDataHandler handler, unsigned nThreads)
+{
+  bool pooled = !gBinaryPool.empty();
+  stopBinaryPool();
+  gpBinaryDataHandler       = nullptr;
+  gpThreadSafeBinaryHandler = handler;
+  if (handler) {
+    startBinaryPool(nThreads);
+  }
+  if (pooled != !gBinaryPool.empty()) {
+    restartReceivers();
+  }
+}
+/**
+ * MPITcl_setBinaryChunkHandler
+ *    Register a handler for binary data that arrives in chunks.  If one
+ *    is set, large binary payloads are passed to it a chunk at a time
+ *    as they arrive rather than being assembled for the binary data
+ *    handler.
+ * @param handler - the handler (nullptr to remove).
+ */
+void
+MPITcl_setBinaryChunkHandler(MPIBinChunkHandler handler)
+{
+  gpBinaryChunkHandler = handler;
+}
+/**
+ * MPITcl_sendBinary
+ *    Send binary data to the binary data handler of a rank.  The
+ *    data are chunked if they're too big for a single message.
+ *
+ * @param rank   - receiving rank.
+ * @param pData  - Data to send.
+ * @param nBytes - Bytes of data.
+ */
+void
+MPITcl_sendBinary(int rank, const void* pData, size_t nBytes)
+{
+  MPITcl_sendLarge(pData, nBytes, MPI_TAG_BINDATA, rank, classComm(MPI_TAG_BINDATA));
+}
+/**
+ * MPITcl_addIdlePoller
+ *   Add a poller run while a rank other than 0 waits for messages.
+ * @param poller - the poller.
+ */
+void
+MPITcl_addIdlePoller(MPIIdlePoller poller)
+{
+  gIdlePollers.push_back(poller);
+}
+
+/**
+ * dispatchTclData
+ *    Pass Tcl data that arrived from some rank to an mpi handle script
+ *    (if there is one).
+ *
+ * @param interp   - interpreter to run the handler in.
+ * @param pHandler - the handler (null if none).
+ * @param source   - rank that sent the data.
+ * @param msg      - The data (null terminated).
+ */
+static void
+dispatchTclData(
+  CTCLInterpreter& interp, CTCLObject* pHandler, int source, const char* msg
+)
+{
+  if (pHandler) {
+    CTCLObject fullCommand;
+    fullCommand.Bind(interp);
+    fullCommand = *pHandler;                     // base command.
+    fullCommand += source;
+    fullCommand += msg;
+    std::string result = interp.GlobalEval(std::string(fullCommand));
+  }
+}
+
+/**
+ * tagClass
+ * @param tag - a message tag.
+ * @return int - the receive class of messages with that tag.
+ */
+static int
+tagClass(int tag)
+{
+  switch (tag) {
+  case MPI_TAG_SCRIPT:
+  case MPI_TAG_EVALALL:
+  case MPI_TAG_SHARE:
+  case MPI_TAG_STOPTHREAD:
+    return RECEIVE_CONTROL;
+  case MPI_TAG_BINDATA:
+    return RECEIVE_BINARY;
+  default:
+    return RECEIVE_TCLDATA;
+  }
+}
+/**
+ * classComm
+ * @param tag - a message tag.
+ * @return MPI_Comm - the communicator messages with that tag go on.
+ */
+static MPI_Comm
+classComm(int tag)
+{
+  MPI_Comm comm = gClassComms[tagClass(tag)];
+  return (comm == MPI_COMM_NULL) ? MPI_COMM_WORLD : comm;
+}
+/**
+ * myRank
+ * @return int - our rank in MPI_COMM_WORLD.
+ */
+static int
+myRank()
+{
+  int rank;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  return rank;
+}
+
+/**
+ * passOnStopToken
+ *   If a message we've matched is a binary pool stop token (a zero
+ *   length binary message we sent ourselves while the pool is stopping),
+ *   receive it and send it again for a pool thread.  This is done on
+ *   the receiving thread since the Tcl thread may be the one waiting
+ *   for the pool to stop.
+ * @param message - the matched message.
+ * @param status  - its probe status.
+ * @param comm    - communicator it was matched on.
+ * @return bool - true if it was a token.
+ */
+static bool
+passOnStopToken(MPI_Message& message, MPI_Status& status, MPI_Comm comm)
+{
+  int count;
+  MPI_Get_count(&status, MPI_CHAR, &count);
+  if ((status.MPI_TAG != MPI_TAG_BINDATA) || (count != 0)
+      || (status.MPI_SOURCE != myRank()) || !gStoppingBinaryPool) {
+    return false;
+  }
+  char        token;
+  MPI_Request request;
+  MPI_Mrecv(&token, 0, MPI_CHAR, &message, MPI_STATUS_IGNORE);
+  MPI_Isend(
+    &token, 0, MPI_CHAR, status.MPI_SOURCE, MPI_TAG_BINDATA, comm, &request
+  );
+  MPI_Request_free(&request);
+  return true;
+}
+
+/**
+ * dispatchTclObject
+ *   Pass binary encoded Tcl data to an mpi handle script.  The handler
+ *   is run with the decoded object itself as its last word so it gets
+ *   the data with their types.
+ *
+ * @param interp   - interpreter to run the handler in.
+ * @param pHandler - the handler (null if none).
+ * @param source   - rank that sent the data.
+ * @param msg      - The encoded data.
+ * @param count    - Their size.
+ */
+static void
+dispatchTclObject(
+  CTCLInterpreter& interp, CTCLObject* pHandler, int source, const char* msg,
+  size_t count
+)
+{
+  if (pHandler) {
+    Tcl_Obj* pData;
+    try {
+      pData = CMPITclCodec::decode(msg, count);
+    } catch (std::string err) {
+      std::cerr << err << " from rank " << source << " message ignored\n";
+      return;
+    }
+    Tcl_Interp* pInterp  = interp.getInterpreter();
+    Tcl_Obj*    pCommand = Tcl_DuplicateObj(pHandler->getObject());
+    Tcl_IncrRefCount(pCommand);
+    Tcl_ListObjAppendElement(pInterp, pCommand, Tcl_NewIntObj(source));
+    Tcl_ListObjAppendElement(pInterp, pCommand, pData);
+    int status = Tcl_EvalObjEx(pInterp, pCommand, TCL_EVAL_GLOBAL);
+    Tcl_DecrRefCount(pCommand);
+    if (status != TCL_OK) {
+      Tcl_BackgroundError(pInterp);
+    }
+  }
+}
+/**
+ * decompressMessage
+ *   Decompress the payload of an MPI_TAG_TCLDATA_Z or MPI_TAG_TCLDATA_BZ
+ *   message.  The size the header claims must be one the payload could
+ *   decompress to and is reserved in the receive account before it's
+ *   allocated, so a bad header can't make us allocate without limit.
+ * @param source - rank that sent it.
+ * @param msg    - the message.
+ * @param count  - its size.
+ * @param[out] data - the decompressed data.  On success their size is
+ *                    reserved; the caller releases it.
+ * @return bool - false (and complaint made) if it was bad.
+ */
+static bool
+decompressMessage(int source, const char* msg, size_t count, std::vector<char>& data)
+{
+  CompressedHeader hdr;
+  if (count < sizeof(hdr)) {
+    std::cerr << "Runt compressed Tcl data from rank "
+              << source << " message ignored\n";
+    return false;
+  }
+  memcpy(&hdr, msg, sizeof(hdr));
+  if ((hdr.s_originalSize > CMPICompressor::expansion(count - sizeof(hdr)))
+      || (hdr.s_originalSize > SIZE_MAX/2)) {
+    std::cerr << "Corrupt compressed Tcl data from rank "
+              << source << " message ignored\n";
+    return false;
+  }
+  CMPIMemoryBudget* pBudget = CMPIMemoryBudget::getInstance();
+  if (!pBudget->tryReserve(CMPIMemoryBudget::receive, hdr.s_originalSize)) {
+    std::cerr << "No room in the memory budget for " << hdr.s_originalSize
+              << " bytes of Tcl data from rank " << source
+              << " message ignored\n";
+    return false;
+  }
+  try {
+    data.resize(hdr.s_originalSize);
+  }
+  catch (std::bad_alloc&) {
+    pBudget->release(CMPIMemoryBudget::receive, hdr.s_originalSize);
+    std::cerr << "Unable to allocate " << hdr.s_originalSize
+              << " bytes for Tcl data from rank " << source
+              << " message ignored\n";
+    return false;
+  }
+  if (!CMPICompressor::decompress(
+      msg + sizeof(hdr), count - sizeof(hdr), data.data(), data.size()
+    )) {
+    pBudget->release(CMPIMemoryBudget::receive, hdr.s_originalSize);
+    std::cerr << "Corrupt compressed Tcl data from rank "
+              << source << " message ignored\n";
+    return false;
+  }
+  return true;
+}
+/**
+ * dispatchTclPayload
+ *   Pass any of the forms of mpi send data to a handler.
+ *
+ * @param interp   - interpreter to run the handler in.
+ * @param pHandler - the handler (null if none).
+ * @param source   - rank that sent the data.
+ * @param tag      - MPI_TAG_TCLDATA{,_Z,_B,_BZ}: what msg is.
+ * @param msg      - The data.
+ * @param count    - Their size.
+ */
+static void
+dispatchTclPayload(
+  CTCLInterpreter& interp, CTCLObject* pHandler, int source, int tag,
+  const char* msg, size_t count
+)
+{
+  std::vector<char> data;
+  switch (tag) {
+  case MPI_TAG_TCLDATA:
+    if ((count == 0) || (msg[count-1] != '\0')) {
+      std::cerr << "Unterminated Tcl data from rank "
+                << source << " message ignored\n";
+      break;
+    }
+    dispatchTclData(interp, pHandler, source, msg);
+    break;
+  case MPI_TAG_TCLDATA_B:
+    dispatchTclObject(interp, pHandler, source, msg, count);
+    break;
+  case MPI_TAG_TCLDATA_Z:
+  case MPI_TAG_TCLDATA_BZ:
+    if (!decompressMessage(source, msg, count, data)) break;
+    try {
+      dispatchTclPayload(
+        interp, pHandler, source,
+        (tag == MPI_TAG_TCLDATA_Z) ? MPI_TAG_TCLDATA : MPI_TAG_TCLDATA_B,
+        data.data(), data.size()
+      );
+    }
+    catch (...) {
+      CMPIMemoryBudget::getInstance()->release(
+        CMPIMemoryBudget::receive, data.size()
+      );
+      throw;
+    }
+    CMPIMemoryBudget::getInstance()->release(
+      CMPIMemoryBudget::receive, data.size()
+    );
+    break;
+  default:
+    std::cerr << "Unrecognized Tcl data type : " << tag << " message ignored\n";
+  }
+}
+
+/**
+ * Tcl event that carries thread data to its thread.  The data follow
+ * in the same allocation so Tcl frees them with the event even if the
+ * thread exits first.
+ */
+struct ThreadDataEvent {
+  Tcl_Event s_event;
+  int       s_source;
+  int       s_tag;
+  size_t    s_count;
+  char      s_data[1];                  // Really s_count bytes.
+};
+/**
+ * threadDataEventHandler
+ *   Runs in the receiving thread: pass the data to its mpi handler
+ *   unless the thread's interpreter has gone away.
+ */
+static int
+threadDataEventHandler(Tcl_Event* pRawEvent, int flags)
+{
+  ThreadDataEvent* pEvent = reinterpret_cast<ThreadDataEvent*>(pRawEvent);
+  ThreadEndpoint   endpoint;
+  if (findEndpoint(Tcl_GetCurrentThread(), endpoint)) {
+    try {
+      dispatchTclPayload(
+        *endpoint.s_pInterp, endpoint.s_pCommand->m_pDataHandler,
+        pEvent->s_source, pEvent->s_tag, pEvent->s_data, pEvent->s_count
+      );
+    } catch (...) {
+      Tcl_BackgroundError(endpoint.s_pInterp->getInterpreter());
+    }
+  }
+  return 1;
+}
+/**
+ * routeToThread
+ *   Pass on an MPI_TAG_THREADDATA message.  Data for the calling thread
+ *   are dispatched right away; data for any other thread are queued to
+ *   it as an event.
+ *
+ * @param source - rank that sent it.
+ * @param msg    - the message.
+ * @param count  - its size.
+ */
+static void
+routeToThread(int source, const char* msg, size_t count)
+{
+  ThreadDataHeader hdr;
+  if (count < sizeof(hdr)) {
+    std::cerr << "Runt thread data from rank "
+              << source << " message ignored\n";
+    return;
+  }
+  memcpy(&hdr, msg, sizeof(hdr));
+  Tcl_ThreadId thread =
+    reinterpret_cast<Tcl_ThreadId>(static_cast<uintptr_t>(hdr.s_thread));
+  msg   += sizeof(hdr);
+  count -= sizeof(hdr);
+  
+  ThreadEndpoint endpoint;
+  if (thread == Tcl_GetCurrentThread()) {
+    if (findEndpoint(thread, endpoint)) {
+      dispatchTclPayload(
+        *endpoint.s_pInterp, endpoint.s_pCommand->m_pDataHandler,
+        source, hdr.s_tag, msg, count
+      );
+    }
+    return;
+  }
+  queueToThread(thread, source, hdr.s_tag, msg, count);
+}
+/**
+ * queueToThread
+ *   Queue Tcl data to a thread as a ThreadDataEvent.
+ *
+ * @param thread - the thread.
+ * @param source - rank that sent them.
+ * @param tag    - MPI_TAG_TCLDATA{,_Z,_B,_BZ}.
+ * @param msg    - the data.
+ * @param count  - their size.
+ */
+static void
+queueToThread(
+  Tcl_ThreadId thread, int source, int tag, const char* msg, size_t count
+)
+{
+  // Queue under the lock so the thread can't drop out from under us.
+  
+  std::lock_guard<std::mutex> lock(gThreadEndpointLock);
+  if (!gThreadEndpoints.count(thread)) {
+    std::cerr << "No mpi thread tid" << static_cast<void*>(thread)
+              << " for data from rank " << source << " message ignored\n";
+    return;
+  }
+  ThreadDataEvent* pEvent = reinterpret_cast<ThreadDataEvent*>(
+    Tcl_Alloc(offsetof(ThreadDataEvent, s_data) + (count ? count : 1))
+  );
+  pEvent->s_event.proc    = threadDataEventHandler;
+  pEvent->s_event.nextPtr = nullptr;
+  pEvent->s_source        = source;
+  pEvent->s_tag           = tag;
+  pEvent->s_count         = count;
+  memcpy(pEvent->s_data, msg, count);
+  Tcl_ThreadQueueEvent(
+    thread, reinterpret_cast<Tcl_Event*>(pEvent), TCL_QUEUE_TAIL
+  );
+  Tcl_ThreadAlert(thread);
+}
+
+/**
+ * unwrapCoalesced
+ *   Take the CoalesceHeader and key off an MPI_TAG_COALESCE message.
+ * @param source     - rank that sent it.
+ * @param msg        - the message.
+ * @param count      - its size.
+ * @param[out] tag   - tag of the data.
+ * @param[out] key   - the key.
+ * @param[out] skip  - bytes before the data.
+ * @return bool - false (and complaint made) if it was bad.
+ */
+static bool
+unwrapCoalesced(
+  int source, const char* msg, size_t count, int& tag, std::string& key,
+  size_t& skip
+)
+{
+  CoalesceHeader hdr;
+  if (count < sizeof(hdr)) {
+    std::cerr << "Runt coalesced Tcl data from rank "
+              << source << " message ignored\n";
+    return false;
+  }
+  memcpy(&hdr, msg, sizeof(hdr));
+  if (count - sizeof(hdr) < hdr.s_keyLength) {
+    std::cerr << "Truncated coalesced Tcl data from rank "
+              << source << " message ignored\n";
+    return false;
+  }
+  tag  = hdr.s_tag;
+  key.assign(msg + sizeof(hdr), hdr.s_keyLength);
+  skip = sizeof(hdr) + hdr.s_keyLength;
+  return true;
+}
+/**
+ * dispatchMessage
+ *   Process a message that's been received.
+ *   @param interp - references the TCL interpeter we're running.
+ *   @param source - The rank that sent the message.
+ *   @param tag    - Type of message.
+ *   @param msg    - Message contents.
+ *   @param count  - Bytes in msg.
+ */
+static void
+dispatchMessage(
+  CTCLInterpreter& interp, int source, int tag, char* msg, size_t count
+)
+{
+  switch(tag) {
+  case MPI_TAG_SCRIPT:
+    {
+      int myrank;
+      MPI_Comm_rank(MPI_COMM_WORLD, &myrank);
+      interp.GlobalEval(msg);
+      break;
+    }
+  case MPI_TAG_TCLDATA:
+  case MPI_TAG_TCLDATA_Z:
+  case MPI_TAG_TCLDATA_B:
+  case MPI_TAG_TCLDATA_BZ:
+    dispatchTclPayload(
+      interp, gpMpiCommand->m_pDataHandler, source, tag, msg, count
+    );
+    break;
+  case MPI_TAG_THREADDATA:
+    routeToThread(source, msg, count);
+    break;
+  case MPI_TAG_COALESCE:                // Nothing left to coalesce with.
+    {
+      int         dataTag;
+      std::string key;
+      size_t      skip;
+      if (unwrapCoalesced(source, msg, count, dataTag, key, skip)) {
+        dispatchTclPayload(
+          interp, gpMpiCommand->m_pDataHandler, source, dataTag,
+          msg + skip, count - skip
+        );
+      }
+    }
+    break;
+  case MPI_TAG_EVALALL:
+    {
+      EvalAllHeader hdr;
+      if ((count <= sizeof(hdr)) || (msg[count-1] != '\0')) {
+        std::cerr << "Bad evalall request from rank "
+                  << source << " message ignored\n";
+        break;
+      }
+      memcpy(&hdr, msg, sizeof(hdr));
+      evaluateInAll(interp, hdr.s_root, msg + sizeof(hdr), nullptr);
+    }
+    break;
+  case MPI_TAG_SHARE:
+    gpMpiCommand->receiveShare(interp, source, msg, count);
+    break;
+  case MPI_TAG_BINDATA:
+    {
+      MPIBinDataHandler handler = gpThreadSafeBinaryHandler;
+      if (!handler) handler = gpBinaryDataHandler;
+      if (!handler) break;
+      if (count > INT_MAX) {
+        std::cerr << "Binary data from rank " << source
+                  << " too big for the binary data handler; use a chunk handler\n";
+        break;
+      }
+      (*handler)(source, count, msg);
+    }
+    break;
+  default:
+    std::cerr << "Unrecognized MPI tag type : " << tag << " message ignored\n";
+  }
+}
+/**
+ * receiveLarge
+ *   Receive the chunks of a large payload that's been announced by an
+ *   MPI_TAG_CHUNKED message.  Binary data for which a chunk handler
+ *   is registered stream through to it; everything else is assembled
+ *   and dispatched as if it had come in a single message.
+ *
+ *   @param interp - references the TCL interpeter we're running.
+ *   @param source - the rank sending the payload.
+ *   @param header - the announcement.
+ *   @param comm   - communicator it came on; the chunks follow on it.
+ */
+static void
+receiveLarge(
+  CTCLInterpreter& interp, int source, const MPIChunkHeader& header,
+  MPI_Comm comm
+)
+{
+  CMPIChunkReceiver receiver;
+  if ((header.s_tag == MPI_TAG_BINDATA) && gpBinaryChunkHandler) {
+    uint64_t total = header.s_totalSize;
+    receiver.receive(
+      [source, total](uint64_t offset, const void* pChunk, size_t nBytes) {
+        (*gpBinaryChunkHandler)(
+          source, offset, total, nBytes, const_cast<void*>(pChunk)
+        );
+      },
+      header, source, comm
+    );
+  } else {
+    CMPIMemoryBudget* pBudget = CMPIMemoryBudget::getInstance();
+    std::vector<char> payload(header.s_totalSize ? header.s_totalSize : 1);
+    pBudget->charge(CMPIMemoryBudget::receive, payload.size());
+    try {
+      receiver.receiveInto(payload.data(), header, source, comm);
+      dispatchMessage(
+        interp, source, header.s_tag, payload.data(), header.s_totalSize
+      );
+    }
+    catch (...) {
+      pBudget->release(CMPIMemoryBudget::receive, payload.size());
+      throw;
+    }
+    pBudget->release(CMPIMemoryBudget::receive, payload.size());
+  }
+}
+
+/**
+ * evaluateInAll
+ *   Our part of an mpi evalall.  The script is passed down a binomial
+ *   tree rooted at the rank that ran the command so no rank sends more
+ *   than log2(size) copies.  We forward it to our children, evaluate it
+ *   at global level and then join the gather of everyone's completion
+ *   code and result at the root.  Only one evalall can be going at a
+ *   time and the script can't do one itself.
+ *
+ * @param interp  - interpreter to evaluate in.
+ * @param root    - rank that ran mpi evalall.
+ * @param script  - the script.
+ * @param pResult - (root only) bound object that gets the dict.
+ */
+static void
+evaluateInAll(
+  CTCLInterpreter& interp, int root, const char* script, CTCLObject* pResult
+)
+{
+  int rank, size;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &size);
+  int relative = (rank - root + size) % size;
+  
+  // Our children are relative + mask for the masks below our lowest
+  // set bit (all of them for the root).
+  
+  int mask = 1;
+  while ((mask < size) && !(relative & mask)) mask <<= 1;
+  if (mask > 1) {
+    EvalAllHeader     hdr;
+    size_t            scriptBytes = strlen(script) + 1;
+    std::vector<char> request(sizeof(hdr) + scriptBytes);
+    hdr.s_root = root;
+    memcpy(request.data(), &hdr, sizeof(hdr));
+    memcpy(request.data() + sizeof(hdr), script, scriptBytes);
+    for (mask >>= 1; mask > 0; mask >>= 1) {
+      if (relative + mask < size) {
+        MPITcl_sendLarge(
+          request.data(), request.size(), MPI_TAG_EVALALL,
+          (relative + mask + root) % size, classComm(MPI_TAG_EVALALL)
+        );
+      }
+    }
+  }
+  
+  // Evaluate and gather.  Each contributes its int32_t code followed
+  // by its result string.
+  
+  Tcl_Interp* pInterp = interp.getInterpreter();
+  int32_t     code    = Tcl_EvalEx(pInterp, script, -1, TCL_EVAL_GLOBAL);
+  const char* pValue  = Tcl_GetStringResult(pInterp);
+  std::vector<char> mine(sizeof(code) + strlen(pValue));
+  memcpy(mine.data(), &code, sizeof(code));
+  memcpy(mine.data() + sizeof(code), pValue, mine.size() - sizeof(code));
+  Tcl_ResetResult(pInterp);
+  
+  int nBytes = mine.size();
+  std::vector<int> counts(rank == root ? size : 0);
+  MPI_Gather(&nBytes, 1, MPI_INT, counts.data(), 1, MPI_INT, root, gEvalComm);
+  std::vector<int>  offsets(counts.size());
+  std::vector<char> all;
+  if (rank == root) {
+    size_t total = 0;
+    for (int i = 0; i < size; i++) {
+      offsets[i] = total;
+      total     += counts[i];
+    }
+    all.resize(total);
+  }
+  MPI_Gatherv(
+    mine.data(), nBytes, MPI_CHAR, all.data(), counts.data(), offsets.data(),
+    MPI_CHAR, root, gEvalComm
+  );
+  
+  if (pResult) {
+    Tcl_Obj* pDict = Tcl_NewDictObj();
+    for (int i = 0; i < size; i++) {
+      int32_t  theirCode;
+      memcpy(&theirCode, all.data() + offsets[i], sizeof(theirCode));
+      Tcl_Obj* pEntry[2] = {
+        Tcl_NewIntObj(theirCode),
+        Tcl_NewStringObj(
+          all.data() + offsets[i] + sizeof(theirCode), counts[i] - sizeof(theirCode)
+        )
+      };
+      Tcl_DictObjPut(pInterp, pDict, Tcl_NewIntObj(i), Tcl_NewListObj(2, pEntry));
+    }
+    (*pResult) = pDict;
+  }
+}
+
+/**
+ * mpiEventProcessor
+ *   Called to process an MPI event.  Messages are matched by MPI_Mprobe
+ *   so a binary receiver thread can't take one out from under us.
+ *   @param interp - references the TCL interpeter we're running.
+ *   @param message - the matched message.
+ *   @param probeStat - references probe status that caused this to be
+ *                      called.
+ *   @param comm    - the communicator it was matched on.
+ */
+void
+mpiEventProcessor(
+  CTCLInterpreter& interp, MPI_Message& message, MPI_Status& probeStat,
+  MPI_Comm comm
+)
 {
   int tag = probeStat.MPI_TAG;             // Type of message.
   int        count;
 
-  MPI_Get_count(&probeStat, MPI_CHAR, &count);
-  
-  char msg[count];          // For now stack allocate.
-  
-  MPI_Recv(msg, count, MPI_CHAR, probeStat.MPI_SOURCE, tag, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-  
-  switch(tag) {
-  case MPI_TAG_SCRIPT:
+  MPI_Get_count(&probeStat, MPI_CHAR, &count);
+  
+  std::vector<char> msg(count ? count : 1);    // Can be up to a chunk big.
+  
+  MPI_Mrecv(msg.data(), count, MPI_CHAR, &message, MPI_STATUS_IGNORE);
+  
+  if (tag == MPI_TAG_CHUNKED) {
+    MPIChunkHeader header;
+    if (count != sizeof(header)) {
+      std::cerr << "Bad chunked transfer header from rank "
+                << probeStat.MPI_SOURCE << " message ignored\n";
+      return;
+    }
+    memcpy(&header, msg.data(), sizeof(header));
+    receiveLarge(interp, probeStat.MPI_SOURCE, header, comm);
+  } else {
+    dispatchMessage(interp, probeStat.MPI_SOURCE, tag, msg.data(), count);
+  }
+}
+
+
+// Class probers.  A thread per receive class blocks in MPI_Probe (which
+// matches nothing) on the class's communicator once a waiter has armed
+// it and then wakes the waiters.  A thread that takes several classes
+// arms them, looks for a message of each in order and, if there's none,
+// sleeps until a prober sees one.  They're stopped and joined before
+// MPI is finalized.
+
+static std::mutex              gProbeLock;
+static std::condition_variable gProbeArm;       // Probers wait to be armed.
+static std::condition_variable gProbeWake;      // Waiters wait for arrivals.
+static bool                    gProbeArmed[RECEIVE_CLASSES];
+static uint64_t                gProbeArrivals(0);
+static std::once_flag          gProbersStarted;
+static bool                    gProbersStopping(false);
+static std::vector<Tcl_ThreadId> gProbers;
+
+/**
+ * classProberThread
+ *   Body of a class prober.
+ * @param p - the class (as an intptr_t).
+ */
+static void
+classProberThread(ClientData p)
+{
+  int cls = static_cast<int>(reinterpret_cast<intptr_t>(p));
+  for (;;) {
     {
-      int myrank;
-      MPI_Comm_rank(MPI_COMM_WORLD, &myrank);
-      interp.GlobalEval(msg);
-      break;
+      std::unique_lock<std::mutex> lock(gProbeLock);
+      gProbeArm.wait(lock, [cls]() {
+        return gProbeArmed[cls] || gProbersStopping;
+      });
+      if (gProbersStopping) break;
     }
-  case MPI_TAG_TCLDATA:
-    if (gpMpiCommand->m_pDataHandler) {
-      CTCLObject fullCommand;
-      fullCommand.Bind(interp);
-      fullCommand = *gpMpiCommand->m_pDataHandler;   // base command.
-      fullCommand += probeStat.MPI_SOURCE;
-      fullCommand += msg;
-      std::string result = interp.GlobalEval(std::string(fullCommand));
+    MPI_Status status;
+    MPI_Probe(MPI_ANY_SOURCE, MPI_ANY_TAG, gClassComms[cls], &status);
+    {
+      std::lock_guard<std::mutex> lock(gProbeLock);
+      gProbeArmed[cls] = false;
+      gProbeArrivals++;
     }
-    break;
-  case MPI_TAG_BINDATA:
-    if (gpBinaryDataHandler) {
-      (*gpBinaryDataHandler)(probeStat.MPI_SOURCE, count, msg);
+    gProbeWake.notify_all();
+  }
+  Tcl_ExitThread(TCL_OK);
+}
+/**
+ * armProbers
+ *   Have the probers of some classes watch for a message, starting them
+ *   the first time.
+ * @param classes - the classes.
+ * @return uint64_t - arrivals so far, for waitForArrival.
+ */
+static uint64_t
+armProbers(const std::vector<int>& classes)
+{
+  std::call_once(gProbersStarted, []() {
+    for (int i = 0; i < RECEIVE_CLASSES; i++) {
+      Tcl_ThreadId thread;
+      if (Tcl_CreateThread(
+            &thread, classProberThread, reinterpret_cast<ClientData>(intptr_t(i)),
+            TCL_THREAD_STACK_DEFAULT, TCL_THREAD_JOINABLE
+          ) == TCL_OK) {
+        gProbers.push_back(thread);
+      }
+    }
+  });
+  uint64_t arrivals;
+  {
+    std::lock_guard<std::mutex> lock(gProbeLock);
+    for (size_t i = 0; i < classes.size(); i++) {
+      gProbeArmed[classes[i]] = true;
+    }
+    arrivals = gProbeArrivals;
+  }
+  gProbeArm.notify_all();
+  return arrivals;
+}
+/**
+ * stopProbers
+ *   Stop the class probers and wait for them to exit.  Those that are
+ *   armed may be in MPI_Probe so they get a stop token (MPI_TAG_STOPTHREAD)
+ *   on their communicator.  Once they're gone we take the tokens back.
+ *   Nothing else may be receiving on the class communicators.
+ */
+static void
+stopProbers()
+{
+  std::vector<int> armed;
+  {
+    std::lock_guard<std::mutex> lock(gProbeLock);
+    gProbersStopping = true;
+    for (int i = 0; i < RECEIVE_CLASSES; i++) {
+      if (gProbeArmed[i]) armed.push_back(i);
+    }
+  }
+  gProbeArm.notify_all();
+  
+  int      me    = myRank();
+  uint32_t token = 0;
+  for (size_t i = 0; i < armed.size(); i++) {
+    MPI_Send(
+      &token, sizeof(token), MPI_CHAR, me, MPI_TAG_STOPTHREAD,
+      gClassComms[armed[i]]
+    );
+  }
+  for (size_t i = 0; i < gProbers.size(); i++) {
+    int result;
+    Tcl_JoinThread(gProbers[i], &result);
+  }
+  gProbers.clear();
+  for (size_t i = 0; i < armed.size(); i++) {
+    int         flag;
+    MPI_Message message;
+    MPI_Improbe(
+      me, MPI_TAG_STOPTHREAD, gClassComms[armed[i]], &flag, &message,
+      MPI_STATUS_IGNORE
+    );
+    if (flag) {
+      MPI_Mrecv(&token, sizeof(token), MPI_CHAR, &message, MPI_STATUS_IGNORE);
     }
-    break;
-  default:
-    std::cerr << "Unrecognized MPI tag type : " << tag << " message ignored\n";
   }
 }
+/**
+ * waitForArrival
+ *   Sleep until a prober sees a message after armProbers, a receiver
+ *   group is stopped or a time passes.
+ * @param arrivals - what armProbers returned.
+ * @param ms       - longest sleep in milliseconds.
+ * @param pGroup   - a receiver group whose stopping ends the wait, or null.
+ */
+static void
+waitForArrival(uint64_t arrivals, unsigned ms, ReceiverGroup* pGroup)
+{
+  std::unique_lock<std::mutex> lock(gProbeLock);
+  gProbeWake.wait_for(lock, std::chrono::milliseconds(ms), [=]() {
+    return (gProbeArrivals != arrivals)
+      || (pGroup && (pGroup->s_generation != gReceiverGeneration));
+  });
+}
 
+/**
+ * probeGroup
+ *   Wait for a message of one of a receiver group's classes.  A group
+ *   with a single class blocks in MPI_Mprobe.  Otherwise the classes
+ *   are looked at in order, so earlier classes go first, sleeping on
+ *   the class probers while there's nothing.
+ *
+ * @param group - the group.
+ * @param[out] message - the matched message.
+ * @param[out] status  - its status.
+ * @param[out] cls     - its class.
+ * @return bool - false if a polling group was stopped while waiting.
+ */
+static bool
+probeGroup(ReceiverGroup& group, MPI_Message& message, MPI_Status& status, int& cls)
+{
+  if (group.s_classes.size() == 1) {
+    cls = group.s_classes[0];
+    MPI_Mprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, gClassComms[cls], &message, &status);
+    return true;
+  }
+  while (group.s_generation == gReceiverGeneration) {
+    uint64_t arrivals = armProbers(group.s_classes);
+    for (size_t i = 0; i < group.s_classes.size(); i++) {
+      int flag;
+      cls = group.s_classes[i];
+      MPI_Improbe(
+        MPI_ANY_SOURCE, MPI_ANY_TAG, gClassComms[cls], &flag, &message, &status
+      );
+      if (flag) return true;
+    }
+    waitForArrival(arrivals, 100, &group);
+  }
+  return false;
+}
+/**
+ * processMessage
+ *   Process a matched message on the main thread and account for it.
+ *
+ * @param group    - receiver group that matched it.
+ * @param message  - the message.
+ * @param status   - its status.
+ * @param cls      - its class.
+ * @param received - MPI_Wtime when it was matched.
+ */
+static void
+processMessage(
+  ReceiverGroup& group, MPI_Message& message, MPI_Status& status, int cls,
+  double received
+)
+{
+  int count;
+  MPI_Get_count(&status, MPI_CHAR, &count);
+  double   start  = MPI_Wtime();
+  uint64_t queued = (start - received)*1.0e6;
+  group.s_messages++;
+  group.s_bytes     += count;
+  group.s_queueTime += queued;
+  if (queued > group.s_maxQueueTime) {
+    group.s_maxQueueTime = queued;      // Only the main thread writes it.
+  }
+  mpiEventProcessor(*group.s_pInterp, message, status, gClassComms[cls]);
+  group.s_handleTime += uint64_t((MPI_Wtime() - start)*1.0e6);
+}
 
+/**
+ * pollIdle
+ *   Run the idle pollers.
+ * @return bool - true if any of them has work left.
+ */
+static bool
+pollIdle()
+{
+  bool busy = false;
+  for (size_t i = 0; i < gIdlePollers.size(); i++) {
+    if ((*gIdlePollers[i])()) busy = true;
+  }
+  return busy;
+}
+/**
+ * waitForChildMessage
+ *   Wait for a message of any class, control first, running the idle
+ *   pollers while there's none.  In between we sleep on the class
+ *   probers, waking every millisecond while a poller has work left and
+ *   every 50 otherwise.  Binary data are left to the binary pool if
+ *   there is one.  Tcl events (data we sent ourselves) are serviced
+ *   first.
+ *
+ * @param group - the rank's receiver group.
+ * @param[out] message - the matched message.
+ * @param[out] status  - its status.
+ * @param[out] cls     - its class.
+ */
+static void
+waitForChildMessage(
+  ReceiverGroup& group, MPI_Message& message, MPI_Status& status, int& cls
+)
+{
+  for (;;) {
+    while (Tcl_ServiceEvent(TCL_ALL_EVENTS)) {}
+    std::vector<int> classes;
+    for (size_t i = 0; i < group.s_classes.size(); i++) {
+      if ((group.s_classes[i] != RECEIVE_BINARY) || gBinaryPool.empty()) {
+        classes.push_back(group.s_classes[i]);
+      }
+    }
+    uint64_t arrivals = armProbers(classes);
+    for (size_t i = 0; i < classes.size(); i++) {
+      int flag;
+      cls = classes[i];
+      MPI_Improbe(
+        MPI_ANY_SOURCE, MPI_ANY_TAG, gClassComms[cls], &flag, &message, &status
+      );
+      if (flag) return;
+    }
+    waitForArrival(arrivals, pollIdle() ? 1 : 50, nullptr);
+  }
+}
 /**
  * Main loop of non rank 0  processes
  *
@@ -416,106 +2799,719 @@ mpiEventProcessor(CTCLInterpreter& interp, MPI_Status& probeStat)
  *   Messages can be scripts that get executed in our interpreter.
  *   Tcl data that can be passed to a tcl script established via mpi handle
  *   and binary data that can be passed to compiled code set via
- *   TclMpi_SetDataHandler e.g.
+ *   TclMpi_SetDataHandler e.g.  All classes are polled here, control
+ *   first, so this loop is the rank's only receiver.  The idle pollers
+ *   are run while there are no messages.
  */
 void childMainLoop(CTCLInterpreter& interp)
 {
-  MPI_Status probeStat;
+  MPI_Status  probeStat;
+  MPI_Message message;
   int        myrank;  
   MPI_Comm_rank(MPI_COMM_WORLD, &myrank);
+  
+  std::vector<int> classes;
+  for (int i = 0; i < RECEIVE_CLASSES; i++) {
+    classes.push_back(i);
+  }
+  ReceiverGroup* pGroup = new ReceiverGroup(
+    classes, gReceiverGeneration, &interp, Tcl_GetCurrentThread()
+  );
+  gReceivers.push_back(pGroup);
   try {
   
     while(1) {			// Exit will be done by tcl command e.g.
-      MPI_Probe(MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD,  &probeStat);
-      mpiEventProcessor(interp, probeStat);
+      int cls;
+      waitForChildMessage(*pGroup, message, probeStat, cls);
+      if (!passOnStopToken(message, probeStat, gClassComms[cls])) {
+        processMessage(*pGroup, message, probeStat, cls, MPI_Wtime());
+      }
     }
   } catch (CException& e) {
     std::cerr << myrank << " Exception: " << e.ReasonText() << std::endl;
   }
 }
 
-static void finalize(ClientData d)
+static void waitForRetiredReceivers();
+
+/**
+ * shutdownMPI
+ *   Stop the threads that may be in MPI calls (receivers, the binary
+ *   pool and the class probers) and finalize MPI.  Only the first call
+ *   does anything.
+ */
+static void
+shutdownMPI()
 {
+  int finalized;
+  MPI_Finalized(&finalized);
+  if (finalized) return;
+  stopReceivers();
+  waitForRetiredReceivers();
+  stopBinaryPool();
+  stopProbers();
   MPI_Finalize();
 }
 
-struct mpiThreadData {
-  Tcl_ThreadId     s_mainId;
-  CTCLInterpreter* s_pInterp;
-};
+static void finalize(ClientData d)
+{
+  shutdownMPI();
+}
 
-struct mpiEvent {
-  Tcl_Event        s_event;
-  CTCLInterpreter* s_pInterp;
-  MPI_Status       s_status;
+/**
+ * A message waiting in a lane.  A chunked payload's announcement is left
+ * matched (s_matched) for the main thread to receive since it has to
+ * receive the chunks right after it.  The data are reserved against the
+ * memory budget until the message is deleted.
+ */
+struct LaneMessage {
+  LaneMessage(ReceiverGroup* pGroup) : s_pGroup(pGroup), s_reserved(0) {
+    s_pGroup->s_queued++;
+  }
+  ~LaneMessage() {
+    CMPIMemoryBudget::getInstance()->release(CMPIMemoryBudget::receive, s_reserved);
+    s_pGroup->s_queued--;
+  }
+  ReceiverGroup*    s_pGroup;
+  int               s_class;
+  double            s_received;        // MPI_Wtime when taken.
+  bool              s_matched;
+  MPI_Message       s_message;
+  MPI_Status        s_status;
+  int               s_count;
+  std::vector<char> s_data;
+  bool              s_keyed;           // Coalesced by s_key.
+  std::string       s_key;
+  uint64_t          s_reserved;        // Bytes of budget held.
 };
+typedef std::pair<int, std::string> CoalesceKey;    // Source, key.
+static std::deque<LaneMessage*>          gLanes[RECEIVE_CLASSES];
+static std::map<CoalesceKey, LaneMessage*> gKeyedMessages;     // Those waiting.
+static int                      gLaneCredit[RECEIVE_CLASSES];  // Weighted dispatch.
+static bool                     gDispatchQueued(false);         // Event is queued.
 
+static void startReceiverGroup(ReceiverGroup* pGroup);
+static void queueDispatch(Tcl_ThreadId thread);
 
-int mpiEventHandler(Tcl_Event* pRawEvent, int flags)
+/**
+ * takeLaneMessage
+ *   Take the next message by the dispatch policy: from the first lane
+ *   that has one if strict, otherwise by smooth weighted round robin
+ *   over the lanes that have one.  Call with gLaneLock held.
+ * @return LaneMessage* - the message, null if the lanes are empty.
+ */
+static LaneMessage*
+takeLaneMessage()
 {
-  mpiEvent* pEvent = reinterpret_cast<mpiEvent*>(pRawEvent);
-  mpiEventProcessor(*pEvent->s_pInterp, pEvent->s_status);
-  startMpiReceiverThread(*pEvent->s_pInterp, Tcl_GetCurrentThread());   // Restart the receiver thread.
-
+  int best  = -1;
+  int total = 0;
+  for (int i = 0; i < RECEIVE_CLASSES; i++) {
+    if (gLanes[i].empty()) continue;
+    if (gDispatchPolicy == LANE_STRICT) {
+      best = i;
+      break;
+    }
+    gLaneCredit[i] += gLaneWeights[i];
+    total          += gLaneWeights[i];
+    if ((best < 0) || (gLaneCredit[i] > gLaneCredit[best])) {
+      best = i;
+    }
+  }
+  if (best < 0) return nullptr;
+  if (gDispatchPolicy == LANE_WEIGHTED) {
+    gLaneCredit[best] -= total;
+  }
+  LaneMessage* pMessage = gLanes[best].front();
+  gLanes[best].pop_front();
+  if (pMessage->s_keyed) {
+    gKeyedMessages.erase(CoalesceKey(pMessage->s_status.MPI_SOURCE, pMessage->s_key));
+  }
+  return pMessage;
+}
+/**
+ * restartReceiverGroup
+ *   Restart the thread of a group that stopped for a chunked payload,
+ *   unless the group's been replaced since.
+ */
+static void
+restartReceiverGroup(ReceiverGroup& group)
+{
+  if (group.s_generation == gReceiverGeneration) {
+    startReceiverGroup(&group);
+  }
+}
+/**
+ * laneDispatchHandler
+ *   Tcl event handler on the main thread: handle the next message from
+ *   the lanes.  If more are waiting another event is queued for them so
+ *   other Tcl events get their turn in between.
+ */
+static int
+laneDispatchHandler(Tcl_Event* pRawEvent, int flags)
+{
+  std::unique_ptr<LaneMessage> pMessage;
+  bool                         more;
+  {
+    std::lock_guard<std::mutex> lock(gLaneLock);
+    pMessage.reset(takeLaneMessage());
+    more = false;
+    for (int i = 0; i < RECEIVE_CLASSES; i++) {
+      if (!gLanes[i].empty()) more = true;
+    }
+    gDispatchQueued = more;
+  }
+  if (!pMessage) return 1;
+  gLaneSpace.notify_all();
+  
+  ReceiverGroup& group(*pMessage->s_pGroup);
+  if (more) {
+    queueDispatch(group.s_mainThread);
+  }
+  if (pMessage->s_matched) {
+    try {
+      processMessage(
+        group, pMessage->s_message, pMessage->s_status, pMessage->s_class,
+        pMessage->s_received
+      );
+    } catch (...) {
+      restartReceiverGroup(group);
+      throw;
+    }
+    restartReceiverGroup(group);
+  } else {
+    double   start  = MPI_Wtime();
+    uint64_t queued = (start - pMessage->s_received)*1.0e6;
+    group.s_messages++;
+    group.s_bytes     += pMessage->s_count;
+    group.s_queueTime += queued;
+    if (queued > group.s_maxQueueTime) {
+      group.s_maxQueueTime = queued;    // Only the main thread writes it.
+    }
+    dispatchMessage(
+      *group.s_pInterp, pMessage->s_status.MPI_SOURCE,
+      pMessage->s_status.MPI_TAG, pMessage->s_data.data(), pMessage->s_count
+    );
+    group.s_handleTime += uint64_t((MPI_Wtime() - start)*1.0e6);
+  }
   return 1;
 }
-
-void mpiProbeThread(ClientData p)
+/**
+ * queueDispatch
+ *   Queue a lane dispatch event to the main thread.
+ */
+static void
+queueDispatch(Tcl_ThreadId thread)
+{
+  Tcl_Event* pEvent = reinterpret_cast<Tcl_Event*>(Tcl_Alloc(sizeof(Tcl_Event)));
+  pEvent->proc    = laneDispatchHandler;
+  pEvent->nextPtr = nullptr;
+  Tcl_ThreadQueueEvent(thread, pEvent, TCL_QUEUE_TAIL);
+  Tcl_ThreadAlert(thread);
+}
+/**
+ * filterChannel
+ *   The receive filter that applies to messages with a tag.
+ * @return int - FILTER_TCLDATA, FILTER_BINARY or -1 if none.
+ */
+static int
+filterChannel(int tag)
+{
+  switch (tag) {
+  case MPI_TAG_TCLDATA:
+  case MPI_TAG_TCLDATA_Z:
+  case MPI_TAG_TCLDATA_B:
+  case MPI_TAG_TCLDATA_BZ:
+  case MPI_TAG_COALESCE:
+    return FILTER_TCLDATA;
+  case MPI_TAG_BINDATA:
+    return FILTER_BINARY;
+  default:
+    return -1;
+  }
+}
+/**
+ * filterMessage
+ *   Run a received message past its channel's filter.  Compressed data
+ *   that have to be matched are decompressed here and stay that way so
+ *   the main thread needn't do it again.  Data too broken to look at are
+ *   kept so the main thread complains about them as usual.
+ * @param message    - the message.
+ * @param[out] latest - true if only the newest from its source is kept.
+ * @return bool - true to keep it.
+ */
+static bool
+filterMessage(LaneMessage& message, bool& latest)
 {
-  mpiThreadData* pData = static_cast<mpiThreadData*>(p);
+  latest      = false;
+  int channel = filterChannel(message.s_status.MPI_TAG);
+  if (channel < 0) return true;
   
-  struct mpiEvent e;			//  Template event.
-  e.s_event.proc   = mpiEventHandler;
-  e.s_event.nextPtr= nullptr;
-  e.s_pInterp      = pData->s_pInterp;
-
+  std::lock_guard<std::mutex> lock(gFilterLock);
+  CMPIReceiveFilter& filter(gFilters[channel]);
+  if (!filter.active()) return true;
+  latest = filter.latest();
+  
+  int  source = message.s_status.MPI_SOURCE;
+  int& tag(message.s_status.MPI_TAG);
+  if (!filter.matching()) return filter.keep(source);
   
-  MPI_Status probeStat;
-  MPI_Probe(MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD,  &probeStat);
-  if (probeStat.MPI_TAG  == MPI_TAG_STOPTHREAD) {      // Being asked to exit.
-    char buf[1];
-    int  count;
-    MPI_Recv(                                           // Recv the token msg.
-      buf, count, MPI_CHAR, probeStat.MPI_SOURCE, probeStat.MPI_TAG,
-      MPI_COMM_WORLD, MPI_STATUS_IGNORE
+  if ((tag == MPI_TAG_TCLDATA_Z) || (tag == MPI_TAG_TCLDATA_BZ)) {
+    std::vector<char> data;
+    if (!decompressMessage(source, message.s_data.data(), message.s_count, data)) {
+      return false;
+    }
+    CMPIMemoryBudget::getInstance()->release(
+      CMPIMemoryBudget::receive, message.s_reserved
     );
-    delete pData;
-    return;
+    message.s_reserved = data.size();
+    message.s_data.swap(data);
+    message.s_count = message.s_data.size();
+    tag = (tag == MPI_TAG_TCLDATA_Z) ? MPI_TAG_TCLDATA : MPI_TAG_TCLDATA_B;
   }
-  struct mpiEvent* pEvent =
-    reinterpret_cast<struct mpiEvent*>(Tcl_Alloc(sizeof(mpiEvent)));
-  memcpy(pEvent, &e, sizeof(struct mpiEvent));
-  pEvent->s_status = probeStat;
-  
+  if (tag == MPI_TAG_TCLDATA) {
+    if ((message.s_count == 0) || (message.s_data[message.s_count-1] != '\0')) {
+      return true;
+    }
+    return filter.keepText(source, message.s_data.data());
+  }
+  Tcl_Obj* pObj;
+  try {
+    pObj = CMPITclCodec::decode(message.s_data.data(), message.s_count);
+  }
+  catch (std::string&) {
+    return true;
+  }
+  Tcl_IncrRefCount(pObj);
+  bool keep = filter.keepObject(source, pObj);
+  Tcl_DecrRefCount(pObj);
+  return keep;
+}
+/**
+ * unwrapKeyed
+ *   Turn a received MPI_TAG_COALESCE message into the data it carries,
+ *   remembering the key.
+ * @param message - the message.
+ * @return bool   - false (and complaint made) if it was bad.
+ */
+static bool
+unwrapKeyed(LaneMessage& message)
+{
+  int    tag;
+  size_t skip;
+  if (!unwrapCoalesced(
+      message.s_status.MPI_SOURCE, message.s_data.data(), message.s_count,
+      tag, message.s_key, skip
+    )) {
+    return false;
+  }
+  message.s_data.erase(message.s_data.begin(), message.s_data.begin() + skip);
+  message.s_count         -= skip;
+  message.s_status.MPI_TAG = tag;
+  message.s_keyed          = true;
+  return true;
+}
+/**
+ * pushLaneMessage
+ *   Put a message in its lane, queuing a dispatch event if there isn't
+ *   one already.  A keyed message that has one from its source with
+ *   the same key waiting takes over that one's place and the older data
+ *   are dropped.
+ * @param pMessage - the message.
+ * @param latest   - it replaces a waiting (unkeyed) message from its
+ *                   source on the same filter channel if there is one.
+ */
+static void
+pushLaneMessage(LaneMessage* pMessage, bool latest)
+{
+  Tcl_ThreadId thread    = pMessage->s_pGroup->s_mainThread;
+  int          channel   = filterChannel(pMessage->s_status.MPI_TAG);
+  LaneMessage* pReplaced = nullptr;
+  bool         queue;
+  {
+    std::lock_guard<std::mutex> lock(gLaneLock);
+    std::deque<LaneMessage*>& lane(gLanes[pMessage->s_class]);
+    if (pMessage->s_keyed) {
+      CoalesceKey key(pMessage->s_status.MPI_SOURCE, pMessage->s_key);
+      auto p = gKeyedMessages.find(key);
+      if (p != gKeyedMessages.end()) {
+        LaneMessage* pWaiting = p->second;    // Keeps its place in line.
+        pWaiting->s_data.swap(pMessage->s_data);
+        std::swap(pWaiting->s_reserved, pMessage->s_reserved);
+        pWaiting->s_count  = pMessage->s_count;
+        pWaiting->s_status = pMessage->s_status;
+        pWaiting->s_pGroup->s_coalesced++;
+        delete pMessage;
+        return;                         // Its dispatch event is queued.
+      }
+      gKeyedMessages[key] = pMessage;
+    } else if (latest) {
+      for (auto p = lane.rbegin(); p != lane.rend(); p++) {
+        if (!(*p)->s_matched && !(*p)->s_keyed
+            && ((*p)->s_status.MPI_SOURCE == pMessage->s_status.MPI_SOURCE)
+            && (filterChannel((*p)->s_status.MPI_TAG) == channel)) {
+          pReplaced = *p;
+          *p        = pMessage;
+          break;
+        }
+      }
+    }
+    if (!pReplaced) {
+      lane.push_back(pMessage);
+    }
+    queue           = !gDispatchQueued;
+    gDispatchQueued = true;
+  }
+  if (pReplaced) {
+    delete pReplaced;
+    std::lock_guard<std::mutex> lock(gFilterLock);
+    gFilters[channel].coalesced();
+  }
+  if (queue) {
+    queueDispatch(thread);
+  }
+}
+/**
+ * waitForLaneSpace
+ *   Wait until each of a group's lanes has room.
+ * @param group - the group.
+ * @return bool - false if the group was stopped meanwhile.
+ */
+static bool
+waitForLaneSpace(ReceiverGroup& group)
+{
+  std::unique_lock<std::mutex> lock(gLaneLock);
+  for (;;) {
+    if (group.s_generation != gReceiverGeneration) return false;
+    bool room = true;
+    for (size_t i = 0; i < group.s_classes.size(); i++) {
+      if (gLanes[group.s_classes[i]].size() >= gLaneDepth) room = false;
+    }
+    if (room) return true;
+    gLaneSpace.wait(lock);
+  }
+}
 
-  Tcl_ThreadQueueEvent(
-      pData->s_mainId, reinterpret_cast<Tcl_Event*>(pEvent), TCL_QUEUE_TAIL
-  );
-  Tcl_ThreadAlert(pData->s_mainId);
-  delete pData;
+/**
+ * receiveForGroup
+ *   Body of a receiver thread.  It takes messages of its group's classes,
+ *   runs them past the receive filters and puts them in their lanes,
+ *   coalescing keyed data, waiting while a lane is full or the memory
+ *   budget has no room for the data.  Control messages are charged to
+ *   the budget rather than waiting behind data, and a wait for room ends
+ *   when the group is stopped: the message it matched is charged and
+ *   still queued.  Thread data are passed straight on to their thread.
+ *   On a chunked payload's announcement it stops; the main thread starts
+ *   it again once it has the chunks.  A stop token (MPI_TAG_STOPTHREAD
+ *   carrying the receivers' generation) for us ends the thread; one for
+ *   an earlier generation of receivers is thrown away (its thread had
+ *   seen the generation change and exited without probing).
+ *
+ * @param pGroup - the group.
+ */
+static void
+receiveForGroup(ReceiverGroup* pGroup)
+{
+  MPI_Status  probeStat;
+  MPI_Message message;
+  int         cls;
+  std::vector<char> msg;
+  for (;;) {
+    if (!waitForLaneSpace(*pGroup)) return;
+    
+    // stopReceivers bumps the generation then looks at s_probing; we
+    // do the reverse so one of us sees the other.
+    
+    pGroup->s_probing = true;
+    if ((pGroup->s_generation != gReceiverGeneration)
+        || !probeGroup(*pGroup, message, probeStat, cls)) {
+      pGroup->s_probing = false;
+      return;
+    }
+    pGroup->s_probing = false;
+    if (passOnStopToken(message, probeStat, gClassComms[cls])) continue;
+    
+    int count;
+    MPI_Get_count(&probeStat, MPI_CHAR, &count);
+    if (probeStat.MPI_TAG == MPI_TAG_STOPTHREAD) {
+      uint32_t generation = 0;
+      msg.resize(count ? count : 1);
+      MPI_Mrecv(msg.data(), count, MPI_CHAR, &message, MPI_STATUS_IGNORE);
+      if (count == sizeof(generation)) {
+        memcpy(&generation, msg.data(), sizeof(generation));
+      }
+      if (generation == pGroup->s_generation) return;
+      continue;
+    }
+    if (probeStat.MPI_TAG == MPI_TAG_THREADDATA) {
+      msg.resize(count ? count : 1);
+      MPI_Mrecv(msg.data(), count, MPI_CHAR, &message, MPI_STATUS_IGNORE);
+      pGroup->s_messages++;
+      pGroup->s_bytes += count;
+      pGroup->s_routed++;
+      routeToThread(probeStat.MPI_SOURCE, msg.data(), count);
+      continue;
+    }
+    
+    LaneMessage* pMessage = new LaneMessage(pGroup);
+    bool         chunked  = (probeStat.MPI_TAG == MPI_TAG_CHUNKED);
+    pMessage->s_class    = cls;
+    pMessage->s_received = MPI_Wtime();
+    pMessage->s_matched  = chunked;
+    pMessage->s_message  = message;
+    pMessage->s_status   = probeStat;
+    pMessage->s_count    = count;
+    pMessage->s_keyed    = false;
+    if (!chunked) {
+      CMPIMemoryBudget* pBudget = CMPIMemoryBudget::getInstance();
+      if ((cls == RECEIVE_CONTROL) || !pBudget->reserve(
+            CMPIMemoryBudget::receive, count,
+            [pGroup]() { return pGroup->s_generation != gReceiverGeneration; }
+          )) {
+        pBudget->charge(CMPIMemoryBudget::receive, count);
+      }
+      pMessage->s_reserved = count;
+      pMessage->s_data.resize(count ? count : 1);
+      MPI_Mrecv(
+        pMessage->s_data.data(), count, MPI_CHAR, &message, MPI_STATUS_IGNORE
+      );
+      if ((probeStat.MPI_TAG == MPI_TAG_COALESCE) && !unwrapKeyed(*pMessage)) {
+        delete pMessage;
+        continue;
+      }
+    }
+    bool latest = false;
+    if (!chunked && !filterMessage(*pMessage, latest)) {
+      delete pMessage;
+      continue;
+    }
+    pushLaneMessage(pMessage, latest);
+    if (chunked) return;
+  }
+}
+/**
+ * mpiProbeThread
+ *   Receiver thread: receiveForGroup, then say the group's thread is
+ *   gone.  That's the last it touches the group.
+ *
+ * @param p - the ReceiverGroup.
+ */
+void mpiProbeThread(ClientData p)
+{
+  ReceiverGroup* pGroup = static_cast<ReceiverGroup*>(p);
+  receiveForGroup(pGroup);
+  pGroup->s_threads--;
 }
 
 /**
- * startMpiReceiverThread
- *   Starts the thread that probes for mpi data available.
- * 
- * @param interp - references the interpreter of this thread -- I think
- *                 this can be ignored.
- * @param mainThread - thread to which events are queues.
+ * startReceiverGroup
+ *   Start (or restart) a receiver group's thread.
+ * @param pGroup - the group.
  */
-static void startMpiReceiverThread(CTCLInterpreter& interp, Tcl_ThreadId mainThread)
+static void
+startReceiverGroup(ReceiverGroup* pGroup)
 {
-  
-  mpiThreadData* pThreadData = new mpiThreadData;
-  pThreadData->s_mainId = mainThread;
-  pThreadData->s_pInterp = &interp;
-  
   Tcl_ThreadId child;
+  pGroup->s_threads++;
   Tcl_CreateThread(
-     &child, mpiProbeThread, reinterpret_cast<ClientData>(pThreadData),
+     &child, mpiProbeThread, reinterpret_cast<ClientData>(pGroup),
      TCL_THREAD_STACK_DEFAULT, TCL_THREAD_NOFLAGS
    );
 }
+/**
+ * waitForRetiredReceivers
+ *   Wait for the threads of the retired receiver groups to exit.  Once
+ *   stopReceivers has woken them none waits on anything but a message
+ *   already on its way (the stop token), so this doesn't take long.
+ */
+static void
+waitForRetiredReceivers()
+{
+  for (size_t i = 0; i < gRetiredReceivers.size(); i++) {
+    while (gRetiredReceivers[i]->s_threads) {
+      usleep(100);
+    }
+  }
+}
+/**
+ * startReceivers
+ *   Start a receiver thread for each configured group.  While a binary
+ *   pool is running the binary class is left out of the groups (and a
+ *   group with nothing else isn't started) so that single message binary
+ *   data only go to the pool.  The retired groups' threads must be gone
+ *   first: a new thread on a class's communicator could otherwise take
+ *   the stop token meant for the old one, which would then go on taking
+ *   messages.
+ * 
+ * @param interp - references the interpreter of this thread.
+ * @param mainThread - thread to which events are queued.
+ */
+static void
+startReceivers(CTCLInterpreter& interp, Tcl_ThreadId mainThread)
+{
+  if (gReceiverConfig.empty()) {
+    for (int i = 0; i < RECEIVE_CLASSES; i++) {
+      gReceiverConfig.push_back(std::vector<int>(1, i));
+    }
+  }
+  waitForRetiredReceivers();
+  gpReceiverInterp    = &interp;
+  gReceiverMainThread = mainThread;
+  unsigned generation = ++gReceiverGeneration;
+  for (size_t i = 0; i < gReceiverConfig.size(); i++) {
+    std::vector<int> classes;
+    for (size_t c = 0; c < gReceiverConfig[i].size(); c++) {
+      if ((gReceiverConfig[i][c] != RECEIVE_BINARY) || gBinaryPool.empty()) {
+        classes.push_back(gReceiverConfig[i][c]);
+      }
+    }
+    if (classes.empty()) continue;
+    ReceiverGroup* pGroup = new ReceiverGroup(
+      classes, generation, &interp, mainThread
+    );
+    gReceivers.push_back(pGroup);
+    startReceiverGroup(pGroup);
+  }
+}
+/**
+ * stopReceivers
+ *   Stop the receiver threads.  Polling threads and threads waiting for
+ *   lane space see the generation change.  Blocked ones that are waiting
+ *   for a message get a stop token on their communicator.  Ones whose
+ *   chunked payload is waiting for the main thread just aren't
+ *   restarted.  Messages already in the lanes are still handled.
+ *   Groups retired earlier whose threads have exited and whose messages
+ *   are all handled are deleted.
+ */
+static void
+stopReceivers()
+{
+  {
+    std::lock_guard<std::mutex> lock(gLaneLock);
+    gReceiverGeneration++;
+  }
+  gLaneSpace.notify_all();
+  {
+    std::lock_guard<std::mutex> lock(gProbeLock);
+  }
+  gProbeWake.notify_all();                // Polling groups.
+  CMPIMemoryBudget::getInstance()->wake(); // Groups waiting for budget.
+  for (auto p = gRetiredReceivers.begin(); p != gRetiredReceivers.end(); ) {
+    if (((*p)->s_threads == 0) && ((*p)->s_queued == 0)) {
+      delete *p;
+      p = gRetiredReceivers.erase(p);
+    } else {
+      p++;
+    }
+  }
+  for (size_t i = 0; i < gReceivers.size(); i++) {
+    ReceiverGroup* pGroup = gReceivers[i];
+    if ((pGroup->s_classes.size() == 1) && pGroup->s_probing) {
+      uint32_t generation = pGroup->s_generation;
+      MPI_Send(
+        &generation, sizeof(generation), MPI_CHAR, myRank(),
+        MPI_TAG_STOPTHREAD, gClassComms[pGroup->s_classes[0]]
+      );
+    }
+    gRetiredReceivers.push_back(pGroup);
+  }
+  gReceivers.clear();
+}
+
+/**
+ * restartReceivers
+ *   Rank 0 - restart the receivers, with the interpreter and main thread
+ *   they were started with, so they pick up a change in what they take.
+ */
+static void
+restartReceivers()
+{
+  if (!gpReceiverInterp) return;         // Not rank 0 or not started yet.
+  stopReceivers();
+  startReceivers(*gpReceiverInterp, gReceiverMainThread);
+}
+
+/**
+ * binaryReceiverThread
+ *   Body of a binary data pool thread.  Receives MPI_TAG_BINDATA
+ *   messages and passes them to the thread safe handler until it gets a
+ *   stop token: a zero length binary message we sent ourselves while
+ *   the pool is stopping.  The Tcl side passes on any tokens it gets.
+ *
+ * @param p - unused.
+ */
+static void
+binaryReceiverThread(ClientData p)
+{
+  int               me = myRank();
+  std::vector<char> msg;
+  for (;;) {
+    MPI_Status  status;
+    MPI_Message message;
+    int         count;
+    MPI_Mprobe(
+      MPI_ANY_SOURCE, MPI_TAG_BINDATA, classComm(MPI_TAG_BINDATA), &message,
+      &status
+    );
+    MPI_Get_count(&status, MPI_CHAR, &count);
+    msg.resize(count ? count : 1);
+    MPI_Mrecv(msg.data(), count, MPI_CHAR, &message, MPI_STATUS_IGNORE);
+    
+    if ((count == 0) && (status.MPI_SOURCE == me) && gStoppingBinaryPool) {
+      break;
+    }
+    MPIBinDataHandler handler = gpThreadSafeBinaryHandler;
+    if (handler) {
+      (*handler)(status.MPI_SOURCE, count, msg.data());
+    }
+  }
+  Tcl_ExitThread(TCL_OK);
+}
+/**
+ * startBinaryPool
+ *   Start the binary data receiver threads.
+ * @param nThreads - how many.
+ */
+static void
+startBinaryPool(unsigned nThreads)
+{
+  for (unsigned i = 0; i < nThreads; i++) {
+    Tcl_ThreadId thread;
+    if (Tcl_CreateThread(
+          &thread, binaryReceiverThread, nullptr, TCL_THREAD_STACK_DEFAULT,
+          TCL_THREAD_JOINABLE
+        ) == TCL_OK) {
+      gBinaryPool.push_back(thread);
+    }
+  }
+}
+/**
+ * stopBinaryPool
+ *   Send each binary receiver thread a stop token and wait for them all
+ *   to exit.
+ */
+static void
+stopBinaryPool()
+{
+  if (gBinaryPool.empty()) return;
+  
+  int  me = myRank();
+  char token;
+  std::vector<MPI_Request> tokens(gBinaryPool.size());
+  gStoppingBinaryPool = true;
+  for (size_t i = 0; i < gBinaryPool.size(); i++) {
+    MPI_Isend(
+      &token, 0, MPI_CHAR, me, MPI_TAG_BINDATA, classComm(MPI_TAG_BINDATA),
+      &tokens[i]
+    );
+  }
+  for (size_t i = 0; i < gBinaryPool.size(); i++) {
+    int result;
+    Tcl_JoinThread(gBinaryPool[i], &result);
+  }
+  MPI_Waitall(tokens.size(), tokens.data(), MPI_STATUSES_IGNORE);
+  gBinaryPool.clear();
+  gStoppingBinaryPool = false;
+}
 
 /**
  * main
@@ -548,7 +3544,7 @@ int main(int argc, char** argv)
     childMainLoop(interp);
   }
 
-  MPI_Finalize();
+  shutdownMPI();
 }
 
 
@@ -563,7 +3559,7 @@ static int initInteractive(Tcl_Interp* pRawInterpreter)
   loadMPIExtensions(*pInterp);
 
   Tcl_SetExitProc(finalize);
-  startMpiReceiverThread(*pInterp, Tcl_GetCurrentThread());
+  startReceivers(*pInterp, Tcl_GetCurrentThread());
 
   // Now run an event loop:
 
@@ -1,13 +1,49 @@
 #ifndef MPITCL_H
 #define MPITCL_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 typedef void (*MPIBinDataHandler)(int, int, void*);
 
+// Large binary payloads can be handed to compiled code chunk by chunk:
+// (source, offset, totalSize, chunkSize, chunkData).
+
+typedef void (*MPIBinChunkHandler)(int, uint64_t, uint64_t, size_t, void*);
+
 void MPITcl_setBinaryDataHandler(MPIBinDataHandler handler);
 
+// A handler that's safe to call from several threads at once can be run
+// on a pool of receiver threads, off the Tcl thread.  While the pool
+// runs the Tcl receivers leave the binary class to it, so single message
+// binary data never go through the Tcl event queue; chunked payloads
+// still do.  Don't call from a handler.
+
+void MPITcl_setThreadSafeBinaryDataHandler(
+  MPIBinDataHandler handler, unsigned nThreads = 2
+);
+void MPITcl_setBinaryChunkHandler(MPIBinChunkHandler handler);
+void MPITcl_sendBinary(int rank, const void* pData, size_t nBytes);
+
+// Compiled code with work to move along in the background (nonblocking
+// MPI operations, say) can have it polled while a rank other than 0
+// waits for messages.  A poller returns true while it has work left.
+
+typedef bool (*MPIIdlePoller)();
+void MPITcl_addIdlePoller(MPIIdlePoller poller);
+
 static const int MPI_TAG_SCRIPT(1);                    // Tag for sending a script.
 static const int MPI_TAG_TCLDATA(2);                   // Tag for sending Tcl encoded data.
 static const int MPI_TAG_BINDATA(3);                   // Tag for sending Binary data.
+static const int MPI_TAG_TCLDATA_Z(4);                 // Compressed Tcl encoded data.
+static const int MPI_TAG_CHUNKED(5);                   // Large payload announcement.
+static const int MPI_TAG_CHUNK(6);                     // A chunk of a large payload.
+static const int MPI_TAG_EVALALL(7);                   // mpi evalall script.
+static const int MPI_TAG_SHARE(8);                     // mpi share update.
+static const int MPI_TAG_TCLDATA_B(9);                 // Binary encoded Tcl data.
+static const int MPI_TAG_TCLDATA_BZ(10);               // Compressed binary Tcl data.
+static const int MPI_TAG_THREADDATA(11);               // Tcl data for a thread.
+static const int MPI_TAG_COALESCE(12);                 // Tcl data coalesced by key.
 static const int MPI_TAG_STOPTHREAD(100);              // Rank 0 - stop event pump  thread.
 
 